@@ -1,19 +1,62 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <WebServer.h>
+#include <Wire.h>
 #include <ArduinoOTA.h>
+#include <Update.h>
 #include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <rom/miniz.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/pk.h>
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <driver/ledc.h>
+#include <soc/ledc_struct.h>
 #include <time.h>
+#include <sys/time.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <esp_debug_helpers.h>
+#include <esp_core_dump.h>
+#include <esp_heap_caps.h>
+#include <xtensa_context.h>
+#include <lwip/sockets.h>
 #include <cmath>
+#include <algorithm>
 
 // ============ CONFIGURATION ============
 const char *WIFI_SSID = "";
 const char *WIFI_PASSWORD = "";
 const char *NTP_SERVER = "pool.ntp.org";
 
-// Timezone configuration using POSIX timezone strings
+// Default timezone using POSIX timezone strings (can be changed at runtime via /set-timezone)
 // For London (GMT/BST with automatic DST):
 const char *TZ_INFO = "GMT0BST,M3.5.0/1,M10.5.0";
+const int TZ_TABLE_YEARS = 5; // Years of DST transitions precomputed ahead of the current one
+
+// Time discipline configuration
+const int32_t TIME_STEP_THRESHOLD_MS = 1000;           // SNTP offsets above this are stepped, below slewed
+const unsigned long TIME_HOLDOVER_INTERVAL_MS = 60000; // How often drift compensation is applied
+const float TIME_MAX_DRIFT_PPM = 500.0f;               // Reject drift estimates beyond crystal tolerance
+const float TIME_DRIFT_FLOOR_PPM = 2.0f;               // Assumed residual drift even with a good estimate
+const int32_t TIME_SYNC_ERROR_MS = 50;                 // Assumed error of a single SNTP sample
+const int32_t TIME_CLIENT_ERROR_MS = 250;              // Error of a POST /time sample (network latency)
+const int32_t TIME_HTTP_DATE_ERROR_MS = 1000;          // Error of an HTTP Date header (1 s resolution)
+const int32_t TIME_RTC_ERROR_MS = 1000;                // Error of an I2C RTC read (1 s resolution)
+const time_t TIME_VALID_AFTER = 1609459200;            // 2021-01-01 - earlier clocks are unset
+
+// Optional DS3231/DS1307-compatible I2C RTC, used when NTP is unreachable
+const bool RTC_ENABLED = false;
+const int RTC_SDA_PIN = 21;
+const int RTC_SCL_PIN = 22;
+const uint8_t RTC_I2C_ADDRESS = 0x68;
+const unsigned long RTC_WRITE_INTERVAL_MS = 3600000; // How often a good clock is written back to the RTC
+
+// API token - when set, a request only counts as authenticated with
+// "Authorization: Bearer <token>". Empty = open API (every request trusted).
+const char *API_TOKEN = "";
 
 // Other timezone examples (POSIX format):
 // UTC: "UTC0"
@@ -22,13 +65,187 @@ const char *TZ_INFO = "GMT0BST,M3.5.0/1,M10.5.0";
 // CET/CEST (Central Europe): "CET-1CEST,M3.5.0,M10.5.0"
 // IST (India): "IST-5:30"
 
-// LED Configuration
-const int WARM_PIN = 18;
-const int COOL_PIN = 19;
-const int PWM_FREQ = 5000;     // 5 kHz PWM frequency (increased for better linearity)
-const int PWM_RESOLUTION = 10; // 10-bit resolution (0-1023) for finer control
-const int PWM_CHANNEL_WARM = 0;
-const int PWM_CHANNEL_COOL = 1;
+// PWM timer setting used from a brightness level up (see pwmBand() in the board profiles)
+struct PwmBand
+{
+  uint16_t fromLevel; // band starts at this level of the brighter channel
+  uint32_t freq;
+  uint8_t bits;
+};
+
+// LED Configuration - one board profile per hardware revision. Pick one with
+// -DWAKELIGHT_BOARD=<n> (see the environments in platformio.ini); the lighting
+// code is compiled for that board's pins, channels and PWM timing.
+// pwmFreq/pwmResolution is the fixed timing (PWM_BANDS_ENABLED = false) and
+// the unit of the usage counters; pwmBand() lists the adaptive timer bands.
+struct BoardRevA // Original board
+{
+  static const char *name() { return "rev-a"; }
+  static constexpr int warmPin = 18;
+  static constexpr int coolPin = 19;
+  static constexpr int warmChannel = 8; // LEDC low-speed channels (8-15)
+  static constexpr int coolChannel = 9;
+  static constexpr uint32_t pwmFreq = 5000;    // 5 kHz PWM frequency (increased for better linearity)
+  static constexpr uint8_t pwmResolution = 10; // 10-bit resolution (0-1023) for finer control
+  // 16-bit steps for night-light levels; a fast timer for bright light (no camera banding)
+  static constexpr int pwmBandCount = 3;
+  static constexpr PwmBand pwmBand(int i)
+  {
+    return i == 0 ? PwmBand{0, 1000, 16} : i == 1 ? PwmBand{16384, 4800, 14} : PwmBand{39321, 19000, 12};
+  }
+};
+
+struct BoardRevB // LED outputs moved to GPIO 16/17
+{
+  static const char *name() { return "rev-b"; }
+  static constexpr int warmPin = 16;
+  static constexpr int coolPin = 17;
+  static constexpr int warmChannel = 8;
+  static constexpr int coolChannel = 9;
+  static constexpr uint32_t pwmFreq = 5000;
+  static constexpr uint8_t pwmResolution = 10;
+  static constexpr int pwmBandCount = 2;
+  static constexpr PwmBand pwmBand(int i)
+  {
+    return i == 0 ? PwmBand{0, 1000, 16} : PwmBand{16384, 4800, 14};
+  }
+};
+
+struct BoardRevC // Constant-current drivers: 13-bit PWM at a lower frequency
+{
+  static const char *name() { return "rev-c"; }
+  static constexpr int warmPin = 16;
+  static constexpr int coolPin = 17;
+  static constexpr int warmChannel = 8;
+  static constexpr int coolChannel = 9;
+  static constexpr uint32_t pwmFreq = 2000;
+  static constexpr uint8_t pwmResolution = 13;
+  static constexpr int pwmBandCount = 2; // the drivers top out around 2 kHz
+  static constexpr PwmBand pwmBand(int i)
+  {
+    return i == 0 ? PwmBand{0, 1000, 16} : PwmBand{16384, 2000, 15};
+  }
+};
+
+// Highest LEDC resolution at a PWM frequency: frequency x 2^bits must fit the 80 MHz clock
+constexpr int ledcMaxResolution(uint32_t freq, int bits = 20)
+{
+  return bits == 0 || ((uint64_t)freq << bits) <= 80000000ULL ? bits : ledcMaxResolution(freq, bits - 1);
+}
+
+// A timer setting the LEDC can produce from the 80 MHz APB clock (clock divider 1-1023)
+constexpr bool ledcTimingValid(uint32_t freq, int bits)
+{
+  return bits >= 8 && bits <= 16 && freq >= 100 && bits <= ledcMaxResolution(freq) && ((uint64_t)freq << bits) >= 80000000ULL / 1023;
+}
+
+// Bands start at level 0 and go up in level
+template <class B>
+constexpr bool pwmBandsValid(int i = 0)
+{
+  return i >= B::pwmBandCount ||
+         (ledcTimingValid(B::pwmBand(i).freq, B::pwmBand(i).bits) &&
+          (i == 0 ? B::pwmBand(i).fromLevel == 0 : B::pwmBand(i).fromLevel > B::pwmBand(i - 1).fromLevel) &&
+          pwmBandsValid<B>(i + 1));
+}
+
+// ESP32 GPIOs that can drive an output (6-11 are the flash bus, 34-39 are input-only)
+constexpr bool boardOutputPin(int pin)
+{
+  return (pin >= 0 && pin <= 5) || (pin >= 12 && pin <= 19) || (pin >= 21 && pin <= 23) || (pin >= 25 && pin <= 27) ||
+         pin == 32 || pin == 33;
+}
+
+// A board profile plus the constants derived from it, checked at compile time
+template <class B>
+struct LedProfile : B
+{
+  static_assert(boardOutputPin(B::warmPin) && boardOutputPin(B::coolPin), "LED pins must be output-capable GPIOs");
+  static_assert(B::warmPin != B::coolPin, "Warm and cool LEDs need their own pins");
+  static_assert(B::warmChannel >= 8 && B::warmChannel < 16 && B::coolChannel >= 8 && B::coolChannel < 16,
+                "LEDs must be on LEDC low-speed channels (8-15), which latch timer and duty changes at the period end");
+  static_assert(B::warmChannel != B::coolChannel, "Warm and cool LEDs need their own LEDC channels");
+  static_assert(B::pwmResolution >= 8 && B::pwmResolution <= 16, "PWM resolution must be 8-16 bits");
+  static_assert(B::pwmFreq >= 100, "PWM below 100 Hz flickers visibly");
+  static_assert(B::pwmResolution <= ledcMaxResolution(B::pwmFreq),
+                "PWM frequency too high for the resolution (frequency x 2^bits is limited to the 80 MHz LEDC clock)");
+  static_assert(ledcTimingValid(B::pwmFreq, B::pwmResolution), "PWM timing out of the LEDC clock divider range");
+  static_assert(B::pwmBandCount >= 1 && pwmBandsValid<B>(),
+                "PWM bands need valid timings (8-16 bits, divider 1-1023), starting at level 0 in rising order");
+
+  static constexpr int pwmMax = (1 << B::pwmResolution) - 1; // Full-scale duty
+};
+
+#ifndef WAKELIGHT_BOARD
+#define WAKELIGHT_BOARD 1
+#endif
+#if WAKELIGHT_BOARD == 1
+typedef LedProfile<BoardRevA> Board;
+#elif WAKELIGHT_BOARD == 2
+typedef LedProfile<BoardRevB> Board;
+#elif WAKELIGHT_BOARD == 3
+typedef LedProfile<BoardRevC> Board;
+#else
+#error "WAKELIGHT_BOARD must be 1 (rev A), 2 (rev B) or 3 (rev C)"
+#endif
+
+const int WARM_PIN = Board::warmPin;
+const int COOL_PIN = Board::coolPin;
+const int PWM_FREQ = Board::pwmFreq;
+const int PWM_RESOLUTION = Board::pwmResolution;
+const int PWM_CHANNEL_WARM = Board::warmChannel;
+const int PWM_CHANNEL_COOL = Board::coolChannel;
+const int PWM_BAND_COUNT = Board::pwmBandCount;
+const int PWM_MAX = Board::pwmMax;
+const int LEVEL_MAX = 65535;                           // Full scale of the internal 16-bit brightness level
+const int BRIGHTNESS_MAX = 1023;                       // Full scale of API brightness values (unless "scale" is given)
+const int SUNRISE_COOL_LEVEL = LEVEL_MAX * 2 / 5;      // Cool level at the end of a sunrise (40%)
+const int GAMMA_TABLE_KNOTS = 257;                     // Gamma curve samples; levels between are interpolated
+
+// Adaptive PWM - the timer's frequency/resolution follows the brightness (board pwmBand())
+const bool PWM_BANDS_ENABLED = true;          // false = fixed pwmFreq/pwmResolution
+const int PWM_BAND_HYSTERESIS = 1311;         // Levels (2%) below a band's start before dropping out of it
+const ledc_mode_t PWM_MODE = LEDC_LOW_SPEED_MODE;
+const ledc_timer_t PWM_TIMER = LEDC_TIMER_0;  // Shared by both channels
+const int PWM_TRACE_ENTRIES = 64;             // Output writes kept for /debug/pwm-trace
+const bool PWM_PHASE_STAGGER = true;          // Offset the cool channel's on-time from the warm one's (LEDC hpoint)
+const int PWM_COMMIT_GUARD_US = 25;           // A commit closer than this to a period end waits for the next period
+
+// Local controls (push button + quadrature rotary encoder, active low)
+const bool LOCAL_CONTROLS_ENABLED = true;
+const int BUTTON_PIN = 25;
+const int ENCODER_A_PIN = 26;
+const int ENCODER_B_PIN = 27;
+const unsigned long BUTTON_DEBOUNCE_MS = 25;    // Edges closer than this are contact bounce
+const unsigned long BUTTON_LONG_PRESS_MS = 800; // Hold at least this long to snooze
+const unsigned long BUTTON_DOUBLE_CLICK_MS = 400; // A second press this soon after the first is a double click
+const int BUTTON_SCENE_ID = 1;                    // Scene a double click recalls (0 or not saved = no double click)
+const int ENCODER_STEP = 1024;                  // Level change per detent (1/64 of full scale)
+const unsigned long ENCODER_MEDIUM_MS = 80;     // Detents faster than this move 4x
+const unsigned long ENCODER_FAST_MS = 30;       // Detents faster than this move 12x
+const int ENCODER_MEDIUM_MULTIPLIER = 4;
+const int ENCODER_FAST_MULTIPLIER = 12;
+
+static_assert(!LOCAL_CONTROLS_ENABLED || (WARM_PIN != BUTTON_PIN && WARM_PIN != ENCODER_A_PIN && WARM_PIN != ENCODER_B_PIN &&
+                                          COOL_PIN != BUTTON_PIN && COOL_PIN != ENCODER_A_PIN && COOL_PIN != ENCODER_B_PIN),
+              "Board LED pins collide with the local control pins");
+static_assert(!RTC_ENABLED || (WARM_PIN != RTC_SDA_PIN && WARM_PIN != RTC_SCL_PIN && COOL_PIN != RTC_SDA_PIN && COOL_PIN != RTC_SCL_PIN),
+              "Board LED pins collide with the RTC I2C pins");
+
+// Ambient light sensor (photodiode/LDR divider on an ADC1 pin, sampled by I2S DMA)
+const bool AMBIENT_ENABLED = false;
+const adc1_channel_t AMBIENT_ADC_CHANNEL = ADC1_CHANNEL_6; // GPIO 34
+const uint32_t AMBIENT_SAMPLE_RATE = 8000;                 // Hz, continuous DMA sampling
+const int AMBIENT_BLOCK_SAMPLES = 256;                     // DMA buffer length
+const int32_t AMBIENT_ADC_MAX = 4095;
+const int AMBIENT_FILTER_SHIFT = 4;                        // EMA weight 1/16 per tick (~0.3 s at 50 Hz)
+// Controller constants, Q16 fixed point (65536 = 1.0)
+const int32_t AMBIENT_FULL_SCALE = 65536;
+const int32_t AMBIENT_SETPOINT_Q16 = 39322;  // Sensed level wanted at the end of sunrise (0.6)
+const int32_t AMBIENT_MAX_SKIP_Q16 = 52429;  // Never skip more than 80% of the curve
+const int32_t AMBIENT_MIN_SCALE_Q16 = 19661; // Output never trimmed below 30%
+const int32_t AMBIENT_KI_Q16 = 6554;         // Output trim per second per unit error (0.1)
+const int32_t AMBIENT_SKIP_GAIN_Q16 = 262144; // Extra speed per unit lead over the curve (4.0)
 
 // Sunrise Configuration
 const int SUNRISE_DURATION_MINUTES = 15; // Duration of sunrise fade
@@ -37,10 +254,136 @@ const unsigned long SUNRISE_DURATION_MS = SUNRISE_DURATION_MINUTES * 60 * 1000;
 const unsigned long MANUAL_FADE_MS = 350; // 350 milliseconds fade for manual on/off
 // Auto-off configuration
 const int DEFAULT_AUTO_OFF_MINUTES = 45; // Default time to auto-off after sunrise completes
+// Snooze configuration (defaults, adjustable via /set-snooze)
+const int DEFAULT_SNOOZE_MINUTES = 9;    // Time before a snoozed sunrise resumes
+const int DEFAULT_SNOOZE_DIM_LEVEL = 40; // Warm level held while snoozed (0-1023)
+const int DEFAULT_SNOOZE_MAX_COUNT = 3;  // Snoozes allowed per sunrise
+// Sunset (wind-down) configuration
+const int SUNSET_MIN_MINUTES = 30;
+const int SUNSET_MAX_MINUTES = 120;
+const int DEFAULT_SUNSET_MINUTES = 60;
+const int SUNSET_COOL_END_PERCENT = 60; // Cool channel is off after this share of the fade
+const int SUNSET_DEFAULT_WARM = 700;    // Starting level when the lights are off
+const int SUNSET_DEFAULT_COOL = 150;
+// Scene presets
+const int MAX_SCENES = 16;
+const uint8_t SCENE_STORE_VERSION = 2; // Bump when the Scene layout changes (2: 16-bit levels)
+const int SCENE_WARM_KELVIN = 2700;    // Colour temperature of the warm LEDs
+const int SCENE_COOL_KELVIN = 6500;    // Colour temperature of the cool LEDs
+const int SCENE_SCHEDULE_SLOTS = 8;    // Daily times at which a scene is recalled
+// Light programs (chained transitions)
+const int MAX_PROGRAM_STEPS = 16;
+const uint32_t MAX_PROGRAM_STEP_MS = 3600000; // Longest fade or hold of one step (1 hour)
+// Effect VM (bytecode light effects)
+const int VM_MAX_CODE = 256;                        // Bytes of bytecode
+const int VM_REGISTERS = 8;                         // r0-r7
+const int VM_LOOP_DEPTH = 4;                        // Nested LOOP limit
+const uint32_t VM_TICK_BUDGET = 256;                // Instructions per loop() tick, keeps the web server responsive
+const uint32_t VM_BENCHMARK_INSTRUCTIONS = 200000;  // Length of the /benchmark-effect run
+const int OUTPUT_BENCHMARK_STRIDE = 7;              // /benchmark-output converts every 7th level (9363 samples)
+const uint8_t VM_IMM16 = 0x80;                      // Operand tag: a u16 immediate follows
+// Solar almanac
+const uint8_t ALMANAC_VERSION = 1;         // Bump when the Almanac layout or equations change
+const int16_t SOLAR_NONE = INT16_MIN;      // No sunrise/sunset that day (polar day or night)
+const int SOLAR_MAX_OFFSET_MINUTES = 180;  // Limit for offsets from sunrise/sunset
+// Circadian mode
+const int DEFAULT_CIRCADIAN_LEVEL = 800;
+const int DEFAULT_CIRCADIAN_OVERRIDE_MINUTES = 60; // Manual control holds the output this long
+const unsigned long CIRCADIAN_BLEND_MS = 30000;    // Fade back to the curve after an override
+const unsigned long CIRCADIAN_RETRY_MS = 10000;    // Recheck while another transition owns the output
+const unsigned long CIRCADIAN_MAX_SLEEP_MS = 900000;
+struct CircadianPoint
+{
+  int16_t minute; // local minute of the day
+  int16_t kelvin;
+};
+// Daylight-like curve: warm at night, coolest around midday
+const CircadianPoint CIRCADIAN_CURVE[] = {
+    {0, 2700}, {6 * 60, 2700}, {9 * 60, 4500}, {12 * 60, 6000}, {15 * 60, 6000}, {18 * 60, 4000}, {20 * 60, 2700}, {24 * 60, 2700},
+};
+const int CIRCADIAN_POINTS = sizeof(CIRCADIAN_CURVE) / sizeof(CIRCADIAN_CURVE[0]);
+
+// OTA Configuration
+const int OTA_HTTP_PORT = 8080;        // Streaming upload endpoint for raw, zlib and delta images
+const uint32_t OTA_TASK_STACK = 8192;  // Bytes of stack for the OTA task
+const int OTA_TASK_CORE = 0;           // loop() runs on core 1, keep flash writes away from it
+const uint8_t OTA_FORMAT_ZLIB = 0x01;  // Image is zlib-compressed, inflated while streaming
+const uint8_t OTA_FORMAT_DELTA = 0x02; // Image is a delta patch against the running firmware
+
+// Firmware signing - PEM public key (ECDSA P-256 recommended). When set, every
+// image must carry a valid signature over its SHA-256 and the unsigned espota
+// path is disabled. Leave empty to accept unsigned images.
+const char *OTA_SIGNING_PUBLIC_KEY = "";
+// Password for the espota path when signing is not enabled (empty = none).
+// POST /ota takes it, or API_TOKEN, as a bearer token; with neither set it
+// accepts only signed images, and without a signing key it is closed.
+const char *OTA_PASSWORD = "";
+
+// Group sync - lights in one room share a timebase over UDP multicast
+const bool GROUP_ENABLED = false;
+const char *GROUP_MULTICAST_ADDR = "239.255.77.77";
+const uint16_t GROUP_PORT = 4777;
+const unsigned long GROUP_BEACON_MS = 1000;       // Beacon and sync request interval
+const unsigned long GROUP_PEER_TIMEOUT_MS = 3500; // Peer (and sync) considered lost after this
+const unsigned long GROUP_RECV_TIMEOUT_MS = 50;   // Socket wait per task iteration
+const int GROUP_MAX_PEERS = 8;
+const int GROUP_SYNC_SAMPLES = 8;                 // Offset exchanges kept for the min-delay filter
+const uint32_t GROUP_TASK_STACK = 4096;
+const int GROUP_TASK_CORE = 0;
+const uint32_t GROUP_MAGIC = 0x53475557;          // "WUGS" little-endian
+const int GROUP_JOIN_WINDOW_MINUTES = 5;          // Follow a group sunrise only when our own alarm is this close
+const int GROUP_TAG_BYTES = 16;                   // Truncated HMAC-SHA256 tag on every packet
+// Group key - when API_TOKEN is set, packets must carry an HMAC-SHA256 tag
+// made with this key (every light in the group needs the same one).
+// Empty = API_TOKEN.
+const char *GROUP_KEY = "";
+
+// Event log - append-only journal in its own flash partition (see partitions.csv)
+const char *EVENT_LOG_PARTITION = "eventlog";
+const uint8_t EVENT_LOG_SUBTYPE = 0x40;        // Custom data subtype of the partition
+const uint32_t EVENT_SECTOR_SIZE = 4096;       // Flash erase unit
+const int EVENT_PAGE_RECORDS = 16;             // One 256-byte flash page of records
+const int EVENT_PENDING_MAX = 32;              // Records staged in RAM between flushes
+const unsigned long EVENT_FLUSH_MS = 10000;    // Longest a record waits for its page to fill
+const int EVENT_QUERY_DEFAULT = 100;           // Records per /events page
+const int EVENT_QUERY_MAX = 1000;
+
+// Usage counters - LED on-time and energy, kept in RTC memory and saved to NVS now and then
+const float LED_WARM_WATTS = 12.0f;              // Draw of the warm strip at full duty
+const float LED_COOL_WATTS = 12.0f;              // Draw of the cool strip at full duty
+const unsigned long USAGE_SAVE_MS = 3600000;     // NVS save interval (at most this much is lost on a power cut)
+const uint32_t USAGE_MAGIC = 0x31475355;         // "USG1" - bump when UsageTotals changes
+
+// Stall detector - watches the loop() tick from an esp_timer callback
+const unsigned long STALL_CHECK_MS = 100;    // How often the detector looks
+const unsigned long STALL_LATE_MS = 100;     // A loop() gap above this is a late tick (normal gap ~20 ms)
+const unsigned long STALL_DETECT_MS = 1000;  // A gap above this is a stall and is captured
+const unsigned long STALL_ABORT_MS = 10000;  // A stall this long panics, for a core dump and a reboot (not in HTTP)
+const int STALL_BACKTRACE_DEPTH = 16;
+const uint32_t STALL_MAGIC = 0x4C415453;     // "STAL" - bump when StallRecord changes
+
+// Resource monitor - task stacks, heap and allocations by call site
+const unsigned long RESOURCE_SAMPLE_MS = 10000; // Sampling interval
+const uint32_t STACK_ALERT_BYTES = 512;         // Alert when a task's unused stack falls below this
+const uint32_t HEAP_ALERT_BYTES = 24576;        // Alert when free heap falls below this
+const int HEAP_FRAGMENTATION_ALERT_PERCENT = 70; // Alert when the largest free block is this much below free heap
+const int MONITORED_TASKS = 6;
+const int ALLOC_MAX_SITES = 64;               // Fixed sites plus one per HTTP handler
 
 // ============ GLOBAL VARIABLES ============
 Preferences preferences;
 WebServer server(80);
+WebServer otaServer(OTA_HTTP_PORT); // Served from the OTA task, never from loop()
+TaskHandle_t otaTaskHandle = nullptr;
+TaskHandle_t groupTaskHandle = nullptr;
+
+// Fade curves selectable per transition
+enum Easing : uint8_t
+{
+  EASING_SINE,   // ease-in-out sine (default)
+  EASING_LINEAR,
+  EASING_SMOOTH, // smoothstep
+};
 
 struct
 {
@@ -48,13 +391,15 @@ struct
   int minute = 30;
   bool isAlarmSet = false;
   bool isSunriseActive = false;
-  unsigned long sunriseStartTime = 0;
-  int currentWarmBrightness = 0;
+  float sunriseProgress = 0.0f;        // 0.0 .. 1.0, advanced each tick
+  unsigned long lastSunriseUpdate = 0; // millis() of the last sunrise tick
+  int currentWarmBrightness = 0; // 16-bit levels (0-LEVEL_MAX)
   int currentCoolBrightness = 0;
   // Manual fade state
   bool isManualFadeActive = false;
   unsigned long manualFadeStartTime = 0;
   unsigned long manualFadeDuration = 0;
+  Easing manualFadeEasing = EASING_SINE;
   int manualStartWarm = 0;
   int manualStartCool = 0;
   int manualTargetWarm = 0;
@@ -62,16 +407,608 @@ struct
   // Auto-off configuration and state
   bool autoOffEnabled = true;
   int autoOffMinutes = DEFAULT_AUTO_OFF_MINUTES;
-  unsigned long sunriseCompleteTime = 0;
+  unsigned long autoOffStartTime = 0; // sunrise completion or scene recall
+  int autoOffDelayMinutes = 0;        // delay of the pending auto-off
   bool autoOffScheduled = false;
 } alarmState;
 
+// Snooze configuration and state - persisted so a reboot mid-snooze still resumes
+struct
+{
+  int minutes = DEFAULT_SNOOZE_MINUTES;
+  int dimLevel = DEFAULT_SNOOZE_DIM_LEVEL;
+  int maxCount = DEFAULT_SNOOZE_MAX_COUNT;
+  bool active = false;   // waiting to resume
+  int count = 0;         // snoozes used in the current sunrise
+  float progress = 0.0f; // sunrise progress to resume from
+  time_t resumeAt = 0;   // UTC instant the sunrise resumes
+} snoozeState;
+
+// Sunset (wind-down) state - the running fade is persisted so it resumes after a reboot
+struct
+{
+  bool active = false;
+  bool needsResync = false;    // restored from flash, position not yet placed
+  int startWarm = 0;
+  int startCool = 0;
+  uint32_t durationMs = 0;
+  unsigned long startMillis = 0;
+  time_t startEpoch = 0;       // UTC start, used to resume after a reboot
+  uint32_t nextEventMs = 0;    // elapsed time of the next output change
+  uint32_t updates = 0;        // output updates so far
+  // Daily schedule
+  bool scheduleEnabled = false;
+  int scheduleHour = 22;
+  int scheduleMinute = 30;
+  int scheduleMinutes = DEFAULT_SUNSET_MINUTES;
+  int lastScheduledYday = -1;
+} sunsetState;
+
+// Scene presets - stored in NVS as one packed blob, kept in RAM for recall
+struct __attribute__((packed)) Scene
+{
+  uint8_t used;
+  char name[16];
+  uint16_t warm;
+  uint16_t cool;
+  uint32_t fadeMs;
+  uint16_t autoOffMinutes; // 0 = stay on
+};
+
+struct __attribute__((packed))
+{
+  uint8_t version = SCENE_STORE_VERSION;
+  Scene scenes[MAX_SCENES]; // scene ID n lives in slot n-1
+} sceneStore;
+
+// Scene schedule - daily recall times, stored in NVS as one packed blob
+struct __attribute__((packed)) SceneSlot
+{
+  uint8_t sceneId; // 0 = slot unused
+  uint8_t hour;
+  uint8_t minute;
+};
+
+struct
+{
+  SceneSlot slots[SCENE_SCHEDULE_SLOTS] = {};
+  time_t lastMinute = 0; // epoch minute last checked, so a slot fires once
+} sceneSchedule;
+
+// Light program - a queue of transitions run back to back by updateProgram()
+struct TransitionStep
+{
+  uint16_t warm;
+  uint16_t cool;
+  uint32_t durationMs; // fade time to reach the target
+  uint32_t holdMs;     // time to stay at the target before the next step
+  uint8_t easing;      // Easing
+};
+
+struct
+{
+  TransitionStep steps[MAX_PROGRAM_STEPS];
+  uint8_t count = 0;
+  uint8_t index = 0;           // step currently fading or holding
+  unsigned long stepStart = 0; // scheduled millis() start of the current step
+  bool active = false;
+} programState;
+
+// Effect VM opcodes - keep in sync with tools/lightc.py
+enum VmOp : uint8_t
+{
+  VM_HALT,  // stop
+  VM_MOV,   // r, v      r = v
+  VM_RND,   // r, lo, hi r = random in [lo, hi]
+  VM_SENSE, // r         r = ambient level 0-1023
+  VM_ADD,   // r, v      r += v
+  VM_SUB,   // r, v      r -= v
+  VM_SET,   // warm, cool
+  VM_FADE,  // warm, cool, ms (waits for the fade)
+  VM_WAIT,  // ms
+  VM_LOOP,  // count (0 = forever) ... END
+  VM_END,
+  VM_JMP,   // addr16
+  VM_JLT,   // a, b, addr16  jump if a < b
+};
+
+struct VmContext
+{
+  int32_t reg[VM_REGISTERS] = {0};
+  uint16_t pc = 0;
+  uint8_t depth = 0;
+  uint16_t loopStart[VM_LOOP_DEPTH] = {0};
+  int32_t loopLeft[VM_LOOP_DEPTH] = {0}; // -1 = forever
+  unsigned long clock = 0;               // virtual time; the VM sleeps until millis() reaches it
+  bool running = false;
+  const char *fault = nullptr;
+};
+
+// Uploaded effect - bytecode persisted in NVS, VM state in RAM only
+struct
+{
+  uint8_t code[VM_MAX_CODE];
+  int length = 0;
+  VmContext vm;
+  uint32_t executed = 0;
+} effectState;
+
+// Sunrise/sunset table for one location and year - persisted as one blob
+struct __attribute__((packed)) Almanac
+{
+  uint8_t version;
+  int32_t latE4; // degrees * 10^4
+  int32_t lonE4;
+  int16_t year;
+  int16_t rise[366]; // quarter-minutes after UTC midnight, indexed by local tm_yday
+  int16_t set[366];
+};
+
+// Solar schedule - location, table and today's cached events
+struct
+{
+  bool hasLocation = false;
+  int32_t latE4 = 0;
+  int32_t lonE4 = 0;
+  Almanac table = {};
+  uint8_t alarmDays = 0;       // tm_wday bitmask of days that wake at sunrise + offset
+  int alarmOffsetMinutes = 0;
+  bool sunsetFollow = false;   // sunset schedule starts at solar sunset + offset
+  int sunsetOffsetMinutes = 0;
+  int32_t cachedDay = -1;      // local day the instants below belong to
+  time_t riseAt = 0;           // 0 = none today
+  time_t setAt = 0;
+} solarState;
+
+// Circadian mode - all-day colour temperature tracking
+struct
+{
+  bool enabled = false;
+  int level = DEFAULT_CIRCADIAN_LEVEL;
+  int overrideMinutes = DEFAULT_CIRCADIAN_OVERRIDE_MINUTES;
+  bool overridden = false;        // another feature owns the output until wakeMillis
+  bool suspended = false;         // switched off; the curve waits until the light is turned on again
+  bool blend = false;             // next update fades instead of stepping
+  unsigned long wakeMillis = 0;   // next time updateCircadian() has work to do
+  uint32_t updates = 0;           // output updates so far
+} circadianState;
+
+// Group sync wire format - keep in sync with tools/groupsync.py
+enum GroupMessage : uint8_t
+{
+  GROUP_NONE,
+  GROUP_BEACON,
+  GROUP_SYNC_REQUEST,  // t1
+  GROUP_SYNC_RESPONSE, // target, t1 echoed, t2, t3
+  GROUP_START_SUNRISE, // startUs
+  GROUP_START_SUNSET,  // startUs, minutes
+};
+const uint8_t GROUP_FLAG_TIMEBASE = 0x01; // sender holds the group timebase (leads, or has synced to a leader)
+
+struct __attribute__((packed)) GroupPacket
+{
+  uint32_t magic;
+  uint8_t type;
+  uint8_t flags; // GROUP_FLAG_*
+  uint16_t seq;
+  uint32_t nodeId;
+  uint32_t target;
+  int64_t t1;      // follower clock, microseconds
+  int64_t t2;      // group clock
+  int64_t t3;      // group clock
+  int64_t startUs; // group clock
+  uint32_t minutes;
+  uint8_t tag[GROUP_TAG_BYTES]; // HMAC-SHA256 of the fields above (zero when API_TOKEN is empty)
+};
+
+struct GroupPeer
+{
+  uint32_t id; // 0 = free slot
+  unsigned long lastSeen;
+  bool timebase; // may lead (GROUP_FLAG_TIMEBASE in its last packet)
+};
+
+// Group sync state - shared with groupTask (accessed under groupLock)
+struct
+{
+  int sock = -1;
+  struct sockaddr_in groupAddr;
+  uint32_t nodeId = 0;
+  uint32_t leaderId = 0;              // 0 = no light holds a timebase yet
+  bool hasTimebase = false;           // we lead or have synced once, so leading keeps the group clock
+  unsigned long startedMillis = 0;    // when we began listening for a timebase
+  GroupPeer peers[GROUP_MAX_PEERS] = {};
+  int peerCount = 0;
+  uint16_t txSeq = 0;
+  int64_t offsetUs = 0;               // group time = local time + offset
+  int64_t delayUs = 0;                // one-way delay of the sample in use
+  int64_t sampleOffset[GROUP_SYNC_SAMPLES];
+  int64_t sampleDelay[GROUP_SYNC_SAMPLES];
+  int sampleIndex = 0;
+  int sampleCount = 0;
+  unsigned long lastSyncMillis = 0;
+  uint32_t syncCount = 0;
+  GroupPacket txAnnounce = {};        // queued by loop(), sent by the task
+  uint8_t rxType = GROUP_NONE;        // last transition start heard, applied by loop()
+  int64_t rxStartUs = 0;
+  int rxMinutes = 0;
+  // Loop side only: group start of the running transitions (0 = local timing)
+  int64_t sunriseStartUs = 0;
+  int64_t sunsetStartUs = 0;
+} groupState;
+
+// Event log records - fixed size so a sector holds a whole number of them
+enum EventType : uint8_t
+{
+  EVENT_NONE,
+  EVENT_BOOT,             // arg = esp_reset_reason()
+  EVENT_ALARM_FIRED,      // arg = local minute of the day, value = 1 on a solar day
+  EVENT_SUNRISE_COMPLETE,
+  EVENT_MANUAL_ON,        // arg = EventSource
+  EVENT_MANUAL_OFF,       // arg = EventSource
+  EVENT_AUTO_OFF,         // arg = timer length in minutes
+  EVENT_WIFI_DROP,        // arg = disconnect reason
+  EVENT_WIFI_CONNECTED,
+  EVENT_TIME_SYNC,        // arg = TimeSource, value = correction in ms
+  EVENT_LOOP_STALL,       // arg = LoopStage, value = stall length in ms
+  EVENT_RESOURCE_ALERT,   // arg = ResourceCheck | task index << 8, value = bytes or percent
+  EVENT_TYPE_COUNT
+};
+
+enum EventSource : uint16_t
+{
+  EVENT_FROM_API,
+  EVENT_FROM_BUTTON
+};
+
+struct __attribute__((packed)) EventRecord
+{
+  uint32_t seq;  // 0xFFFFFFFF = erased slot
+  uint32_t time; // UTC seconds; below TIME_VALID_AFTER the clock was unset and this is uptime
+  uint8_t type;
+  uint8_t check; // catches records torn by a power cut mid-write
+  uint16_t arg;
+  int32_t value;
+};
+static_assert(EVENT_SECTOR_SIZE % sizeof(EventRecord) == 0, "EventRecord must tile a sector");
+
+// Event log state - records are staged from any task under eventLock, written by loop()
+struct
+{
+  const esp_partition_t *partition = nullptr;
+  uint32_t sectorCount = 0;
+  uint32_t head = 0;    // offset of the next free slot; the rest of its sector is erased
+  uint32_t nextSeq = 1;
+  EventRecord pending[EVENT_PENDING_MAX];
+  int pendingCount = 0;
+  unsigned long pendingSince = 0;
+  uint32_t dropped = 0; // records lost because staging was full
+  uint32_t flushes = 0;
+  uint32_t erases = 0;
+} eventLog;
+
+portMUX_TYPE eventLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Usage totals - duty x time per channel in PWM counts x microseconds (exact integers)
+struct UsageTotals
+{
+  uint32_t magic;
+  uint64_t dutyUs[2]; // warm, cool; divide by the PWM full scale for full-power time
+  uint64_t onUs[2];   // time with the channel above zero
+  uint64_t poweredUs; // time the board has been running
+  uint32_t check;
+};
+
+// Running totals live in RTC memory, which survives panics, watchdog resets and
+// ESP.restart(), so only a power cut loses what was not yet saved to NVS
+RTC_NOINIT_ATTR UsageTotals usageRtc;
+
+// Output stage bookkeeping (accessed under usageLock)
+struct
+{
+  int64_t lastUs = 0; // esp_timer time the totals were last brought up to date
+  uint32_t duty[2] = {0, 0}; // in pwmResolution counts
+  bool lit[2] = {false, false};
+  unsigned long lastSaveTime = 0;
+  uint32_t saves = 0;
+  bool restored = false; // totals came from RTC memory rather than NVS
+} usageState;
+
+// One output write, for /debug/pwm-trace
+struct PwmTraceEntry
+{
+  uint32_t timeUs;
+  int8_t band;
+  uint8_t bits;
+  uint16_t warm16; // 16-bit duty asked for
+  uint16_t cool16;
+  uint16_t warmDuty; // duty written, in `bits` counts
+  uint16_t coolDuty;
+  uint16_t coolHpoint; // cool channel's phase offset, in `bits` counts
+  uint32_t frame;      // number of the committed frame
+  bool torn;           // the commit straddled a period end
+};
+
+// LED outputs of the PWM output stage
+enum PwmOutput : uint8_t
+{
+  PWM_OUT_WARM,
+  PWM_OUT_COOL,
+  PWM_OUTPUTS
+};
+
+// PWM output stage (loop() only)
+struct
+{
+  int band = -1; // active entry of Board::pwmBand(), -1 = fixed pwmFreq/pwmResolution
+  uint32_t freq = PWM_FREQ;
+  uint16_t staged[PWM_OUTPUTS] = {0, 0}; // 16-bit duties waiting for pwmCommit()
+  uint8_t bits = PWM_RESOLUTION;
+  uint32_t warmDuty = 0; // last written, in `bits` counts
+  uint32_t coolDuty = 0;
+  uint32_t coolHpoint = 0;   // counter value the cool output turns on at (warm is always 0)
+  uint32_t overlap = 0;      // counts per period with both outputs on
+  float peakWatts = 0;       // instantaneous draw while both are on (or the larger one)
+  float peakWattsMax = 0;    // since boot
+  uint32_t bandSwitches = 0;
+  uint32_t lateSwitches = 0; // switches whose writes straddled a period end
+  uint32_t framesCommitted = 0;
+  uint32_t framesTorn = 0;   // commits whose latch writes straddled a period end
+  PwmTraceEntry trace[PWM_TRACE_ENTRIES];
+  uint32_t traceCount = 0;
+} pwmState;
+
+portMUX_TYPE usageLock = portMUX_INITIALIZER_UNLOCKED;
+
+// What loop() was doing, for stall reports
+enum LoopStage : uint8_t
+{
+  STAGE_SETUP,
+  STAGE_HTTP,     // server.handleClient() and the handler it runs
+  STAGE_LIGHTING, // update functions
+  STAGE_IDLE,     // delay() at the end of the tick
+  STAGE_COUNT
+};
+
+// A captured stall. Kept in RTC memory so it survives the reboot it may lead to.
+struct StallRecord
+{
+  uint32_t magic;
+  uint32_t time;      // UTC seconds, or uptime if the clock was unset
+  uint32_t uptimeMs;
+  uint32_t stalledMs; // longest gap seen during this stall
+  uint8_t stage;
+  uint8_t taskState;  // eTaskState of loopTask at capture
+  uint8_t aborted;    // the detector forced a panic
+  uint8_t depth;      // backtrace entries (0 if loopTask was running and had no saved context)
+  char handler[32];   // URI of the HTTP handler, empty outside one
+  char core0Task[16]; // tasks running on each core at capture
+  char core1Task[16];
+  uint32_t backtrace[STALL_BACKTRACE_DEPTH]; // loopTask program counters
+  uint32_t check;
+};
+
+RTC_NOINIT_ATTR StallRecord stallRtc;
+
+// Loop heartbeat - written by loop(), read by the detector callback
+struct
+{
+  TaskHandle_t loopTask = nullptr;
+  esp_timer_handle_t timer = nullptr;
+  volatile int64_t lastTickUs = 0;
+  volatile int64_t lastProgressUs = 0; // last tick or progress mark (stallProgress)
+  volatile uint8_t stage = STAGE_SETUP;
+  char handler[32] = "";  // current HTTP handler URI
+  volatile bool capturing = false; // a stall is in progress and has been captured
+  StallRecord previous = {};       // stall from before this boot, if any
+  bool hasPrevious = false;
+  uint32_t lateTicks = 0;
+  uint32_t stalls = 0;
+  uint32_t maxTickMs = 0;
+} stallState;
+
+// Resource checks that can raise an alert
+enum ResourceCheck : uint8_t
+{
+  RESOURCE_STACK,
+  RESOURCE_HEAP_LOW,
+  RESOURCE_HEAP_FRAGMENTED
+};
+
+struct MonitoredTask
+{
+  const char *name;
+  TaskHandle_t handle;
+  uint32_t minFreeStack; // bytes never used (high-water mark)
+  bool alert;
+};
+
+// Resource monitor samples (loop() only)
+struct
+{
+  MonitoredTask tasks[MONITORED_TASKS];
+  int taskCount = 0;
+  uint32_t freeHeap = 0;
+  uint32_t minFreeHeap = 0;
+  uint32_t largestFreeBlock = 0;
+  int fragmentationPercent = 0;
+  bool heapLowAlert = false;
+  bool fragmentedAlert = false;
+  uint32_t alerts = 0;
+  unsigned long lastSampleTime = 0;
+} resourceState;
+
+// Allocation sites: loop() stages, other tasks, then one per HTTP handler
+enum AllocFixedSite : uint8_t
+{
+  ALLOC_SITE_SETUP,
+  ALLOC_SITE_HTTP,     // WebServer parsing outside a handler
+  ALLOC_SITE_LIGHTING,
+  ALLOC_SITE_IDLE,
+  ALLOC_SITE_OTA,
+  ALLOC_SITE_GROUP,
+  ALLOC_SITE_SYSTEM,   // WiFi, lwIP, timers and anything else
+  ALLOC_FIXED_SITES
+};
+
+struct AllocSite
+{
+  char name[28];
+  uint32_t count;
+  uint64_t bytes;
+};
+
+// Updated by the malloc wrappers from any task (under allocLock). Constant-initialised,
+// because malloc runs before static constructors.
+struct
+{
+  AllocSite sites[ALLOC_MAX_SITES];
+  volatile int siteCount;
+  volatile int handlerSite; // loopTask's current HTTP handler site, -1 outside one
+  TaskHandle_t loopTask;
+  uint32_t frees;
+  uint32_t failures;
+} allocState = {{}, ALLOC_FIXED_SITES, -1, nullptr, 0, 0};
+
+portMUX_TYPE allocLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Ambient light state - filtered sensor level and closed-loop controller outputs
+struct
+{
+  bool running = false;
+  bool primed = false;                     // first sample has seeded the filter
+  int32_t levelQ16 = 0;                    // filtered ADC reading, Q16
+  int32_t outputScaleQ16 = 65536;          // sunrise output trim
+  int32_t speedQ16 = 65536;                // sunrise speed multiplier
+} ambientState;
+
+// Local control events, queued from GPIO interrupts and consumed by loop()
+enum ControlEventType : uint8_t
+{
+  CONTROL_PRESS,
+  CONTROL_LONG_PRESS,
+  CONTROL_ROTATE
+};
+
+struct ControlEvent
+{
+  ControlEventType type;
+  int16_t delta; // encoder detents, already scaled by turn speed
+};
+
+const uint8_t CONTROL_QUEUE_SIZE = 32; // power of two
+
+struct
+{
+  ControlEvent events[CONTROL_QUEUE_SIZE];
+  volatile uint8_t head = 0; // written by the ISR only
+  volatile uint8_t tail = 0; // written by loop() only
+  volatile uint32_t dropped = 0;
+} controlQueue;
+
+// Button debounce - shared by buttonISR() and buttonSettle() under buttonLock
+struct
+{
+  unsigned long lastEdgeMs = 0; // any edge, bounce included
+  unsigned long burstAt = 0;    // first edge after a quiet spell
+  unsigned long pressedAt = 0;
+  bool pressed = false;
+  bool settling = false; // edges since the level was last read when quiet
+} buttonState;
+portMUX_TYPE buttonLock = portMUX_INITIALIZER_UNLOCKED;
+
+// OTA progress metrics - written by the OTA task, read by /ota-status
+enum OtaPhase : uint8_t
+{
+  OTA_IDLE,
+  OTA_RECEIVING,
+  OTA_SUCCEEDED,
+  OTA_FAILED
+};
+
+struct
+{
+  volatile OtaPhase phase = OTA_IDLE;
+  volatile uint8_t format = 0;
+  volatile uint32_t bytesReceived = 0; // bytes received over the network
+  volatile uint32_t bytesWritten = 0;  // bytes written to flash after inflate/patch
+  volatile uint32_t totalSize = 0;     // expected network size, 0 if unknown
+  volatile unsigned long startTime = 0;
+  volatile unsigned long endTime = 0;
+  volatile bool signatureVerified = false;
+  volatile uint32_t hashMicros = 0;   // time spent hashing the image
+  volatile uint32_t verifyMicros = 0; // time spent checking the signature
+  const char *lastError = "";
+} otaStatus;
+
+// Time zone - the POSIX rule compiled into a sorted table of UTC transition instants
+struct TzTransition
+{
+  time_t at;         // UTC instant the new offset takes effect
+  int32_t utcOffset; // seconds east of UTC from this instant on
+  bool isDst;
+};
+
+struct
+{
+  char spec[64] = "";
+  int32_t stdOffset = 0; // seconds east of UTC
+  int32_t dstOffset = 0;
+  bool hasDst = false;
+  char startRule[16] = "";
+  char endRule[16] = "";
+  // Lazily built table covering [coverStart, coverEnd)
+  TzTransition transitions[2 * (TZ_TABLE_YEARS + 1)];
+  int transitionCount = 0;
+  int32_t baseOffset = 0; // offset before the first transition
+  bool baseIsDst = false;
+  time_t coverStart = 0;
+  time_t coverEnd = 0;
+} tzState;
+
+// Time sources, combined by quality (expected error) and recency
+enum TimeSource : uint8_t
+{
+  TIME_SOURCE_NONE,
+  TIME_SOURCE_NTP,
+  TIME_SOURCE_CLIENT,
+  TIME_SOURCE_HTTP_DATE,
+  TIME_SOURCE_RTC
+};
+
+// Time discipline - tracks offset and drift across time samples (accessed under timeLock)
+struct
+{
+  bool synced = false;            // at least one time sample since boot
+  TimeSource source = TIME_SOURCE_NONE; // source of the last accepted sample
+  int32_t sourceErrorMs = 0;      // expected error of that sample
+  bool lastWasStep = false;       // previous correction stepped the clock
+  int64_t lastSyncUs = 0;         // esp_timer time of the last sample
+  int64_t lastOffsetUs = 0;       // server minus local at the last sample
+  float driftPpm = 0.0f;          // local clock rate error, positive = runs fast
+  float driftSpreadPpm = 0.0f;    // filtered deviation of drift samples (estimate quality)
+  uint32_t sampleCount = 0;
+  uint32_t stepCount = 0;
+  uint32_t rejectedCount = 0;     // samples worse than the running clock
+  unsigned long lastHoldoverTime = 0;
+  unsigned long lastRtcWriteTime = 0;
+} timeDiscipline;
+
+SemaphoreHandle_t timeLock = nullptr;
+SemaphoreHandle_t groupLock = nullptr;
+
 // ============ FUNCTION DECLARATIONS ============
 void setupWiFi();
 void setupNTP();
 void setupWebServer();
 void setupLED();
 void setupOTA();
+void setupRTC();
+void writeRTC();
+void otaTask(void *param);
+void handleOtaUpload();
+void handleOtaUploadComplete();
+void handleOtaStatus();
 void handleSetAlarm();
 void handleGetAlarm();
 void handleManualOn();
@@ -85,8 +1022,119 @@ void saveAlarmToStorage();
 void updateSunrise();
 void updateManualFade();
 void updateAutoOff();
+void setupControls();
+void setupAmbient();
+void updateAmbient();
+int32_t ambientLevelQ16();
+void updateControls();
+void buttonSettle();
+void startManualFade(int warm, int cool, unsigned long duration);
+bool snoozeSunrise();
+void cancelSnooze();
+void updateSnooze();
+void resumeSunrise(float progress);
+void startSunset(int minutes);
+void stopSunset();
+void updateSunset();
+void handleStartSunset();
+void handleStopSunset();
+void handleSetSunsetSchedule();
+void handleGetSunset();
+void loadScenes();
+void saveScenes();
+void cctToChannels(int kelvin, int level, int &warm, int &cool);
+Scene *findScene(int id);
+bool recallScene(int id);
+void handleSaveScene();
+void handleRecallScene();
+void handleDeleteScene();
+void handleGetScenes();
+void updateSceneSchedule();
+void handleSetSceneSchedule();
+void handleGetSceneSchedule();
+void startProgram(const TransitionStep *steps, int count);
+void stopProgram();
+void updateProgram();
+void handleStartProgram();
+void handleStopProgram();
+void handleGetProgram();
+void loadEffect();
+bool loadEffectCode(const uint8_t *code, int length);
+bool startEffect();
+void stopEffect();
+void updateEffect();
+uint32_t benchmarkEffectVm(uint32_t &executed, uint32_t &elapsedUs);
+void handleLoadEffect();
+void handleStartEffect();
+void handleStopEffect();
+void handleGetEffect();
+void handleBenchmarkEffect();
+void handleBenchmarkOutput();
+void loadAlmanac();
+void solarRefreshDay(const struct tm &local);
+void solarInvalidate();
+time_t solarAlarmToday(const struct tm &local);
+time_t solarSunsetToday(const struct tm &local);
+void handleSetLocation();
+void handleSetSolarSchedule();
+void handleGetSolar();
+int circadianKelvinAt(int32_t second);
+void saveCircadianSettings();
+void circadianOverride();
+void circadianSuspend();
+void setCircadianEnabled(bool enabled);
+void updateCircadian();
+void handleSetCircadian();
+void handleGetCircadian();
+void setupGroup();
+void groupTask(void *param);
+int64_t groupNowUs();
+bool groupIsSynced();
+void groupAnnounceSunrise();
+void groupAnnounceSunset(int minutes);
+void updateGroup();
+void handleGroupStatus();
+void setupEventLog();
+void logEvent(EventType type, uint16_t arg = 0, int32_t value = 0);
+void flushEventLog();
+void updateEventLog();
+void handleEvents();
+void setupUsage();
+void saveUsage();
+void updateUsage();
+UsageTotals usageSnapshot();
+float usageWattHours(const UsageTotals &totals, int ch);
+void setupStallDetector();
+void stallHeartbeat();
+void stallProgress();
+void handleLastCrash();
+void handleCoreDump();
+void handleClearCrash();
+void setupResourceMonitor();
+void updateResourceMonitor();
+void sampleResources();
+void allocEnterHandler(const char *uri);
+void allocLeaveHandler();
+const char *allocSiteName(int site);
+void handleMetrics();
+void handleSnooze();
+void handleSetSnooze();
+void handleGetSnooze();
 void handleSetAutoOff();
 void handleGetAutoOff();
+void handleSetTimezone();
+void handleGetTimezone();
+bool tzSetZone(const char *spec);
+void tzLocalTime(time_t t, struct tm *out);
+bool timeIsValid();
+int32_t timeEstimatedErrorMs();
+void updateTimeDiscipline();
+void handleTimeStatus();
+void handleSetTime();
+bool timeFromHttpDate(const char *date);
+bool timeFromClient(int64_t epochMs);
+bool isRequestAuthenticated();
+WebServer::THandlerFunction withRequestTime(WebServer::THandlerFunction handler);
 
 // Smoothstep easing function: starts and ends gently
 static float smoothstepf(float x)
@@ -108,25 +1156,55 @@ static float easeInOutSine(float x)
   return 0.5f * (1.0f - cosf(x * M_PI));
 }
 
-// Apply simple gamma correction for perceptual brightness
-// Gamma settings
-const float DEFAULT_GAMMA = 2.2f;
-const float SUNRISE_GAMMA = 1.0f; // linear response during sunrise for smooth fade-up
+const float DEFAULT_GAMMA = 2.2f; // Perceptual brightness curve for everything but the sunrise
+
+// DEFAULT_GAMMA curve from level to 16-bit duty, filled by setupLED()
+static uint16_t gammaTable[GAMMA_TABLE_KNOTS];
 
-// applyGamma: map 0-1023 value through gamma correction
-static int applyGamma(int v, float gamma)
+// applyGamma: map a 0-LEVEL_MAX level to 16-bit duty (0-65535), which the
+// output stage scales to the timer's resolution. The default curve is
+// interpolated from gammaTable for perceptual brightness; the sunrise curve
+// is linear, for a smooth fade-up.
+static int applyGamma(int v, bool linear)
 {
   // clamp
   if (v <= 0)
     return 0;
-  if (v >= 1023)
-    return 1023;
-  float normalized = (float)v / 1023.0f;
-  float corrected = powf(normalized, gamma);
-  return (int)(corrected * 1023.0f + 0.5f);
+  if (v >= LEVEL_MAX)
+    return LEVEL_MAX;
+  if (linear)
+    return v;
+  uint32_t pos = ((uint32_t)v << 8) + (v >> 8); // v * 256 / 65535 as a knot index, 16.16 fixed point
+  uint32_t knot = pos >> 16;
+  uint32_t frac = pos & 0xFFFF;
+  return gammaTable[knot] + (int)((((int32_t)gammaTable[knot + 1] - gammaTable[knot]) * (int32_t)frac + 0x8000) >> 16);
+}
+
+// 16-bit duty to `bits` counts, rounded
+static inline uint32_t pwmScale(uint32_t duty16, int bits)
+{
+  return (duty16 * ((1u << bits) - 1) + 32767) / 65535;
+}
+
+// API brightness (0-1023) to the internal level and back
+static int levelFromBrightness(int brightness)
+{
+  return (brightness * LEVEL_MAX + BRIGHTNESS_MAX / 2) / BRIGHTNESS_MAX;
 }
+
+static int brightnessFromLevel(int level)
+{
+  return (level * BRIGHTNESS_MAX + LEVEL_MAX / 2) / LEVEL_MAX;
+}
+
 void setBrightness(int warm, int cool);
 void startSunrise();
+bool alarmDueWithin(int minutes);
+void setupPwm();
+void pwmStage(PwmOutput output, uint32_t duty16);
+void pwmCommit(int level);
+float pwmOverlapRatio();
+void handlePwmTrace();
 
 // ============ SETUP ============
 void setup()
@@ -139,13 +1217,23 @@ void setup()
   // Initialize preferences for persistent storage
   preferences.begin("alarm", false);
 
+  setupResourceMonitor();
+  setupEventLog();
+  setupUsage(); // before the first setBrightness()
   setupLED();
+  setupControls();
+  setupAmbient();
   setupWiFi();
   setupNTP();
+  setupGroup();
   setupWebServer();
   setupOTA();
 
   loadAlarmFromStorage();
+  loadScenes();
+  loadEffect();
+  loadAlmanac();
+  setupStallDetector(); // last, so a slow WiFi connect is not a stall
 
   Serial.println("Setup complete!");
 }
@@ -153,12 +1241,27 @@ void setup()
 // ============ MAIN LOOP ============
 void loop()
 {
-  ArduinoOTA.handle(); // Handle OTA updates
+  stallHeartbeat(); // Marks the tick for the stall detector
   server.handleClient();
+  stallState.stage = STAGE_LIGHTING;
+  updateControls(); // Button and encoder events
+  updateAmbient();  // Drain ambient light samples
+  updateGroup();    // Transitions started by other lights
   // Update manual fading (if active) and sunrise logic
+  updateProgram();
+  updateEffect();
   updateManualFade();
+  updateSnooze();
   updateSunrise();
-  updateAutoOff(); // Check if auto-off should trigger
+  updateSunset();        // Sparse: only does work when the output actually changes
+  updateSceneSchedule(); // Scenes recalled at set times
+  updateCircadian();     // Sparse as well
+  updateAutoOff();       // Check if auto-off should trigger
+  updateTimeDiscipline();
+  updateEventLog(); // Write staged records a page at a time
+  updateUsage();    // Hourly NVS save of the usage counters
+  updateResourceMonitor();
+  stallState.stage = STAGE_IDLE;
   // Faster update interval for smoother fades
   delay(20);
 }
@@ -166,15 +1269,12 @@ void loop()
 // ============ LED SETUP ============
 void setupLED()
 {
-  Serial.println("Setting up LED pins...");
+  Serial.printf("Setting up LED pins (board %s)...\n", Board::name());
 
-  // Configure PWM channels
-  ledcSetup(PWM_CHANNEL_WARM, PWM_FREQ, PWM_RESOLUTION);
-  ledcSetup(PWM_CHANNEL_COOL, PWM_FREQ, PWM_RESOLUTION);
+  for (int i = 0; i < GAMMA_TABLE_KNOTS; i++)
+    gammaTable[i] = (uint16_t)(powf((float)i / (GAMMA_TABLE_KNOTS - 1), DEFAULT_GAMMA) * LEVEL_MAX + 0.5f);
 
-  // Attach pins to PWM channels
-  ledcAttachPin(WARM_PIN, PWM_CHANNEL_WARM);
-  ledcAttachPin(COOL_PIN, PWM_CHANNEL_COOL);
+  setupPwm();
 
   // Start with lights off
   setBrightness(0, 0);
@@ -183,11 +1283,30 @@ void setupLED()
 }
 
 // ============ WiFi SETUP ============
+// Journal drops and reconnects. The core keeps retrying on its own and reports
+// every failed attempt as another disconnect, so only the first one is logged.
+static void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+  static bool connected = false;
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP && !connected)
+  {
+    connected = true;
+    logEvent(EVENT_WIFI_CONNECTED);
+  }
+  else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED && connected)
+  {
+    connected = false;
+    logEvent(EVENT_WIFI_DROP, info.wifi_sta_disconnected.reason);
+  }
+}
+
 void setupWiFi()
 {
   Serial.print("Connecting to WiFi: ");
   Serial.println(WIFI_SSID);
 
+  WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
   WiFi.mode(WIFI_STA);
   WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
 
@@ -216,16 +1335,28 @@ void setupNTP()
 {
   Serial.println("Setting up NTP time synchronization...");
 
-  // Configure time with NTP server and POSIX timezone string (handles DST automatically)
+  // Drift learned on previous boots gives holdover from the first minute
+  timeLock = xSemaphoreCreateMutex();
+  timeDiscipline.driftPpm = preferences.getFloat("drift_ppm", 0.0f);
+  timeDiscipline.lastHoldoverTime = millis();
+  setupRTC();
+
+  // Configure time with NTP server; the system clock stays in UTC and local
+  // time comes from the precomputed transition table (see tzLocalTime).
+  // Samples are applied by sntp_sync_time() below, which slews instead of stepping.
   configTime(0, 0, NTP_SERVER, "time.nist.gov", "time.google.com");
-  setenv("TZ", TZ_INFO, 1);
-  tzset();
+  String zone = preferences.getString("tz", TZ_INFO);
+  if (!tzSetZone(zone.c_str()))
+  {
+    Serial.printf("Invalid stored timezone \"%s\", using default\n", zone.c_str());
+    tzSetZone(TZ_INFO);
+  }
 
-  // Wait for time to be set
+  // Wait for time to be set (a clock kept across a soft reset is already valid)
   Serial.print("Waiting for NTP time sync: ");
   time_t now = time(nullptr);
   int attempts = 0;
-  while (now < 24 * 3600 && attempts < 20)
+  while (!timeIsValid() && attempts < 20)
   {
     delay(500);
     Serial.print(".");
@@ -234,7 +1365,14 @@ void setupNTP()
   }
 
   Serial.println();
-  struct tm timeinfo = *localtime(&now);
+  if (!timeIsValid())
+  {
+    // SNTP keeps retrying in the background; alarms wait for the first sample
+    Serial.println("Time not set yet - alarm paused until first sync");
+    return;
+  }
+  struct tm timeinfo;
+  tzLocalTime(now, &timeinfo);
   Serial.print("Current time: ");
   Serial.println(asctime(&timeinfo));
 }
@@ -266,17 +1404,138 @@ void setupWebServer()
             { server.send(204); });
   server.on("/get-auto-off", HTTP_OPTIONS, []()
             { server.send(204); });
+  server.on("/ota-status", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-timezone", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-timezone", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/time-status", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/time", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/snooze", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-snooze", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-snooze", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/start-sunset", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/stop-sunset", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-sunset-schedule", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-sunset", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/save-scene", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/recall-scene", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/delete-scene", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-scenes", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-scene-schedule", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-scene-schedule", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/start-program", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/stop-program", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-program", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/load-effect", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/start-effect", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/stop-effect", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-effect", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/benchmark-effect", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/benchmark-output", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-location", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-solar-schedule", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-solar", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/set-circadian", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/get-circadian", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/group-status", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/events", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/metrics", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/debug/last-crash", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/debug/coredump", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/debug/clear-crash", HTTP_OPTIONS, []()
+            { server.send(204); });
+  server.on("/debug/pwm-trace", HTTP_OPTIONS, []()
+            { server.send(204); });
+
+  // Headers inspected for time samples and authentication
+  static const char *collectedHeaders[] = {"Date", "Authorization"};
+  server.collectHeaders(collectedHeaders, 2);
 
   // Actual endpoint handlers
-  server.on("/set-alarm", HTTP_POST, handleSetAlarm);
-  server.on("/get-alarm", HTTP_GET, handleGetAlarm);
-  server.on("/manual-on", HTTP_POST, handleManualOn);
-  server.on("/manual-off", HTTP_POST, handleManualOff);
-  server.on("/set-brightness", HTTP_POST, handleSetBrightness);
-  server.on("/toggle-alarm", HTTP_POST, handleToggleAlarm);
-  server.on("/set-auto-off", HTTP_POST, handleSetAutoOff);
-  server.on("/get-auto-off", HTTP_GET, handleGetAutoOff);
-  server.on("/status", HTTP_GET, handleStatus);
+  server.on("/set-alarm", HTTP_POST, withRequestTime(handleSetAlarm));
+  server.on("/get-alarm", HTTP_GET, withRequestTime(handleGetAlarm));
+  server.on("/manual-on", HTTP_POST, withRequestTime(handleManualOn));
+  server.on("/manual-off", HTTP_POST, withRequestTime(handleManualOff));
+  server.on("/set-brightness", HTTP_POST, withRequestTime(handleSetBrightness));
+  server.on("/toggle-alarm", HTTP_POST, withRequestTime(handleToggleAlarm));
+  server.on("/set-auto-off", HTTP_POST, withRequestTime(handleSetAutoOff));
+  server.on("/get-auto-off", HTTP_GET, withRequestTime(handleGetAutoOff));
+  server.on("/status", HTTP_GET, withRequestTime(handleStatus));
+  server.on("/ota-status", HTTP_GET, withRequestTime(handleOtaStatus));
+  server.on("/set-timezone", HTTP_POST, withRequestTime(handleSetTimezone));
+  server.on("/get-timezone", HTTP_GET, withRequestTime(handleGetTimezone));
+  server.on("/time-status", HTTP_GET, withRequestTime(handleTimeStatus));
+  server.on("/time", HTTP_POST, handleSetTime);
+  server.on("/snooze", HTTP_POST, withRequestTime(handleSnooze));
+  server.on("/set-snooze", HTTP_POST, withRequestTime(handleSetSnooze));
+  server.on("/get-snooze", HTTP_GET, withRequestTime(handleGetSnooze));
+  server.on("/start-sunset", HTTP_POST, withRequestTime(handleStartSunset));
+  server.on("/stop-sunset", HTTP_POST, withRequestTime(handleStopSunset));
+  server.on("/set-sunset-schedule", HTTP_POST, withRequestTime(handleSetSunsetSchedule));
+  server.on("/get-sunset", HTTP_GET, withRequestTime(handleGetSunset));
+  server.on("/save-scene", HTTP_POST, withRequestTime(handleSaveScene));
+  server.on("/recall-scene", HTTP_POST, withRequestTime(handleRecallScene));
+  server.on("/delete-scene", HTTP_POST, withRequestTime(handleDeleteScene));
+  server.on("/get-scenes", HTTP_GET, withRequestTime(handleGetScenes));
+  server.on("/set-scene-schedule", HTTP_POST, withRequestTime(handleSetSceneSchedule));
+  server.on("/get-scene-schedule", HTTP_GET, withRequestTime(handleGetSceneSchedule));
+  server.on("/start-program", HTTP_POST, withRequestTime(handleStartProgram));
+  server.on("/stop-program", HTTP_POST, withRequestTime(handleStopProgram));
+  server.on("/get-program", HTTP_GET, withRequestTime(handleGetProgram));
+  server.on("/load-effect", HTTP_POST, withRequestTime(handleLoadEffect));
+  server.on("/start-effect", HTTP_POST, withRequestTime(handleStartEffect));
+  server.on("/stop-effect", HTTP_POST, withRequestTime(handleStopEffect));
+  server.on("/get-effect", HTTP_GET, withRequestTime(handleGetEffect));
+  server.on("/benchmark-effect", HTTP_GET, withRequestTime(handleBenchmarkEffect));
+  server.on("/benchmark-output", HTTP_GET, withRequestTime(handleBenchmarkOutput));
+  server.on("/set-location", HTTP_POST, withRequestTime(handleSetLocation));
+  server.on("/set-solar-schedule", HTTP_POST, withRequestTime(handleSetSolarSchedule));
+  server.on("/get-solar", HTTP_GET, withRequestTime(handleGetSolar));
+  server.on("/set-circadian", HTTP_POST, withRequestTime(handleSetCircadian));
+  server.on("/get-circadian", HTTP_GET, withRequestTime(handleGetCircadian));
+  server.on("/group-status", HTTP_GET, withRequestTime(handleGroupStatus));
+  server.on("/events", HTTP_GET, withRequestTime(handleEvents));
+  server.on("/metrics", HTTP_GET, withRequestTime(handleMetrics));
+  server.on("/debug/last-crash", HTTP_GET, withRequestTime(handleLastCrash));
+  server.on("/debug/coredump", HTTP_GET, withRequestTime(handleCoreDump));
+  server.on("/debug/clear-crash", HTTP_POST, withRequestTime(handleClearCrash));
+  server.on("/debug/pwm-trace", HTTP_GET, withRequestTime(handlePwmTrace));
   server.onNotFound(handleNotFound);
 
   server.begin();
@@ -290,50 +1549,549 @@ void setupOTA()
   ArduinoOTA.setHostname("wake-up-light");
 
   // Set authentication password (optional, but recommended)
-  // ArduinoOTA.setPassword("your_ota_password");
+  if (OTA_PASSWORD[0] != '\0')
+    ArduinoOTA.setPassword(OTA_PASSWORD);
 
   ArduinoOTA.onStart([]()
-                     { Serial.println("OTA: Starting update..."); });
+                     {
+    Serial.println("OTA: Starting update...");
+    otaStatus.format = 0;
+    otaStatus.bytesReceived = 0;
+    otaStatus.bytesWritten = 0;
+    otaStatus.totalSize = 0;
+    otaStatus.startTime = millis();
+    otaStatus.phase = OTA_RECEIVING; });
 
   ArduinoOTA.onEnd([]()
-                   { Serial.println("\nOTA: Update finished!"); });
+                   {
+    saveUsage(); // ArduinoOTA reboots straight after this
+    otaStatus.endTime = millis();
+    otaStatus.phase = OTA_SUCCEEDED;
+    Serial.println("OTA: Update finished!"); });
 
+  // Progress is recorded as a metric (see /ota-status) rather than printed
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total)
-                        { Serial.printf("OTA: Progress: %u%%\r", (progress / (total / 100))); });
+                        {
+    otaStatus.bytesReceived = progress;
+    otaStatus.bytesWritten = progress;
+    otaStatus.totalSize = total; });
 
   ArduinoOTA.onError([](ota_error_t error)
                      {
-    Serial.printf("OTA Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-    else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-    else if (error == OTA_END_ERROR) Serial.println("End Failed"); });
+    const char *reason = "Unknown";
+    if (error == OTA_AUTH_ERROR) reason = "Auth Failed";
+    else if (error == OTA_BEGIN_ERROR) reason = "Begin Failed";
+    else if (error == OTA_CONNECT_ERROR) reason = "Connect Failed";
+    else if (error == OTA_RECEIVE_ERROR) reason = "Receive Failed";
+    else if (error == OTA_END_ERROR) reason = "End Failed";
+    otaStatus.lastError = reason;
+    otaStatus.endTime = millis();
+    otaStatus.phase = OTA_FAILED;
+    Serial.printf("OTA Error[%u]: %s\n", error, reason); });
+
+  // espota writes straight to flash and switches the boot partition itself,
+  // so it cannot be verified - only signed HTTP uploads are accepted then
+  if (OTA_SIGNING_PUBLIC_KEY[0] == '\0')
+    ArduinoOTA.begin();
+  else
+    Serial.println("OTA: Signing enabled, espota disabled");
 
-  ArduinoOTA.begin();
-  Serial.println("OTA ready - device can be updated wirelessly");
+  // Streaming upload endpoint for compressed and delta images
+  static const char *otaHeaders[] = {"Authorization"};
+  otaServer.collectHeaders(otaHeaders, 1);
+  otaServer.on(
+      "/ota", HTTP_POST, handleOtaUploadComplete, handleOtaUpload);
+  otaServer.onNotFound([]()
+                       { otaServer.send(404, "text/plain", "Not Found"); });
+  otaServer.begin();
+
+  // Flash writes stall the calling task for milliseconds at a time, so OTA
+  // runs in its own task and loop() keeps fading while an image is written
+  xTaskCreatePinnedToCore(otaTask, "ota", OTA_TASK_STACK, nullptr, 1, &otaTaskHandle, OTA_TASK_CORE);
+
+  Serial.printf("OTA ready - espota on 3232, streaming uploads on port %d\n", OTA_HTTP_PORT);
 }
 
-// ============ WEB HANDLERS ============
-void handleSetAlarm()
+void otaTask(void *param)
 {
-  if (!server.hasArg("plain"))
+  for (;;)
   {
-    server.send(400, "text/plain", "No body");
-    return;
+    ArduinoOTA.handle();
+    otaServer.handleClient();
+    vTaskDelay(pdMS_TO_TICKS(10));
   }
+}
 
-  String body = server.arg("plain");
+// ============ OTA STREAMING PIPELINE ============
+// Network bytes -> [zlib inflate] -> [delta patch] -> Update.write()
+//
+// Delta patch format (all integers little-endian):
+//   "WUD1" magic, u32 target image size, then a sequence of ops:
+//   'C' u32 offset, u32 length  - copy bytes from the running image
+//   'I' u32 length, <bytes>     - insert literal bytes
+//   'E'                         - end of patch
+enum DeltaState : uint8_t
+{
+  DELTA_HEADER,
+  DELTA_OP,
+  DELTA_ARGS,
+  DELTA_INSERT,
+  DELTA_DONE
+};
 
-  // Simple JSON parsing (looking for "hour" and "minute")
-  int hourPos = body.indexOf("\"hour\":");
-  int minutePos = body.indexOf("\"minute\":");
+struct
+{
+  bool ok = false;
+  uint8_t format = 0;
+  // Inflate state (allocated only while a compressed upload is running)
+  tinfl_decompressor *inflater = nullptr;
+  uint8_t *window = nullptr; // TINFL_LZ_DICT_SIZE circular output buffer
+  size_t windowPos = 0;
+  bool inflateDone = false;
+  // Delta patch state
+  const esp_partition_t *source = nullptr;
+  DeltaState deltaState = DELTA_HEADER;
+  uint32_t targetSize = 0; // image size from the patch header
+  uint8_t op = 0;
+  uint8_t args[8];
+  uint8_t argsLen = 0;
+  uint8_t argsNeeded = 0;
+  uint32_t remaining = 0;
+  // Signature verification over the decoded image
+  mbedtls_sha256_context sha;
+  uint8_t signature[512]; // DER-encoded signature from the uploader
+  size_t signatureLen = 0;
+} otaPipeline;
 
-  if (hourPos == -1 || minutePos == -1)
-  {
-    server.send(400, "text/plain", "Invalid JSON format");
-    return;
-  }
+static uint32_t readLE32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool otaFail(const char *reason)
+{
+  if (otaPipeline.ok)
+    Serial.printf("OTA Error: %s\n", reason);
+  otaPipeline.ok = false;
+  otaStatus.lastError = reason;
+  return false;
+}
+
+static bool otaWriteImage(const uint8_t *data, size_t len)
+{
+  // Hash as we go so verification never has to read the partition back;
+  // mbedtls uses the ESP32 SHA accelerator when it is free
+  unsigned long hashStart = micros();
+  mbedtls_sha256_update_ret(&otaPipeline.sha, data, len);
+  otaStatus.hashMicros += micros() - hashStart;
+
+  if (Update.write((uint8_t *)data, len) != len)
+    return otaFail("Flash write failed");
+  otaStatus.bytesWritten += len;
+  return true;
+}
+
+static int hexNibble(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decode the hex signature supplied with the upload
+static bool otaSetSignature(const char *hex)
+{
+  size_t len = strlen(hex);
+  if (len % 2 != 0 || len / 2 > sizeof(otaPipeline.signature))
+    return false;
+  for (size_t i = 0; i < len / 2; i++)
+  {
+    int hi = hexNibble(hex[2 * i]);
+    int lo = hexNibble(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    otaPipeline.signature[i] = (uint8_t)((hi << 4) | lo);
+  }
+  otaPipeline.signatureLen = len / 2;
+  return true;
+}
+
+// Check the signature against the streamed hash, before the boot partition is switched
+static bool otaVerifySignature()
+{
+  uint8_t digest[32];
+  mbedtls_sha256_finish_ret(&otaPipeline.sha, digest);
+
+  if (OTA_SIGNING_PUBLIC_KEY[0] == '\0')
+    return true;
+  if (otaPipeline.signatureLen == 0)
+    return otaFail("Missing signature");
+
+  unsigned long verifyStart = micros();
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  int ret = mbedtls_pk_parse_public_key(&pk, (const uint8_t *)OTA_SIGNING_PUBLIC_KEY, strlen(OTA_SIGNING_PUBLIC_KEY) + 1);
+  if (ret == 0)
+    ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, sizeof(digest), otaPipeline.signature, otaPipeline.signatureLen);
+  mbedtls_pk_free(&pk);
+  otaStatus.verifyMicros = micros() - verifyStart;
+
+  if (ret != 0)
+    return otaFail("Bad signature");
+  otaStatus.signatureVerified = true;
+  return true;
+}
+
+// Copy a range of the running image into the new one
+static bool otaCopyFromSource(uint32_t offset, uint32_t length)
+{
+  if (otaPipeline.source == nullptr || offset + length > otaPipeline.source->size || offset + length < offset)
+    return otaFail("Delta copy out of range");
+
+  uint8_t buf[256];
+  while (length > 0)
+  {
+    size_t n = length < sizeof(buf) ? length : sizeof(buf);
+    if (esp_partition_read(otaPipeline.source, offset, buf, n) != ESP_OK)
+      return otaFail("Source read failed");
+    if (!otaWriteImage(buf, n))
+      return false;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool otaApplyDelta(const uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    switch (otaPipeline.deltaState)
+    {
+    case DELTA_HEADER:
+    case DELTA_ARGS:
+    {
+      // Accumulate fixed-size fields that may straddle chunk boundaries
+      size_t n = otaPipeline.argsNeeded - otaPipeline.argsLen;
+      if (n > len)
+        n = len;
+      memcpy(otaPipeline.args + otaPipeline.argsLen, data, n);
+      otaPipeline.argsLen += n;
+      data += n;
+      len -= n;
+      if (otaPipeline.argsLen < otaPipeline.argsNeeded)
+        break;
+
+      if (otaPipeline.deltaState == DELTA_HEADER)
+      {
+        if (memcmp(otaPipeline.args, "WUD1", 4) != 0)
+          return otaFail("Bad delta magic");
+        otaPipeline.targetSize = readLE32(otaPipeline.args + 4);
+        otaPipeline.deltaState = DELTA_OP;
+      }
+      else if (otaPipeline.op == 'C')
+      {
+        if (!otaCopyFromSource(readLE32(otaPipeline.args), readLE32(otaPipeline.args + 4)))
+          return false;
+        otaPipeline.deltaState = DELTA_OP;
+      }
+      else
+      {
+        otaPipeline.remaining = readLE32(otaPipeline.args);
+        otaPipeline.deltaState = otaPipeline.remaining > 0 ? DELTA_INSERT : DELTA_OP;
+      }
+      break;
+    }
+
+    case DELTA_OP:
+      otaPipeline.op = *data++;
+      len--;
+      otaPipeline.argsLen = 0;
+      if (otaPipeline.op == 'C')
+        otaPipeline.argsNeeded = 8;
+      else if (otaPipeline.op == 'I')
+        otaPipeline.argsNeeded = 4;
+      else if (otaPipeline.op == 'E')
+      {
+        otaPipeline.deltaState = DELTA_DONE;
+        break;
+      }
+      else
+        return otaFail("Bad delta op");
+      otaPipeline.deltaState = DELTA_ARGS;
+      break;
+
+    case DELTA_INSERT:
+    {
+      size_t n = len < otaPipeline.remaining ? len : otaPipeline.remaining;
+      if (!otaWriteImage(data, n))
+        return false;
+      data += n;
+      len -= n;
+      otaPipeline.remaining -= n;
+      if (otaPipeline.remaining == 0)
+        otaPipeline.deltaState = DELTA_OP;
+      break;
+    }
+
+    case DELTA_DONE:
+      return otaFail("Trailing data after delta end");
+    }
+  }
+  return true;
+}
+
+// Hand decoded image bytes to the next stage
+static bool otaEmit(const uint8_t *data, size_t len)
+{
+  if (otaPipeline.format & OTA_FORMAT_DELTA)
+    return otaApplyDelta(data, len);
+  return otaWriteImage(data, len);
+}
+
+static bool otaInflate(const uint8_t *data, size_t len)
+{
+  for (;;)
+  {
+    size_t inBytes = len;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - otaPipeline.windowPos;
+    tinfl_status status = tinfl_decompress(otaPipeline.inflater, data, &inBytes,
+                                           otaPipeline.window, otaPipeline.window + otaPipeline.windowPos, &outBytes,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    data += inBytes;
+    len -= inBytes;
+
+    if (outBytes > 0 && !otaEmit(otaPipeline.window + otaPipeline.windowPos, outBytes))
+      return false;
+    otaPipeline.windowPos = (otaPipeline.windowPos + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+    if (status < TINFL_STATUS_DONE)
+      return otaFail("Inflate failed");
+    if (status == TINFL_STATUS_DONE)
+    {
+      otaPipeline.inflateDone = true;
+      return len == 0 ? true : otaFail("Trailing data after zlib stream");
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0)
+      return true;
+  }
+}
+
+static void otaReleaseBuffers()
+{
+  free(otaPipeline.inflater);
+  free(otaPipeline.window);
+  otaPipeline.inflater = nullptr;
+  otaPipeline.window = nullptr;
+}
+
+bool otaBegin(uint8_t format, uint32_t networkSize, const char *signatureHex)
+{
+  otaPipeline.ok = true;
+  otaPipeline.format = format;
+  otaPipeline.windowPos = 0;
+  otaPipeline.inflateDone = false;
+  otaPipeline.deltaState = DELTA_HEADER;
+  otaPipeline.argsLen = 0;
+  otaPipeline.argsNeeded = 8;
+  otaPipeline.source = esp_ota_get_running_partition();
+  otaPipeline.signatureLen = 0;
+  mbedtls_sha256_init(&otaPipeline.sha);
+  mbedtls_sha256_starts_ret(&otaPipeline.sha, 0);
+
+  otaStatus.format = format;
+  otaStatus.bytesReceived = 0;
+  otaStatus.bytesWritten = 0;
+  otaStatus.totalSize = networkSize;
+  otaStatus.startTime = millis();
+  otaStatus.signatureVerified = false;
+  otaStatus.hashMicros = 0;
+  otaStatus.verifyMicros = 0;
+  otaStatus.lastError = "";
+  otaStatus.phase = OTA_RECEIVING;
+
+  if (!otaSetSignature(signatureHex))
+  {
+    otaStatus.phase = OTA_FAILED;
+    return otaFail("Malformed signature");
+  }
+
+  if (format & OTA_FORMAT_ZLIB)
+  {
+    otaPipeline.inflater = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    otaPipeline.window = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (otaPipeline.inflater == nullptr || otaPipeline.window == nullptr)
+    {
+      otaReleaseBuffers();
+      otaStatus.phase = OTA_FAILED;
+      return otaFail("Out of memory");
+    }
+    tinfl_init(otaPipeline.inflater);
+  }
+
+  // Decoded size is not known up front for compressed or delta images
+  size_t imageSize = (format == 0 && networkSize > 0) ? networkSize : UPDATE_SIZE_UNKNOWN;
+  if (!Update.begin(imageSize))
+  {
+    otaReleaseBuffers();
+    otaStatus.phase = OTA_FAILED;
+    return otaFail("Begin Failed");
+  }
+  Serial.printf("OTA: Receiving %s%simage...\n", format & OTA_FORMAT_ZLIB ? "zlib " : "", format & OTA_FORMAT_DELTA ? "delta " : "");
+  return true;
+}
+
+bool otaFeed(const uint8_t *data, size_t len)
+{
+  if (!otaPipeline.ok)
+    return false;
+  otaStatus.bytesReceived += len;
+  if (otaPipeline.format & OTA_FORMAT_ZLIB)
+    return otaInflate(data, len);
+  return otaEmit(data, len);
+}
+
+bool otaFinish()
+{
+  if (otaPipeline.ok && (otaPipeline.format & OTA_FORMAT_ZLIB) && !otaPipeline.inflateDone)
+    otaFail("Truncated zlib stream");
+  if (otaPipeline.ok && (otaPipeline.format & OTA_FORMAT_DELTA) && otaPipeline.deltaState != DELTA_DONE)
+    otaFail("Truncated delta patch");
+  // A patch made against another base image, or cut short, decodes to the wrong size
+  if (otaPipeline.ok && (otaPipeline.format & OTA_FORMAT_DELTA) && otaStatus.bytesWritten != otaPipeline.targetSize)
+    otaFail("Delta image size mismatch");
+  otaReleaseBuffers();
+  if (otaPipeline.ok)
+    otaVerifySignature();
+  mbedtls_sha256_free(&otaPipeline.sha);
+
+  if (!otaPipeline.ok)
+  {
+    Update.abort();
+  }
+  else if (!Update.end(true))
+  {
+    otaFail(Update.errorString());
+  }
+
+  otaStatus.endTime = millis();
+  otaStatus.phase = otaPipeline.ok ? OTA_SUCCEEDED : OTA_FAILED;
+
+  unsigned long elapsed = otaStatus.endTime - otaStatus.startTime;
+  Serial.printf("OTA: %s - %u bytes received, %u written in %lu ms\n", otaPipeline.ok ? "Update finished" : "Update failed",
+                otaStatus.bytesReceived, otaStatus.bytesWritten, elapsed);
+  return otaPipeline.ok;
+}
+
+void otaAbort()
+{
+  if (otaPipeline.ok)
+    otaFail("Upload aborted");
+  otaReleaseBuffers();
+  mbedtls_sha256_free(&otaPipeline.sha);
+  Update.abort();
+  otaStatus.endTime = millis();
+  otaStatus.phase = OTA_FAILED;
+}
+
+// POST /ota writes firmware, so it takes the API token or the OTA password as
+// "Authorization: Bearer <credential>". With neither set it only accepts
+// signed images, and with no signing key either it is closed.
+// Returns 0 when the upload may go ahead, else the HTTP status to refuse it with.
+static int otaUploadRefusal()
+{
+  if (API_TOKEN[0] == '\0' && OTA_PASSWORD[0] == '\0')
+    return OTA_SIGNING_PUBLIC_KEY[0] != '\0' ? 0 : 403;
+  String auth = otaServer.header("Authorization");
+  if (API_TOKEN[0] != '\0' && auth == String("Bearer ") + API_TOKEN)
+    return 0;
+  if (OTA_PASSWORD[0] != '\0' && auth == String("Bearer ") + OTA_PASSWORD)
+    return 0;
+  return 401;
+}
+
+// Upload chunk handler for POST /ota?format=raw|zlib|delta|zlib-delta&sig=<hex DER>
+void handleOtaUpload()
+{
+  // A refused upload is never decoded, and leaves /ota-status alone
+  if (otaUploadRefusal() != 0)
+    return;
+  HTTPUpload &upload = otaServer.upload();
+
+  if (upload.status == UPLOAD_FILE_START)
+  {
+    String format = otaServer.arg("format");
+    uint8_t flags = 0;
+    if (format.indexOf("zlib") != -1)
+      flags |= OTA_FORMAT_ZLIB;
+    if (format.indexOf("delta") != -1)
+      flags |= OTA_FORMAT_DELTA;
+    otaBegin(flags, otaServer.hasArg("size") ? otaServer.arg("size").toInt() : 0, otaServer.arg("sig").c_str());
+  }
+  else if (upload.status == UPLOAD_FILE_WRITE)
+  {
+    otaFeed(upload.buf, upload.currentSize);
+  }
+  else if (upload.status == UPLOAD_FILE_END)
+  {
+    otaFinish();
+  }
+  else if (upload.status == UPLOAD_FILE_ABORTED)
+  {
+    otaAbort();
+  }
+}
+
+void handleOtaUploadComplete()
+{
+  int refusal = otaUploadRefusal();
+  if (refusal == 403)
+  {
+    otaServer.send(403, "text/plain", "OTA uploads disabled: set API_TOKEN, OTA_PASSWORD or OTA_SIGNING_PUBLIC_KEY");
+    return;
+  }
+  if (refusal != 0)
+  {
+    otaServer.send(401, "text/plain", "Unauthorized");
+    return;
+  }
+
+  if (otaStatus.phase != OTA_SUCCEEDED)
+  {
+    otaServer.send(500, "text/plain", String("OTA failed: ") + otaStatus.lastError);
+    return;
+  }
+
+  otaServer.send(200, "text/plain", "OTA complete, rebooting");
+  saveUsage(); // the new firmware may not recognise the RTC copy
+  delay(500);
+  ESP.restart();
+}
+
+// ============ WEB HANDLERS ============
+void handleSetAlarm()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "hour" and "minute")
+  int hourPos = body.indexOf("\"hour\":");
+  int minutePos = body.indexOf("\"minute\":");
+
+  if (hourPos == -1 || minutePos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
 
   int hour = atoi(body.c_str() + hourPos + 7);
   int minute = atoi(body.c_str() + minutePos + 9);
@@ -364,15 +2122,10 @@ void handleGetAlarm()
 
 void handleManualOn()
 {
-  // Cancel sunrise and start a manual fade up to full brightness
-  alarmState.isSunriseActive = false;
-  alarmState.isManualFadeActive = true;
-  alarmState.manualFadeStartTime = millis();
-  alarmState.manualFadeDuration = MANUAL_FADE_MS;
-  alarmState.manualStartWarm = alarmState.currentWarmBrightness;
-  alarmState.manualStartCool = alarmState.currentCoolBrightness;
-  alarmState.manualTargetWarm = 1023;
-  alarmState.manualTargetCool = 1023;
+  // Cancel sunrise (and any snooze) and start a manual fade up to full brightness
+  cancelSnooze();
+  startManualFade(LEVEL_MAX, LEVEL_MAX, MANUAL_FADE_MS);
+  logEvent(EVENT_MANUAL_ON, EVENT_FROM_API);
 
   server.send(200, "text/plain", "Lights fading on");
   Serial.println("Manual: fading lights on");
@@ -380,20 +2133,31 @@ void handleManualOn()
 
 void handleManualOff()
 {
-  // Cancel sunrise and start a manual fade down to zero
-  alarmState.isSunriseActive = false;
-  alarmState.isManualFadeActive = true;
-  alarmState.manualFadeStartTime = millis();
-  alarmState.manualFadeDuration = MANUAL_FADE_MS;
-  alarmState.manualStartWarm = alarmState.currentWarmBrightness;
-  alarmState.manualStartCool = alarmState.currentCoolBrightness;
-  alarmState.manualTargetWarm = 0;
-  alarmState.manualTargetCool = 0;
+  // Cancel sunrise (and any snooze) and start a manual fade down to zero
+  cancelSnooze();
+  startManualFade(0, 0, MANUAL_FADE_MS);
+  logEvent(EVENT_MANUAL_OFF, EVENT_FROM_API);
 
   server.send(200, "text/plain", "Lights fading off");
   Serial.println("Manual: fading lights off");
 }
 
+// Full scale of the brightness values in a request body: "scale" if given
+// (1 = normalised 0.0-1.0, 65535 = 16-bit), otherwise 1023
+static float requestScale(const String &body)
+{
+  int scalePos = body.indexOf("\"scale\":");
+  return scalePos == -1 ? BRIGHTNESS_MAX : atof(body.c_str() + scalePos + 8);
+}
+
+// A request brightness on a 0-scale range as an internal level, or -1 if out of range
+static int levelFromRequest(float value, float scale)
+{
+  if (!(scale > 0 && scale <= LEVEL_MAX) || !(value >= 0 && value <= scale))
+    return -1;
+  return (int)(value / scale * LEVEL_MAX + 0.5f);
+}
+
 void handleSetBrightness()
 {
   if (!server.hasArg("plain"))
@@ -414,31 +2178,24 @@ void handleSetBrightness()
     return;
   }
 
-  int warm = atoi(body.c_str() + warmPos + 7);
-  int cool = atoi(body.c_str() + coolPos + 7);
+  float scale = requestScale(body);
+  int warm = levelFromRequest(atof(body.c_str() + warmPos + 7), scale);
+  int cool = levelFromRequest(atof(body.c_str() + coolPos + 7), scale);
 
-  if (warm < 0 || warm > 1023 || cool < 0 || cool > 1023)
+  if (warm < 0 || cool < 0)
   {
-    server.send(400, "text/plain", "Invalid brightness values (must be 0-1023)");
+    server.send(400, "text/plain", "Invalid brightness values (must be 0-1023, or 0-scale)");
     return;
   }
 
-  // Cancel any active sunrise
-  alarmState.isSunriseActive = false;
-
-  // Start a manual fade to the target brightness values
-  alarmState.isManualFadeActive = true;
-  alarmState.manualFadeStartTime = millis();
-  alarmState.manualFadeDuration = MANUAL_FADE_MS;
-  alarmState.manualStartWarm = alarmState.currentWarmBrightness;
-  alarmState.manualStartCool = alarmState.currentCoolBrightness;
-  alarmState.manualTargetWarm = warm;
-  alarmState.manualTargetCool = cool;
+  // Cancel any active sunrise and start a manual fade to the target brightness values
+  startManualFade(warm, cool, MANUAL_FADE_MS);
 
-  String response = "{\"warm\":" + String(warm) + ",\"cool\":" + String(cool) + ",\"fading\":true}";
+  String response = "{\"warm\":" + String(brightnessFromLevel(warm)) + ",\"cool\":" + String(brightnessFromLevel(cool)) +
+                    ",\"warmLevel\":" + String(warm) + ",\"coolLevel\":" + String(cool) + ",\"fading\":true}";
   server.send(200, "application/json", response);
 
-  Serial.printf("Brightness fading to: warm=%d cool=%d\n", warm, cool);
+  Serial.printf("Brightness fading to: warm=%d cool=%d (of %d)\n", warm, cool, LEVEL_MAX);
 }
 
 void handleToggleAlarm()
@@ -474,10 +2231,11 @@ void handleToggleAlarm()
 
   alarmState.isAlarmSet = enabled;
 
-  // If disabling, cancel any active sunrise
+  // If disabling, cancel any active or snoozed sunrise
   if (!enabled)
   {
     alarmState.isSunriseActive = false;
+    cancelSnooze();
   }
 
   saveAlarmToStorage();
@@ -493,7 +2251,8 @@ void handleToggleAlarm()
 void handleStatus()
 {
   time_t now = time(nullptr);
-  struct tm timeinfo = *localtime(&now);
+  struct tm timeinfo;
+  tzLocalTime(now, &timeinfo);
 
   char timeStr[20];
   strftime(timeStr, sizeof(timeStr), "%H:%M:%S", &timeinfo);
@@ -503,8 +2262,154 @@ void handleStatus()
   response += "\"alarmTime\":\"" + String(alarmState.hour) + ":" + String(alarmState.minute < 10 ? "0" : "") + String(alarmState.minute) + "\",";
   response += "\"isAlarmSet\":" + String(alarmState.isAlarmSet ? "true" : "false") + ",";
   response += "\"isSunriseActive\":" + String(alarmState.isSunriseActive ? "true" : "false") + ",";
-  response += "\"warmBrightness\":" + String(alarmState.currentWarmBrightness) + ",";
-  response += "\"coolBrightness\":" + String(alarmState.currentCoolBrightness);
+  response += "\"warmBrightness\":" + String(brightnessFromLevel(alarmState.currentWarmBrightness)) + ",";
+  response += "\"coolBrightness\":" + String(brightnessFromLevel(alarmState.currentCoolBrightness)) + ",";
+  response += "\"warmLevel\":" + String(alarmState.currentWarmBrightness) + ",";
+  response += "\"coolLevel\":" + String(alarmState.currentCoolBrightness) + ",";
+  response += "\"board\":\"" + String(Board::name()) + "\",";
+  response += "\"pwm\":{\"band\":" + String(pwmState.band) + ",\"freq\":" + String(pwmState.freq) +
+              ",\"bits\":" + String(pwmState.bits) + ",\"coolHpoint\":" + String(pwmState.coolHpoint) +
+              ",\"overlap\":" + String(pwmOverlapRatio(), 4) + ",\"peakW\":" + String(pwmState.peakWatts, 1) +
+              ",\"peakWMax\":" + String(pwmState.peakWattsMax, 1) + "},";
+  response += "\"ambientLevel\":" + String(ambientState.primed ? (int)((int64_t)ambientLevelQ16() * 1000 >> 16) : -1) + ",";
+  UsageTotals usage = usageSnapshot();
+  response += "\"usage\":{\"warmOnHours\":" + String(usage.onUs[0] / 3.6e9, 2) + ",\"coolOnHours\":" + String(usage.onUs[1] / 3.6e9, 2) +
+              ",\"warmWh\":" + String(usageWattHours(usage, 0), 1) + ",\"coolWh\":" + String(usageWattHours(usage, 1), 1) +
+              ",\"poweredHours\":" + String(usage.poweredUs / 3.6e9, 2) + "}";
+  response += "}";
+
+  server.send(200, "application/json", response);
+}
+
+// Prometheus text format header for one metric
+static void metricHeader(String &out, const char *name, const char *type, const char *help)
+{
+  out += String("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+// GET /metrics - counters for scraping (Prometheus text format)
+void handleMetrics()
+{
+  static const char *channels[] = {"warm", "cool"};
+  UsageTotals usage = usageSnapshot();
+  String out;
+
+  metricHeader(out, "wakelight_led_on_seconds_total", "counter", "Time the LED channel has been lit at any level.");
+  for (int ch = 0; ch < 2; ch++)
+    out += String("wakelight_led_on_seconds_total{channel=\"") + channels[ch] + "\"} " + String(usage.onUs[ch] / 1e6, 1) + "\n";
+
+  metricHeader(out, "wakelight_led_full_power_seconds_total", "counter", "Duty-weighted on-time, in seconds at full power.");
+  for (int ch = 0; ch < 2; ch++)
+    out += String("wakelight_led_full_power_seconds_total{channel=\"") + channels[ch] + "\"} " +
+           String(usage.dutyUs[ch] / (float)PWM_MAX / 1e6f, 1) + "\n";
+
+  metricHeader(out, "wakelight_led_energy_wh_total", "counter", "Estimated energy drawn by the LED channel.");
+  for (int ch = 0; ch < 2; ch++)
+    out += String("wakelight_led_energy_wh_total{channel=\"") + channels[ch] + "\"} " + String(usageWattHours(usage, ch), 2) + "\n";
+
+  metricHeader(out, "wakelight_pwm_frequency_hz", "gauge", "Current LED PWM frequency.");
+  out += "wakelight_pwm_frequency_hz " + String(pwmState.freq) + "\n";
+  metricHeader(out, "wakelight_pwm_resolution_bits", "gauge", "Current LED PWM duty resolution.");
+  out += "wakelight_pwm_resolution_bits " + String(pwmState.bits) + "\n";
+  metricHeader(out, "wakelight_pwm_overlap_ratio", "gauge", "Fraction of each PWM period with both LED outputs on.");
+  out += "wakelight_pwm_overlap_ratio " + String(pwmOverlapRatio(), 4) + "\n";
+  metricHeader(out, "wakelight_pwm_peak_watts", "gauge", "Estimated peak LED draw within a PWM period.");
+  out += "wakelight_pwm_peak_watts " + String(pwmState.peakWatts, 1) + "\n";
+  metricHeader(out, "wakelight_pwm_peak_watts_max", "gauge", "Highest estimated peak LED draw since boot.");
+  out += "wakelight_pwm_peak_watts_max " + String(pwmState.peakWattsMax, 1) + "\n";
+  metricHeader(out, "wakelight_pwm_band_switches_total", "counter", "PWM frequency/resolution band changes since boot.");
+  out += "wakelight_pwm_band_switches_total " + String(pwmState.bandSwitches) + "\n";
+  metricHeader(out, "wakelight_pwm_late_switches_total", "counter", "Band changes whose writes straddled the end of a PWM period.");
+  out += "wakelight_pwm_late_switches_total " + String(pwmState.lateSwitches) + "\n";
+  metricHeader(out, "wakelight_pwm_frames_committed_total", "counter", "Output frames (all channel duties) latched together.");
+  out += "wakelight_pwm_frames_committed_total " + String(pwmState.framesCommitted) + "\n";
+  metricHeader(out, "wakelight_pwm_frames_torn_total", "counter", "Frames whose latch writes straddled the end of a PWM period.");
+  out += "wakelight_pwm_frames_torn_total " + String(pwmState.framesTorn) + "\n";
+
+  metricHeader(out, "wakelight_powered_seconds_total", "counter", "Lifetime running time of the board.");
+  out += "wakelight_powered_seconds_total " + String(usage.poweredUs / 1e6, 0) + "\n";
+
+  metricHeader(out, "wakelight_uptime_seconds", "gauge", "Time since boot.");
+  out += "wakelight_uptime_seconds " + String(millis() / 1000) + "\n";
+
+  metricHeader(out, "wakelight_loop_late_ticks_total", "counter", "loop() ticks that started more than 100 ms after the previous one.");
+  out += "wakelight_loop_late_ticks_total " + String(stallState.lateTicks) + "\n";
+  metricHeader(out, "wakelight_loop_stalls_total", "counter", "loop() stalls of a second or more since boot.");
+  out += "wakelight_loop_stalls_total " + String(stallState.stalls) + "\n";
+  metricHeader(out, "wakelight_loop_max_tick_ms", "gauge", "Longest gap between loop() ticks since boot.");
+  out += "wakelight_loop_max_tick_ms " + String(stallState.maxTickMs) + "\n";
+
+  sampleResources();
+  metricHeader(out, "wakelight_task_stack_free_bytes", "gauge", "Least free stack the task has had since it started (high-water mark).");
+  for (int i = 0; i < resourceState.taskCount; i++)
+    if (resourceState.tasks[i].handle != nullptr)
+      out += String("wakelight_task_stack_free_bytes{task=\"") + resourceState.tasks[i].name + "\"} " +
+             String(resourceState.tasks[i].minFreeStack) + "\n";
+  metricHeader(out, "wakelight_heap_free_bytes", "gauge", "Free heap.");
+  out += "wakelight_heap_free_bytes " + String(resourceState.freeHeap) + "\n";
+  metricHeader(out, "wakelight_heap_min_free_bytes", "gauge", "Lowest free heap since boot.");
+  out += "wakelight_heap_min_free_bytes " + String(resourceState.minFreeHeap) + "\n";
+  metricHeader(out, "wakelight_heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated.");
+  out += "wakelight_heap_largest_free_block_bytes " + String(resourceState.largestFreeBlock) + "\n";
+  metricHeader(out, "wakelight_heap_fragmentation_percent", "gauge", "How far the largest free block falls short of free heap.");
+  out += "wakelight_heap_fragmentation_percent " + String(resourceState.fragmentationPercent) + "\n";
+
+  // Copy the counters out first; building the output allocates
+  static AllocSite sites[ALLOC_MAX_SITES];
+  portENTER_CRITICAL(&allocLock);
+  int siteCount = allocState.siteCount;
+  memcpy(sites, allocState.sites, sizeof(sites));
+  uint32_t frees = allocState.frees;
+  uint32_t failures = allocState.failures;
+  portEXIT_CRITICAL(&allocLock);
+  metricHeader(out, "wakelight_alloc_total", "counter", "Heap allocations by call site.");
+  for (int site = 0; site < siteCount; site++)
+    out += String("wakelight_alloc_total{site=\"") + allocSiteName(site) + "\"} " + String(sites[site].count) + "\n";
+  metricHeader(out, "wakelight_alloc_bytes_total", "counter", "Bytes requested from the heap by call site.");
+  for (int site = 0; site < siteCount; site++)
+    out += String("wakelight_alloc_bytes_total{site=\"") + allocSiteName(site) + "\"} " + String((double)sites[site].bytes, 0) + "\n";
+  metricHeader(out, "wakelight_free_total", "counter", "Heap blocks freed.");
+  out += "wakelight_free_total " + String(frees) + "\n";
+  metricHeader(out, "wakelight_alloc_failures_total", "counter", "Allocations the heap could not satisfy.");
+  out += "wakelight_alloc_failures_total " + String(failures) + "\n";
+
+  metricHeader(out, "wakelight_resource_alert", "gauge", "1 while a resource threshold is crossed.");
+  for (int i = 0; i < resourceState.taskCount; i++)
+    if (resourceState.tasks[i].handle != nullptr)
+      out += String("wakelight_resource_alert{check=\"stack\",task=\"") + resourceState.tasks[i].name + "\"} " +
+             (resourceState.tasks[i].alert ? "1" : "0") + "\n";
+  out += String("wakelight_resource_alert{check=\"heap_low\"} ") + (resourceState.heapLowAlert ? "1" : "0") + "\n";
+  out += String("wakelight_resource_alert{check=\"heap_fragmented\"} ") + (resourceState.fragmentedAlert ? "1" : "0") + "\n";
+  metricHeader(out, "wakelight_resource_alerts_total", "counter", "Resource alerts raised since boot.");
+  out += "wakelight_resource_alerts_total " + String(resourceState.alerts) + "\n";
+
+  server.send(200, "text/plain; version=0.0.4", out);
+}
+
+void handleOtaStatus()
+{
+  static const char *phaseNames[] = {"idle", "receiving", "succeeded", "failed"};
+
+  unsigned long end = otaStatus.phase == OTA_RECEIVING ? millis() : otaStatus.endTime;
+  unsigned long elapsed = otaStatus.phase == OTA_IDLE ? 0 : end - otaStatus.startTime;
+  uint32_t received = otaStatus.bytesReceived;
+  uint32_t total = otaStatus.totalSize;
+  uint32_t written = otaStatus.bytesWritten;
+
+  String response = "{";
+  response += "\"phase\":\"" + String(phaseNames[otaStatus.phase]) + "\",";
+  response += "\"compressed\":" + String(otaStatus.format & OTA_FORMAT_ZLIB ? "true" : "false") + ",";
+  response += "\"delta\":" + String(otaStatus.format & OTA_FORMAT_DELTA ? "true" : "false") + ",";
+  response += "\"bytesReceived\":" + String(received) + ",";
+  response += "\"bytesWritten\":" + String(written) + ",";
+  response += "\"totalSize\":" + String(total) + ",";
+  response += "\"progress\":" + String(total > 0 ? (int)((uint64_t)received * 100 / total) : -1) + ",";
+  response += "\"elapsedMs\":" + String(elapsed) + ",";
+  response += "\"throughputBps\":" + String(elapsed > 0 ? (unsigned long)((uint64_t)received * 1000 / elapsed) : 0UL) + ",";
+  response += "\"signatureVerified\":" + String(otaStatus.signatureVerified ? "true" : "false") + ",";
+  response += "\"hashUsPerMB\":" + String(written > 0 ? (unsigned long)((uint64_t)otaStatus.hashMicros * 1048576 / written) : 0UL) + ",";
+  response += "\"verifyUs\":" + String(otaStatus.verifyMicros) + ",";
+  response += "\"lastError\":\"" + String(otaStatus.lastError) + "\"";
   response += "}";
 
   server.send(200, "application/json", response);
@@ -574,107 +2479,4586 @@ void handleGetAutoOff()
   server.send(200, "application/json", response);
 }
 
-// ============ STORAGE FUNCTIONS ============
-void saveAlarmToStorage()
+void handleSetTimezone()
 {
-  preferences.putInt("alarm_hour", alarmState.hour);
-  preferences.putInt("alarm_min", alarmState.minute);
-  preferences.putBool("alarm_set", alarmState.isAlarmSet);
-  preferences.putBool("autooff_enabled", alarmState.autoOffEnabled);
-  preferences.putInt("autooff_mins", alarmState.autoOffMinutes);
-  Serial.println("Alarm saved to persistent storage");
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "tz" string value)
+  int tzPos = body.indexOf("\"tz\":");
+  int valueStart = tzPos == -1 ? -1 : body.indexOf('"', tzPos + 5);
+  int valueEnd = valueStart == -1 ? -1 : body.indexOf('"', valueStart + 1);
+
+  if (valueEnd == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  String zone = body.substring(valueStart + 1, valueEnd);
+  if (!tzSetZone(zone.c_str()))
+  {
+    server.send(400, "text/plain", "Invalid POSIX timezone string");
+    return;
+  }
+
+  preferences.putString("tz", zone);
+  solarInvalidate();
+  Serial.printf("Timezone set to %s\n", zone.c_str());
+  handleGetTimezone();
 }
 
-void loadAlarmFromStorage()
+void handleGetTimezone()
 {
-  alarmState.hour = preferences.getInt("alarm_hour", 6);
-  alarmState.minute = preferences.getInt("alarm_min", 30);
-  alarmState.isAlarmSet = preferences.getBool("alarm_set", false);
-  alarmState.autoOffEnabled = preferences.getBool("autooff_enabled", true);
-  alarmState.autoOffMinutes = preferences.getInt("autooff_mins", DEFAULT_AUTO_OFF_MINUTES);
-  Serial.printf("Alarm loaded: %d:%02d (Set: %s)\n", alarmState.hour, alarmState.minute, alarmState.isAlarmSet ? "Yes" : "No");
-  Serial.printf("Auto-off: %s (%d minutes)\n", alarmState.autoOffEnabled ? "enabled" : "disabled", alarmState.autoOffMinutes);
+  time_t now = time(nullptr);
+  struct tm timeinfo;
+  tzLocalTime(now, &timeinfo);
+
+  int32_t offset = timeinfo.tm_isdst > 0 ? tzState.dstOffset : tzState.stdOffset;
+  String response = "{\"tz\":\"" + String(tzState.spec) + "\",\"utcOffset\":" + String(offset) +
+                    ",\"isDst\":" + String(timeinfo.tm_isdst > 0 ? "true" : "false") +
+                    ",\"transitions\":" + String(tzState.transitionCount) + "}";
+  server.send(200, "application/json", response);
 }
 
-// ============ LED CONTROL FUNCTIONS ============
-void setBrightness(int warm, int cool)
+void handleTimeStatus()
 {
-  // Clamp values to 0-1023 (10-bit resolution)
-  warm = constrain(warm, 0, 1023);
-  cool = constrain(cool, 0, 1023);
-
-  alarmState.currentWarmBrightness = warm;
-  alarmState.currentCoolBrightness = cool;
+  static const char *sourceNames[] = {"none", "ntp", "client", "http-date", "rtc"};
 
-  // Choose gamma depending on whether we're in sunrise mode (tweak perceptual curve)
-  float gamma = alarmState.isSunriseActive ? SUNRISE_GAMMA : DEFAULT_GAMMA;
-  int pwmWarm = applyGamma(warm, gamma);
-  int pwmCool = applyGamma(cool, gamma);
+  xSemaphoreTake(timeLock, portMAX_DELAY);
+  bool synced = timeDiscipline.synced;
+  TimeSource source = timeDiscipline.source;
+  int64_t ageUs = esp_timer_get_time() - timeDiscipline.lastSyncUs;
+  int64_t lastOffsetUs = timeDiscipline.lastOffsetUs;
+  float driftPpm = timeDiscipline.driftPpm;
+  int32_t estErrorMs = timeEstimatedErrorMs();
+  uint32_t samples = timeDiscipline.sampleCount;
+  uint32_t steps = timeDiscipline.stepCount;
+  uint32_t rejected = timeDiscipline.rejectedCount;
+  xSemaphoreGive(timeLock);
 
-  ledcWrite(PWM_CHANNEL_WARM, pwmWarm);
-  ledcWrite(PWM_CHANNEL_COOL, pwmCool);
-}
+  String response = "{";
+  response += "\"valid\":" + String(timeIsValid() ? "true" : "false") + ",";
+  response += "\"synced\":" + String(synced ? "true" : "false") + ",";
+  response += "\"source\":\"" + String(sourceNames[source]) + "\",";
+  response += "\"syncAgeSeconds\":" + String(synced ? (long)(ageUs / 1000000) : -1L) + ",";
+  response += "\"lastOffsetMs\":" + String((long)(lastOffsetUs / 1000)) + ",";
+  response += "\"driftPpm\":" + String(driftPpm, 2) + ",";
+  response += "\"estimatedErrorMs\":" + String(synced ? (long)estErrorMs : -1L) + ",";
+  response += "\"samples\":" + String(samples) + ",";
+  response += "\"steps\":" + String(steps) + ",";
+  response += "\"rejected\":" + String(rejected);
+  response += "}";
 
-// ============ SUNRISE LOGIC ============
-void startSunrise()
-{
-  Serial.println("Starting sunrise...");
-  alarmState.isSunriseActive = true;
-  alarmState.sunriseStartTime = millis();
+  server.send(200, "application/json", response);
 }
 
-void updateSunrise()
+void handleSetTime()
 {
-  // If sunrise not active, check whether we should start it
-  if (!alarmState.isSunriseActive)
+  if (!server.hasArg("plain"))
   {
-    if (!alarmState.isAlarmSet)
-    {
-      return;
-    }
+    server.send(400, "text/plain", "No body");
+    return;
+  }
 
-    time_t now = time(nullptr);
-    struct tm timeinfo = *localtime(&now);
+  String body = server.arg("plain");
 
-    if (timeinfo.tm_hour == alarmState.hour && timeinfo.tm_min == alarmState.minute)
-    {
-      startSunrise();
-      Serial.println("Sunrise started");
-    }
+  // Simple JSON parsing (looking for "epochMs")
+  int epochPos = body.indexOf("\"epochMs\":");
+
+  if (epochPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
     return;
   }
 
-  // Sunrise is active - update brightness progressively using easing
-  unsigned long elapsedTime = millis() - alarmState.sunriseStartTime;
+  int64_t epochMs = strtoll(body.c_str() + epochPos + 10, nullptr, 10);
 
-  if (elapsedTime >= SUNRISE_DURATION_MS)
+  if (epochMs < (int64_t)TIME_VALID_AFTER * 1000)
   {
-    // Sunrise complete - set to target brightness (1023 warm, 409 cool in 10-bit)
-    setBrightness(1023, 409);
+    server.send(400, "text/plain", "Invalid epochMs value");
+    return;
+  }
+
+  if (!isRequestAuthenticated())
+  {
+    server.send(401, "text/plain", "Unauthorized");
+    return;
+  }
+
+  bool accepted = timeFromClient(epochMs);
+  handleTimeStatus();
+  Serial.printf("Client time %s\n", accepted ? "accepted" : "ignored (clock already better)");
+}
+
+void handleSnooze()
+{
+  if (!alarmState.isSunriseActive)
+  {
+    server.send(409, "text/plain", "No sunrise running");
+    return;
+  }
+
+  if (!snoozeSunrise())
+  {
+    server.send(409, "text/plain", "Snooze limit reached");
+    return;
+  }
+
+  handleGetSnooze();
+}
+
+void handleSetSnooze()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "minutes", "dimLevel" and "maxCount")
+  int minutesPos = body.indexOf("\"minutes\":");
+  int dimPos = body.indexOf("\"dimLevel\":");
+  int maxPos = body.indexOf("\"maxCount\":");
+
+  if (minutesPos == -1 || dimPos == -1 || maxPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  int minutes = atoi(body.c_str() + minutesPos + 10);
+  int dimLevel = atoi(body.c_str() + dimPos + 11);
+  int maxCount = atoi(body.c_str() + maxPos + 11);
+
+  if (minutes < 1 || minutes > 60 || dimLevel < 0 || dimLevel > BRIGHTNESS_MAX || maxCount < 0 || maxCount > 10)
+  {
+    server.send(400, "text/plain", "Invalid values (minutes 1-60, dimLevel 0-1023, maxCount 0-10)");
+    return;
+  }
+
+  snoozeState.minutes = minutes;
+  snoozeState.dimLevel = dimLevel;
+  snoozeState.maxCount = maxCount;
+  saveAlarmToStorage();
+
+  handleGetSnooze();
+  Serial.printf("Snooze: %d minutes, dim %d, max %d\n", minutes, dimLevel, maxCount);
+}
+
+void handleGetSnooze()
+{
+  long remaining = snoozeState.active ? (long)(snoozeState.resumeAt - time(nullptr)) : 0;
+  if (remaining < 0)
+    remaining = 0;
+
+  String response = "{\"minutes\":" + String(snoozeState.minutes) +
+                    ",\"dimLevel\":" + String(snoozeState.dimLevel) +
+                    ",\"maxCount\":" + String(snoozeState.maxCount) +
+                    ",\"isSnoozed\":" + String(snoozeState.active ? "true" : "false") +
+                    ",\"count\":" + String(snoozeState.count) +
+                    ",\"remainingSeconds\":" + String(remaining) + "}";
+  server.send(200, "application/json", response);
+}
+
+void handleStartSunset()
+{
+  int minutes = sunsetState.scheduleMinutes;
+
+  // Body is optional: {"minutes": 60}
+  if (server.hasArg("plain"))
+  {
+    String body = server.arg("plain");
+    int minutesPos = body.indexOf("\"minutes\":");
+    if (minutesPos != -1)
+      minutes = atoi(body.c_str() + minutesPos + 10);
+  }
+
+  if (minutes < SUNSET_MIN_MINUTES || minutes > SUNSET_MAX_MINUTES)
+  {
+    server.send(400, "text/plain", "Invalid minutes value (must be 30-120)");
+    return;
+  }
+
+  cancelSnooze();
+  startSunset(minutes);
+  groupAnnounceSunset(minutes);
+  handleGetSunset();
+}
+
+void handleStopSunset()
+{
+  stopSunset();
+  handleGetSunset();
+}
+
+void handleSetSunsetSchedule()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "enabled", "hour", "minute" and "minutes")
+  int enabledPos = body.indexOf("\"enabled\":");
+  int hourPos = body.indexOf("\"hour\":");
+  int minutePos = body.indexOf("\"minute\":");
+  int minutesPos = body.indexOf("\"minutes\":");
+
+  if (enabledPos == -1 || hourPos == -1 || minutePos == -1 || minutesPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  // Parse boolean value for enabled
+  bool enabled = false;
+  if (body.indexOf("true", enabledPos) != -1)
+  {
+    enabled = true;
+  }
+  else if (body.indexOf("false", enabledPos) == -1)
+  {
+    server.send(400, "text/plain", "Invalid boolean value for enabled");
+    return;
+  }
+
+  int hour = atoi(body.c_str() + hourPos + 7);
+  int minute = atoi(body.c_str() + minutePos + 9);
+  int minutes = atoi(body.c_str() + minutesPos + 10);
+
+  if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || minutes < SUNSET_MIN_MINUTES || minutes > SUNSET_MAX_MINUTES)
+  {
+    server.send(400, "text/plain", "Invalid values (hour 0-23, minute 0-59, minutes 30-120)");
+    return;
+  }
+
+  sunsetState.scheduleEnabled = enabled;
+  sunsetState.scheduleHour = hour;
+  sunsetState.scheduleMinute = minute;
+  sunsetState.scheduleMinutes = minutes;
+  saveAlarmToStorage();
+
+  handleGetSunset();
+  Serial.printf("Sunset schedule: %s %d:%02d for %d minutes\n", enabled ? "enabled" : "disabled", hour, minute, minutes);
+}
+
+void handleGetSunset()
+{
+  uint32_t elapsed = sunsetState.active && !sunsetState.needsResync ? millis() - sunsetState.startMillis : 0;
+  long remaining = sunsetState.active ? (long)((sunsetState.durationMs - (elapsed < sunsetState.durationMs ? elapsed : sunsetState.durationMs)) / 1000) : 0;
+
+  String response = "{\"isSunsetActive\":" + String(sunsetState.active ? "true" : "false") +
+                    ",\"remainingSeconds\":" + String(remaining) +
+                    ",\"updates\":" + String(sunsetState.updates) +
+                    ",\"scheduleEnabled\":" + String(sunsetState.scheduleEnabled ? "true" : "false") +
+                    ",\"scheduleTime\":\"" + String(sunsetState.scheduleHour) + ":" + String(sunsetState.scheduleMinute < 10 ? "0" : "") + String(sunsetState.scheduleMinute) + "\"" +
+                    ",\"minutes\":" + String(sunsetState.scheduleMinutes) + "}";
+  server.send(200, "application/json", response);
+}
+
+static String sceneToJson(int id, const Scene &scene)
+{
+  return "{\"id\":" + String(id) + ",\"name\":\"" + String(scene.name) + "\",\"warm\":" + String(brightnessFromLevel(scene.warm)) +
+         ",\"cool\":" + String(brightnessFromLevel(scene.cool)) + ",\"warmLevel\":" + String(scene.warm) +
+         ",\"coolLevel\":" + String(scene.cool) + ",\"fadeMs\":" + String(scene.fadeMs) +
+         ",\"autoOffMinutes\":" + String(scene.autoOffMinutes) + "}";
+}
+
+void handleSaveScene()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing: "id" and "name", then either "warm"/"cool" or "cct"/"level",
+  // optional "fadeMs" and "autoOffMinutes"
+  int idPos = body.indexOf("\"id\":");
+  int namePos = body.indexOf("\"name\":");
+  int nameStart = namePos == -1 ? -1 : body.indexOf('"', namePos + 7);
+  int nameEnd = nameStart == -1 ? -1 : body.indexOf('"', nameStart + 1);
+  int warmPos = body.indexOf("\"warm\":");
+  int coolPos = body.indexOf("\"cool\":");
+  int cctPos = body.indexOf("\"cct\":");
+  int levelPos = body.indexOf("\"level\":");
+  int fadePos = body.indexOf("\"fadeMs\":");
+  int autoOffPos = body.indexOf("\"autoOffMinutes\":");
+
+  bool hasChannels = warmPos != -1 && coolPos != -1;
+  bool hasCct = cctPos != -1 && levelPos != -1;
+  if (idPos == -1 || nameEnd == -1 || (!hasChannels && !hasCct))
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  int id = atoi(body.c_str() + idPos + 5);
+  String name = body.substring(nameStart + 1, nameEnd);
+  long fadeMs = fadePos == -1 ? (long)MANUAL_FADE_MS : atol(body.c_str() + fadePos + 9);
+  int autoOff = autoOffPos == -1 ? 0 : atoi(body.c_str() + autoOffPos + 17);
+
+  float scale = requestScale(body);
+  int warm, cool;
+  if (hasChannels)
+  {
+    warm = levelFromRequest(atof(body.c_str() + warmPos + 7), scale);
+    cool = levelFromRequest(atof(body.c_str() + coolPos + 7), scale);
+  }
+  else
+  {
+    int kelvin = atoi(body.c_str() + cctPos + 6);
+    int level = levelFromRequest(atof(body.c_str() + levelPos + 8), scale);
+    if (kelvin < SCENE_WARM_KELVIN || kelvin > SCENE_COOL_KELVIN || level < 0)
+    {
+      server.send(400, "text/plain", "Invalid cct/level values");
+      return;
+    }
+    cctToChannels(kelvin, level, warm, cool);
+  }
+
+  if (id < 1 || id > MAX_SCENES || name.length() == 0 || name.length() >= sizeof(Scene::name) || warm < 0 || cool < 0 || fadeMs < 0 || fadeMs > 600000 || autoOff < 0 || autoOff > 1440)
+  {
+    server.send(400, "text/plain", "Invalid scene values");
+    return;
+  }
+
+  Scene &scene = sceneStore.scenes[id - 1];
+  scene.used = 1;
+  strncpy(scene.name, name.c_str(), sizeof(scene.name));
+  scene.warm = warm;
+  scene.cool = cool;
+  scene.fadeMs = fadeMs;
+  scene.autoOffMinutes = autoOff;
+  saveScenes();
+
+  server.send(200, "application/json", sceneToJson(id, scene));
+  Serial.printf("Scene %d saved: %s warm=%d cool=%d\n", id, scene.name, warm, cool);
+}
+
+// Shared "id" parsing for recall/delete
+static int sceneIdFromBody()
+{
+  if (!server.hasArg("plain"))
+    return -1;
+  String body = server.arg("plain");
+  int idPos = body.indexOf("\"id\":");
+  return idPos == -1 ? -1 : atoi(body.c_str() + idPos + 5);
+}
+
+void handleRecallScene()
+{
+  int id = sceneIdFromBody();
+  if (!recallScene(id))
+  {
+    server.send(404, "text/plain", "Scene not found");
+    return;
+  }
+  server.send(200, "application/json", sceneToJson(id, *findScene(id)));
+}
+
+void handleDeleteScene()
+{
+  int id = sceneIdFromBody();
+  Scene *scene = findScene(id);
+  if (scene == nullptr)
+  {
+    server.send(404, "text/plain", "Scene not found");
+    return;
+  }
+
+  memset(scene, 0, sizeof(Scene));
+  saveScenes();
+  server.send(200, "text/plain", "Scene deleted");
+}
+
+void handleGetScenes()
+{
+  String response = "[";
+  bool first = true;
+  for (int i = 0; i < MAX_SCENES; i++)
+  {
+    if (!sceneStore.scenes[i].used)
+      continue;
+    if (!first)
+      response += ",";
+    response += sceneToJson(i + 1, sceneStore.scenes[i]);
+    first = false;
+  }
+  response += "]";
+  server.send(200, "application/json", response);
+}
+
+// POST /set-scene-schedule {"slot": 1, "id": 3, "hour": 7, "minute": 0}
+// Recalls scene "id" every day at hour:minute; "id": 0 clears the slot.
+void handleSetSceneSchedule()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "slot", "id", "hour" and "minute")
+  int slotPos = body.indexOf("\"slot\":");
+  int idPos = body.indexOf("\"id\":");
+  int hourPos = body.indexOf("\"hour\":");
+  int minutePos = body.indexOf("\"minute\":");
+
+  if (slotPos == -1 || idPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  int slot = atoi(body.c_str() + slotPos + 7);
+  int id = atoi(body.c_str() + idPos + 5);
+  int hour = hourPos == -1 ? 0 : atoi(body.c_str() + hourPos + 7);
+  int minute = minutePos == -1 ? 0 : atoi(body.c_str() + minutePos + 9);
+
+  if (slot < 1 || slot > SCENE_SCHEDULE_SLOTS || id < 0 || id > MAX_SCENES ||
+      (id > 0 && (hourPos == -1 || minutePos == -1 || hour < 0 || hour > 23 || minute < 0 || minute > 59)))
+  {
+    server.send(400, "text/plain", "Invalid values (slot 1-8, id 0-16, hour 0-23, minute 0-59)");
+    return;
+  }
+  if (id > 0 && findScene(id) == nullptr)
+  {
+    server.send(404, "text/plain", "Scene not found");
+    return;
+  }
+
+  SceneSlot &entry = sceneSchedule.slots[slot - 1];
+  entry.sceneId = id;
+  entry.hour = id > 0 ? hour : 0;
+  entry.minute = id > 0 ? minute : 0;
+  saveScenes();
+
+  handleGetSceneSchedule();
+  if (id > 0)
+    Serial.printf("Scene schedule: slot %d recalls scene %d at %d:%02d\n", slot, id, hour, minute);
+  else
+    Serial.printf("Scene schedule: slot %d cleared\n", slot);
+}
+
+void handleGetSceneSchedule()
+{
+  String response = "[";
+  bool first = true;
+  for (int i = 0; i < SCENE_SCHEDULE_SLOTS; i++)
+  {
+    const SceneSlot &entry = sceneSchedule.slots[i];
+    if (entry.sceneId == 0)
+      continue;
+    if (!first)
+      response += ",";
+    response += "{\"slot\":" + String(i + 1) + ",\"id\":" + String(entry.sceneId) + ",\"hour\":" + String(entry.hour) +
+                ",\"minute\":" + String(entry.minute) + "}";
+    first = false;
+  }
+  response += "]";
+  server.send(200, "application/json", response);
+}
+
+static const char *easingName(uint8_t easing)
+{
+  switch (easing)
+  {
+  case EASING_LINEAR:
+    return "linear";
+  case EASING_SMOOTH:
+    return "smooth";
+  default:
+    return "sine";
+  }
+}
+
+void handleStartProgram()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing: each {...} after "steps" is one step with "warm"/"cool"
+  // or "cct"/"level", and optional "durationMs", "holdMs" and "easing"
+  int stepsPos = body.indexOf("\"steps\":");
+  if (stepsPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  float scale = requestScale(body);
+  TransitionStep steps[MAX_PROGRAM_STEPS];
+  int count = 0;
+  int objStart = body.indexOf('{', stepsPos);
+  while (objStart != -1)
+  {
+    int objEnd = body.indexOf('}', objStart);
+    if (objEnd == -1 || count == MAX_PROGRAM_STEPS)
+    {
+      server.send(400, "text/plain", "Invalid step list (at most 16 steps)");
+      return;
+    }
+
+    String obj = body.substring(objStart, objEnd + 1);
+    int warmPos = obj.indexOf("\"warm\":");
+    int coolPos = obj.indexOf("\"cool\":");
+    int cctPos = obj.indexOf("\"cct\":");
+    int levelPos = obj.indexOf("\"level\":");
+    int durationPos = obj.indexOf("\"durationMs\":");
+    int holdPos = obj.indexOf("\"holdMs\":");
+    int easingPos = obj.indexOf("\"easing\":");
+
+    int warm = -1, cool = -1;
+    if (warmPos != -1 && coolPos != -1)
+    {
+      warm = levelFromRequest(atof(obj.c_str() + warmPos + 7), scale);
+      cool = levelFromRequest(atof(obj.c_str() + coolPos + 7), scale);
+    }
+    else if (cctPos != -1 && levelPos != -1)
+    {
+      int kelvin = atoi(obj.c_str() + cctPos + 6);
+      int level = levelFromRequest(atof(obj.c_str() + levelPos + 8), scale);
+      if (kelvin >= SCENE_WARM_KELVIN && kelvin <= SCENE_COOL_KELVIN && level >= 0)
+        cctToChannels(kelvin, level, warm, cool);
+    }
+    long duration = durationPos == -1 ? 0 : atol(obj.c_str() + durationPos + 13);
+    long hold = holdPos == -1 ? 0 : atol(obj.c_str() + holdPos + 9);
+
+    Easing easing = EASING_SINE;
+    if (easingPos != -1)
+    {
+      if (obj.indexOf("\"linear\"", easingPos) != -1)
+        easing = EASING_LINEAR;
+      else if (obj.indexOf("\"smooth\"", easingPos) != -1)
+        easing = EASING_SMOOTH;
+      else if (obj.indexOf("\"sine\"", easingPos) == -1)
+      {
+        server.send(400, "text/plain", "Invalid easing (linear, sine or smooth)");
+        return;
+      }
+    }
+
+    if (warm < 0 || cool < 0 || duration < 0 || duration > (long)MAX_PROGRAM_STEP_MS ||
+        hold < 0 || hold > (long)MAX_PROGRAM_STEP_MS)
+    {
+      server.send(400, "text/plain", "Invalid step values");
+      return;
+    }
+
+    steps[count].warm = warm;
+    steps[count].cool = cool;
+    steps[count].durationMs = duration;
+    steps[count].holdMs = hold;
+    steps[count].easing = easing;
+    count++;
+    objStart = body.indexOf('{', objEnd);
+  }
+
+  if (count == 0)
+  {
+    server.send(400, "text/plain", "No steps");
+    return;
+  }
+
+  cancelSnooze();
+  alarmState.autoOffScheduled = false;
+  startProgram(steps, count);
+  handleGetProgram();
+}
+
+void handleStopProgram()
+{
+  stopProgram();
+  stopEffect();
+  handleGetProgram();
+}
+
+void handleGetProgram()
+{
+  unsigned long stepRemaining = 0;
+  bool holding = false;
+  if (programState.active)
+  {
+    const TransitionStep &step = programState.steps[programState.index];
+    unsigned long elapsed = millis() - programState.stepStart;
+    unsigned long stepLength = step.durationMs + step.holdMs;
+    stepRemaining = elapsed < stepLength ? stepLength - elapsed : 0;
+    holding = elapsed >= step.durationMs;
+  }
+
+  String response = "{\"isProgramActive\":" + String(programState.active ? "true" : "false") +
+                    ",\"step\":" + String(programState.active ? programState.index : 0) +
+                    ",\"phase\":\"" + String(!programState.active ? "idle" : (holding ? "hold" : "fade")) + "\"" +
+                    ",\"stepRemainingMs\":" + String(stepRemaining) + ",\"steps\":[";
+  int shown = programState.active ? programState.count : 0;
+  for (int i = 0; i < shown; i++)
+  {
+    const TransitionStep &step = programState.steps[i];
+    if (i > 0)
+      response += ",";
+    response += "{\"warm\":" + String(brightnessFromLevel(step.warm)) + ",\"cool\":" + String(brightnessFromLevel(step.cool)) +
+                ",\"durationMs\":" + String(step.durationMs) + ",\"holdMs\":" + String(step.holdMs) +
+                ",\"easing\":\"" + String(easingName(step.easing)) + "\"}";
+  }
+  response += "]}";
+  server.send(200, "application/json", response);
+}
+
+void handleLoadEffect()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing: "code" is the hex bytecode from tools/lightc.py, "start" optional
+  int codePos = body.indexOf("\"code\":");
+  int codeStart = codePos == -1 ? -1 : body.indexOf('"', codePos + 7);
+  int codeEnd = codeStart == -1 ? -1 : body.indexOf('"', codeStart + 1);
+  if (codeEnd == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  int hexLength = codeEnd - codeStart - 1;
+  if (hexLength <= 0 || hexLength % 2 != 0 || hexLength / 2 > VM_MAX_CODE)
+  {
+    server.send(400, "text/plain", "Invalid code length (at most 256 bytes)");
+    return;
+  }
+
+  uint8_t code[VM_MAX_CODE];
+  const char *hex = body.c_str() + codeStart + 1;
+  for (int i = 0; i < hexLength / 2; i++)
+  {
+    int hi = hexNibble(hex[2 * i]);
+    int lo = hexNibble(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+    {
+      server.send(400, "text/plain", "Invalid hex in code");
+      return;
+    }
+    code[i] = (hi << 4) | lo;
+  }
+
+  if (!loadEffectCode(code, hexLength / 2))
+  {
+    server.send(400, "text/plain", "Bytecode failed validation");
+    return;
+  }
+
+  int startPos = body.indexOf("\"start\":");
+  if (startPos != -1 && body.indexOf("true", startPos) != -1)
+  {
+    cancelSnooze();
+    startEffect();
+  }
+
+  handleGetEffect();
+  Serial.printf("Effect uploaded: %d bytes\n", hexLength / 2);
+}
+
+void handleStartEffect()
+{
+  cancelSnooze();
+  if (!startEffect())
+  {
+    server.send(409, "text/plain", "No effect loaded");
+    return;
+  }
+  handleGetEffect();
+}
+
+void handleStopEffect()
+{
+  stopEffect();
+  handleGetEffect();
+}
+
+void handleGetEffect()
+{
+  const VmContext &vm = effectState.vm;
+  String response = "{\"loadedBytes\":" + String(effectState.length) +
+                    ",\"isEffectActive\":" + String(vm.running ? "true" : "false") +
+                    ",\"pc\":" + String(vm.pc) +
+                    ",\"executed\":" + String(effectState.executed) +
+                    ",\"fault\":" + (vm.fault ? "\"" + String(vm.fault) + "\"" : String("null")) + "}";
+  server.send(200, "application/json", response);
+}
+
+void handleBenchmarkEffect()
+{
+  uint32_t executed, elapsedUs;
+  uint32_t rate = benchmarkEffectVm(executed, elapsedUs);
+  String response = "{\"instructions\":" + String(executed) +
+                    ",\"micros\":" + String(elapsedUs) +
+                    ",\"instructionsPerSecond\":" + String(rate) +
+                    ",\"tickBudget\":" + String(VM_TICK_BUDGET) + "}";
+  server.send(200, "application/json", response);
+}
+
+// Average ns per call of a level conversion, over a sweep of the level range
+template <class Convert>
+static uint32_t benchmarkConversion(Convert convert)
+{
+  volatile int sink = 0;
+  int samples = 0;
+  int64_t start = esp_timer_get_time();
+  for (int level = 0; level <= LEVEL_MAX; level += OUTPUT_BENCHMARK_STRIDE, samples++)
+    sink = sink + convert(level);
+  return (uint32_t)((esp_timer_get_time() - start) * 1000 / samples);
+}
+
+// GET /benchmark-output - cost of turning a level into PWM duty on this board
+void handleBenchmarkOutput()
+{
+  uint32_t gammaNs = benchmarkConversion([](int level)
+                                         { return applyGamma(level, false); });
+  uint32_t scaleNs = benchmarkConversion([](int level)
+                                         { return (int)pwmScale(level, pwmState.bits); });
+  uint32_t brightnessNs = benchmarkConversion([](int level)
+                                              { return levelFromBrightness(level >> 6); });
+  // The per-call powf curve the table replaced, for comparison
+  uint32_t powfNs = benchmarkConversion([](int level)
+                                        { return (int)(powf((float)level / LEVEL_MAX, DEFAULT_GAMMA) * LEVEL_MAX + 0.5f); });
+
+  String response = "{\"board\":\"" + String(Board::name()) + "\",\"pwmBits\":" + String(pwmState.bits) +
+                    ",\"pwmFreq\":" + String(pwmState.freq) + ",\"gammaNs\":" + String(gammaNs) +
+                    ",\"scaleNs\":" + String(scaleNs) + ",\"brightnessToLevelNs\":" + String(brightnessNs) +
+                    ",\"powfNs\":" + String(powfNs) + "}";
+  server.send(200, "application/json", response);
+}
+
+void handleSetLocation()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "latitude" and "longitude" in degrees)
+  int latPos = body.indexOf("\"latitude\":");
+  int lonPos = body.indexOf("\"longitude\":");
+  if (latPos == -1 || lonPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  float lat = atof(body.c_str() + latPos + 11);
+  float lon = atof(body.c_str() + lonPos + 12);
+  if (lat < -90.0f || lat > 90.0f || lon < -180.0f || lon > 180.0f)
+  {
+    server.send(400, "text/plain", "Invalid location (latitude -90..90, longitude -180..180)");
+    return;
+  }
+
+  solarState.hasLocation = true;
+  solarState.latE4 = lroundf(lat * 1e4f);
+  solarState.lonE4 = lroundf(lon * 1e4f);
+  solarInvalidate();
+  saveAlarmToStorage();
+
+  handleGetSolar();
+  Serial.printf("Location set to %.4f, %.4f\n", lat, lon);
+}
+
+void handleSetSolarSchedule()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing: "alarmDays" (bit 0 = Sunday .. bit 6 = Saturday), "alarmOffsetMinutes",
+  // "sunsetFollow", "sunsetOffsetMinutes" - all optional
+  int daysPos = body.indexOf("\"alarmDays\":");
+  int alarmOffsetPos = body.indexOf("\"alarmOffsetMinutes\":");
+  int followPos = body.indexOf("\"sunsetFollow\":");
+  int sunsetOffsetPos = body.indexOf("\"sunsetOffsetMinutes\":");
+
+  int days = daysPos == -1 ? solarState.alarmDays : atoi(body.c_str() + daysPos + 12);
+  int alarmOffset = alarmOffsetPos == -1 ? solarState.alarmOffsetMinutes : atoi(body.c_str() + alarmOffsetPos + 21);
+  int sunsetOffset = sunsetOffsetPos == -1 ? solarState.sunsetOffsetMinutes : atoi(body.c_str() + sunsetOffsetPos + 22);
+  bool follow = solarState.sunsetFollow;
+  if (followPos != -1)
+  {
+    int valueEnd = body.indexOf(',', followPos);
+    String value = body.substring(followPos + 15, valueEnd == -1 ? body.length() : valueEnd);
+    if (value.indexOf("true") != -1)
+      follow = true;
+    else if (value.indexOf("false") != -1)
+      follow = false;
+    else
+    {
+      server.send(400, "text/plain", "Invalid boolean value for sunsetFollow");
+      return;
+    }
+  }
+
+  if (days < 0 || days > 0x7F || abs(alarmOffset) > SOLAR_MAX_OFFSET_MINUTES || abs(sunsetOffset) > SOLAR_MAX_OFFSET_MINUTES)
+  {
+    server.send(400, "text/plain", "Invalid values (alarmDays 0-127, offsets -180..180)");
+    return;
+  }
+
+  solarState.alarmDays = days;
+  solarState.alarmOffsetMinutes = alarmOffset;
+  solarState.sunsetFollow = follow;
+  solarState.sunsetOffsetMinutes = sunsetOffset;
+  saveAlarmToStorage();
+
+  handleGetSolar();
+}
+
+static String solarTimeString(time_t at)
+{
+  if (at == 0)
+    return "null";
+  struct tm local;
+  tzLocalTime(at, &local);
+  char buf[8];
+  strftime(buf, sizeof(buf), "%H:%M", &local);
+  return "\"" + String(buf) + "\"";
+}
+
+void handleGetSolar()
+{
+  time_t rise = 0, set = 0;
+  if (timeIsValid() && solarState.hasLocation)
+  {
+    struct tm local;
+    tzLocalTime(time(nullptr), &local);
+    solarRefreshDay(local);
+    rise = solarState.riseAt;
+    set = solarState.setAt;
+  }
+
+  String response = "{\"hasLocation\":" + String(solarState.hasLocation ? "true" : "false") +
+                    ",\"latitude\":" + String(solarState.latE4 / 1e4f, 4) +
+                    ",\"longitude\":" + String(solarState.lonE4 / 1e4f, 4) +
+                    ",\"tableYear\":" + String(solarState.table.version == ALMANAC_VERSION ? solarState.table.year : 0) +
+                    ",\"sunriseToday\":" + solarTimeString(rise) +
+                    ",\"sunsetToday\":" + solarTimeString(set) +
+                    ",\"alarmDays\":" + String(solarState.alarmDays) +
+                    ",\"alarmOffsetMinutes\":" + String(solarState.alarmOffsetMinutes) +
+                    ",\"sunsetFollow\":" + String(solarState.sunsetFollow ? "true" : "false") +
+                    ",\"sunsetOffsetMinutes\":" + String(solarState.sunsetOffsetMinutes) + "}";
+  server.send(200, "application/json", response);
+}
+
+void handleSetCircadian()
+{
+  if (!server.hasArg("plain"))
+  {
+    server.send(400, "text/plain", "No body");
+    return;
+  }
+
+  String body = server.arg("plain");
+
+  // Simple JSON parsing (looking for "enabled", optional "level" and "overrideMinutes")
+  int enabledPos = body.indexOf("\"enabled\":");
+  int levelPos = body.indexOf("\"level\":");
+  int overridePos = body.indexOf("\"overrideMinutes\":");
+
+  if (enabledPos == -1)
+  {
+    server.send(400, "text/plain", "Invalid JSON format");
+    return;
+  }
+
+  // Parse boolean value for enabled
+  int enabledEnd = body.indexOf(',', enabledPos);
+  String enabledValue = body.substring(enabledPos + 10, enabledEnd == -1 ? body.length() : enabledEnd);
+  bool enabled = false;
+  if (enabledValue.indexOf("true") != -1)
+  {
+    enabled = true;
+  }
+  else if (enabledValue.indexOf("false") == -1)
+  {
+    server.send(400, "text/plain", "Invalid boolean value for enabled");
+    return;
+  }
+
+  int level = levelPos == -1 ? circadianState.level : atoi(body.c_str() + levelPos + 8);
+  int overrideMinutes = overridePos == -1 ? circadianState.overrideMinutes : atoi(body.c_str() + overridePos + 18);
+  if (level < 1 || level > BRIGHTNESS_MAX || overrideMinutes < 1 || overrideMinutes > 720)
+  {
+    server.send(400, "text/plain", "Invalid values (level 1-1023, overrideMinutes 1-720)");
+    return;
+  }
+
+  circadianState.level = level;
+  circadianState.overrideMinutes = overrideMinutes;
+  setCircadianEnabled(enabled);
+  saveCircadianSettings();
+
+  handleGetCircadian();
+  Serial.printf("Circadian mode %s (level %d)\n", enabled ? "enabled" : "disabled", level);
+}
+
+void handleGetCircadian()
+{
+  int kelvin = 0;
+  if (timeIsValid())
+  {
+    struct tm local;
+    tzLocalTime(time(nullptr), &local);
+    kelvin = circadianKelvinAt(local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec);
+  }
+
+  long overrideRemaining = 0;
+  if (circadianState.enabled && circadianState.overridden)
+  {
+    long left = (long)(circadianState.wakeMillis - millis());
+    overrideRemaining = left > 0 ? left / 1000 : 0;
+  }
+
+  String response = "{\"enabled\":" + String(circadianState.enabled ? "true" : "false") +
+                    ",\"level\":" + String(circadianState.level) +
+                    ",\"overrideMinutes\":" + String(circadianState.overrideMinutes) +
+                    ",\"kelvin\":" + String(kelvin) +
+                    ",\"isOverridden\":" + String(circadianState.overridden ? "true" : "false") +
+                    ",\"isSuspended\":" + String(circadianState.suspended ? "true" : "false") +
+                    ",\"overrideRemainingSeconds\":" + String(overrideRemaining) +
+                    ",\"updates\":" + String(circadianState.updates) + "}";
+  server.send(200, "application/json", response);
+}
+
+void handleGroupStatus()
+{
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  String response = "{\"enabled\":" + String(GROUP_ENABLED && groupState.sock >= 0 ? "true" : "false") +
+                    ",\"nodeId\":\"" + String(groupState.nodeId, HEX) + "\"" +
+                    ",\"leaderId\":\"" + String(groupState.leaderId, HEX) + "\"" +
+                    ",\"isLeader\":" + String(groupState.leaderId == groupState.nodeId ? "true" : "false") +
+                    ",\"peers\":" + String(groupState.peerCount) +
+                    ",\"offsetUs\":" + String((long)groupState.offsetUs) +
+                    ",\"delayUs\":" + String((long)groupState.delayUs) +
+                    ",\"syncs\":" + String(groupState.syncCount);
+  xSemaphoreGive(groupLock);
+  response += ",\"isSynced\":" + String(groupIsSynced() ? "true" : "false") +
+              ",\"sunriseOnGroupTime\":" + String(alarmState.isSunriseActive && groupState.sunriseStartUs != 0 ? "true" : "false") + "}";
+  server.send(200, "application/json", response);
+}
+
+// ============ STORAGE FUNCTIONS ============
+void saveAlarmToStorage()
+{
+  preferences.putInt("alarm_hour", alarmState.hour);
+  preferences.putInt("alarm_min", alarmState.minute);
+  preferences.putBool("alarm_set", alarmState.isAlarmSet);
+  preferences.putBool("autooff_enabled", alarmState.autoOffEnabled);
+  preferences.putInt("autooff_mins", alarmState.autoOffMinutes);
+  preferences.putInt("snz_mins", snoozeState.minutes);
+  preferences.putInt("snz_dim", snoozeState.dimLevel);
+  preferences.putInt("snz_max", snoozeState.maxCount);
+  preferences.putBool("dusk_sched", sunsetState.scheduleEnabled);
+  preferences.putInt("dusk_hour", sunsetState.scheduleHour);
+  preferences.putInt("dusk_min", sunsetState.scheduleMinute);
+  preferences.putInt("dusk_mins", sunsetState.scheduleMinutes);
+  preferences.putBool("sol_loc", solarState.hasLocation);
+  preferences.putInt("sol_lat", solarState.latE4);
+  preferences.putInt("sol_lon", solarState.lonE4);
+  preferences.putUChar("sol_days", solarState.alarmDays);
+  preferences.putInt("sol_offset", solarState.alarmOffsetMinutes);
+  preferences.putBool("sol_dusk", solarState.sunsetFollow);
+  preferences.putInt("sol_dusk_off", solarState.sunsetOffsetMinutes);
+  Serial.println("Alarm saved to persistent storage");
+}
+
+void loadAlarmFromStorage()
+{
+  alarmState.hour = preferences.getInt("alarm_hour", 6);
+  alarmState.minute = preferences.getInt("alarm_min", 30);
+  alarmState.isAlarmSet = preferences.getBool("alarm_set", false);
+  alarmState.autoOffEnabled = preferences.getBool("autooff_enabled", true);
+  alarmState.autoOffMinutes = preferences.getInt("autooff_mins", DEFAULT_AUTO_OFF_MINUTES);
+  Serial.printf("Alarm loaded: %d:%02d (Set: %s)\n", alarmState.hour, alarmState.minute, alarmState.isAlarmSet ? "Yes" : "No");
+  Serial.printf("Auto-off: %s (%d minutes)\n", alarmState.autoOffEnabled ? "enabled" : "disabled", alarmState.autoOffMinutes);
+
+  snoozeState.minutes = preferences.getInt("snz_mins", DEFAULT_SNOOZE_MINUTES);
+  snoozeState.dimLevel = preferences.getInt("snz_dim", DEFAULT_SNOOZE_DIM_LEVEL);
+  snoozeState.maxCount = preferences.getInt("snz_max", DEFAULT_SNOOZE_MAX_COUNT);
+  snoozeState.active = preferences.getBool("snz_active", false);
+  snoozeState.progress = preferences.getFloat("snz_progress", 0.0f);
+  snoozeState.resumeAt = (time_t)preferences.getUInt("snz_resume", 0);
+  snoozeState.count = preferences.getInt("snz_count", 0);
+  if (snoozeState.active)
+  {
+    // Interrupted mid-snooze: hold the dim level until the sunrise resumes
+    setBrightness(levelFromBrightness(snoozeState.dimLevel), levelFromBrightness(snoozeState.dimLevel) * SUNRISE_COOL_LEVEL / LEVEL_MAX);
+    Serial.printf("Snooze restored, resuming at %.0f%%\n", snoozeState.progress * 100.0f);
+  }
+
+  sunsetState.scheduleEnabled = preferences.getBool("dusk_sched", false);
+  sunsetState.scheduleHour = preferences.getInt("dusk_hour", 22);
+  sunsetState.scheduleMinute = preferences.getInt("dusk_min", 30);
+  sunsetState.scheduleMinutes = preferences.getInt("dusk_mins", DEFAULT_SUNSET_MINUTES);
+  sunsetState.active = preferences.getBool("dusk_active", false);
+  if (sunsetState.active)
+  {
+    // Interrupted mid-fade: updateSunset() places the curve once the clock is valid
+    sunsetState.startEpoch = (time_t)preferences.getUInt("dusk_start", 0);
+    sunsetState.durationMs = preferences.getUInt("dusk_ms", (uint32_t)DEFAULT_SUNSET_MINUTES * 60 * 1000);
+    sunsetState.startWarm = preferences.getInt("dusk_lwarm", levelFromBrightness(SUNSET_DEFAULT_WARM));
+    sunsetState.startCool = preferences.getInt("dusk_lcool", levelFromBrightness(SUNSET_DEFAULT_COOL));
+    sunsetState.needsResync = true;
+    Serial.println("Sunset restored");
+  }
+
+  solarState.hasLocation = preferences.getBool("sol_loc", false);
+  solarState.latE4 = preferences.getInt("sol_lat", 0);
+  solarState.lonE4 = preferences.getInt("sol_lon", 0);
+  solarState.alarmDays = preferences.getUChar("sol_days", 0);
+  solarState.alarmOffsetMinutes = preferences.getInt("sol_offset", 0);
+  solarState.sunsetFollow = preferences.getBool("sol_dusk", false);
+  solarState.sunsetOffsetMinutes = preferences.getInt("sol_dusk_off", 0);
+
+  circadianState.level = preferences.getInt("circ_level", DEFAULT_CIRCADIAN_LEVEL);
+  circadianState.overrideMinutes = preferences.getInt("circ_ovr", DEFAULT_CIRCADIAN_OVERRIDE_MINUTES);
+  setCircadianEnabled(preferences.getBool("circ_on", false));
+  circadianState.suspended = circadianState.enabled && preferences.getBool("circ_off", false);
+}
+
+// ============ TIME ZONE ============
+// Parsing the POSIX TZ rule and walking DST rules on every localtime() call
+// is wasteful for something that changes twice a year. The rule is compiled
+// once into a sorted table of UTC transition instants; converting to local
+// time is then a binary search plus an offset add.
+
+// Days since 1970-01-01 for a proleptic Gregorian date
+static int32_t daysFromCivil(int32_t y, int32_t m, int32_t d)
+{
+  y -= m <= 2;
+  int32_t era = (y >= 0 ? y : y - 399) / 400;
+  int32_t yoe = y - era * 400;
+  int32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static bool isLeapYear(int32_t y)
+{
+  return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+// Parse [+|-]hh[:mm[:ss]] into seconds, advancing p
+static bool tzParseTime(const char *&p, int32_t &seconds)
+{
+  int sign = 1;
+  if (*p == '+' || *p == '-')
+    sign = (*p++ == '-') ? -1 : 1;
+  if (!isdigit((unsigned char)*p))
+    return false;
+
+  int32_t parts[3] = {0, 0, 0};
+  for (int i = 0; i < 3; i++)
+  {
+    if (!isdigit((unsigned char)*p))
+      return false;
+    parts[i] = strtol(p, (char **)&p, 10);
+    if (*p != ':')
+      break;
+    p++;
+  }
+  seconds = sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+  return true;
+}
+
+// Parse a zone abbreviation: alphabetic run or <quoted>, advancing p
+static bool tzParseName(const char *&p)
+{
+  const char *start = p;
+  if (*p == '<')
+  {
+    while (*p && *p != '>')
+      p++;
+    if (*p != '>')
+      return false;
+    p++;
+    return p - start >= 5;
+  }
+  while (isalpha((unsigned char)*p))
+    p++;
+  return p - start >= 3;
+}
+
+// Copy one ",rule" field into dst, advancing p
+static bool tzCopyRule(const char *&p, char *dst, size_t size)
+{
+  if (*p != ',')
+    return false;
+  p++;
+  size_t n = 0;
+  while (*p && *p != ',' && n + 1 < size)
+    dst[n++] = *p++;
+  dst[n] = '\0';
+  return n > 0 && (*p == '\0' || *p == ',');
+}
+
+// UTC instant of a transition rule (Mm.w.d, Jn or n, optional /time) in a given year.
+// The rule's wall-clock time is interpreted in the offset in force before the transition.
+static bool tzRuleInstant(const char *rule, int32_t year, int32_t offsetBefore, time_t &at)
+{
+  const char *p = rule;
+  int32_t day; // days since epoch
+
+  if (*p == 'M')
+  {
+    p++;
+    int month = strtol(p, (char **)&p, 10);
+    if (*p++ != '.')
+      return false;
+    int week = strtol(p, (char **)&p, 10);
+    if (*p++ != '.')
+      return false;
+    int weekday = strtol(p, (char **)&p, 10);
+    if (month < 1 || month > 12 || week < 1 || week > 5 || weekday < 0 || weekday > 6)
+      return false;
+
+    static const int8_t monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int32_t first = daysFromCivil(year, month, 1);
+    int32_t firstWeekday = ((first % 7) + 11) % 7; // 1970-01-01 was a Thursday
+    int32_t dom = 1 + (weekday - firstWeekday + 7) % 7 + (week - 1) * 7;
+    int32_t lastDom = monthDays[month - 1] + (month == 2 && isLeapYear(year));
+    while (dom > lastDom)
+      dom -= 7;
+    day = first + dom - 1;
+  }
+  else if (*p == 'J')
+  {
+    p++;
+    int julian = strtol(p, (char **)&p, 10); // 1..365, Feb 29 never counted
+    if (julian < 1 || julian > 365)
+      return false;
+    day = daysFromCivil(year, 1, 1) + julian - 1 + (isLeapYear(year) && julian >= 60);
+  }
+  else if (isdigit((unsigned char)*p))
+  {
+    int zeroBased = strtol(p, (char **)&p, 10); // 0..365, Feb 29 counted
+    if (zeroBased > 365)
+      return false;
+    day = daysFromCivil(year, 1, 1) + zeroBased;
+  }
+  else
+  {
+    return false;
+  }
+
+  int32_t timeOfDay = 2 * 3600;
+  if (*p == '/')
+  {
+    p++;
+    if (!tzParseTime(p, timeOfDay))
+      return false;
+  }
+  if (*p != '\0')
+    return false;
+
+  at = (time_t)day * 86400 + timeOfDay - offsetBefore;
+  return true;
+}
+
+// Build the transition table for [firstYear, firstYear + TZ_TABLE_YEARS]
+static void tzBuildTable(int32_t firstYear)
+{
+  int lastYear = firstYear + TZ_TABLE_YEARS;
+  tzState.coverStart = (time_t)daysFromCivil(firstYear, 1, 1) * 86400;
+  tzState.coverEnd = (time_t)daysFromCivil(lastYear + 1, 1, 1) * 86400;
+  tzState.transitionCount = 0;
+  tzState.baseOffset = tzState.stdOffset;
+  tzState.baseIsDst = false;
+
+  if (!tzState.hasDst)
+    return;
+
+  for (int32_t year = firstYear; year <= lastYear; year++)
+  {
+    time_t start, end;
+    tzRuleInstant(tzState.startRule, year, tzState.stdOffset, start);
+    tzRuleInstant(tzState.endRule, year, tzState.dstOffset, end);
+    tzState.transitions[tzState.transitionCount++] = {start, tzState.dstOffset, true};
+    tzState.transitions[tzState.transitionCount++] = {end, tzState.stdOffset, false};
+  }
+
+  // Southern hemisphere zones end DST before they start it in the same year
+  std::sort(tzState.transitions, tzState.transitions + tzState.transitionCount,
+            [](const TzTransition &a, const TzTransition &b)
+            { return a.at < b.at; });
+
+  // Before the first transition the opposite state is in force
+  tzState.baseIsDst = !tzState.transitions[0].isDst;
+  tzState.baseOffset = tzState.baseIsDst ? tzState.dstOffset : tzState.stdOffset;
+}
+
+// Compile a POSIX TZ string, e.g. "CET-1CEST,M3.5.0,M10.5.0/3". Returns false if invalid.
+bool tzSetZone(const char *spec)
+{
+  const char *p = spec;
+  int32_t stdPosix, dstPosix;
+  char startRule[16] = "M3.2.0"; // US rules are the POSIX default when none are given
+  char endRule[16] = "M11.1.0";
+
+  if (strlen(spec) >= sizeof(tzState.spec) || !tzParseName(p) || !tzParseTime(p, stdPosix))
+    return false;
+
+  bool hasDst = *p != '\0';
+  dstPosix = stdPosix - 3600;
+  if (hasDst)
+  {
+    if (!tzParseName(p))
+      return false;
+    if (*p != ',' && *p != '\0' && !tzParseTime(p, dstPosix))
+      return false;
+    if (*p != '\0' && (!tzCopyRule(p, startRule, sizeof(startRule)) || !tzCopyRule(p, endRule, sizeof(endRule)) || *p != '\0'))
+      return false;
+
+    // Validate both rules once so the table builder can trust them
+    time_t probe;
+    if (!tzRuleInstant(startRule, 2000, 0, probe) || !tzRuleInstant(endRule, 2000, 0, probe))
+      return false;
+  }
+
+  // POSIX offsets are west-positive; store east-positive like tm_gmtoff
+  strcpy(tzState.spec, spec);
+  tzState.stdOffset = -stdPosix;
+  tzState.dstOffset = -dstPosix;
+  tzState.hasDst = hasDst;
+  strcpy(tzState.startRule, startRule);
+  strcpy(tzState.endRule, endRule);
+
+  // Force a lazy rebuild on the next conversion
+  tzState.coverStart = 0;
+  tzState.coverEnd = 0;
+  return true;
+}
+
+// Convert a UTC instant to local broken-down time
+void tzLocalTime(time_t t, struct tm *out)
+{
+  if (t < tzState.coverStart || t >= tzState.coverEnd)
+  {
+    // Outside the table (new year or zone change) - rebuild starting a year back
+    struct tm utc;
+    gmtime_r(&t, &utc);
+    tzBuildTable(utc.tm_year + 1900 - 1);
+  }
+
+  // Last transition at or before t
+  const TzTransition *first = tzState.transitions;
+  const TzTransition *next = std::upper_bound(first, first + tzState.transitionCount, t,
+                                              [](time_t value, const TzTransition &tr)
+                                              { return value < tr.at; });
+  int32_t offset = tzState.baseOffset;
+  bool isDst = tzState.baseIsDst;
+  if (next != first)
+  {
+    offset = (next - 1)->utcOffset;
+    isDst = (next - 1)->isDst;
+  }
+
+  time_t local = t + offset;
+  gmtime_r(&local, out);
+  out->tm_isdst = isDst ? 1 : 0;
+}
+
+// ============ TIME DISCIPLINE ============
+// SNTP samples are turned into an offset and a drift estimate. Small offsets
+// are slewed with adjtime() so the clock never jumps under a running sunrise,
+// and the learned drift keeps being corrected between samples so the clock
+// holds over for days when the network is gone.
+
+bool timeIsValid()
+{
+  return time(nullptr) >= TIME_VALID_AFTER;
+}
+
+// Slew the clock by deltaUs. A measured offset is taken against the clock as
+// it reads now, without the part of the last slew still to come, so it
+// replaces that slew; a drift correction is a further change and adds to it.
+static void timeSlew(int64_t deltaUs, bool addToPending)
+{
+  int64_t totalUs = deltaUs;
+  if (addToPending)
+  {
+    struct timeval outstanding = {0, 0};
+    adjtime(nullptr, &outstanding);
+    totalUs += (int64_t)outstanding.tv_sec * 1000000 + outstanding.tv_usec;
+  }
+  struct timeval delta = {(time_t)(totalUs / 1000000), (suseconds_t)(totalUs % 1000000)};
+  adjtime(&delta, nullptr);
+}
+
+// Expected error of the running clock (timeLock held)
+int32_t timeEstimatedErrorMs()
+{
+  if (!timeDiscipline.synced)
+    return INT32_MAX;
+
+  // Error grows with sync age at the rate we are unsure of the drift
+  int64_t ageSeconds = (esp_timer_get_time() - timeDiscipline.lastSyncUs) / 1000000;
+  return timeDiscipline.sourceErrorMs + (int32_t)((timeDiscipline.driftSpreadPpm + TIME_DRIFT_FLOOR_PPM) * ageSeconds / 1000.0f);
+}
+
+// Apply a time sample from any source. Samples worse than the running clock's
+// expected error are ignored, so a fresh NTP sample is never overridden by a
+// coarse Date header, but a Date header beats a clock that has drifted for days.
+static bool timeApplySample(const struct timeval *tv, TimeSource source, int32_t errorMs)
+{
+  struct timeval local;
+  gettimeofday(&local, nullptr);
+  int64_t offsetUs = ((int64_t)tv->tv_sec - local.tv_sec) * 1000000 + (tv->tv_usec - local.tv_usec);
+  int64_t monoUs = esp_timer_get_time();
+
+  xSemaphoreTake(timeLock, portMAX_DELAY);
+  if (source != TIME_SOURCE_NTP && errorMs >= timeEstimatedErrorMs())
+  {
+    timeDiscipline.rejectedCount++;
+    xSemaphoreGive(timeLock);
+    return false;
+  }
+
+  bool step = !timeIsValid() || llabs(offsetUs) > (int64_t)TIME_STEP_THRESHOLD_MS * 1000;
+  bool firstSync = !timeDiscipline.synced;
+
+  // Only NTP-to-NTP intervals are precise enough to learn drift from: the
+  // residual offset since the last slewed sample is drift we failed to predict
+  int64_t intervalUs = monoUs - timeDiscipline.lastSyncUs;
+  if (source == TIME_SOURCE_NTP && timeDiscipline.source == TIME_SOURCE_NTP && !step && !timeDiscipline.lastWasStep &&
+      intervalUs >= 60000000LL)
+  {
+    float samplePpm = timeDiscipline.driftPpm - (float)offsetUs * 1e6f / (float)intervalUs;
+    if (fabsf(samplePpm) <= TIME_MAX_DRIFT_PPM)
+    {
+      float gain = timeDiscipline.sampleCount < 4 ? 0.5f : 0.25f;
+      timeDiscipline.driftSpreadPpm += gain * (fabsf(samplePpm - timeDiscipline.driftPpm) - timeDiscipline.driftSpreadPpm);
+      timeDiscipline.driftPpm += gain * (samplePpm - timeDiscipline.driftPpm);
+    }
+  }
+
+  if (step)
+  {
+    settimeofday(tv, nullptr);
+    timeDiscipline.stepCount++;
+  }
+  else
+  {
+    timeSlew(offsetUs, false);
+  }
+
+  timeDiscipline.synced = true;
+  timeDiscipline.source = source;
+  timeDiscipline.sourceErrorMs = errorMs;
+  timeDiscipline.lastWasStep = step;
+  timeDiscipline.lastSyncUs = monoUs;
+  timeDiscipline.lastOffsetUs = offsetUs;
+  timeDiscipline.sampleCount++;
+  xSemaphoreGive(timeLock);
+
+  // Journal the clock being set or jumped; routine slews would only add noise
+  if (step || firstSync)
+    logEvent(EVENT_TIME_SYNC, source, (int32_t)std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, offsetUs / 1000)));
+  return true;
+}
+
+// Replaces the weak ESP-IDF hook that applies each SNTP sample (runs in the lwIP task)
+extern "C" void sntp_sync_time(struct timeval *tv)
+{
+  timeApplySample(tv, TIME_SOURCE_NTP, TIME_SYNC_ERROR_MS);
+  sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+}
+
+bool timeFromClient(int64_t epochMs)
+{
+  struct timeval tv = {(time_t)(epochMs / 1000), (suseconds_t)((epochMs % 1000) * 1000)};
+  return timeApplySample(&tv, TIME_SOURCE_CLIENT, TIME_CLIENT_ERROR_MS);
+}
+
+// Parse an RFC 7231 date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+bool timeFromHttpDate(const char *date)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, minute, second;
+  if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour, &minute, &second) != 6)
+    return false;
+
+  const char *found = strstr(months, month);
+  if (found == nullptr || strlen(month) != 3 || (found - months) % 3 != 0)
+    return false;
+  int monthIndex = (found - months) / 3 + 1;
+
+  // Mid-second is the best guess for a 1 s resolution timestamp
+  struct timeval tv = {(time_t)daysFromCivil(year, monthIndex, day) * 86400 + hour * 3600 + minute * 60 + second, 500000};
+  if (tv.tv_sec < TIME_VALID_AFTER)
+    return false;
+  return timeApplySample(&tv, TIME_SOURCE_HTTP_DATE, TIME_HTTP_DATE_ERROR_MS);
+}
+
+bool isRequestAuthenticated()
+{
+  if (API_TOKEN[0] == '\0')
+    return true;
+  return server.header("Authorization") == String("Bearer ") + API_TOKEN;
+}
+
+// Wrap an API handler so the Date header of authenticated requests feeds the
+// clock, and stall reports and allocation counts can name the handler
+WebServer::THandlerFunction withRequestTime(WebServer::THandlerFunction handler)
+{
+  return [handler]()
+  {
+    strlcpy(stallState.handler, server.uri().c_str(), sizeof(stallState.handler));
+    allocEnterHandler(stallState.handler);
+    if (server.hasHeader("Date") && isRequestAuthenticated())
+      timeFromHttpDate(server.header("Date").c_str());
+    handler();
+    allocLeaveHandler();
+    stallState.handler[0] = '\0';
+  };
+}
+
+// Apply drift compensation between samples (called from loop)
+void updateTimeDiscipline()
+{
+  unsigned long elapsed = millis() - timeDiscipline.lastHoldoverTime;
+  if (elapsed < TIME_HOLDOVER_INTERVAL_MS)
+    return;
+  timeDiscipline.lastHoldoverTime = millis();
+
+  if (!timeIsValid())
+    return;
+
+  xSemaphoreTake(timeLock, portMAX_DELAY);
+  float driftPpm = timeDiscipline.driftPpm;
+  timeSlew(-(int64_t)(driftPpm * (float)elapsed / 1000.0f), true);
+  bool rtcDue = RTC_ENABLED && timeDiscipline.source == TIME_SOURCE_NTP &&
+                (timeDiscipline.lastRtcWriteTime == 0 || millis() - timeDiscipline.lastRtcWriteTime >= RTC_WRITE_INTERVAL_MS);
+  xSemaphoreGive(timeLock);
+
+  if (rtcDue)
+  {
+    writeRTC();
+    timeDiscipline.lastRtcWriteTime = millis();
+  }
+
+  // Persist the crystal error once it has settled, for holdover after a reboot
+  static float savedDriftPpm = NAN;
+  if (timeDiscipline.sampleCount >= 4 && !(fabsf(driftPpm - savedDriftPpm) < 0.5f))
+  {
+    preferences.putFloat("drift_ppm", driftPpm);
+    savedDriftPpm = driftPpm;
+  }
+}
+
+// ============ RTC ============
+static uint8_t bcdToBin(uint8_t v)
+{
+  return (v >> 4) * 10 + (v & 0x0F);
+}
+
+static uint8_t binToBcd(uint8_t v)
+{
+  return ((v / 10) << 4) | (v % 10);
+}
+
+// Read the RTC (always kept in UTC) and offer it as a time sample
+void setupRTC()
+{
+  if (!RTC_ENABLED)
+    return;
+
+  Wire.begin(RTC_SDA_PIN, RTC_SCL_PIN);
+  Wire.beginTransmission(RTC_I2C_ADDRESS);
+  Wire.write(0x00);
+  if (Wire.endTransmission() != 0 || Wire.requestFrom(RTC_I2C_ADDRESS, (uint8_t)7) != 7)
+  {
+    Serial.println("RTC not found");
+    return;
+  }
+
+  uint8_t regs[7];
+  for (int i = 0; i < 7; i++)
+    regs[i] = Wire.read();
+
+  int32_t days = daysFromCivil(2000 + bcdToBin(regs[6]), bcdToBin(regs[5] & 0x1F), bcdToBin(regs[4] & 0x3F));
+  time_t seconds = (time_t)days * 86400 + bcdToBin(regs[2] & 0x3F) * 3600 + bcdToBin(regs[1] & 0x7F) * 60 + bcdToBin(regs[0] & 0x7F);
+  struct timeval tv = {seconds, 500000};
+  if (seconds >= TIME_VALID_AFTER && timeApplySample(&tv, TIME_SOURCE_RTC, TIME_RTC_ERROR_MS))
+    Serial.println("Time set from RTC");
+}
+
+// Keep the RTC close to a good clock so it is useful on the next cold boot
+void writeRTC()
+{
+  time_t now = time(nullptr);
+  struct tm utc;
+  gmtime_r(&now, &utc);
+
+  Wire.beginTransmission(RTC_I2C_ADDRESS);
+  Wire.write(0x00);
+  Wire.write(binToBcd(utc.tm_sec));
+  Wire.write(binToBcd(utc.tm_min));
+  Wire.write(binToBcd(utc.tm_hour)); // 24-hour mode
+  Wire.write(binToBcd(utc.tm_wday + 1));
+  Wire.write(binToBcd(utc.tm_mday));
+  Wire.write(binToBcd(utc.tm_mon + 1));
+  Wire.write(binToBcd(utc.tm_year - 100));
+  Wire.endTransmission();
+}
+
+// ============ USAGE COUNTERS ============
+// Lifetime on-time and energy per channel for maintenance and PSU sizing.
+// The duty x time product is integrated in integer PWM-count microseconds
+// whenever the output changes, not on every tick, so a steady light costs
+// nothing. Totals are kept in RTC memory and saved to NVS hourly and before
+// an OTA reboot.
+
+// Checksum for records kept in RTC memory, which holds garbage after a power cut
+static uint32_t rtcChecksum(const void *data, size_t length)
+{
+  const uint32_t *words = (const uint32_t *)data;
+  uint32_t check = 0x9E3779B9;
+  for (size_t i = 0; i < length / 4; i++)
+    check = (check ^ words[i]) * 16777619u;
+  return check;
+}
+
+static uint32_t usageCheck(const UsageTotals &totals)
+{
+  return rtcChecksum(&totals, offsetof(UsageTotals, check));
+}
+
+// Bring the totals up to now at the current duties (usageLock held)
+static void usageAdvance()
+{
+  int64_t now = esp_timer_get_time();
+  uint64_t dt = now - usageState.lastUs;
+  usageState.lastUs = now;
+  usageRtc.poweredUs += dt;
+  for (int ch = 0; ch < 2; ch++)
+  {
+    usageRtc.dutyUs[ch] += (uint64_t)usageState.duty[ch] * dt;
+    if (usageState.lit[ch])
+      usageRtc.onUs[ch] += dt;
+  }
+  usageRtc.check = usageCheck(usageRtc);
+}
+
+// Prefer the RTC copy (newer) after a reset; after a power cut it is garbage and NVS is used
+void setupUsage()
+{
+  bool rtcValid = esp_reset_reason() != ESP_RST_POWERON && usageRtc.magic == USAGE_MAGIC && usageRtc.check == usageCheck(usageRtc);
+  if (rtcValid)
+  {
+    usageState.restored = true;
+  }
+  else
+  {
+    UsageTotals saved;
+    if (preferences.getBytes("usage", &saved, sizeof(saved)) == sizeof(saved) && saved.magic == USAGE_MAGIC &&
+        saved.check == usageCheck(saved))
+    {
+      usageRtc = saved;
+    }
+    else
+    {
+      memset(&usageRtc, 0, sizeof(usageRtc));
+      usageRtc.magic = USAGE_MAGIC;
+      usageRtc.check = usageCheck(usageRtc);
+    }
+  }
+  usageState.lastUs = esp_timer_get_time();
+  usageState.lastSaveTime = millis();
+  Serial.printf("Usage counters from %s: warm %.1f h, cool %.1f h on\n", rtcValid ? "RTC memory" : "flash",
+                usageRtc.onUs[0] / 3.6e9, usageRtc.onUs[1] / 3.6e9);
+}
+
+// Called by setBrightness() with the 16-bit duties it just wrote. The totals
+// stay in pwmResolution counts whichever band the timer is in.
+static void usageRecordOutput(int dutyWarm, int dutyCool)
+{
+  uint32_t warm = pwmScale(dutyWarm, PWM_RESOLUTION);
+  uint32_t cool = pwmScale(dutyCool, PWM_RESOLUTION);
+  portENTER_CRITICAL(&usageLock);
+  usageAdvance();
+  usageState.duty[0] = warm;
+  usageState.duty[1] = cool;
+  usageState.lit[0] = dutyWarm > 0;
+  usageState.lit[1] = dutyCool > 0;
+  portEXIT_CRITICAL(&usageLock);
+}
+
+UsageTotals usageSnapshot()
+{
+  portENTER_CRITICAL(&usageLock);
+  usageAdvance();
+  UsageTotals totals = usageRtc;
+  portEXIT_CRITICAL(&usageLock);
+  return totals;
+}
+
+// Safe from any task (also called by the OTA task before a reboot)
+void saveUsage()
+{
+  UsageTotals totals = usageSnapshot();
+  preferences.putBytes("usage", &totals, sizeof(totals));
+  usageState.lastSaveTime = millis();
+  usageState.saves++;
+}
+
+void updateUsage()
+{
+  if (millis() - usageState.lastSaveTime >= USAGE_SAVE_MS)
+    saveUsage();
+}
+
+// Watt-hours drawn by one channel, assuming current scales linearly with duty
+float usageWattHours(const UsageTotals &totals, int ch)
+{
+  float fullPowerHours = totals.dutyUs[ch] / (float)PWM_MAX / 3.6e9f;
+  return fullPowerHours * (ch == 0 ? LED_WARM_WATTS : LED_COOL_WATTS);
+}
+
+// ============ LED CONTROL FUNCTIONS ============
+void setBrightness(int warm, int cool)
+{
+  warm = constrain(warm, 0, LEVEL_MAX);
+  cool = constrain(cool, 0, LEVEL_MAX);
+
+  alarmState.currentWarmBrightness = warm;
+  alarmState.currentCoolBrightness = cool;
+
+  // Choose gamma depending on whether we're in sunrise mode (tweak perceptual curve)
+  bool linear = alarmState.isSunriseActive;
+  int dutyWarm = applyGamma(warm, linear);
+  int dutyCool = applyGamma(cool, linear);
+
+  pwmStage(PWM_OUT_WARM, dutyWarm);
+  pwmStage(PWM_OUT_COOL, dutyCool);
+  pwmCommit(warm > cool ? warm : cool);
+  usageRecordOutput(dutyWarm, dutyCool);
+}
+
+// ============ PWM OUTPUT STAGE ============
+// Both LEDs share one low-speed LEDC timer. Dim light runs at a low
+// frequency with fine duty steps, bright light at a higher frequency with
+// fewer bits (Board::pwmBand()).
+//
+// Output changes are frames: pwmStage() collects the duty of each output and
+// pwmCommit() hands them to the LEDC together. The low-speed group only takes
+// a new duty (or timer setting) at the end of a PWM period, once its update
+// bit is set. pwmCommit() loads every duty register first and then sets the
+// update bits back to back, away from a period end, so they all latch at the
+// same one: no period runs new-warm with old-cool, or a new timer with an
+// old duty.
+
+static const ledc_channel_t PWM_LEDC_WARM = (ledc_channel_t)(PWM_CHANNEL_WARM - 8);
+static const ledc_channel_t PWM_LEDC_COOL = (ledc_channel_t)(PWM_CHANNEL_COOL - 8);
+static const uint32_t PWM_TIMER_OVERFLOW_BIT = 1u << (4 + PWM_TIMER); // LSTIMERx_OVF in LEDC int_raw
+
+static void pwmBandTiming(int band, uint32_t &freq, uint8_t &bits)
+{
+  if (band < 0)
+  {
+    freq = PWM_FREQ;
+    bits = PWM_RESOLUTION;
+    return;
+  }
+  PwmBand b = Board::pwmBand(band);
+  freq = b.freq;
+  bits = b.bits;
+}
+
+// Band for the brighter channel's level. Dropping to a lower band waits until
+// the level is PWM_BAND_HYSTERESIS under the band's start, so a fade hovering
+// at a boundary does not switch the timer every step.
+static int pwmBandFor(int level)
+{
+  if (!PWM_BANDS_ENABLED)
+    return -1;
+  int band = pwmState.band < 0 ? 0 : pwmState.band;
+  while (band + 1 < PWM_BAND_COUNT && level >= Board::pwmBand(band + 1).fromLevel)
+    band++;
+  while (band > 0 && level < (int)Board::pwmBand(band).fromLevel - PWM_BAND_HYSTERESIS)
+    band--;
+  return band;
+}
+
+static void pwmTrace(uint32_t warm16, uint32_t cool16, bool torn)
+{
+  PwmTraceEntry &e = pwmState.trace[pwmState.traceCount % PWM_TRACE_ENTRIES];
+  e.timeUs = (uint32_t)esp_timer_get_time();
+  e.band = pwmState.band;
+  e.bits = pwmState.bits;
+  e.warm16 = warm16;
+  e.cool16 = cool16;
+  e.warmDuty = pwmState.warmDuty;
+  e.coolDuty = pwmState.coolDuty;
+  e.coolHpoint = pwmState.coolHpoint;
+  e.frame = pwmState.framesCommitted;
+  e.torn = torn;
+  pwmState.traceCount++;
+}
+
+// Phase offset for the cool channel. Warm turns on at the start of the
+// period and cool is aligned to end with it, so their on-times only overlap
+// when the duties add up to more than a period - the least overlap possible.
+static uint32_t pwmCoolHpoint(uint32_t coolDuty, uint8_t bits)
+{
+  if (!PWM_PHASE_STAGGER || coolDuty == 0)
+    return 0;
+  return (1u << bits) - coolDuty;
+}
+
+// Track the per-period overlap of the two on-times and the peak draw it implies
+static void pwmUpdateOverlap()
+{
+  uint32_t coolEnd = pwmState.coolHpoint + pwmState.coolDuty;
+  uint32_t end = std::min(pwmState.warmDuty, coolEnd);
+  pwmState.overlap = end > pwmState.coolHpoint ? end - pwmState.coolHpoint : 0;
+  if (pwmState.overlap > 0)
+    pwmState.peakWatts = LED_WARM_WATTS + LED_COOL_WATTS;
+  else
+    pwmState.peakWatts = std::max(pwmState.warmDuty > 0 ? LED_WARM_WATTS : 0.0f, pwmState.coolDuty > 0 ? LED_COOL_WATTS : 0.0f);
+  if (pwmState.peakWatts > pwmState.peakWattsMax)
+    pwmState.peakWattsMax = pwmState.peakWatts;
+}
+
+void setupPwm()
+{
+  pwmState.band = PWM_BANDS_ENABLED ? 0 : -1;
+  pwmBandTiming(pwmState.band, pwmState.freq, pwmState.bits);
+
+  ledc_timer_config_t timer = {};
+  timer.speed_mode = PWM_MODE;
+  timer.duty_resolution = (ledc_timer_bit_t)pwmState.bits;
+  timer.timer_num = PWM_TIMER;
+  timer.freq_hz = pwmState.freq;
+  timer.clk_cfg = LEDC_USE_APB_CLK; // pwmCommit() computes dividers from the 80 MHz APB clock
+  ledc_timer_config(&timer);
+
+  const int pins[2] = {WARM_PIN, COOL_PIN};
+  const ledc_channel_t channels[2] = {PWM_LEDC_WARM, PWM_LEDC_COOL};
+  for (int i = 0; i < 2; i++)
+  {
+    ledc_channel_config_t channel = {};
+    channel.gpio_num = pins[i];
+    channel.speed_mode = PWM_MODE;
+    channel.channel = channels[i];
+    channel.intr_type = LEDC_INTR_DISABLE;
+    channel.timer_sel = PWM_TIMER;
+    channel.duty = 0;
+    channel.hpoint = 0;
+    ledc_channel_config(&channel);
+  }
+  pwmState.warmDuty = 0;
+  pwmState.coolDuty = 0;
+  pwmState.coolHpoint = 0;
+  pwmUpdateOverlap();
+}
+
+// Stage an output's 16-bit duty for the next pwmCommit()
+void pwmStage(PwmOutput output, uint32_t duty16)
+{
+  pwmState.staged[output] = duty16;
+}
+
+// Latch the staged duties at the next period end; `level` (the brighter
+// channel) picks the timer band. A band change is part of the same frame.
+void pwmCommit(int level)
+{
+  uint32_t warm16 = pwmState.staged[PWM_OUT_WARM];
+  uint32_t cool16 = pwmState.staged[PWM_OUT_COOL];
+  int band = pwmBandFor(level);
+  bool retime = band != pwmState.band;
+  uint32_t freq = pwmState.freq;
+  uint8_t bits = pwmState.bits;
+  if (retime)
+    pwmBandTiming(band, freq, bits);
+  uint32_t warmDuty = pwmScale(warm16, bits);
+  uint32_t coolDuty = pwmScale(cool16, bits);
+  uint32_t coolHpoint = pwmCoolHpoint(coolDuty, bits);
+  bool warmChanged = retime || warmDuty != pwmState.warmDuty;
+  bool coolChanged = retime || coolDuty != pwmState.coolDuty;
+  if (!warmChanged && !coolChanged)
+  {
+    pwmTrace(warm16, cool16, false);
+    return;
+  }
+
+  // Counts of the running period in the guard time
+  uint32_t period = 1u << pwmState.bits;
+  uint32_t guard = (uint32_t)((uint64_t)pwmState.freq * period * PWM_COMMIT_GUARD_US / 1000000) + 1;
+
+  static portMUX_TYPE commitLock = portMUX_INITIALIZER_UNLOCKED;
+  portENTER_CRITICAL(&commitLock);
+  LEDC.int_clr.val = PWM_TIMER_OVERFLOW_BIT;
+  uint32_t count = LEDC.timer_group[PWM_MODE].timer[PWM_TIMER].value.timer_cnt;
+  if (count + guard >= period)
+  {
+    // Too close to the period end to set every bit before it: wait it out
+    // (bounded, in case the timer is stopped)
+    int64_t deadline = esp_timer_get_time() + PWM_COMMIT_GUARD_US * 2;
+    while (!(LEDC.int_raw.val & PWM_TIMER_OVERFLOW_BIT) && esp_timer_get_time() < deadline)
+    {
+    }
+    LEDC.int_clr.val = PWM_TIMER_OVERFLOW_BIT;
+  }
+  // Load the duty registers; nothing reaches the output until the update bits
+  if (warmChanged)
+    ledc_set_duty_with_hpoint(PWM_MODE, PWM_LEDC_WARM, warmDuty, 0);
+  if (coolChanged)
+    ledc_set_duty_with_hpoint(PWM_MODE, PWM_LEDC_COOL, coolDuty, coolHpoint);
+  if (retime)
+  {
+    // 10.8 fixed-point divider of the 80 MHz APB clock
+    uint32_t divider = (uint32_t)((80000000ULL << 8) / ((uint64_t)freq << bits));
+    ledc_timer_set(PWM_MODE, PWM_TIMER, divider, bits, LEDC_APB_CLK);
+  }
+  if (warmChanged)
+    ledc_update_duty(PWM_MODE, PWM_LEDC_WARM);
+  if (coolChanged)
+    ledc_update_duty(PWM_MODE, PWM_LEDC_COOL);
+  // A period ending mid-commit latched part of the frame one period early
+  bool torn = LEDC.int_raw.val & PWM_TIMER_OVERFLOW_BIT;
+  portEXIT_CRITICAL(&commitLock);
+
+  if (retime)
+  {
+    pwmState.band = band;
+    pwmState.freq = freq;
+    pwmState.bits = bits;
+    pwmState.bandSwitches++;
+    if (torn)
+      pwmState.lateSwitches++;
+  }
+  pwmState.warmDuty = warmDuty;
+  pwmState.coolDuty = coolDuty;
+  pwmState.coolHpoint = coolHpoint;
+  pwmUpdateOverlap();
+  pwmState.framesCommitted++;
+  if (torn)
+    pwmState.framesTorn++;
+  pwmTrace(warm16, cool16, torn);
+}
+
+// Overlap as a fraction of the PWM period
+float pwmOverlapRatio()
+{
+  return pwmState.overlap / (float)(1u << pwmState.bits);
+}
+
+// GET /debug/pwm-trace - recent output writes, oldest first. `warm`/`cool`
+// are the duty fractions actually output, to check that a band switch keeps
+// the light level continuous.
+void handlePwmTrace()
+{
+  uint32_t count = std::min<uint32_t>(pwmState.traceCount, PWM_TRACE_ENTRIES);
+  String response = "{\"band\":" + String(pwmState.band) + ",\"freq\":" + String(pwmState.freq) +
+                    ",\"bits\":" + String(pwmState.bits) + ",\"bandSwitches\":" + String(pwmState.bandSwitches) +
+                    ",\"lateSwitches\":" + String(pwmState.lateSwitches) +
+                    ",\"framesCommitted\":" + String(pwmState.framesCommitted) +
+                    ",\"framesTorn\":" + String(pwmState.framesTorn) + ",\"writes\":[";
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const PwmTraceEntry &e = pwmState.trace[(pwmState.traceCount - count + i) % PWM_TRACE_ENTRIES];
+    uint32_t freq;
+    uint8_t bits;
+    pwmBandTiming(e.band, freq, bits);
+    float full = (float)(1u << e.bits); // a duty of 2^bits is fully on
+    if (i > 0)
+      response += ",";
+    response += "{\"us\":" + String(e.timeUs) + ",\"band\":" + String(e.band) + ",\"freq\":" + String(freq) +
+                ",\"bits\":" + String(e.bits) + ",\"warm16\":" + String(e.warm16) + ",\"cool16\":" + String(e.cool16) +
+                ",\"warmDuty\":" + String(e.warmDuty) + ",\"coolDuty\":" + String(e.coolDuty) +
+                ",\"coolHpoint\":" + String(e.coolHpoint) + ",\"frame\":" + String(e.frame) +
+                ",\"torn\":" + (e.torn ? "true" : "false") +
+                ",\"warm\":" + String(e.warmDuty / full, 6) + ",\"cool\":" + String(e.coolDuty / full, 6) + "}";
+  }
+  response += "]}";
+  server.send(200, "application/json", response);
+}
+
+// ============ LOCAL CONTROLS ============
+// Button and encoder edges are decoded in GPIO interrupts and handed to
+// loop() through a single-producer/single-consumer ring. All GPIO handlers
+// run from the one GPIO interrupt on the same core, so they never preempt
+// each other and the ring needs no locks. The one push from loop(),
+// buttonSettle(), runs in a critical section, with that interrupt masked.
+
+static bool controlQueuePush(ControlEventType type, int16_t delta)
+{
+  uint8_t head = controlQueue.head;
+  uint8_t next = (head + 1) & (CONTROL_QUEUE_SIZE - 1);
+  if (next == controlQueue.tail)
+  {
+    controlQueue.dropped++;
+    return false;
+  }
+  controlQueue.events[head] = {type, delta};
+  __atomic_store_n(&controlQueue.head, next, __ATOMIC_RELEASE);
+  return true;
+}
+
+static bool controlQueuePop(ControlEvent &event)
+{
+  uint8_t tail = controlQueue.tail;
+  if (tail == __atomic_load_n(&controlQueue.head, __ATOMIC_ACQUIRE))
+    return false;
+  event = controlQueue.events[tail];
+  __atomic_store_n(&controlQueue.tail, (uint8_t)((tail + 1) & (CONTROL_QUEUE_SIZE - 1)), __ATOMIC_RELEASE);
+  return true;
+}
+
+// Move the button to a level read at `at`, classifying press length on release
+static void IRAM_ATTR buttonApply(bool down, unsigned long at)
+{
+  if (down && !buttonState.pressed)
+  {
+    buttonState.pressed = true;
+    buttonState.pressedAt = at;
+  }
+  else if (!down && buttonState.pressed)
+  {
+    buttonState.pressed = false;
+    controlQueuePush(at - buttonState.pressedAt >= BUTTON_LONG_PRESS_MS ? CONTROL_LONG_PRESS : CONTROL_PRESS, 0);
+  }
+}
+
+// Button: the first edge after a quiet spell is read at once, so a clean
+// press costs no latency. Edges closer together than BUTTON_DEBOUNCE_MS are
+// one burst of contact bounce, and buttonSettle() reads the level it ends at.
+void IRAM_ATTR buttonISR()
+{
+  portENTER_CRITICAL_ISR(&buttonLock);
+  unsigned long now = millis();
+  bool burstStart = now - buttonState.lastEdgeMs >= BUTTON_DEBOUNCE_MS;
+  buttonState.lastEdgeMs = now;
+  buttonState.settling = true;
+  if (burstStart)
+  {
+    buttonState.burstAt = now;
+    buttonApply(digitalRead(BUTTON_PIN) == LOW, now);
+  }
+  portEXIT_CRITICAL_ISR(&buttonLock);
+}
+
+// Once a burst has been quiet for BUTTON_DEBOUNCE_MS, classify from the level
+// it settled at: a tap shorter than the window, or a release whose bounce
+// outlasted it, is not missed (called from loop)
+void buttonSettle()
+{
+  portENTER_CRITICAL(&buttonLock);
+  if (buttonState.settling && millis() - buttonState.lastEdgeMs >= BUTTON_DEBOUNCE_MS)
+  {
+    buttonState.settling = false;
+    buttonApply(digitalRead(BUTTON_PIN) == LOW, buttonState.burstAt);
+  }
+  portEXIT_CRITICAL(&buttonLock);
+}
+
+// Encoder: quadrature state table rejects bounce (invalid transitions count 0);
+// the transitions since the last detent are resolved when the knob is back at
+// rest (both contacts open), so a wiggle counts 0 and a missed edge does not
+// put the count out of step with the detents. Scaled by how fast the knob turns.
+void IRAM_ATTR encoderISR()
+{
+  static const int8_t transitions[16] = {0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0};
+  static uint8_t state = 0x0F; // at rest
+  static int8_t steps = 0;
+  static unsigned long lastDetent = 0;
+
+  state = ((state << 2) | (digitalRead(ENCODER_A_PIN) << 1) | digitalRead(ENCODER_B_PIN)) & 0x0F;
+  steps += transitions[state];
+  if ((state & 0x03) != 0x03)
+    return;
+  if (steps > -2 && steps < 2)
+  {
+    steps = 0;
+    return;
+  }
+
+  int direction = steps > 0 ? 1 : -1;
+  steps = 0;
+
+  unsigned long now = millis();
+  unsigned long interval = now - lastDetent;
+  lastDetent = now;
+
+  int multiplier = 1;
+  if (interval < ENCODER_FAST_MS)
+    multiplier = ENCODER_FAST_MULTIPLIER;
+  else if (interval < ENCODER_MEDIUM_MS)
+    multiplier = ENCODER_MEDIUM_MULTIPLIER;
+
+  controlQueuePush(CONTROL_ROTATE, direction * multiplier);
+}
+
+void setupControls()
+{
+  if (!LOCAL_CONTROLS_ENABLED)
+    return;
+
+  pinMode(BUTTON_PIN, INPUT_PULLUP);
+  pinMode(ENCODER_A_PIN, INPUT_PULLUP);
+  pinMode(ENCODER_B_PIN, INPUT_PULLUP);
+
+  attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), buttonISR, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ENCODER_A_PIN), encoderISR, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ENCODER_B_PIN), encoderISR, CHANGE);
+
+  Serial.println("Local controls ready");
+}
+
+// Scale both channels by the encoder, keeping the warm/cool ratio
+static void adjustBrightness(int detents)
+{
+  int warm = alarmState.currentWarmBrightness;
+  int cool = alarmState.currentCoolBrightness;
+  int level = warm > cool ? warm : cool;
+  int newLevel = constrain(level + detents * ENCODER_STEP, 0, LEVEL_MAX);
+
+  if (level == 0)
+  {
+    warm = newLevel;
+    cool = newLevel;
+  }
+  else
+  {
+    warm = (int)((int64_t)warm * newLevel / level);
+    cool = (int)((int64_t)cool * newLevel / level);
+  }
+
+  // Applied immediately - a fade would add latency to every detent
+  alarmState.isSunriseActive = false;
+  stopSunset();
+  stopProgram();
+  stopEffect();
+  if (newLevel == 0)
+    circadianSuspend();
+  else
+    circadianOverride();
+  alarmState.isManualFadeActive = false;
+  alarmState.autoOffScheduled = false;
+  setBrightness(warm, cool);
+}
+
+// Short press: toggle the lights with the manual fade
+static void buttonToggle()
+{
+  cancelSnooze();
+  if (alarmState.currentWarmBrightness > 0 || alarmState.currentCoolBrightness > 0)
+  {
+    startManualFade(0, 0, MANUAL_FADE_MS);
+    logEvent(EVENT_MANUAL_OFF, EVENT_FROM_BUTTON);
+    Serial.println("Button: fading lights off");
+  }
+  else
+  {
+    startManualFade(LEVEL_MAX, LEVEL_MAX, MANUAL_FADE_MS);
+    logEvent(EVENT_MANUAL_ON, EVENT_FROM_BUTTON);
+    Serial.println("Button: fading lights on");
+  }
+}
+
+// Drain button/encoder events (called from loop)
+void updateControls()
+{
+  // With a button scene saved, a press waits out the double click window
+  // before it toggles
+  static bool pressPending = false;
+  static unsigned long pressAt = 0;
+
+  ControlEvent event;
+  int detents = 0;
+
+  buttonSettle();
+  while (controlQueuePop(event))
+  {
+    switch (event.type)
+    {
+    case CONTROL_PRESS:
+      if (pressPending && recallScene(BUTTON_SCENE_ID))
+      {
+        pressPending = false;
+        Serial.println("Button: double click, scene recalled");
+        break;
+      }
+      if (pressPending)
+      {
+        pressPending = false; // the scene was deleted in between
+        buttonToggle();
+      }
+      // Only wait for a second press when there is a scene for it to recall
+      if (findScene(BUTTON_SCENE_ID) != nullptr)
+      {
+        pressPending = true;
+        pressAt = millis();
+      }
+      else
+      {
+        buttonToggle();
+      }
+      break;
+
+    case CONTROL_LONG_PRESS:
+      if (alarmState.isSunriseActive)
+      {
+        snoozeSunrise(); // ignored once the snooze limit is reached
+      }
+      break;
+
+    case CONTROL_ROTATE:
+      detents += event.delta; // coalesce a burst into one output update
+      break;
+    }
+  }
+
+  if (pressPending && millis() - pressAt >= BUTTON_DOUBLE_CLICK_MS)
+  {
+    pressPending = false;
+    buttonToggle();
+  }
+
+  if (detents != 0)
+  {
+    adjustBrightness(detents);
+  }
+}
+
+// ============ AMBIENT LIGHT ============
+// The light sensor is sampled continuously by the I2S peripheral in ADC mode,
+// so samples land in DMA buffers without CPU involvement. Each tick drains
+// whatever has arrived, averages it and feeds a fixed-point low-pass filter.
+
+void setupAmbient()
+{
+  if (!AMBIENT_ENABLED)
+    return;
+
+  i2s_config_t config = {};
+  config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+  config.sample_rate = AMBIENT_SAMPLE_RATE;
+  config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+  config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+  config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+  config.dma_buf_count = 4;
+  config.dma_buf_len = AMBIENT_BLOCK_SAMPLES;
+  config.use_apll = false;
+
+  if (i2s_driver_install(I2S_NUM_0, &config, 0, nullptr) != ESP_OK)
+  {
+    Serial.println("Ambient sensor: I2S install failed");
+    return;
+  }
+  adc1_config_channel_atten(AMBIENT_ADC_CHANNEL, ADC_ATTEN_DB_11);
+  i2s_set_adc_mode(ADC_UNIT_1, AMBIENT_ADC_CHANNEL);
+  i2s_adc_enable(I2S_NUM_0);
+
+  ambientState.running = true;
+  Serial.println("Ambient sensor ready");
+}
+
+// Mean of the samples collected since the last call, or -1 if none arrived
+static int32_t ambientReadBlock()
+{
+  static uint16_t samples[AMBIENT_BLOCK_SAMPLES];
+  uint32_t sum = 0;
+  uint32_t count = 0;
+  size_t bytesRead = 0;
+
+  // Non-blocking: drain only what the DMA has already filled
+  while (i2s_read(I2S_NUM_0, samples, sizeof(samples), &bytesRead, 0) == ESP_OK && bytesRead > 0)
+  {
+    for (size_t i = 0; i < bytesRead / sizeof(uint16_t); i++)
+      sum += samples[i] & 0x0FFF; // 12-bit ADC value, upper bits carry the channel
+    count += bytesRead / sizeof(uint16_t);
+  }
+  return count > 0 ? (int32_t)(sum / count) : -1;
+}
+
+// Update the filtered ambient level (called from loop)
+void updateAmbient()
+{
+  if (!ambientState.running)
+    return;
+
+  int32_t block = ambientReadBlock();
+  if (block < 0)
+    return;
+
+  // Exponential moving average in Q16
+  int32_t sampleQ16 = block << 16;
+  if (!ambientState.primed)
+  {
+    ambientState.levelQ16 = sampleQ16;
+    ambientState.primed = true;
+  }
+  ambientState.levelQ16 += (sampleQ16 - ambientState.levelQ16) >> AMBIENT_FILTER_SHIFT;
+}
+
+// Filtered ambient level, 0 (dark) to AMBIENT_FULL_SCALE (bright) in Q16
+int32_t ambientLevelQ16()
+{
+  int64_t scaled = ((int64_t)ambientState.levelQ16) / AMBIENT_ADC_MAX;
+  return (int32_t)constrain(scaled, (int64_t)0, (int64_t)AMBIENT_FULL_SCALE);
+}
+
+// Reset the controller at sunrise start; returns the progress to start from,
+// skipping the part of the curve that would be dimmer than the room already is
+static int32_t ambientBeginSunrise()
+{
+  ambientState.outputScaleQ16 = AMBIENT_FULL_SCALE;
+  ambientState.speedQ16 = AMBIENT_FULL_SCALE;
+  if (!ambientState.primed)
+    return 0;
+
+  int32_t baseline = ambientLevelQ16();
+  int32_t skip = (int32_t)(((int64_t)baseline << 16) / AMBIENT_SETPOINT_Q16);
+  return skip < AMBIENT_MAX_SKIP_Q16 ? skip : AMBIENT_MAX_SKIP_Q16;
+}
+
+// Closed-loop step during sunrise. The sensed light should track
+// progress * AMBIENT_SETPOINT: if the room is brighter than the curve the
+// sunrise runs faster, and the integrator trims the output so a dark room
+// is not over-lit at the end.
+static void ambientControlStep(int32_t progressQ16, unsigned long dtMs)
+{
+  if (!ambientState.primed)
+    return;
+
+  int32_t desired = (int32_t)(((int64_t)progressQ16 * AMBIENT_SETPOINT_Q16) >> 16);
+  int32_t error = desired - ambientLevelQ16(); // positive = too dark
+
+  int64_t scale = ambientState.outputScaleQ16 + (((int64_t)error * AMBIENT_KI_Q16 >> 16) * (int64_t)dtMs) / 1000;
+  ambientState.outputScaleQ16 = (int32_t)constrain(scale, (int64_t)AMBIENT_MIN_SCALE_Q16, (int64_t)AMBIENT_FULL_SCALE);
+
+  int32_t lead = error < 0 ? -error : 0;
+  ambientState.speedQ16 = AMBIENT_FULL_SCALE + (int32_t)(((int64_t)lead * AMBIENT_SKIP_GAIN_Q16) >> 16);
+}
+
+// ============ SNOOZE ============
+// A snooze dims the sunrise to a low level and remembers where the curve was.
+// The resume deadline is stored as a UTC instant together with the progress,
+// so a reboot during a snooze still resumes the sunrise on time.
+
+static void saveSnoozeState()
+{
+  preferences.putBool("snz_active", snoozeState.active);
+  preferences.putFloat("snz_progress", snoozeState.progress);
+  preferences.putUInt("snz_resume", (uint32_t)snoozeState.resumeAt);
+  preferences.putInt("snz_count", snoozeState.count);
+}
+
+// Dim a running sunrise and resume it after snoozeState.minutes. Returns false
+// when the snooze limit has been reached.
+bool snoozeSunrise()
+{
+  if (snoozeState.count >= snoozeState.maxCount)
+  {
+    Serial.println("Snooze limit reached");
+    return false;
+  }
+
+  snoozeState.active = true;
+  snoozeState.count++;
+  snoozeState.progress = alarmState.sunriseProgress;
+  snoozeState.resumeAt = time(nullptr) + (time_t)snoozeState.minutes * 60;
+  saveSnoozeState();
+
+  // Keep the warm/cool balance of the sunrise while dimmed
+  int dim = levelFromBrightness(snoozeState.dimLevel);
+  startManualFade(dim, dim * SUNRISE_COOL_LEVEL / LEVEL_MAX, MANUAL_FADE_MS);
+  Serial.printf("Sunrise snoozed for %d minutes (%d/%d) at %.0f%%\n", snoozeState.minutes, snoozeState.count,
+                snoozeState.maxCount, snoozeState.progress * 100.0f);
+  return true;
+}
+
+// Drop a pending snooze (manual control or alarm disabled)
+void cancelSnooze()
+{
+  if (!snoozeState.active && snoozeState.count == 0)
+    return;
+  snoozeState.active = false;
+  snoozeState.count = 0;
+  saveSnoozeState();
+}
+
+// Resume a snoozed sunrise when the snooze expires (called from loop)
+void updateSnooze()
+{
+  if (!snoozeState.active || !timeIsValid() || time(nullptr) < snoozeState.resumeAt)
+    return;
+
+  snoozeState.active = false;
+  saveSnoozeState();
+  resumeSunrise(snoozeState.progress);
+}
+
+// ============ SUNSET ============
+// A wind-down fade lasts up to two hours but the output only changes about a
+// thousand times over that period. Instead of evaluating the curve every
+// 20 ms tick, each update computes the exact elapsed time at which the next
+// channel value changes; until then updateSunset() is a single comparison.
+//
+// Both channels fade linearly to off. Cool reaches zero after
+// SUNSET_COOL_END_PERCENT of the duration, so the light shifts towards warm.
+
+// Channel value after `elapsed` ms of a linear fade from v0 to 0 over span ms
+static int sunsetChannelAt(int v0, uint32_t span, uint32_t elapsed)
+{
+  if (elapsed >= span)
+    return 0;
+  return (int)((uint64_t)v0 * (span - elapsed) / span);
+}
+
+// Elapsed ms at which a channel currently at `value` next drops by a duty
+// step's worth of level at the timer's resolution (finer steps would not
+// change the output)
+static uint32_t sunsetNextChange(int v0, uint32_t span, int value)
+{
+  if (value <= 0)
+    return UINT32_MAX;
+  int step = LEVEL_MAX >> pwmState.bits;
+  if (step < 1)
+    step = 1;
+  int target = value > step ? value - step : 0;
+  return (uint32_t)((uint64_t)span * (v0 - target - 1) / v0) + 1;
+}
+
+static uint32_t sunsetCoolSpan()
+{
+  return (uint32_t)((uint64_t)sunsetState.durationMs * SUNSET_COOL_END_PERCENT / 100);
+}
+
+static void saveSunsetState()
+{
+  preferences.putBool("dusk_active", sunsetState.active);
+  preferences.putUInt("dusk_start", (uint32_t)sunsetState.startEpoch);
+  preferences.putUInt("dusk_ms", sunsetState.durationMs);
+  preferences.putInt("dusk_lwarm", sunsetState.startWarm);
+  preferences.putInt("dusk_lcool", sunsetState.startCool);
+}
+
+// Start a wind-down from the current output (or a default evening level if off)
+void startSunset(int minutes)
+{
+  int warm = alarmState.currentWarmBrightness;
+  int cool = alarmState.currentCoolBrightness;
+  if (warm == 0 && cool == 0)
+  {
+    warm = levelFromBrightness(SUNSET_DEFAULT_WARM);
+    cool = levelFromBrightness(SUNSET_DEFAULT_COOL);
+  }
+
+  // Take over the output from any other transition
+  alarmState.isSunriseActive = false;
+  stopProgram();
+  stopEffect();
+  circadianOverride();
+  alarmState.isManualFadeActive = false;
+  alarmState.autoOffScheduled = false;
+
+  sunsetState.active = true;
+  sunsetState.needsResync = false;
+  groupState.sunsetStartUs = 0;
+  sunsetState.startWarm = warm;
+  sunsetState.startCool = cool;
+  sunsetState.durationMs = (uint32_t)minutes * 60 * 1000;
+  sunsetState.startMillis = millis();
+  sunsetState.startEpoch = time(nullptr);
+  sunsetState.nextEventMs = 0;
+  sunsetState.updates = 0;
+  saveSunsetState();
+
+  Serial.printf("Sunset started: %d minutes from warm=%d cool=%d\n", minutes, warm, cool);
+}
+
+// Cancel a running sunset, leaving the output where it is
+void stopSunset()
+{
+  if (!sunsetState.active)
+    return;
+  sunsetState.active = false;
+  saveSunsetState();
+  Serial.println("Sunset stopped");
+}
+
+// Advance the sunset when its next output change is due (called from loop)
+void updateSunset()
+{
+  if (!sunsetState.active)
+  {
+    if (!sunsetState.scheduleEnabled || !timeIsValid())
+      return;
+
+    time_t now = time(nullptr);
+    struct tm timeinfo;
+    tzLocalTime(now, &timeinfo);
+    time_t solarAt = solarSunsetToday(timeinfo);
+    bool due = solarAt ? now / 60 == solarAt / 60
+                       : timeinfo.tm_hour == sunsetState.scheduleHour && timeinfo.tm_min == sunsetState.scheduleMinute;
+    if (due && timeinfo.tm_yday != sunsetState.lastScheduledYday)
+    {
+      sunsetState.lastScheduledYday = timeinfo.tm_yday;
+      startSunset(sunsetState.scheduleMinutes);
+      groupAnnounceSunset(sunsetState.scheduleMinutes);
+    }
+    return;
+  }
+
+  if (sunsetState.needsResync)
+  {
+    // Restored after a reboot - place the curve using wall-clock time
+    if (!timeIsValid())
+      return;
+    uint32_t elapsedSeconds = (uint32_t)(time(nullptr) - sunsetState.startEpoch);
+    uint32_t elapsedMs = elapsedSeconds > sunsetState.durationMs / 1000 ? sunsetState.durationMs : elapsedSeconds * 1000;
+    sunsetState.startMillis = millis() - elapsedMs;
+    sunsetState.nextEventMs = 0;
+    sunsetState.needsResync = false;
+  }
+
+  uint32_t elapsed = millis() - sunsetState.startMillis;
+  if (elapsed < sunsetState.nextEventMs)
+    return;
+
+  if (elapsed >= sunsetState.durationMs)
+  {
+    setBrightness(0, 0);
+    sunsetState.active = false;
+    saveSunsetState();
+    circadianSuspend();
+    Serial.printf("Sunset complete (%u output updates)\n", sunsetState.updates);
+    return;
+  }
+
+  uint32_t coolSpan = sunsetCoolSpan();
+  int warm = sunsetChannelAt(sunsetState.startWarm, sunsetState.durationMs, elapsed);
+  int cool = sunsetChannelAt(sunsetState.startCool, coolSpan, elapsed);
+  setBrightness(warm, cool);
+  sunsetState.updates++;
+
+  uint32_t next = sunsetNextChange(sunsetState.startWarm, sunsetState.durationMs, warm);
+  uint32_t nextCool = sunsetNextChange(sunsetState.startCool, coolSpan, cool);
+  if (nextCool < next)
+    next = nextCool;
+  sunsetState.nextEventMs = next < sunsetState.durationMs ? next : sunsetState.durationMs;
+}
+
+// ============ SCENES ============
+// Scenes live in RAM for the whole run; flash is only touched when a scene is
+// saved or deleted, so recalling one costs the same as any other fade start.
+// The scene schedule is kept the same way, next to them.
+
+void saveScenes()
+{
+  preferences.putBytes("scenes", &sceneStore, sizeof(sceneStore));
+  preferences.putBytes("scn_sched", sceneSchedule.slots, sizeof(sceneSchedule.slots));
+}
+
+void loadScenes()
+{
+  size_t length = preferences.getBytesLength("scenes");
+  if (length != sizeof(sceneStore) || preferences.getBytes("scenes", &sceneStore, sizeof(sceneStore)) != sizeof(sceneStore) ||
+      (sceneStore.version != SCENE_STORE_VERSION && sceneStore.version != 1))
+  {
+    sceneStore = decltype(sceneStore)();
+  }
+  else if (sceneStore.version == 1)
+  {
+    // Same layout with 0-1023 brightness; convert to 16-bit levels once
+    for (int i = 0; i < MAX_SCENES; i++)
+    {
+      sceneStore.scenes[i].warm = levelFromBrightness(sceneStore.scenes[i].warm);
+      sceneStore.scenes[i].cool = levelFromBrightness(sceneStore.scenes[i].cool);
+    }
+    sceneStore.version = SCENE_STORE_VERSION;
+    saveScenes();
+  }
+
+  if (preferences.getBytesLength("scn_sched") != sizeof(sceneSchedule.slots) ||
+      preferences.getBytes("scn_sched", sceneSchedule.slots, sizeof(sceneSchedule.slots)) != sizeof(sceneSchedule.slots))
+  {
+    memset(sceneSchedule.slots, 0, sizeof(sceneSchedule.slots));
+  }
+
+  int count = 0;
+  for (int i = 0; i < MAX_SCENES; i++)
+    count += sceneStore.scenes[i].used;
+  Serial.printf("Scenes loaded: %d\n", count);
+}
+
+// Recall the scenes scheduled for this minute (called from loop). A slot
+// whose scene has since been deleted is skipped.
+void updateSceneSchedule()
+{
+  if (!timeIsValid())
+    return;
+  time_t now = time(nullptr);
+  if (now / 60 == sceneSchedule.lastMinute)
+    return;
+  sceneSchedule.lastMinute = now / 60;
+
+  struct tm timeinfo;
+  tzLocalTime(now, &timeinfo);
+  for (int i = 0; i < SCENE_SCHEDULE_SLOTS; i++)
+  {
+    const SceneSlot &entry = sceneSchedule.slots[i];
+    if (entry.sceneId == 0 || entry.hour != timeinfo.tm_hour || entry.minute != timeinfo.tm_min)
+      continue;
+    if (!recallScene(entry.sceneId))
+      Serial.printf("Scene schedule: slot %d, no scene %d saved\n", i + 1, entry.sceneId);
+  }
+}
+
+// Scene slot for an ID, or nullptr if none is stored
+Scene *findScene(int id)
+{
+  if (id < 1 || id > MAX_SCENES || !sceneStore.scenes[id - 1].used)
+    return nullptr;
+  return &sceneStore.scenes[id - 1];
+}
+
+// Mix warm and cool in mired space for a colour temperature; the stronger
+// channel is set to `level`
+void cctToChannels(int kelvin, int level, int &warm, int &cool)
+{
+  float miredWarm = 1e6f / SCENE_WARM_KELVIN;
+  float miredCool = 1e6f / SCENE_COOL_KELVIN;
+  float coolShare = constrain((miredWarm - 1e6f / kelvin) / (miredWarm - miredCool), 0.0f, 1.0f);
+  float strongest = coolShare > 0.5f ? coolShare : 1.0f - coolShare;
+  warm = (int)(level * (1.0f - coolShare) / strongest + 0.5f);
+  cool = (int)(level * coolShare / strongest + 0.5f);
+}
+
+// Start the scene's fade and auto-off; returns false for an unknown ID
+bool recallScene(int id)
+{
+  Scene *scene = findScene(id);
+  if (scene == nullptr)
+    return false;
+
+  cancelSnooze();
+  startManualFade(scene->warm, scene->cool, scene->fadeMs);
+
+  alarmState.autoOffScheduled = scene->autoOffMinutes > 0;
+  if (alarmState.autoOffScheduled)
+  {
+    alarmState.autoOffStartTime = millis();
+    alarmState.autoOffDelayMinutes = scene->autoOffMinutes;
+  }
+
+  Serial.printf("Scene %d (%s) recalled\n", id, scene->name);
+  return true;
+}
+
+// ============ LIGHT PROGRAMS ============
+// Each step is scheduled from the previous step's deadline rather than from the
+// tick that noticed it ended, so loop latency never accumulates across steps.
+
+static float applyEasing(Easing easing, float x)
+{
+  switch (easing)
+  {
+  case EASING_LINEAR:
+    return x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+  case EASING_SMOOTH:
+    return smoothstepf(x);
+  default:
+    return easeInOutSine(x);
+  }
+}
+
+// Fade from an explicit start point; `startTime` may lie in the past
+static void beginFade(int fromWarm, int fromCool, int warm, int cool, unsigned long duration, unsigned long startTime, Easing easing)
+{
+  alarmState.isSunriseActive = false;
+  stopSunset();
+  alarmState.isManualFadeActive = true;
+  alarmState.manualFadeStartTime = startTime;
+  alarmState.manualFadeDuration = duration;
+  alarmState.manualFadeEasing = easing;
+  alarmState.manualStartWarm = fromWarm;
+  alarmState.manualStartCool = fromCool;
+  alarmState.manualTargetWarm = warm;
+  alarmState.manualTargetCool = cool;
+}
+
+// Replace any running program and start the first step now
+void startProgram(const TransitionStep *steps, int count)
+{
+  stopEffect();
+  circadianOverride();
+  memcpy(programState.steps, steps, count * sizeof(TransitionStep));
+  programState.count = count;
+  programState.index = 0;
+  programState.stepStart = millis();
+
+  beginFade(alarmState.currentWarmBrightness, alarmState.currentCoolBrightness, steps[0].warm, steps[0].cool,
+            steps[0].durationMs, programState.stepStart, (Easing)steps[0].easing);
+  programState.active = true;
+  Serial.printf("Program started: %d steps\n", count);
+}
+
+// Stop the program, leaving the output where it is
+void stopProgram()
+{
+  if (!programState.active)
+    return;
+  programState.active = false;
+  alarmState.isManualFadeActive = false;
+  Serial.println("Program stopped");
+}
+
+// Advance to the next step when the current one's fade and hold are over (called from loop)
+void updateProgram()
+{
+  if (!programState.active)
+    return;
+
+  unsigned long now = millis();
+  while (true)
+  {
+    const TransitionStep &step = programState.steps[programState.index];
+    unsigned long stepLength = step.durationMs + step.holdMs;
+    if (now - programState.stepStart < stepLength)
+      return;
+
+    programState.stepStart += stepLength;
+    if (++programState.index >= programState.count)
+    {
+      setBrightness(step.warm, step.cool);
+      alarmState.isManualFadeActive = false;
+      programState.active = false;
+      Serial.println("Program complete");
+      return;
+    }
+
+    // The next fade starts from this step's exact target, even if we are late
+    const TransitionStep &next = programState.steps[programState.index];
+    beginFade(step.warm, step.cool, next.warm, next.cool, next.durationMs, programState.stepStart, (Easing)next.easing);
+  }
+}
+
+// ============ EFFECT VM ============
+// Bytecode is validated once when it is loaded (opcodes, registers, operand
+// lengths, jump targets), so the interpreter can decode without bounds checks.
+// Value operands are one byte: 0-7 selects a register, VM_IMM16 is followed by
+// a little-endian u16. WAIT and FADE advance a virtual clock and yield.
+
+static inline uint16_t vmRead16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+// Length of the instruction at `pc`, or 0 if it is malformed
+static int vmInstructionLength(const uint8_t *code, int length, int pc)
+{
+  int p = pc + 1;
+  int regs = 0, values = 0, addrs = 0;
+  switch (code[pc])
+  {
+  case VM_HALT:
+  case VM_END:
+    break;
+  case VM_SENSE:
+    regs = 1;
+    break;
+  case VM_MOV:
+  case VM_ADD:
+  case VM_SUB:
+    regs = 1;
+    values = 1;
+    break;
+  case VM_RND:
+    regs = 1;
+    values = 2;
+    break;
+  case VM_SET:
+    values = 2;
+    break;
+  case VM_FADE:
+    values = 3;
+    break;
+  case VM_WAIT:
+  case VM_LOOP:
+    values = 1;
+    break;
+  case VM_JMP:
+    addrs = 1;
+    break;
+  case VM_JLT:
+    values = 2;
+    addrs = 1;
+    break;
+  default:
+    return 0;
+  }
+
+  for (int i = 0; i < regs; i++, p++)
+    if (p >= length || code[p] >= VM_REGISTERS)
+      return 0;
+  for (int i = 0; i < values; i++)
+  {
+    if (p >= length || (code[p] >= VM_REGISTERS && code[p] != VM_IMM16))
+      return 0;
+    p += code[p] == VM_IMM16 ? 3 : 1;
+  }
+  p += 2 * addrs;
+  return p <= length ? p - pc : 0;
+}
+
+// Check a whole program; jump targets must land on instruction boundaries
+static bool vmValidate(const uint8_t *code, int length)
+{
+  bool boundary[VM_MAX_CODE + 1] = {false};
+  for (int pc = 0; pc < length;)
+  {
+    int n = vmInstructionLength(code, length, pc);
+    if (n == 0)
+      return false;
+    boundary[pc] = true;
+    pc += n;
+  }
+  boundary[length] = true; // falling off the end halts
+
+  for (int pc = 0; pc < length;)
+  {
+    int n = vmInstructionLength(code, length, pc);
+    if (code[pc] == VM_JMP || code[pc] == VM_JLT)
+    {
+      uint16_t target = vmRead16(code + pc + n - 2);
+      if (target > length || !boundary[target])
+        return false;
+    }
+    pc += n;
+  }
+  return length > 0;
+}
+
+static int32_t vmValue(VmContext &vm, const uint8_t *code)
+{
+  uint8_t b = code[vm.pc++];
+  if (b < VM_REGISTERS)
+    return vm.reg[b];
+  int32_t v = vmRead16(code + vm.pc);
+  vm.pc += 2;
+  return v;
+}
+
+static void vmFault(VmContext &vm, const char *reason)
+{
+  vm.running = false;
+  vm.fault = reason;
+}
+
+// Run up to `budget` instructions; stops early when the program waits or halts.
+// `drive` is false for the benchmark, which must not touch the output.
+static uint32_t vmExecute(VmContext &vm, const uint8_t *code, int length, uint32_t budget, bool drive)
+{
+  uint32_t executed = 0;
+  if ((long)(millis() - vm.clock) < 0)
+    return 0; // still waiting
+
+  while (vm.running && executed < budget)
+  {
+    if (vm.pc >= length)
+    {
+      vm.running = false;
+      break;
+    }
+
+    executed++;
+    uint8_t op = code[vm.pc++];
+    switch (op)
+    {
+    case VM_HALT:
+      vm.running = false;
+      break;
+    case VM_MOV:
+    {
+      uint8_t r = code[vm.pc++];
+      vm.reg[r] = vmValue(vm, code);
+      break;
+    }
+    case VM_ADD:
+    {
+      uint8_t r = code[vm.pc++];
+      vm.reg[r] += vmValue(vm, code);
+      break;
+    }
+    case VM_SUB:
+    {
+      uint8_t r = code[vm.pc++];
+      vm.reg[r] -= vmValue(vm, code);
+      break;
+    }
+    case VM_RND:
+    {
+      uint8_t r = code[vm.pc++];
+      int32_t lo = vmValue(vm, code);
+      int32_t hi = vmValue(vm, code);
+      vm.reg[r] = hi > lo ? random(lo, hi + 1) : lo;
+      break;
+    }
+    case VM_SENSE:
+    {
+      uint8_t r = code[vm.pc++];
+      vm.reg[r] = (ambientLevelQ16() * BRIGHTNESS_MAX) >> 16;
+      break;
+    }
+    case VM_SET:
+    {
+      int warm = constrain(vmValue(vm, code), 0, BRIGHTNESS_MAX);
+      int cool = constrain(vmValue(vm, code), 0, BRIGHTNESS_MAX);
+      if (drive)
+      {
+        alarmState.isManualFadeActive = false;
+        setBrightness(levelFromBrightness(warm), levelFromBrightness(cool));
+      }
+      break;
+    }
+    case VM_FADE:
+    {
+      int warm = constrain(vmValue(vm, code), 0, BRIGHTNESS_MAX);
+      int cool = constrain(vmValue(vm, code), 0, BRIGHTNESS_MAX);
+      int32_t ms = vmValue(vm, code);
+      if (ms < 0)
+        ms = 0;
+      if (drive)
+        beginFade(alarmState.currentWarmBrightness, alarmState.currentCoolBrightness, levelFromBrightness(warm),
+                  levelFromBrightness(cool), ms, vm.clock, EASING_SINE);
+      vm.clock += ms;
+      if ((long)(millis() - vm.clock) < 0)
+        return executed;
+      break;
+    }
+    case VM_WAIT:
+    {
+      int32_t ms = vmValue(vm, code);
+      vm.clock += ms > 0 ? ms : 0;
+      if ((long)(millis() - vm.clock) < 0)
+        return executed;
+      break;
+    }
+    case VM_LOOP:
+    {
+      int32_t count = vmValue(vm, code);
+      if (vm.depth == VM_LOOP_DEPTH)
+      {
+        vmFault(vm, "loop depth");
+        break;
+      }
+      vm.loopStart[vm.depth] = vm.pc;
+      vm.loopLeft[vm.depth] = count > 0 ? count : -1; // 0 = forever
+      vm.depth++;
+      break;
+    }
+    case VM_END:
+      if (vm.depth == 0)
+      {
+        vmFault(vm, "end without loop");
+        break;
+      }
+      if (vm.loopLeft[vm.depth - 1] < 0 || --vm.loopLeft[vm.depth - 1] > 0)
+        vm.pc = vm.loopStart[vm.depth - 1];
+      else
+        vm.depth--;
+      break;
+    case VM_JMP:
+      vm.pc = vmRead16(code + vm.pc);
+      break;
+    case VM_JLT:
+    {
+      int32_t a = vmValue(vm, code);
+      int32_t b = vmValue(vm, code);
+      vm.pc = a < b ? vmRead16(code + vm.pc) : vm.pc + 2;
+      break;
+    }
+    }
+  }
+  return executed;
+}
+
+static void saveEffect()
+{
+  preferences.putBytes("effect", effectState.code, effectState.length);
+}
+
+void loadEffect()
+{
+  size_t length = preferences.getBytesLength("effect");
+  if (length == 0 || length > VM_MAX_CODE || preferences.getBytes("effect", effectState.code, length) != length ||
+      !vmValidate(effectState.code, length))
+  {
+    effectState.length = 0;
+    return;
+  }
+  effectState.length = length;
+  Serial.printf("Effect loaded: %u bytes\n", (unsigned)length);
+}
+
+// Replace the stored effect; returns false if the bytecode does not validate
+bool loadEffectCode(const uint8_t *code, int length)
+{
+  if (length <= 0 || length > VM_MAX_CODE || !vmValidate(code, length))
+    return false;
+  stopEffect();
+  memcpy(effectState.code, code, length);
+  effectState.length = length;
+  saveEffect();
+  return true;
+}
+
+// Start the stored effect from the top (takes over the output)
+bool startEffect()
+{
+  if (effectState.length == 0)
+    return false;
+
+  alarmState.isSunriseActive = false;
+  stopSunset();
+  stopProgram();
+  circadianOverride();
+  alarmState.isManualFadeActive = false;
+  alarmState.autoOffScheduled = false;
+
+  effectState.vm = VmContext();
+  effectState.vm.clock = millis();
+  effectState.vm.running = true;
+  effectState.executed = 0;
+  Serial.println("Effect started");
+  return true;
+}
+
+void stopEffect()
+{
+  if (!effectState.vm.running)
+    return;
+  effectState.vm.running = false;
+  alarmState.isManualFadeActive = false;
+  Serial.println("Effect stopped");
+}
+
+// Run the effect for at most VM_TICK_BUDGET instructions (called from loop)
+void updateEffect()
+{
+  if (!effectState.vm.running)
+    return;
+
+  effectState.executed += vmExecute(effectState.vm, effectState.code, effectState.length, VM_TICK_BUDGET, true);
+  if (!effectState.vm.running)
+    Serial.printf("Effect finished%s%s\n", effectState.vm.fault ? ": " : "", effectState.vm.fault ? effectState.vm.fault : "");
+}
+
+// Instructions per second of a register-only loop, without touching the output
+uint32_t benchmarkEffectVm(uint32_t &executed, uint32_t &elapsedUs)
+{
+  // loop 0 { add r0 1 ; sub r1 1 ; jlt r0 r1 top } - r1 starts far below r0, so JLT never jumps
+  static const uint8_t bench[] = {
+      VM_LOOP, VM_IMM16, 0, 0,
+      VM_ADD, 0, VM_IMM16, 1, 0,
+      VM_SUB, 1, VM_IMM16, 1, 0,
+      VM_JLT, 0, 1, 4, 0,
+      VM_END};
+
+  VmContext vm;
+  vm.clock = millis();
+  vm.running = true;
+  vm.reg[1] = INT32_MIN / 2;
+
+  unsigned long start = micros();
+  executed = vmExecute(vm, bench, sizeof(bench), VM_BENCHMARK_INSTRUCTIONS, false);
+  elapsedUs = micros() - start;
+  return elapsedUs > 0 ? (uint32_t)((uint64_t)executed * 1000000 / elapsedUs) : 0;
+}
+
+// ============ SOLAR ALMANAC ============
+// Sunrise/sunset for every day of the year is computed once per location and
+// year (NOAA low-precision equations, about a minute of error) and kept in NVS.
+// Entries are quarter-minutes after UTC midnight of the local date; far from
+// Greenwich they can fall outside 0..1440 minutes, which is why they are signed.
+
+static void solarComputeYear(int32_t year)
+{
+  Almanac &table = solarState.table;
+  float lat = solarState.latE4 / 1e4f * (float)DEG_TO_RAD;
+  float lon = solarState.lonE4 / 1e4f;
+  int days = isLeapYear(year) ? 366 : 365;
+  float zenith = cosf(90.833f * (float)DEG_TO_RAD); // refraction and solar disc
+
+  for (int yday = 0; yday < 366; yday++)
+  {
+    float g = 2.0f * (float)M_PI / days * yday;
+    float eqTime = 229.18f * (0.000075f + 0.001868f * cosf(g) - 0.032077f * sinf(g) - 0.014615f * cosf(2 * g) -
+                              0.040849f * sinf(2 * g));
+    float decl = 0.006918f - 0.399912f * cosf(g) + 0.070257f * sinf(g) - 0.006758f * cosf(2 * g) +
+                 0.000907f * sinf(2 * g) - 0.002697f * cosf(3 * g) + 0.00148f * sinf(3 * g);
+    float cosHa = zenith / (cosf(lat) * cosf(decl)) - tanf(lat) * tanf(decl);
+
+    if (yday >= days || cosHa < -1.0f || cosHa > 1.0f)
+    {
+      // Polar day or night (or the missing 366th day)
+      table.rise[yday] = SOLAR_NONE;
+      table.set[yday] = SOLAR_NONE;
+      continue;
+    }
+
+    float ha = acosf(cosHa) * (float)RAD_TO_DEG;
+    table.rise[yday] = (int16_t)lroundf((720.0f - 4.0f * (lon + ha) - eqTime) * 4.0f);
+    table.set[yday] = (int16_t)lroundf((720.0f - 4.0f * (lon - ha) - eqTime) * 4.0f);
+  }
+
+  table.version = ALMANAC_VERSION;
+  table.latE4 = solarState.latE4;
+  table.lonE4 = solarState.lonE4;
+  table.year = year;
+}
+
+// Make sure the table matches the location and year; regenerates and persists if not
+static void solarEnsureTable(int32_t year)
+{
+  const Almanac &table = solarState.table;
+  if (!solarState.hasLocation ||
+      (table.version == ALMANAC_VERSION && table.year == year && table.latE4 == solarState.latE4 && table.lonE4 == solarState.lonE4))
+    return;
+
+  unsigned long start = micros();
+  solarComputeYear(year);
+  preferences.putBytes("almanac", &solarState.table, sizeof(Almanac));
+  Serial.printf("Almanac for %d generated in %lu us\n", (int)year, micros() - start);
+}
+
+void loadAlmanac()
+{
+  if (preferences.getBytesLength("almanac") != sizeof(Almanac) ||
+      preferences.getBytes("almanac", &solarState.table, sizeof(Almanac)) != sizeof(Almanac))
+    solarState.table.version = 0;
+}
+
+// Today's sunrise/sunset instants, refreshed once per local day
+void solarRefreshDay(const struct tm &local)
+{
+  int32_t key = local.tm_year * 400 + local.tm_yday;
+  if (key == solarState.cachedDay)
+    return;
+  solarState.cachedDay = key;
+  solarState.riseAt = 0;
+  solarState.setAt = 0;
+  if (!solarState.hasLocation)
+    return;
+
+  int32_t year = local.tm_year + 1900;
+  solarEnsureTable(year);
+  time_t midnightUtc = (time_t)daysFromCivil(year, local.tm_mon + 1, local.tm_mday) * 86400;
+  int16_t rise = solarState.table.rise[local.tm_yday];
+  int16_t set = solarState.table.set[local.tm_yday];
+  if (rise != SOLAR_NONE)
+    solarState.riseAt = midnightUtc + rise * 15;
+  if (set != SOLAR_NONE)
+    solarState.setAt = midnightUtc + set * 15;
+}
+
+// Force the next solarRefreshDay() to recompute (location or zone changed)
+void solarInvalidate()
+{
+  solarState.cachedDay = -1;
+}
+
+// Sunrise-relative alarm for today, or 0 to use the fixed alarm time
+time_t solarAlarmToday(const struct tm &local)
+{
+  if (!(solarState.alarmDays & (1 << local.tm_wday)))
+    return 0;
+  solarRefreshDay(local);
+  return solarState.riseAt ? solarState.riseAt + solarState.alarmOffsetMinutes * 60 : 0;
+}
+
+// Sunset-relative wind-down start for today, or 0 to use the fixed schedule
+time_t solarSunsetToday(const struct tm &local)
+{
+  if (!solarState.sunsetFollow)
+    return 0;
+  solarRefreshDay(local);
+  return solarState.setAt ? solarState.setAt + solarState.sunsetOffsetMinutes * 60 : 0;
+}
+
+// ============ CIRCADIAN ============
+// The curve is piecewise linear in mireds between keypoints, so within a
+// segment both channels move monotonically. After each output change a binary
+// search finds the second at which the next duty value changes and the engine
+// sleeps until then; between changes a tick costs one millis() comparison.
+
+// Colour temperature at a second of the local day
+int circadianKelvinAt(int32_t second)
+{
+  int i = 1;
+  while (i < CIRCADIAN_POINTS - 1 && CIRCADIAN_CURVE[i].minute * 60 <= second)
+    i++;
+  const CircadianPoint &a = CIRCADIAN_CURVE[i - 1];
+  const CircadianPoint &b = CIRCADIAN_CURVE[i];
+  float t = (float)(second - a.minute * 60) / ((b.minute - a.minute) * 60);
+  float mired = 1e6f / a.kelvin + (1e6f / b.kelvin - 1e6f / a.kelvin) * t;
+  return (int)(1e6f / mired + 0.5f);
+}
+
+// End of the curve segment containing `second`
+static int32_t circadianSegmentEnd(int32_t second)
+{
+  for (int i = 1; i < CIRCADIAN_POINTS; i++)
+    if (CIRCADIAN_CURVE[i].minute * 60 > second)
+      return CIRCADIAN_CURVE[i].minute * 60;
+  return 86400;
+}
+
+static void circadianChannelsAt(int32_t second, int &warm, int &cool)
+{
+  cctToChannels(circadianKelvinAt(second), circadianState.level, warm, cool);
+}
+
+// First second after `from` where either channel differs (or the segment end)
+static int32_t circadianNextChange(int32_t from, int warm, int cool)
+{
+  int32_t lo = from, hi = circadianSegmentEnd(from);
+  int w, c;
+  circadianChannelsAt(hi - 1, w, c);
+  if (w == warm && c == cool)
+    return hi;
+  while (hi - lo > 1)
+  {
+    int32_t mid = lo + (hi - lo) / 2;
+    circadianChannelsAt(mid, w, c);
+    if (w == warm && c == cool)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+void saveCircadianSettings()
+{
+  preferences.putBool("circ_on", circadianState.enabled);
+  preferences.putInt("circ_level", circadianState.level);
+  preferences.putInt("circ_ovr", circadianState.overrideMinutes);
+}
+
+// Saved, so a power cut at night does not turn a switched-off light back on
+static void circadianSetSuspended(bool suspended)
+{
+  if (circadianState.suspended == suspended)
+    return;
+  circadianState.suspended = suspended;
+  preferences.putBool("circ_off", suspended);
+}
+
+// Another feature took the output; hand it back after the override timeout.
+// Anything that turns the light on ends a suspension.
+void circadianOverride()
+{
+  if (!circadianState.enabled)
+    return;
+  circadianSetSuspended(false);
+  circadianState.overridden = true;
+  circadianState.blend = true;
+  circadianState.wakeMillis = millis() + (unsigned long)circadianState.overrideMinutes * 60 * 1000;
+}
+
+// The light was switched off (manual off, auto-off, end of a sunset): stay off
+// instead of blending back to the curve after the override timeout
+void circadianSuspend()
+{
+  if (!circadianState.enabled)
+    return;
+  circadianSetSuspended(true);
+  circadianState.overridden = false;
+}
+
+// Enable or disable the mode; enabling blends to the curve on the next tick
+void setCircadianEnabled(bool enabled)
+{
+  circadianState.enabled = enabled;
+  circadianSetSuspended(false);
+  circadianState.overridden = false;
+  circadianState.blend = true;
+  circadianState.wakeMillis = millis();
+}
+
+// Follow the curve when an output change is due (called from loop)
+void updateCircadian()
+{
+  if (!circadianState.enabled || circadianState.suspended || (long)(millis() - circadianState.wakeMillis) < 0)
+    return;
+
+  // Another transition still owns the output (e.g. an effect outlived the override)
+  if (!timeIsValid() || alarmState.isSunriseActive || alarmState.isManualFadeActive || sunsetState.active ||
+      snoozeState.active || programState.active || effectState.vm.running)
+  {
+    circadianState.wakeMillis = millis() + CIRCADIAN_RETRY_MS;
+    return;
+  }
+  circadianState.overridden = false;
+
+  struct tm local;
+  tzLocalTime(time(nullptr), &local);
+  int32_t second = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+  int warm, cool;
+  circadianChannelsAt(second, warm, cool);
+
+  unsigned long sleepMs = (unsigned long)(circadianNextChange(second, warm, cool) - second) * 1000;
+  if (sleepMs > CIRCADIAN_MAX_SLEEP_MS)
+    sleepMs = CIRCADIAN_MAX_SLEEP_MS; // re-read the clock now and then (DST, clock steps)
+
+  if (circadianState.blend)
+  {
+    // Back from an override or just enabled - fade instead of jumping
+    beginFade(alarmState.currentWarmBrightness, alarmState.currentCoolBrightness, levelFromBrightness(warm),
+              levelFromBrightness(cool), CIRCADIAN_BLEND_MS, millis(), EASING_SINE);
+    circadianState.blend = false;
+    if (sleepMs < CIRCADIAN_BLEND_MS)
+      sleepMs = CIRCADIAN_BLEND_MS;
+  }
+  else if (levelFromBrightness(warm) != alarmState.currentWarmBrightness ||
+           levelFromBrightness(cool) != alarmState.currentCoolBrightness)
+  {
+    setBrightness(levelFromBrightness(warm), levelFromBrightness(cool));
+  }
+
+  circadianState.updates++;
+  circadianState.wakeMillis = millis() + sleepMs;
+}
+
+// ============ GROUP SYNC ============
+// Lights in a group share one timebase: the leader's clock. Followers measure
+// their offset to it PTP-style (t1 request sent, t2 leader receive, t3 leader
+// send, t4 response received) and keep the sample with the smallest round trip
+// out of the last few. Packets are handled in their own task with a blocking
+// socket, so timestamps are taken on arrival rather than on the next loop tick.
+// With API_TOKEN set every packet is signed, and unsigned ones are dropped.
+
+static int64_t groupLocalUs()
+{
+  return esp_timer_get_time();
+}
+
+// Shared group time in microseconds (the local clock until a leader is found)
+int64_t groupNowUs()
+{
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  int64_t offset = groupState.offsetUs;
+  xSemaphoreGive(groupLock);
+  return groupLocalUs() + offset;
+}
+
+// True when transitions can be placed on the group timebase
+bool groupIsSynced()
+{
+  if (groupState.sock < 0) // only opened when GROUP_ENABLED
+    return false;
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  bool synced = groupState.hasTimebase &&
+                (groupState.leaderId == groupState.nodeId ||
+                 (groupState.lastSyncMillis != 0 && millis() - groupState.lastSyncMillis < GROUP_PEER_TIMEOUT_MS));
+  xSemaphoreGive(groupLock);
+  return synced;
+}
+
+// HMAC-SHA256 (RFC 2104)
+static void groupHmac(const uint8_t *key, size_t keyLen, const uint8_t *data, size_t len, uint8_t out[32])
+{
+  uint8_t block[64] = {};
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  if (keyLen > sizeof(block))
+  {
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, key, keyLen);
+    mbedtls_sha256_finish_ret(&sha, block);
+  }
+  else
+  {
+    memcpy(block, key, keyLen);
+  }
+
+  uint8_t pad[64];
+  for (size_t i = 0; i < sizeof(pad); i++)
+    pad[i] = block[i] ^ 0x36;
+  mbedtls_sha256_starts_ret(&sha, 0);
+  mbedtls_sha256_update_ret(&sha, pad, sizeof(pad));
+  mbedtls_sha256_update_ret(&sha, data, len);
+  mbedtls_sha256_finish_ret(&sha, out);
+
+  for (size_t i = 0; i < sizeof(pad); i++)
+    pad[i] = block[i] ^ 0x5c;
+  mbedtls_sha256_starts_ret(&sha, 0);
+  mbedtls_sha256_update_ret(&sha, pad, sizeof(pad));
+  mbedtls_sha256_update_ret(&sha, out, 32);
+  mbedtls_sha256_finish_ret(&sha, out);
+  mbedtls_sha256_free(&sha);
+}
+
+// Tag of a packet under the group key (all zero when the API is open)
+static void groupTag(const GroupPacket &packet, uint8_t tag[GROUP_TAG_BYTES])
+{
+  memset(tag, 0, GROUP_TAG_BYTES);
+  if (API_TOKEN[0] == '\0')
+    return;
+  const char *key = GROUP_KEY[0] != '\0' ? GROUP_KEY : API_TOKEN;
+  uint8_t mac[32];
+  groupHmac((const uint8_t *)key, strlen(key), (const uint8_t *)&packet, offsetof(GroupPacket, tag), mac);
+  memcpy(tag, mac, GROUP_TAG_BYTES);
+}
+
+static bool groupTagValid(const GroupPacket &packet)
+{
+  uint8_t tag[GROUP_TAG_BYTES];
+  groupTag(packet, tag);
+  uint8_t diff = 0; // constant time, so a forger learns nothing from timing
+  for (int i = 0; i < GROUP_TAG_BYTES; i++)
+    diff |= tag[i] ^ packet.tag[i];
+  return diff == 0;
+}
+
+static void groupSend(GroupPacket &packet)
+{
+  packet.magic = GROUP_MAGIC;
+  packet.flags = groupState.hasTimebase ? GROUP_FLAG_TIMEBASE : 0;
+  packet.nodeId = groupState.nodeId;
+  packet.seq = groupState.txSeq++;
+  groupTag(packet, packet.tag);
+  sendto(groupState.sock, &packet, sizeof(packet), 0, (struct sockaddr *)&groupState.groupAddr, sizeof(groupState.groupAddr));
+}
+
+// Leader is the lowest node ID heard recently among the lights that hold the
+// timebase (including ourselves). A light that boots, even with a lower ID,
+// syncs to the current leader before it may lead, so a change of leader
+// never moves the group clock under a running transition. Only when no
+// holder has been heard for a peer timeout does the lowest ID found one.
+static void groupElectLeader()
+{
+  uint32_t leader = groupState.hasTimebase ? groupState.nodeId : 0;
+  bool lowest = true; // no light heard with a lower ID than ours
+  int alive = 0;
+  for (int i = 0; i < GROUP_MAX_PEERS; i++)
+  {
+    GroupPeer &peer = groupState.peers[i];
+    if (peer.id == 0)
+      continue;
+    if (millis() - peer.lastSeen > GROUP_PEER_TIMEOUT_MS)
+    {
+      peer.id = 0;
+      continue;
+    }
+    alive++;
+    if (peer.id < groupState.nodeId)
+      lowest = false;
+    if (peer.timebase && (leader == 0 || peer.id < leader))
+      leader = peer.id;
+  }
+  groupState.peerCount = alive;
+
+  if (leader == 0 && lowest && millis() - groupState.startedMillis >= GROUP_PEER_TIMEOUT_MS)
+  {
+    groupState.hasTimebase = true; // our clock becomes the group's
+    leader = groupState.nodeId;
+  }
+
+  if (leader != groupState.leaderId)
+  {
+    // Our current offset is kept: a light only leads once it has synced (or
+    // founded the timebase), so a new leader continues the old timebase
+    groupState.leaderId = leader;
+    groupState.sampleCount = 0;
+    Serial.printf("Group: leader is %08x%s\n", (unsigned)leader, leader == groupState.nodeId ? " (us)" : "");
+  }
+}
+
+static void groupNotePeer(uint32_t id, uint8_t flags)
+{
+  int slot = -1;
+  for (int i = 0; i < GROUP_MAX_PEERS; i++)
+  {
+    if (groupState.peers[i].id == id)
+    {
+      slot = i;
+      break;
+    }
+    if (slot == -1 && groupState.peers[i].id == 0)
+      slot = i;
+  }
+  if (slot == -1)
+    return; // group full
+  groupState.peers[slot].id = id;
+  groupState.peers[slot].lastSeen = millis();
+  groupState.peers[slot].timebase = (flags & GROUP_FLAG_TIMEBASE) != 0;
+}
+
+// Offset sample from one request/response exchange (groupLock held)
+static void groupAddSample(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+  int64_t delay = ((t4 - t1) - (t3 - t2)) / 2;
+  int64_t offset = ((t2 - t1) + (t3 - t4)) / 2;
+  if (delay < 0)
+    return;
+
+  groupState.sampleOffset[groupState.sampleIndex] = offset;
+  groupState.sampleDelay[groupState.sampleIndex] = delay;
+  groupState.sampleIndex = (groupState.sampleIndex + 1) % GROUP_SYNC_SAMPLES;
+  if (groupState.sampleCount < GROUP_SYNC_SAMPLES)
+    groupState.sampleCount++;
+
+  // Queueing only ever adds delay, so the fastest exchange is the most accurate
+  int best = 0;
+  for (int i = 1; i < groupState.sampleCount; i++)
+    if (groupState.sampleDelay[i] < groupState.sampleDelay[best])
+      best = i;
+  groupState.offsetUs = groupState.sampleOffset[best];
+  groupState.delayUs = groupState.sampleDelay[best];
+  groupState.lastSyncMillis = millis();
+  groupState.syncCount++;
+  groupState.hasTimebase = true;
+}
+
+static void groupHandlePacket(const GroupPacket &packet, int64_t rxLocalUs)
+{
+  if (packet.magic != GROUP_MAGIC || packet.nodeId == groupState.nodeId || !groupTagValid(packet))
+    return;
+
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  groupNotePeer(packet.nodeId, packet.flags);
+  bool isLeader = groupState.leaderId == groupState.nodeId;
+  int64_t offset = groupState.offsetUs;
+
+  switch (packet.type)
+  {
+  case GROUP_SYNC_REQUEST:
+    if (isLeader)
+    {
+      GroupPacket reply = {};
+      reply.type = GROUP_SYNC_RESPONSE;
+      reply.target = packet.nodeId;
+      reply.t1 = packet.t1;
+      reply.t2 = rxLocalUs + offset;
+      xSemaphoreGive(groupLock);
+      reply.t3 = groupLocalUs() + offset;
+      groupSend(reply);
+      return;
+    }
+    break;
+  case GROUP_SYNC_RESPONSE:
+    if (packet.target == groupState.nodeId && packet.nodeId == groupState.leaderId)
+      groupAddSample(packet.t1, packet.t2, packet.t3, rxLocalUs);
+    break;
+  case GROUP_START_SUNRISE:
+  case GROUP_START_SUNSET:
+    groupState.rxType = packet.type;
+    groupState.rxStartUs = packet.startUs;
+    groupState.rxMinutes = packet.minutes;
+    break;
+  }
+  xSemaphoreGive(groupLock);
+}
+
+void groupTask(void *param)
+{
+  unsigned long lastBeacon = 0;
+  for (;;)
+  {
+    GroupPacket packet;
+    int received = recv(groupState.sock, &packet, sizeof(packet), 0); // times out after GROUP_RECV_TIMEOUT_MS
+    int64_t rxLocalUs = groupLocalUs();
+    if (received == (int)sizeof(packet))
+      groupHandlePacket(packet, rxLocalUs);
+
+    // Transition starts queued by loop() - the socket is only used from this task
+    xSemaphoreTake(groupLock, portMAX_DELAY);
+    GroupPacket announce = groupState.txAnnounce;
+    groupState.txAnnounce.type = GROUP_NONE;
+    xSemaphoreGive(groupLock);
+    if (announce.type != GROUP_NONE)
+      groupSend(announce);
+
+    if (millis() - lastBeacon < GROUP_BEACON_MS)
+      continue;
+    lastBeacon = millis();
+
+    xSemaphoreTake(groupLock, portMAX_DELAY);
+    groupElectLeader();
+    bool hasLeader = groupState.leaderId != 0 && groupState.leaderId != groupState.nodeId;
+    xSemaphoreGive(groupLock);
+
+    GroupPacket beacon = {};
+    beacon.type = GROUP_BEACON;
+    groupSend(beacon);
+
+    if (hasLeader)
+    {
+      GroupPacket request = {};
+      request.type = GROUP_SYNC_REQUEST;
+      request.t1 = groupLocalUs();
+      groupSend(request);
+    }
+  }
+}
+
+void setupGroup()
+{
+  groupLock = xSemaphoreCreateMutex();
+  if (!GROUP_ENABLED)
+    return;
+
+  groupState.nodeId = (uint32_t)ESP.getEfuseMac() ^ (uint32_t)(ESP.getEfuseMac() >> 32);
+  groupState.leaderId = 0; // listen for a light that holds the timebase first
+  groupState.startedMillis = millis();
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+  {
+    Serial.println("Group: socket failed");
+    return;
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in bindAddr = {};
+  bindAddr.sin_family = AF_INET;
+  bindAddr.sin_port = htons(GROUP_PORT);
+  bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  struct ip_mreq membership = {};
+  membership.imr_multiaddr.s_addr = inet_addr(GROUP_MULTICAST_ADDR);
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+  uint8_t ttl = 1;
+  struct timeval timeout = {0, GROUP_RECV_TIMEOUT_MS * 1000};
+  if (bind(sock, (struct sockaddr *)&bindAddr, sizeof(bindAddr)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+  {
+    Serial.println("Group: multicast setup failed");
+    closesocket(sock);
+    return;
+  }
+
+  groupState.groupAddr.sin_family = AF_INET;
+  groupState.groupAddr.sin_port = htons(GROUP_PORT);
+  groupState.groupAddr.sin_addr.s_addr = inet_addr(GROUP_MULTICAST_ADDR);
+  groupState.sock = sock;
+
+  xTaskCreatePinnedToCore(groupTask, "group", GROUP_TASK_STACK, nullptr, 2, &groupTaskHandle, GROUP_TASK_CORE);
+  Serial.printf("Group: node %08x on %s:%d\n", (unsigned)groupState.nodeId, GROUP_MULTICAST_ADDR, GROUP_PORT);
+}
+
+static void groupQueueAnnounce(uint8_t type, int64_t startUs, int minutes)
+{
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  groupState.txAnnounce.type = type;
+  groupState.txAnnounce.startUs = startUs;
+  groupState.txAnnounce.minutes = minutes;
+  xSemaphoreGive(groupLock);
+}
+
+// Tell the group a sunrise just started here and place it on the group timebase
+void groupAnnounceSunrise()
+{
+  if (!groupIsSynced())
+    return;
+  groupState.sunriseStartUs = groupNowUs();
+  groupQueueAnnounce(GROUP_START_SUNRISE, groupState.sunriseStartUs, 0);
+}
+
+void groupAnnounceSunset(int minutes)
+{
+  if (!groupIsSynced())
+    return;
+  groupState.sunsetStartUs = groupNowUs();
+  groupQueueAnnounce(GROUP_START_SUNSET, groupState.sunsetStartUs, minutes);
+}
+
+// A group sunrise only starts this light when it would have woken anyway:
+// its own alarm is due within the join window, it is not snoozed, and nothing
+// else has the output (manual use, a program, an effect, a sunset)
+static bool groupMayJoinSunrise()
+{
+  return alarmDueWithin(GROUP_JOIN_WINDOW_MINUTES) && !snoozeState.active && !alarmState.isManualFadeActive &&
+         !programState.active && !effectState.vm.running && !sunsetState.active &&
+         alarmState.currentWarmBrightness == 0 && alarmState.currentCoolBrightness == 0;
+}
+
+// Apply transitions started by other lights and keep the sunset on group time (called from loop)
+void updateGroup()
+{
+  if (groupState.sock < 0) // only opened when GROUP_ENABLED
+    return;
+
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  uint8_t type = groupState.rxType;
+  int64_t startUs = groupState.rxStartUs;
+  int minutes = groupState.rxMinutes;
+  groupState.rxType = GROUP_NONE;
+  xSemaphoreGive(groupLock);
+
+  int64_t now = groupNowUs();
+  // (a start ahead of our clock by more than the sync error is not believed)
+  if (type == GROUP_START_SUNRISE && now - startUs < (int64_t)SUNRISE_DURATION_MS * 1000 &&
+      startUs - now < (int64_t)GROUP_BEACON_MS * 1000)
+  {
+    // Join if our own alarm is about to fire, or move the sunrise we started
+    // to an earlier start if two lights fired within the same minute
+    if (!alarmState.isSunriseActive && groupMayJoinSunrise())
+    {
+      snoozeState.count = 0; // fresh snooze allowance, as for our own alarm
+      startSunrise();
+      groupState.sunriseStartUs = startUs;
+    }
+    else if (alarmState.isSunriseActive && groupState.sunriseStartUs != 0 && startUs < groupState.sunriseStartUs)
+    {
+      groupState.sunriseStartUs = startUs;
+    }
+  }
+  else if (type == GROUP_START_SUNSET && minutes >= SUNSET_MIN_MINUTES && minutes <= SUNSET_MAX_MINUTES &&
+           now - startUs < (int64_t)minutes * 60 * 1000000)
+  {
+    if (!sunsetState.active || (groupState.sunsetStartUs != 0 && startUs < groupState.sunsetStartUs))
+    {
+      if (!sunsetState.active)
+      {
+        cancelSnooze();
+        startSunset(minutes);
+      }
+      groupState.sunsetStartUs = startUs;
+    }
+  }
+
+  // Sunset elapsed time is measured from startMillis - pin it to the group start
+  if (sunsetState.active && !sunsetState.needsResync && groupState.sunsetStartUs != 0)
+    sunsetState.startMillis = millis() - (uint32_t)((now - groupState.sunsetStartUs) / 1000);
+}
+
+// ============ EVENT LOG ============
+// A journal of what the light did, for "the alarm didn't go off" reports.
+// Fixed-size records are appended to a ring of flash sectors. A sector is
+// erased only when the head wraps round to it, so all sectors wear evenly.
+// Records from any task are staged in RAM and written from loop() a page at
+// a time. The sector holding the head always has an erased tail, so an
+// append never needs a read-modify-write.
+
+static uint8_t eventCheck(const EventRecord &record)
+{
+  const uint8_t *bytes = (const uint8_t *)&record;
+  uint8_t check = 0xA5; // an all-zero record is not valid
+  for (size_t i = 0; i < sizeof(EventRecord); i++)
+  {
+    if (i != offsetof(EventRecord, check))
+      check = (uint8_t)((check << 1) | (check >> 7)) ^ bytes[i];
+  }
+  return check;
+}
+
+static bool eventValid(const EventRecord &record)
+{
+  return record.seq != 0xFFFFFFFF && record.check == eventCheck(record);
+}
+
+static bool eventErased(const EventRecord &record)
+{
+  const uint8_t *bytes = (const uint8_t *)&record;
+  for (size_t i = 0; i < sizeof(EventRecord); i++)
+  {
+    if (bytes[i] != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+static bool eventReadFirst(uint32_t sector, EventRecord &record)
+{
+  return esp_partition_read(eventLog.partition, sector * EVENT_SECTOR_SIZE, &record, sizeof(record)) == ESP_OK &&
+         eventValid(record);
+}
+
+static void eventEraseSector(uint32_t sector)
+{
+  esp_partition_erase_range(eventLog.partition, sector * EVENT_SECTOR_SIZE, EVENT_SECTOR_SIZE);
+  eventLog.erases++;
+}
+
+// Find the head: the first erased slot in the sector with the newest records
+void setupEventLog()
+{
+  eventLog.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)EVENT_LOG_SUBTYPE, EVENT_LOG_PARTITION);
+  if (eventLog.partition == nullptr || eventLog.partition->size < 2 * EVENT_SECTOR_SIZE)
+  {
+    eventLog.partition = nullptr;
+    Serial.println("No event log partition - events are not recorded");
+    return;
+  }
+  eventLog.sectorCount = eventLog.partition->size / EVENT_SECTOR_SIZE;
+
+  int32_t newest = -1;
+  uint32_t newestSeq = 0;
+  for (uint32_t sector = 0; sector < eventLog.sectorCount; sector++)
+  {
+    EventRecord first;
+    if (eventReadFirst(sector, first) && (newest < 0 || first.seq > newestSeq))
+    {
+      newest = sector;
+      newestSeq = first.seq;
+    }
+  }
+
+  if (newest < 0)
+  {
+    // Blank or reused partition: start clean so old data never parses as records
+    Serial.println("Formatting event log...");
+    esp_partition_erase_range(eventLog.partition, 0, eventLog.sectorCount * EVENT_SECTOR_SIZE);
+    eventLog.head = 0;
+  }
+  else
+  {
+    uint32_t offset = newest * EVENT_SECTOR_SIZE;
+    uint32_t end = offset + EVENT_SECTOR_SIZE;
+    bool found = false;
+    while (offset < end && !found)
+    {
+      EventRecord page[EVENT_PAGE_RECORDS];
+      esp_partition_read(eventLog.partition, offset, page, sizeof(page));
+      for (int i = 0; i < EVENT_PAGE_RECORDS && !found; i++)
+      {
+        if (eventErased(page[i]))
+          found = true;
+        else if (eventValid(page[i]))
+          eventLog.nextSeq = page[i].seq + 1; // a torn record is skipped, its slot stays used
+        if (!found)
+          offset += sizeof(EventRecord);
+      }
+    }
+    eventLog.head = offset;
+    if (!found)
+    {
+      // Newest sector is full - move on to the next (oldest) one
+      eventLog.head = end % (eventLog.sectorCount * EVENT_SECTOR_SIZE);
+      eventEraseSector(eventLog.head / EVENT_SECTOR_SIZE);
+    }
+  }
+
+  Serial.printf("Event log: %u sectors, next record #%u\n", eventLog.sectorCount, eventLog.nextSeq);
+  logEvent(EVENT_BOOT, esp_reset_reason());
+  flushEventLog();
+}
+
+// Stage a record (any task, never blocks on flash)
+void logEvent(EventType type, uint16_t arg, int32_t value)
+{
+  if (eventLog.partition == nullptr)
+    return;
+
+  EventRecord record;
+  time_t now = time(nullptr);
+  record.time = now >= TIME_VALID_AFTER ? (uint32_t)now : millis() / 1000;
+  record.type = type;
+  record.arg = arg;
+  record.value = value;
+
+  portENTER_CRITICAL(&eventLock);
+  if (eventLog.pendingCount < EVENT_PENDING_MAX)
+  {
+    record.seq = eventLog.nextSeq++;
+    record.check = eventCheck(record);
+    if (eventLog.pendingCount == 0)
+      eventLog.pendingSince = millis();
+    eventLog.pending[eventLog.pendingCount++] = record;
+  }
+  else
+  {
+    eventLog.dropped++;
+  }
+  portEXIT_CRITICAL(&eventLock);
+}
+
+// Append everything staged, one write per run that fits in the head's sector
+void flushEventLog()
+{
+  if (eventLog.partition == nullptr)
+    return;
+
+  EventRecord batch[EVENT_PENDING_MAX];
+  portENTER_CRITICAL(&eventLock);
+  int count = eventLog.pendingCount;
+  memcpy(batch, eventLog.pending, count * sizeof(EventRecord));
+  eventLog.pendingCount = 0;
+  portEXIT_CRITICAL(&eventLock);
+  if (count == 0)
+    return;
+
+  uint32_t ringSize = eventLog.sectorCount * EVENT_SECTOR_SIZE;
+  int done = 0;
+  while (done < count)
+  {
+    uint32_t sectorEnd = (eventLog.head / EVENT_SECTOR_SIZE + 1) * EVENT_SECTOR_SIZE;
+    int n = std::min<int>(count - done, (sectorEnd - eventLog.head) / sizeof(EventRecord));
+    esp_partition_write(eventLog.partition, eventLog.head, &batch[done], n * sizeof(EventRecord));
+    eventLog.head += n * sizeof(EventRecord);
+    done += n;
+
+    if (eventLog.head == sectorEnd)
+    {
+      // Sector full: erase the oldest one now, so the head's sector stays writable
+      eventLog.head %= ringSize;
+      eventEraseSector(eventLog.head / EVENT_SECTOR_SIZE);
+    }
+  }
+  eventLog.flushes++;
+}
+
+// Flush once a page is full, or when the oldest staged record has waited long enough (called from loop)
+void updateEventLog()
+{
+  portENTER_CRITICAL(&eventLock);
+  int count = eventLog.pendingCount;
+  unsigned long since = eventLog.pendingSince;
+  portEXIT_CRITICAL(&eventLock);
+
+  if (count >= EVENT_PAGE_RECORDS || (count > 0 && millis() - since >= EVENT_FLUSH_MS))
+    flushEventLog();
+}
+
+static const char *eventTypeName(uint8_t type)
+{
+  static const char *names[EVENT_TYPE_COUNT] = {"none",       "boot",     "alarm_fired", "sunrise_complete", "manual_on",
+                                                "manual_off", "auto_off", "wifi_drop",   "wifi_connected",   "time_sync",
+                                                "loop_stall", "resource_alert"};
+  return type < EVENT_TYPE_COUNT ? names[type] : "unknown";
+}
+
+static const char *resetReasonName(int reason)
+{
+  switch (reason)
+  {
+  case ESP_RST_POWERON:
+    return "power_on";
+  case ESP_RST_EXT:
+    return "external";
+  case ESP_RST_SW:
+    return "software";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "interrupt_watchdog";
+  case ESP_RST_TASK_WDT:
+    return "task_watchdog";
+  case ESP_RST_WDT:
+    return "watchdog";
+  case ESP_RST_DEEPSLEEP:
+    return "deep_sleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  default:
+    return "unknown";
+  }
+}
+
+// Each chunk of a long listing to a slow client is progress, not a stall
+static void eventSendChunk(const String &chunk)
+{
+  server.sendContent(chunk);
+  stallProgress();
+}
+
+// GET /events?since=<seq>&limit=<n> - records after "since", oldest first.
+// Streamed a flash page at a time, so a long query never holds the log in RAM.
+void handleEvents()
+{
+  if (eventLog.partition == nullptr)
+  {
+    server.send(503, "text/plain", "No event log partition");
+    return;
+  }
+
+  uint32_t since = server.hasArg("since") ? strtoul(server.arg("since").c_str(), nullptr, 10) : 0;
+  int limit = server.hasArg("limit") ? server.arg("limit").toInt() : EVENT_QUERY_DEFAULT;
+  if (limit < 1 || limit > EVENT_QUERY_MAX)
+  {
+    server.send(400, "text/plain", "limit must be 1-" + String(EVENT_QUERY_MAX));
+    return;
+  }
+
+  flushEventLog(); // include records still staged in RAM
+
+  // Once the ring has wrapped, the oldest records are in the sector after the head
+  uint32_t ringSize = eventLog.sectorCount * EVENT_SECTOR_SIZE;
+  uint32_t headSector = eventLog.head / EVENT_SECTOR_SIZE;
+  uint32_t sector = (headSector + 1) % eventLog.sectorCount;
+  EventRecord first;
+  if (!eventReadFirst(sector, first))
+    sector = 0;
+
+  // Skip whole sectors that end before "since"
+  while (sector != headSector)
+  {
+    uint32_t next = (sector + 1) % eventLog.sectorCount;
+    if (!eventReadFirst(next, first) || first.seq > since)
+      break;
+    sector = next;
+  }
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  eventSendChunk("{\"events\":[");
+
+  uint32_t offset = sector * EVENT_SECTOR_SIZE;
+  uint32_t last = since;
+  int count = 0;
+  bool more = false;
+  while (offset != eventLog.head && !more)
+  {
+    uint32_t available = (offset < eventLog.head ? eventLog.head : ringSize) - offset;
+    int n = std::min<int>(EVENT_PAGE_RECORDS, available / sizeof(EventRecord));
+    EventRecord page[EVENT_PAGE_RECORDS];
+    esp_partition_read(eventLog.partition, offset, page, n * sizeof(EventRecord));
+
+    String chunk;
+    for (int i = 0; i < n; i++)
+    {
+      const EventRecord &record = page[i];
+      if (!eventValid(record) || record.seq <= since)
+        continue;
+      if (count == limit)
+      {
+        more = true;
+        break;
+      }
+      chunk += String(count ? "," : "") + "{\"seq\":" + String(record.seq) + ",\"time\":" + String(record.time) +
+               ",\"type\":\"" + eventTypeName(record.type) + "\",\"arg\":" + String(record.arg) +
+               ",\"value\":" + String(record.value);
+      if (record.type == EVENT_BOOT)
+        chunk += String(",\"reason\":\"") + resetReasonName(record.arg) + "\"";
+      chunk += "}";
+      last = record.seq;
+      count++;
+    }
+    if (chunk.length())
+      eventSendChunk(chunk);
+
+    offset = (offset + n * sizeof(EventRecord)) % ringSize;
+  }
+
+  eventSendChunk("],\"next\":" + String(last) + ",\"more\":" + (more ? "true" : "false") +
+                 ",\"dropped\":" + String(eventLog.dropped) + "}");
+  eventSendChunk(""); // end of the chunked response
+}
+
+// ============ STALL DETECTOR ============
+// loop() marks every tick and an esp_timer callback on core 0 checks the gap.
+// A gap of STALL_DETECT_MS is captured into RTC memory: the loop stage, the
+// HTTP handler that was running and loopTask's backtrace. If the stall lasts
+// STALL_ABORT_MS the detector panics. The panic handler then writes a core
+// dump of every task on both cores to flash before the reboot, and
+// GET /debug/last-crash reports both afterwards. Handlers that stream a long
+// response mark progress per chunk, and a stall in an HTTP handler is only
+// recorded: it is blocked on a client, and the client's write timeout ends it.
+
+static uint32_t stallRecordCheck(const StallRecord &record)
+{
+  return rtcChecksum(&record, offsetof(StallRecord, check));
+}
+
+// Walk the saved context of a task that is switched out
+static int stallBacktrace(TaskHandle_t task, uint32_t *out, int max)
+{
+  // pxTopOfStack is the first TCB member and points at the frame saved on the last switch
+  const XtExcFrame *exc = *(const XtExcFrame *const *)task;
+  esp_backtrace_frame_t frame = {};
+  if (exc->exit != 0)
+  {
+    // Preempted by an interrupt
+    frame.pc = exc->pc;
+    frame.sp = exc->a1;
+    frame.next_pc = exc->a0;
+  }
+  else
+  {
+    // Yielded: blocked on a queue, semaphore or delay
+    const XtSolFrame *sol = (const XtSolFrame *)exc;
+    frame.pc = sol->pc;
+    frame.sp = sol->a1;
+    frame.next_pc = sol->a0;
+  }
+
+  int depth = 0;
+  do
+  {
+    // Return addresses carry the call window size in the top bits
+    uint32_t pc = frame.pc;
+    if (pc & 0x80000000)
+      pc = (pc & 0x3FFFFFFF) | 0x40000000;
+    out[depth++] = pc - 3;
+  } while (depth < max && frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame));
+  return depth;
+}
+
+static void stallCapture(uint32_t stalledMs)
+{
+  StallRecord &record = stallRtc;
+  memset(&record, 0, sizeof(record));
+  record.magic = STALL_MAGIC;
+  time_t now = time(nullptr);
+  record.time = now >= TIME_VALID_AFTER ? (uint32_t)now : millis() / 1000;
+  record.uptimeMs = millis();
+  record.stalledMs = stalledMs;
+  record.stage = stallState.stage;
+  strlcpy(record.handler, stallState.handler, sizeof(record.handler));
+  strlcpy(record.core0Task, pcTaskGetName(xTaskGetCurrentTaskHandleForCPU(0)), sizeof(record.core0Task));
+  strlcpy(record.core1Task, pcTaskGetName(xTaskGetCurrentTaskHandleForCPU(1)), sizeof(record.core1Task));
+
+  // A running loopTask has no saved context; the core dump covers that case.
+  // Otherwise walk it, and keep the result only if it did not run meanwhile.
+  eTaskState state = eTaskGetState(stallState.loopTask);
+  record.taskState = state;
+  if (state != eRunning)
+  {
+    const void *top = *(const void *const *)stallState.loopTask;
+    int depth = stallBacktrace(stallState.loopTask, record.backtrace, STALL_BACKTRACE_DEPTH);
+    if (*(const void *const *)stallState.loopTask == top && eTaskGetState(stallState.loopTask) != eRunning)
+      record.depth = depth;
+  }
+  record.check = stallRecordCheck(record);
+}
+
+// esp_timer callback (esp_timer task, core 0)
+static void stallCheck(void *)
+{
+  uint32_t gapMs = (esp_timer_get_time() - stallState.lastProgressUs) / 1000;
+  if (gapMs < STALL_DETECT_MS)
+    return;
+
+  if (!stallState.capturing)
+  {
+    stallState.capturing = true;
+    stallState.stalls++;
+    stallCapture(gapMs);
+  }
+  stallRtc.stalledMs = gapMs;
+  stallRtc.aborted = gapMs >= STALL_ABORT_MS && stallState.stage != STAGE_HTTP;
+  stallRtc.check = stallRecordCheck(stallRtc);
+
+  // Panic rather than wait for a watchdog: the core dump shows where every task is
+  if (stallRtc.aborted)
+    esp_system_abort("loop() stalled");
+}
+
+// Start of every loop() tick
+void stallHeartbeat()
+{
+  int64_t now = esp_timer_get_time();
+  uint32_t gapMs = (now - stallState.lastTickUs) / 1000;
+  stallState.lastTickUs = now;
+  stallState.lastProgressUs = now;
+  stallState.stage = STAGE_HTTP;
+
+  if (gapMs > STALL_LATE_MS)
+    stallState.lateTicks++;
+  if (gapMs > stallState.maxTickMs)
+    stallState.maxTickMs = gapMs;
+  if (stallState.capturing)
+  {
+    stallState.capturing = false;
+    logEvent(EVENT_LOOP_STALL, stallRtc.stage, gapMs);
+  }
+}
+
+// A long-running handler is still moving (called per chunk sent)
+void stallProgress()
+{
+  stallState.lastProgressUs = esp_timer_get_time();
+}
+
+void setupStallDetector()
+{
+  // Keep the record from before this reset; RTC memory then holds this boot's
+  if (esp_reset_reason() != ESP_RST_POWERON && stallRtc.magic == STALL_MAGIC && stallRtc.check == stallRecordCheck(stallRtc))
+  {
+    stallState.previous = stallRtc;
+    stallState.hasPrevious = true;
+    if (stallRtc.aborted)
+      logEvent(EVENT_LOOP_STALL, stallRtc.stage, stallRtc.stalledMs); // never logged before the panic
+  }
+  stallRtc.magic = 0;
+
+  stallState.loopTask = xTaskGetCurrentTaskHandle(); // setup() runs in loopTask
+  stallState.lastTickUs = esp_timer_get_time();
+  stallState.lastProgressUs = stallState.lastTickUs;
+
+  esp_timer_create_args_t args = {};
+  args.callback = stallCheck;
+  args.name = "stall";
+  if (esp_timer_create(&args, &stallState.timer) != ESP_OK ||
+      esp_timer_start_periodic(stallState.timer, STALL_CHECK_MS * 1000) != ESP_OK)
+  {
+    Serial.println("Stall detector failed to start");
+    return;
+  }
+  if (stallState.hasPrevious)
+    Serial.printf("Loop stalled for %u ms before this reset (see /debug/last-crash)\n", stallState.previous.stalledMs);
+}
+
+static String stallHex(uint32_t value)
+{
+  char buf[12];
+  snprintf(buf, sizeof(buf), "0x%08x", value);
+  return buf;
+}
+
+static String stallBacktraceJson(const uint32_t *pcs, int depth)
+{
+  String json = "[";
+  for (int i = 0; i < depth; i++)
+    json += String(i ? "," : "") + "\"" + stallHex(pcs[i]) + "\"";
+  return json + "]";
+}
+
+static String stallRecordJson(const StallRecord &record)
+{
+  static const char *stages[STAGE_COUNT] = {"setup", "http", "lighting", "idle"};
+  static const char *states[] = {"running", "ready", "blocked", "suspended", "deleted"};
+  String json = "{\"time\":" + String(record.time) + ",\"uptimeMs\":" + String(record.uptimeMs) +
+                ",\"stalledMs\":" + String(record.stalledMs) + ",\"stage\":\"" +
+                (record.stage < STAGE_COUNT ? stages[record.stage] : "unknown") + "\",\"handler\":\"" + record.handler +
+                "\",\"loopTask\":\"" + (record.taskState < 5 ? states[record.taskState] : "unknown") + "\",\"core0\":\"" +
+                record.core0Task + "\",\"core1\":\"" + record.core1Task + "\",\"aborted\":" + (record.aborted ? "true" : "false");
+  return json + ",\"backtrace\":" + stallBacktraceJson(record.backtrace, record.depth) + "}";
+}
+
+// GET /debug/last-crash - reset reason, captured stalls and the core dump summary
+void handleLastCrash()
+{
+  String response = "{\"resetReason\":\"" + String(resetReasonName(esp_reset_reason())) + "\"";
+  response += ",\"previousStall\":" + (stallState.hasPrevious ? stallRecordJson(stallState.previous) : String("null"));
+  bool current = stallRtc.magic == STALL_MAGIC && stallRtc.check == stallRecordCheck(stallRtc);
+  response += ",\"currentStall\":" + (current ? stallRecordJson(stallRtc) : String("null"));
+
+  // Summary of the dump's crashed task; the full dump has every task (GET /debug/coredump)
+  size_t address = 0, size = 0;
+  esp_core_dump_summary_t summary;
+  if (esp_core_dump_image_get(&address, &size) == ESP_OK && esp_core_dump_get_summary(&summary) == ESP_OK)
+  {
+    response += ",\"coreDump\":{\"size\":" + String((unsigned)size) + ",\"task\":\"" + String(summary.exc_task) +
+                "\",\"pc\":\"" + stallHex(summary.exc_pc) + "\",\"backtrace\":" +
+                stallBacktraceJson(summary.exc_bt_info.bt, std::min<int>(summary.exc_bt_info.depth, 16)) +
+                ",\"corrupted\":" + (summary.exc_bt_info.corrupted ? "true" : "false") + "}";
+  }
+  else
+  {
+    response += ",\"coreDump\":null";
+  }
+
+  response += ",\"lateTicks\":" + String(stallState.lateTicks) + ",\"stalls\":" + String(stallState.stalls) +
+              ",\"maxTickMs\":" + String(stallState.maxTickMs) + "}";
+  server.send(200, "application/json", response);
+}
+
+static const esp_partition_t *coreDumpPartition()
+{
+  return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, nullptr);
+}
+
+// GET /debug/coredump - the raw ELF core dump, for espcoredump.py
+void handleCoreDump()
+{
+  size_t address = 0, size = 0;
+  const esp_partition_t *partition = coreDumpPartition();
+  if (partition == nullptr || esp_core_dump_image_get(&address, &size) != ESP_OK)
+  {
+    server.send(404, "text/plain", "No core dump");
+    return;
+  }
+
+  server.setContentLength(size);
+  server.send(200, "application/octet-stream", "");
+  uint8_t buf[1024];
+  for (size_t offset = 0; offset < size; offset += sizeof(buf))
+  {
+    size_t n = std::min(sizeof(buf), size - offset);
+    if (esp_partition_read(partition, address - partition->address + offset, buf, n) != ESP_OK)
+      break;
+    server.sendContent((const char *)buf, n);
+    stallProgress(); // a 64 KB dump over a weak link can take a while
+  }
+}
+
+// POST /debug/clear-crash - erase the core dump and forget captured stalls
+void handleClearCrash()
+{
+  const esp_partition_t *partition = coreDumpPartition();
+  if (partition != nullptr)
+    esp_partition_erase_range(partition, 0, partition->size);
+  stallState.hasPrevious = false;
+  stallRtc.magic = 0;
+  server.send(200, "text/plain", "Crash data cleared");
+}
+
+// ============ RESOURCE MONITOR ============
+// Counting wrappers around the C allocator (linked with -Wl,--wrap, see
+// platformio.ini). A return address would land inside String or the
+// WebServer for nearly every allocation, so the call site is the HTTP handler
+// or loop() stage that was running, or the task for everything else.
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+  void __real_free(void *ptr);
+
+  static int allocCallerSite()
+  {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (task == nullptr)
+      return ALLOC_SITE_SYSTEM; // before the scheduler starts
+    if (task == allocState.loopTask)
+    {
+      int handler = allocState.handlerSite;
+      return handler >= 0 ? handler : stallState.stage; // LoopStage lines up with the first sites
+    }
+    if (task == otaTaskHandle)
+      return ALLOC_SITE_OTA;
+    if (task == groupTaskHandle)
+      return ALLOC_SITE_GROUP;
+    return ALLOC_SITE_SYSTEM;
+  }
+
+  static void allocRecord(void *ptr, size_t size)
+  {
+    int site = allocCallerSite();
+    portENTER_CRITICAL(&allocLock);
+    if (ptr == nullptr)
+    {
+      allocState.failures++;
+    }
+    else
+    {
+      allocState.sites[site].count++;
+      allocState.sites[site].bytes += size;
+    }
+    portEXIT_CRITICAL(&allocLock);
+  }
+
+  void *__wrap_malloc(size_t size)
+  {
+    void *ptr = __real_malloc(size);
+    allocRecord(ptr, size);
+    return ptr;
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    void *ptr = __real_calloc(count, size);
+    allocRecord(ptr, count * size);
+    return ptr;
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    void *result = __real_realloc(ptr, size);
+    if (size > 0)
+    {
+      allocRecord(result, size);
+    }
+    else if (ptr != nullptr)
+    {
+      portENTER_CRITICAL(&allocLock);
+      allocState.frees++;
+      portEXIT_CRITICAL(&allocLock);
+    }
+    return result;
+  }
+
+  void __wrap_free(void *ptr)
+  {
+    if (ptr != nullptr)
+    {
+      portENTER_CRITICAL(&allocLock);
+      allocState.frees++;
+      portEXIT_CRITICAL(&allocLock);
+    }
+    __real_free(ptr);
+  }
+}
+
+const char *allocSiteName(int site)
+{
+  static const char *fixed[ALLOC_FIXED_SITES] = {"loop:setup", "loop:http", "loop:lighting", "loop:idle",
+                                                 "task:ota", "task:group", "system"};
+  return site < ALLOC_FIXED_SITES ? fixed[site] : allocState.sites[site].name;
+}
+
+// Attribute loopTask's allocations to this handler until allocLeaveHandler()
+void allocEnterHandler(const char *uri)
+{
+  int count = allocState.siteCount;
+  for (int site = ALLOC_FIXED_SITES; site < count; site++)
+  {
+    if (strcmp(allocState.sites[site].name, uri) == 0)
+    {
+      allocState.handlerSite = site;
+      return;
+    }
+  }
+  if (count == ALLOC_MAX_SITES)
+    return; // table full - counted under loop:http
+
+  // Only loop() adds sites; publish the count once the name is in place
+  strlcpy(allocState.sites[count].name, uri, sizeof(allocState.sites[count].name));
+  allocState.siteCount = count + 1;
+  allocState.handlerSite = count;
+}
+
+void allocLeaveHandler()
+{
+  allocState.handlerSite = -1;
+}
+
+void setupResourceMonitor()
+{
+  allocState.loopTask = xTaskGetCurrentTaskHandle(); // setup() runs in loopTask
+
+  static const char *names[MONITORED_TASKS] = {"loopTask", "ota", "group", "esp_timer", "tiT", "wifi"};
+  for (int i = 0; i < MONITORED_TASKS; i++)
+    resourceState.tasks[i] = {names[i], nullptr, 0, false};
+  resourceState.taskCount = MONITORED_TASKS;
+}
+
+static void resourceAlert(ResourceCheck check, int task, uint32_t value, const char *message)
+{
+  resourceState.alerts++;
+  logEvent(EVENT_RESOURCE_ALERT, check | (task << 8), value);
+  Serial.printf("Resource alert: %s (%u)\n", message, value);
+}
+
+// Edge-triggered threshold check; clears only once the value has recovered
+// past the hysteresis band, so a value hovering at the limit logs once
+static bool resourceThreshold(bool &active, bool crossed, bool recovered)
+{
+  bool raised = !active && crossed;
+  if (raised)
+    active = true;
+  else if (active && recovered)
+    active = false;
+  return raised;
+}
+
+// Sample task stack high-water marks and the heap, raising alerts on new crossings
+void sampleResources()
+{
+  for (int i = 0; i < resourceState.taskCount; i++)
+  {
+    MonitoredTask &task = resourceState.tasks[i];
+    if (task.handle == nullptr)
+    {
+      // Our tasks are known once created; system tasks are looked up by name (none are ever deleted)
+      task.handle = i == 0 ? allocState.loopTask : i == 1 ? otaTaskHandle : i == 2 ? groupTaskHandle : xTaskGetHandle(task.name);
+      if (task.handle == nullptr)
+        continue;
+    }
+    task.minFreeStack = uxTaskGetStackHighWaterMark(task.handle); // bytes on ESP-IDF
+    if (resourceThreshold(task.alert, task.minFreeStack < STACK_ALERT_BYTES, task.minFreeStack >= STACK_ALERT_BYTES * 5 / 4))
+      resourceAlert(RESOURCE_STACK, i, task.minFreeStack, (String(task.name) + " stack nearly exhausted").c_str());
+  }
+
+  resourceState.freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  resourceState.minFreeHeap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  resourceState.largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  resourceState.fragmentationPercent =
+      resourceState.freeHeap > 0 ? 100 - (int)((uint64_t)resourceState.largestFreeBlock * 100 / resourceState.freeHeap) : 0;
+
+  if (resourceThreshold(resourceState.heapLowAlert, resourceState.freeHeap < HEAP_ALERT_BYTES,
+                        resourceState.freeHeap >= HEAP_ALERT_BYTES * 5 / 4))
+    resourceAlert(RESOURCE_HEAP_LOW, 0, resourceState.freeHeap, "free heap low");
+  if (resourceThreshold(resourceState.fragmentedAlert, resourceState.fragmentationPercent >= HEAP_FRAGMENTATION_ALERT_PERCENT,
+                        resourceState.fragmentationPercent < HEAP_FRAGMENTATION_ALERT_PERCENT - 10))
+    resourceAlert(RESOURCE_HEAP_FRAGMENTED, 0, resourceState.fragmentationPercent, "heap fragmented");
+}
+
+void updateResourceMonitor()
+{
+  unsigned long now = millis();
+  if (resourceState.lastSampleTime != 0 && now - resourceState.lastSampleTime < RESOURCE_SAMPLE_MS)
+    return;
+  resourceState.lastSampleTime = now;
+  sampleResources();
+}
+
+// ============ SUNRISE LOGIC ============
+void startSunrise()
+{
+  Serial.println("Starting sunrise...");
+  stopSunset();
+  groupState.sunriseStartUs = 0;
+  stopProgram();
+  stopEffect();
+  circadianOverride();
+  alarmState.isSunriseActive = true;
+  alarmState.sunriseProgress = ambientBeginSunrise() / 65536.0f;
+  alarmState.lastSunriseUpdate = millis();
+  if (alarmState.sunriseProgress > 0.0f)
+    Serial.printf("Room already lit - skipping to %.0f%%\n", alarmState.sunriseProgress * 100.0f);
+}
+
+// Continue a sunrise from saved progress (after a snooze)
+void resumeSunrise(float progress)
+{
+  Serial.printf("Resuming sunrise at %.0f%%\n", progress * 100.0f);
+  groupState.sunriseStartUs = 0;
+  ambientBeginSunrise();
+  stopProgram();
+  stopEffect();
+  circadianOverride();
+  alarmState.isManualFadeActive = false;
+  alarmState.isSunriseActive = true;
+  alarmState.sunriseProgress = progress;
+  alarmState.lastSunriseUpdate = millis();
+}
+
+// True when this light's own alarm is set and falls within `minutes` of now
+bool alarmDueWithin(int minutes)
+{
+  if (!alarmState.isAlarmSet || !timeIsValid())
+    return false;
+
+  time_t now = time(nullptr);
+  struct tm timeinfo;
+  tzLocalTime(now, &timeinfo);
+  time_t solarAt = solarAlarmToday(timeinfo);
+  long away;
+  if (solarAt)
+  {
+    away = labs((long)(now - solarAt)) / 60;
+  }
+  else
+  {
+    away = labs((long)(timeinfo.tm_hour * 60 + timeinfo.tm_min) - (alarmState.hour * 60 + alarmState.minute));
+    away = std::min(away, 24 * 60 - away); // either side of midnight
+  }
+  return away <= minutes;
+}
+
+void updateSunrise()
+{
+  // If sunrise not active, check whether we should start it
+  if (!alarmState.isSunriseActive)
+  {
+    if (!alarmState.isAlarmSet)
+    {
+      return;
+    }
+
+    // Never fire from an unset (1970) clock
+    if (!timeIsValid())
+    {
+      return;
+    }
+
+    time_t now = time(nullptr);
+    struct tm timeinfo;
+    tzLocalTime(now, &timeinfo);
+
+    // On solar days the alarm follows sunrise; otherwise the fixed time
+    time_t solarAt = solarAlarmToday(timeinfo);
+    bool due = solarAt ? now / 60 == solarAt / 60 : timeinfo.tm_hour == alarmState.hour && timeinfo.tm_min == alarmState.minute;
+
+    if (due && !snoozeState.active)
+    {
+      snoozeState.count = 0; // fresh snooze allowance for each alarm
+      logEvent(EVENT_ALARM_FIRED, timeinfo.tm_hour * 60 + timeinfo.tm_min, solarAt != 0);
+      startSunrise();
+      groupAnnounceSunrise();
+      Serial.println("Sunrise started");
+    }
+    return;
+  }
+
+  // Sunrise is active - advance progress by this tick, sped up by the ambient controller
+  unsigned long now = millis();
+  unsigned long dt = now - alarmState.lastSunriseUpdate;
+  alarmState.lastSunriseUpdate = now;
+  ambientControlStep((int32_t)(alarmState.sunriseProgress * 65536.0f), dt);
+  if (groupState.sunriseStartUs != 0)
+  {
+    // Grouped: position comes from the shared timebase so all lights match (no ambient speed-up)
+    alarmState.sunriseProgress = (float)(groupNowUs() - groupState.sunriseStartUs) / (SUNRISE_DURATION_MS * 1000.0f);
+  }
+  else
+  {
+    alarmState.sunriseProgress += (float)dt / (float)SUNRISE_DURATION_MS * (ambientState.speedQ16 / 65536.0f);
+  }
+
+  float scale = ambientState.outputScaleQ16 / 65536.0f;
+
+  if (alarmState.sunriseProgress >= 1.0f)
+  {
+    // Sunrise complete - set to target brightness (full warm, SUNRISE_COOL_LEVEL cool), trimmed by ambient
+    setBrightness((int)(LEVEL_MAX * scale), (int)(SUNRISE_COOL_LEVEL * scale));
     alarmState.isSunriseActive = false;
+    cancelSnooze(); // next alarm gets a fresh snooze allowance
 
     // Schedule auto-off if enabled
     if (alarmState.autoOffEnabled)
     {
-      alarmState.sunriseCompleteTime = millis();
+      alarmState.autoOffStartTime = millis();
+      alarmState.autoOffDelayMinutes = alarmState.autoOffMinutes;
       alarmState.autoOffScheduled = true;
       Serial.printf("Auto-off scheduled in %d minutes\n", alarmState.autoOffMinutes);
     }
 
+    logEvent(EVENT_SUNRISE_COMPLETE);
     Serial.println("Sunrise complete!");
     return;
   }
 
   // Normalized progress 0.0 .. 1.0
-  float progress = (float)elapsedTime / (float)SUNRISE_DURATION_MS;
+  float progress = alarmState.sunriseProgress;
   if (progress < 0.0f)
     progress = 0.0f;
-  if (progress > 1.0f)
-    progress = 1.0f;
 
-  // Simple linear fade from (0, 0) to (1023, 409) in 10-bit resolution
-  int warmBrightness = (int)(1023.0f * progress);
-  int coolBrightness = (int)(409.0f * progress);
+  // Simple linear fade from (0, 0) to (LEVEL_MAX, SUNRISE_COOL_LEVEL)
+  int warmBrightness = (int)(LEVEL_MAX * progress * scale);
+  int coolBrightness = (int)(SUNRISE_COOL_LEVEL * progress * scale);
 
   setBrightness(warmBrightness, coolBrightness);
 
@@ -687,6 +7071,18 @@ void updateSunrise()
   }
 }
 
+// Start a fade from the current output to a target (cancels sunrise, sunset and programs)
+void startManualFade(int warm, int cool, unsigned long duration)
+{
+  stopProgram();
+  stopEffect();
+  if (warm == 0 && cool == 0)
+    circadianSuspend();
+  else
+    circadianOverride();
+  beginFade(alarmState.currentWarmBrightness, alarmState.currentCoolBrightness, warm, cool, duration, millis(), EASING_SINE);
+}
+
 // Update manual fade effect (called from loop)
 void updateManualFade()
 {
@@ -711,8 +7107,7 @@ void updateManualFade()
   if (progress > 1.0f)
     progress = 1.0f;
 
-  // Use ease-in-out sine easing for a gentler ramp
-  float eased = easeInOutSine(progress);
+  float eased = applyEasing(alarmState.manualFadeEasing, progress);
 
   int warm = alarmState.manualStartWarm + (int)((alarmState.manualTargetWarm - alarmState.manualStartWarm) * eased);
   int cool = alarmState.manualStartCool + (int)((alarmState.manualTargetCool - alarmState.manualStartCool) * eased);
@@ -726,21 +7121,16 @@ void updateAutoOff()
   if (!alarmState.autoOffScheduled)
     return;
 
-  unsigned long elapsed = millis() - alarmState.sunriseCompleteTime;
-  unsigned long autoOffDuration = (unsigned long)alarmState.autoOffMinutes * 60 * 1000;
+  unsigned long elapsed = millis() - alarmState.autoOffStartTime;
+  unsigned long autoOffDuration = (unsigned long)alarmState.autoOffDelayMinutes * 60 * 1000;
 
   if (elapsed >= autoOffDuration)
   {
     // Time to turn off - start manual fade down to zero
-    alarmState.isManualFadeActive = true;
-    alarmState.manualFadeStartTime = millis();
-    alarmState.manualFadeDuration = MANUAL_FADE_MS;
-    alarmState.manualStartWarm = alarmState.currentWarmBrightness;
-    alarmState.manualStartCool = alarmState.currentCoolBrightness;
-    alarmState.manualTargetWarm = 0;
-    alarmState.manualTargetCool = 0;
+    startManualFade(0, 0, MANUAL_FADE_MS);
 
     alarmState.autoOffScheduled = false;
+    logEvent(EVENT_AUTO_OFF, alarmState.autoOffDelayMinutes);
     Serial.println("Auto-off triggered: fading lights off");
   }
 }
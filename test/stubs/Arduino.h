@@ -0,0 +1,300 @@
+// Native test stub of the Arduino-ESP32 core: enough of the API for
+// src/main.cpp to build and run on the host. Time comes from the simulated
+// clock in esp_timer.h; the wall clock (time(), gettimeofday(), adjtime()...)
+// is simulated on top of it so tests never touch the host clock.
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <string>
+#include <esp_timer.h>
+#include <freertos_stub.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+inline void delay(unsigned long ms) { vTaskDelay(ms); }
+inline void yield() {}
+inline long random(long high) { return high > 0 ? rand() % high : 0; }
+inline long random(long low, long high) { return high > low ? low + rand() % (high - low) : low; }
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define PROGMEM
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#define HEX 16
+#define DEC 10
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+// GPIO: tests set stubPinLevel[] and call the attached handler with stubPinEdge()
+static int stubPinLevel[40];
+static void (*stubPinIsr[40])();
+inline void pinMode(int pin, int mode) { stubPinLevel[pin] = mode == INPUT_PULLUP ? HIGH : LOW; }
+inline int digitalRead(int pin) { return stubPinLevel[pin]; }
+inline int analogRead(int) { return 0; }
+inline int digitalPinToInterrupt(int pin) { return pin; }
+inline void attachInterrupt(int pin, void (*isr)(), int) { stubPinIsr[pin] = isr; }
+inline void stubPinEdge(int pin, int level)
+{
+  stubPinLevel[pin] = level;
+  if (stubPinIsr[pin])
+    stubPinIsr[pin]();
+}
+
+class String
+{
+public:
+  std::string s;
+  String() {}
+  String(const char *c) : s(c ? c : "") {}
+  String(const std::string &x) : s(x) {}
+  String(char c) : s(1, c) {}
+  String(int v) : s(std::to_string(v)) {}
+  String(unsigned v) : s(std::to_string(v)) {}
+  String(unsigned v, int base)
+  {
+    char b[16];
+    snprintf(b, sizeof(b), base == 16 ? "%x" : "%u", v);
+    s = b;
+  }
+  String(long v) : s(std::to_string(v)) {}
+  String(unsigned long v) : s(std::to_string(v)) {}
+  String(long long v) : s(std::to_string(v)) {}
+  String(unsigned long long v) : s(std::to_string(v)) {}
+  String(float v, int d = 2) { format(v, d); }
+  String(double v, int d = 2) { format(v, d); }
+  String operator+(const String &o) const { return String(s + o.s); }
+  friend String operator+(const char *a, const String &b) { return String(std::string(a) + b.s); }
+  String &operator+=(const String &o)
+  {
+    s += o.s;
+    return *this;
+  }
+  String &operator+=(const char *o)
+  {
+    s += o;
+    return *this;
+  }
+  String &operator+=(char c)
+  {
+    s += c;
+    return *this;
+  }
+  int indexOf(const char *x, int from = 0) const { return pos(s.find(x, from)); }
+  int indexOf(const String &x, int from = 0) const { return pos(s.find(x.s, from)); }
+  int indexOf(char x, int from = 0) const { return pos(s.find(x, from)); }
+  int lastIndexOf(char x) const { return pos(s.rfind(x)); }
+  int lastIndexOf(const char *x) const { return pos(s.rfind(x)); }
+  int lastIndexOf(const String &x) const { return pos(s.rfind(x.s)); }
+  const char *c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+  bool reserve(unsigned n)
+  {
+    s.reserve(n);
+    return true;
+  }
+  String substring(int a, int b = -1) const
+  {
+    if (a > (int)s.size())
+      return String();
+    return String(s.substr(a, b < 0 ? std::string::npos : b - a));
+  }
+  bool equals(const String &o) const { return s == o.s; }
+  bool operator==(const char *o) const { return s == o; }
+  bool operator==(const String &o) const { return s == o.s; }
+  bool operator!=(const char *o) const { return s != o; }
+  bool operator!=(const String &o) const { return s != o.s; }
+  bool operator<(const String &o) const { return s < o.s; }
+  bool startsWith(const char *p) const { return s.rfind(p, 0) == 0; }
+  bool startsWith(const String &p) const { return s.rfind(p.s, 0) == 0; }
+  bool endsWith(const char *p) const
+  {
+    size_t n = strlen(p);
+    return s.size() >= n && s.compare(s.size() - n, n, p) == 0;
+  }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  char charAt(unsigned i) const { return i < s.size() ? s[i] : 0; }
+  char operator[](unsigned i) const { return i < s.size() ? s[i] : 0; }
+  void trim()
+  {
+    size_t a = s.find_first_not_of(" \t\r\n");
+    size_t b = s.find_last_not_of(" \t\r\n");
+    s = a == std::string::npos ? std::string() : s.substr(a, b - a + 1);
+  }
+  void toLowerCase()
+  {
+    for (size_t i = 0; i < s.size(); i++)
+      s[i] = tolower((unsigned char)s[i]);
+  }
+  bool isEmpty() const { return s.empty(); }
+
+private:
+  static int pos(size_t p) { return p == std::string::npos ? -1 : (int)p; }
+  void format(double v, int d)
+  {
+    char b[48];
+    snprintf(b, sizeof(b), "%.*f", d, v);
+    s = b;
+  }
+};
+
+// Serial output is dropped unless a test sets stubSerialEcho
+static bool stubSerialEcho = false;
+struct HardwareSerial
+{
+  void begin(int) {}
+  template <class T>
+  void print(const T &v) { echo(String(v)); }
+  void println() { echo("\n"); }
+  template <class T>
+  void println(const T &v) { echo(String(v) + "\n"); }
+  int printf(const char *format, ...)
+  {
+    if (!stubSerialEcho)
+      return 0;
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+  }
+
+private:
+  void echo(const String &text)
+  {
+    if (stubSerialEcho)
+      fputs(text.c_str(), stdout);
+  }
+};
+static HardwareSerial Serial;
+
+struct EspClass
+{
+  void restart() {}
+  uint32_t getFreeHeap() { return 150000; }
+  uint32_t getMaxAllocHeap() { return 100000; }
+  uint32_t getMinFreeHeap() { return 120000; }
+  uint32_t getCpuFreqMHz() { return 240; }
+  uint32_t getCycleCount() { return (uint32_t)(esp_timer_get_time() * 240); }
+  uint64_t getEfuseMac() { return stubEfuseMac; }
+  uint64_t stubEfuseMac = 0x0000A1B2C3D4E5F6ULL;
+};
+static EspClass ESP;
+
+typedef enum
+{
+  ESP_RST_UNKNOWN,
+  ESP_RST_POWERON,
+  ESP_RST_EXT,
+  ESP_RST_SW,
+  ESP_RST_PANIC,
+  ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT,
+  ESP_RST_WDT,
+  ESP_RST_DEEPSLEEP,
+  ESP_RST_BROWNOUT,
+  ESP_RST_SDIO
+} esp_reset_reason_t;
+inline esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+inline uint32_t esp_get_free_heap_size(void) { return 150000; }
+inline uint32_t esp_get_minimum_free_heap_size(void) { return 120000; }
+inline size_t getArduinoLoopTaskStackSize(void) { return 8192; }
+
+inline size_t stubStrlcpy(char *dst, const char *src, size_t size)
+{
+  size_t n = strlen(src);
+  if (size > 0)
+  {
+    size_t copy = n < size - 1 ? n : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = 0;
+  }
+  return n;
+}
+#define strlcpy stubStrlcpy
+
+// Simulated wall clock: the monotonic stub clock plus an offset. adjtime()
+// slews it at 500 ppm like newlib on the ESP32.
+struct StubWallClock
+{
+  int64_t offsetUs = 1767225600LL * 1000000; // 2026-01-01T00:00:00Z at clock 0
+  int64_t slewUs = 0;
+  int64_t lastUs = 0;
+};
+static StubWallClock stubWall;
+
+inline int64_t stubWallUs()
+{
+  int64_t now = esp_timer_get_time();
+  int64_t elapsed = now - stubWall.lastUs;
+  stubWall.lastUs = now;
+  int64_t step = elapsed / 2000;
+  if (stubWall.slewUs > 0)
+    step = step < stubWall.slewUs ? step : stubWall.slewUs;
+  else
+    step = -step > stubWall.slewUs ? -step : stubWall.slewUs;
+  stubWall.offsetUs += step;
+  stubWall.slewUs -= step;
+  return now + stubWall.offsetUs;
+}
+
+inline int stubGettimeofday(struct timeval *tv, void *)
+{
+  int64_t us = stubWallUs();
+  tv->tv_sec = us / 1000000;
+  tv->tv_usec = us % 1000000;
+  return 0;
+}
+inline int stubSettimeofday(const struct timeval *tv, const void *)
+{
+  int64_t us = stubWallUs() - stubWall.offsetUs;
+  stubWall.offsetUs = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec - us;
+  stubWall.slewUs = 0;
+  return 0;
+}
+inline int stubAdjtime(const struct timeval *delta, struct timeval *olddelta)
+{
+  stubWallUs();
+  if (olddelta)
+  {
+    olddelta->tv_sec = stubWall.slewUs / 1000000;
+    olddelta->tv_usec = stubWall.slewUs % 1000000;
+  }
+  if (delta)
+    stubWall.slewUs = (int64_t)delta->tv_sec * 1000000 + delta->tv_usec;
+  return 0;
+}
+inline time_t stubTime(time_t *out)
+{
+  time_t t = (time_t)(stubWallUs() / 1000000);
+  if (out)
+    *out = t;
+  return t;
+}
+#define gettimeofday stubGettimeofday
+#define settimeofday stubSettimeofday
+#define adjtime stubAdjtime
+#define time(out) stubTime(out)
+
+inline void configTime(long, int, const char *, const char * = nullptr, const char * = nullptr) {}
@@ -0,0 +1,27 @@
+// Native test stub
+#pragma once
+#include <Arduino.h>
+#include <functional>
+typedef int ota_error_t;
+enum
+{
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+};
+struct ArduinoOTAClass
+{
+  void setHostname(const char *) {}
+  void setPassword(const char *) {}
+  void setPasswordHash(const char *) {}
+  void onStart(std::function<void()>) {}
+  void onEnd(std::function<void()>) {}
+  void onProgress(std::function<void(unsigned, unsigned)>) {}
+  void onError(std::function<void(ota_error_t)>) {}
+  void begin() {}
+  void handle() {}
+  int getCommand() { return 0; }
+};
+static ArduinoOTAClass ArduinoOTA;
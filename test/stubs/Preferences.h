@@ -0,0 +1,80 @@
+// Native test stub: NVS as an in-memory map shared by all Preferences objects
+#pragma once
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+static std::map<std::string, std::vector<uint8_t>> stubNvs;
+
+struct Preferences
+{
+  bool begin(const char *name, bool = false)
+  {
+    space = name;
+    return true;
+  }
+  void end() {}
+  bool clear()
+  {
+    for (auto it = stubNvs.begin(); it != stubNvs.end();)
+      it = it->first.compare(0, space.size() + 1, space + "/") == 0 ? stubNvs.erase(it) : std::next(it);
+    return true;
+  }
+  bool remove(const char *key) { return stubNvs.erase(path(key)) > 0; }
+  bool isKey(const char *key) { return stubNvs.count(path(key)) > 0; }
+
+  size_t putInt(const char *key, int32_t v) { return put(key, v); }
+  int32_t getInt(const char *key, int32_t d = 0) { return get(key, d); }
+  size_t putUChar(const char *key, uint8_t v) { return put(key, v); }
+  uint8_t getUChar(const char *key, uint8_t d = 0) { return get(key, d); }
+  size_t putUInt(const char *key, uint32_t v) { return put(key, v); }
+  uint32_t getUInt(const char *key, uint32_t d = 0) { return get(key, d); }
+  size_t putBool(const char *key, bool v) { return put(key, (uint8_t)v); }
+  bool getBool(const char *key, bool d = false) { return get(key, (uint8_t)d) != 0; }
+  size_t putFloat(const char *key, float v) { return put(key, v); }
+  float getFloat(const char *key, float d = 0) { return get(key, d); }
+  size_t putULong64(const char *key, uint64_t v) { return put(key, v); }
+  uint64_t getULong64(const char *key, uint64_t d = 0) { return get(key, d); }
+  size_t putLong64(const char *key, int64_t v) { return put(key, v); }
+  int64_t getLong64(const char *key, int64_t d = 0) { return get(key, d); }
+  size_t putString(const char *key, const String &v) { return putBytes(key, v.c_str(), v.length()); }
+  String getString(const char *key, const String &d = String())
+  {
+    auto it = stubNvs.find(path(key));
+    return it == stubNvs.end() ? d : String(std::string(it->second.begin(), it->second.end()));
+  }
+  size_t putBytes(const char *key, const void *data, size_t size)
+  {
+    stubNvs[path(key)].assign((const uint8_t *)data, (const uint8_t *)data + size);
+    return size;
+  }
+  size_t getBytesLength(const char *key)
+  {
+    auto it = stubNvs.find(path(key));
+    return it == stubNvs.end() ? 0 : it->second.size();
+  }
+  size_t getBytes(const char *key, void *data, size_t size)
+  {
+    auto it = stubNvs.find(path(key));
+    if (it == stubNvs.end() || it->second.size() > size)
+      return 0;
+    memcpy(data, it->second.data(), it->second.size());
+    return it->second.size();
+  }
+
+private:
+  std::string space;
+  std::string path(const char *key) const { return space + "/" + key; }
+  template <class T>
+  size_t put(const char *key, T v) { return putBytes(key, &v, sizeof(v)); }
+  template <class T>
+  T get(const char *key, T d)
+  {
+    auto it = stubNvs.find(path(key));
+    if (it == stubNvs.end() || it->second.size() != sizeof(T))
+      return d;
+    T v;
+    memcpy(&v, it->second.data(), sizeof(T));
+    return v;
+  }
+};
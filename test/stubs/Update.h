@@ -0,0 +1,17 @@
+// Native test stub
+#pragma once
+#include <Arduino.h>
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+#define U_FLASH 0
+struct UpdateClass
+{
+  bool begin(size_t = UPDATE_SIZE_UNKNOWN, int = U_FLASH) { return true; }
+  size_t write(uint8_t *, size_t n) { return n; }
+  bool end(bool = false) { return true; }
+  void abort() {}
+  bool hasError() { return false; }
+  const char *errorString() { return ""; }
+  bool isRunning() { return false; }
+  size_t progress() { return 0; }
+};
+static UpdateClass Update;
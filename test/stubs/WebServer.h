@@ -0,0 +1,127 @@
+// Native test stub: handlers are registered by path and method so tests can
+// make requests with stubRequest(); the last response is kept in server.
+#pragma once
+#include <WiFi.h>
+#include <functional>
+#include <map>
+#include <vector>
+
+enum HTTPMethod
+{
+  HTTP_GET,
+  HTTP_POST,
+  HTTP_OPTIONS,
+  HTTP_DELETE,
+  HTTP_PUT,
+  HTTP_ANY
+};
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+struct HTTPUpload
+{
+  int status;
+  String filename;
+  size_t totalSize;
+  size_t currentSize;
+  uint8_t buf[1436];
+};
+enum
+{
+  UPLOAD_FILE_START,
+  UPLOAD_FILE_WRITE,
+  UPLOAD_FILE_END,
+  UPLOAD_FILE_ABORTED
+};
+
+struct WebServer
+{
+  typedef std::function<void()> THandlerFunction;
+  struct Route
+  {
+    String path;
+    HTTPMethod method;
+    THandlerFunction handler;
+  };
+
+  WebServer(int) {}
+  void on(const char *path, HTTPMethod method, THandlerFunction handler) { routes.push_back({path, method, handler}); }
+  void on(const char *path, HTTPMethod method, THandlerFunction handler, THandlerFunction) { on(path, method, handler); }
+  void onNotFound(THandlerFunction handler) { notFound = handler; }
+  void begin() {}
+  void handleClient() {}
+  void enableCORS(bool) {}
+  void collectHeaders(const char **, size_t) {}
+
+  void send(int code, const char *type = nullptr, const String &body = String())
+  {
+    responseCode = code;
+    responseType = type ? type : "";
+    responseBody = body;
+  }
+  void setContentLength(size_t) {}
+  void sendContent(const String &text)
+  {
+    responseBody += text;
+    if (onSendContent)
+      onSendContent();
+  }
+  void sendContent(const char *data, size_t size) { sendContent(String(std::string(data, size))); }
+  void sendHeader(const String &, const String &, bool = false) {}
+
+  bool hasArg(const char *name) { return args.count(name) > 0; }
+  String arg(const char *name) { return args.count(name) ? args[name] : String(); }
+  bool hasHeader(const char *name) { return headers.count(name) > 0; }
+  String header(const char *name) { return headers.count(name) ? headers[name] : String(); }
+  String uri() { return requestUri; }
+  HTTPMethod method() { return requestMethod; }
+  HTTPUpload &upload() { return uploadState; }
+  WiFiClient client() { return WiFiClient(); }
+
+  std::vector<Route> routes;
+  THandlerFunction notFound;
+  std::map<std::string, String> args;
+  std::map<std::string, String> headers;
+  String requestUri;
+  HTTPMethod requestMethod = HTTP_GET;
+  HTTPUpload uploadState;
+  int responseCode = 0;
+  String responseType;
+  String responseBody;
+  std::function<void()> onSendContent; // runs after every chunk (a test's slow client)
+};
+
+// Run the handler registered for `path`, with `body` as the "plain" argument
+// and a "?a=1&b=2" query as the others.
+// Returns the response code (404 when nothing is registered).
+inline int stubRequest(WebServer &server, HTTPMethod method, const char *uri, const char *body = nullptr)
+{
+  server.args.clear();
+  if (body)
+    server.args["plain"] = body;
+  std::string path = uri;
+  size_t query = path.find('?');
+  if (query != std::string::npos)
+  {
+    std::string rest = path.substr(query + 1);
+    path.resize(query);
+    while (!rest.empty())
+    {
+      std::string pair = rest.substr(0, rest.find('&'));
+      rest = pair.size() < rest.size() ? rest.substr(pair.size() + 1) : "";
+      size_t eq = pair.find('=');
+      server.args[pair.substr(0, eq)] = eq == std::string::npos ? String() : String(pair.substr(eq + 1));
+    }
+  }
+  server.requestUri = path.c_str();
+  server.requestMethod = method;
+  server.responseCode = 0;
+  server.responseBody = String();
+  for (size_t i = 0; i < server.routes.size(); i++)
+  {
+    if (server.routes[i].path == path.c_str() && server.routes[i].method == method)
+    {
+      server.routes[i].handler();
+      return server.responseCode;
+    }
+  }
+  return 404;
+}
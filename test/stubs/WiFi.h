@@ -0,0 +1,49 @@
+// Native test stub
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#define WIFI_STA 1
+#define WL_CONNECTED 3
+typedef enum
+{
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED = 5,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP = 7
+} arduino_event_id_t;
+typedef arduino_event_id_t WiFiEvent_t;
+typedef union
+{
+  struct
+  {
+    uint8_t reason;
+  } wifi_sta_disconnected;
+} arduino_event_info_t;
+typedef arduino_event_info_t WiFiEventInfo_t;
+
+struct IPAddress
+{
+  String toString() const { return "127.0.0.1"; }
+  operator String() const { return toString(); }
+};
+
+struct WiFiClass
+{
+  void mode(int) {}
+  void begin(const char *, const char *) {}
+  int status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+  int RSSI() { return -50; }
+  int onEvent(std::function<void(WiFiEvent_t, WiFiEventInfo_t)>, WiFiEvent_t = (WiFiEvent_t)0) { return 0; }
+  int onEvent(void (*)(WiFiEvent_t, WiFiEventInfo_t), WiFiEvent_t = (WiFiEvent_t)0) { return 0; }
+};
+static WiFiClass WiFi;
+
+struct WiFiClient
+{
+  int write(const uint8_t *, size_t n) { return n; }
+  int available() { return 0; }
+  int read(uint8_t *, size_t) { return 0; }
+  int read() { return -1; }
+  bool connected() { return true; }
+  void stop() {}
+  void setTimeout(int) {}
+};
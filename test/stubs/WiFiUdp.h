@@ -0,0 +1,14 @@
+// Native test stub
+#pragma once
+#include <WiFi.h>
+struct WiFiUDP
+{
+  int beginMulticast(IPAddress, uint16_t) { return 1; }
+  int begin(uint16_t) { return 1; }
+  int beginPacket(IPAddress, uint16_t) { return 1; }
+  size_t write(const uint8_t *, size_t n) { return n; }
+  int endPacket() { return 1; }
+  int parsePacket() { return 0; }
+  int read(uint8_t *, size_t) { return 0; }
+  IPAddress remoteIP() { return IPAddress(); }
+};
@@ -0,0 +1,14 @@
+// Native test stub: no RTC on the bus
+#pragma once
+#include <Arduino.h>
+struct TwoWire
+{
+  bool begin(int, int) { return true; }
+  void beginTransmission(uint8_t) {}
+  size_t write(uint8_t) { return 1; }
+  uint8_t endTransmission(bool = true) { return 2; } // NACK
+  uint8_t requestFrom(uint8_t, uint8_t) { return 0; }
+  int read() { return 0; }
+  int available() { return 0; }
+};
+static TwoWire Wire;
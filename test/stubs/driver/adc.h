@@ -0,0 +1,15 @@
+// Native test stub
+#pragma once
+typedef enum
+{
+  ADC_UNIT_1 = 1
+} adc_unit_t;
+typedef enum
+{
+  ADC1_CHANNEL_6 = 6
+} adc1_channel_t;
+typedef enum
+{
+  ADC_ATTEN_DB_11 = 3
+} adc_atten_t;
+inline int adc1_config_channel_atten(adc1_channel_t, adc_atten_t) { return 0; }
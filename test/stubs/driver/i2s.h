@@ -0,0 +1,64 @@
+// Native test stub: i2s_read() drains stubI2sSamples, which tests fill with a
+// synthetic ADC stream (12-bit values, upper bits carry the channel as on the
+// ESP32)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <driver/adc.h>
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+typedef enum
+{
+  I2S_NUM_0 = 0
+} i2s_port_t;
+typedef enum
+{
+  I2S_MODE_MASTER = 1,
+  I2S_MODE_RX = 4,
+  I2S_MODE_ADC_BUILT_IN = 32
+} i2s_mode_t;
+typedef enum
+{
+  I2S_BITS_PER_SAMPLE_16BIT = 16
+} i2s_bits_per_sample_t;
+typedef enum
+{
+  I2S_CHANNEL_FMT_ONLY_LEFT = 3
+} i2s_channel_fmt_t;
+typedef enum
+{
+  I2S_COMM_FORMAT_STAND_I2S = 1
+} i2s_comm_format_t;
+typedef struct
+{
+  i2s_mode_t mode;
+  uint32_t sample_rate;
+  i2s_bits_per_sample_t bits_per_sample;
+  i2s_channel_fmt_t channel_format;
+  i2s_comm_format_t communication_format;
+  int intr_alloc_flags;
+  int dma_buf_count;
+  int dma_buf_len;
+  bool use_apll;
+} i2s_config_t;
+
+static std::deque<uint16_t> stubI2sSamples;
+
+inline esp_err_t i2s_driver_install(i2s_port_t, const i2s_config_t *, int, void *) { return ESP_OK; }
+inline esp_err_t i2s_set_adc_mode(adc_unit_t, adc1_channel_t) { return ESP_OK; }
+inline esp_err_t i2s_adc_enable(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_read(i2s_port_t, void *dst, size_t size, size_t *bytesRead, uint32_t)
+{
+  size_t n = 0;
+  uint16_t *out = (uint16_t *)dst;
+  while (n < size / sizeof(uint16_t) && !stubI2sSamples.empty())
+  {
+    out[n++] = stubI2sSamples.front();
+    stubI2sSamples.pop_front();
+  }
+  *bytesRead = n * sizeof(uint16_t);
+  return ESP_OK;
+}
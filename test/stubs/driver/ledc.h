@@ -0,0 +1,221 @@
+// Native test stub: a register-level model of the ESP32 LEDC low-speed
+// group. Duty and hpoint writes go to shadow registers; ledc_update_duty()
+// and ledc_timer_set() only mark them pending, and pending values latch at
+// the next timer overflow, as on the hardware. Each ledc_* call takes
+// ledcStub.writeUs of simulated time, and every PWM period is logged with
+// the duties it output (ledcStub.periods, one entry per run of identical
+// periods).
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <esp_timer.h>
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+typedef enum
+{
+  LEDC_HIGH_SPEED_MODE = 0,
+  LEDC_LOW_SPEED_MODE = 1
+} ledc_mode_t;
+typedef enum
+{
+  LEDC_TIMER_0 = 0,
+  LEDC_TIMER_1,
+  LEDC_TIMER_2,
+  LEDC_TIMER_3
+} ledc_timer_t;
+typedef enum
+{
+  LEDC_CHANNEL_0 = 0
+} ledc_channel_t;
+typedef enum
+{
+  LEDC_TIMER_8_BIT = 8,
+  LEDC_TIMER_20_BIT = 20
+} ledc_timer_bit_t;
+typedef enum
+{
+  LEDC_AUTO_CLK = 0,
+  LEDC_USE_APB_CLK
+} ledc_clk_cfg_t;
+typedef enum
+{
+  LEDC_REF_TICK = 0,
+  LEDC_APB_CLK
+} ledc_clk_src_t;
+typedef enum
+{
+  LEDC_INTR_DISABLE = 0
+} ledc_intr_type_t;
+typedef struct
+{
+  ledc_mode_t speed_mode;
+  ledc_timer_bit_t duty_resolution;
+  ledc_timer_t timer_num;
+  uint32_t freq_hz;
+  ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+typedef struct
+{
+  int gpio_num;
+  ledc_mode_t speed_mode;
+  ledc_channel_t channel;
+  ledc_intr_type_t intr_type;
+  ledc_timer_t timer_sel;
+  uint32_t duty;
+  int hpoint;
+} ledc_channel_config_t;
+
+struct LedcStubChannel
+{
+  uint32_t duty, hpoint; // shadow registers
+  bool pending;          // update bit set, latches at the next overflow
+  uint32_t outDuty, outHpoint;
+};
+
+// What one PWM period output
+struct LedcStubPeriod
+{
+  uint32_t freq;
+  uint8_t bits;
+  uint32_t duty[2];
+  uint32_t hpoint[2];
+  uint64_t repeats; // consecutive periods with this output
+
+  bool sameOutput(const LedcStubPeriod &o) const
+  {
+    return freq == o.freq && bits == o.bits && duty[0] == o.duty[0] && duty[1] == o.duty[1] &&
+           hpoint[0] == o.hpoint[0] && hpoint[1] == o.hpoint[1];
+  }
+};
+
+struct LedcStub
+{
+  uint32_t freq = 0;
+  uint8_t bits = 0;
+  bool timerPending = false;
+  uint32_t nextFreq = 0;
+  uint8_t nextBits = 0;
+  double count = 0;
+  int64_t syncedUs = 0;
+  uint32_t intRaw = 0;
+  LedcStubChannel channel[8] = {};
+  int64_t writeUs = 2;
+  std::vector<LedcStubPeriod> periods;
+
+  void overflow()
+  {
+    intRaw |= 1u << 4; // LSTIMER0_OVF
+    if (timerPending)
+    {
+      freq = nextFreq;
+      bits = nextBits;
+      timerPending = false;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+      if (channel[i].pending)
+      {
+        channel[i].outDuty = channel[i].duty;
+        channel[i].outHpoint = channel[i].hpoint;
+        channel[i].pending = false;
+      }
+    }
+    LedcStubPeriod p = {freq, bits, {channel[0].outDuty, channel[1].outDuty}, {channel[0].outHpoint, channel[1].outHpoint}, 1};
+    if (!periods.empty() && periods.back().sameOutput(p))
+      periods.back().repeats++;
+    else
+      periods.push_back(p);
+  }
+
+  // Run the timer up to the current simulated time
+  void sync()
+  {
+    int64_t now = stubClock.real ? esp_timer_get_time() : stubClock.us;
+    int64_t elapsed = now - syncedUs;
+    syncedUs = now;
+    if (freq == 0 || elapsed <= 0)
+      return;
+    count += elapsed * ((double)freq * (1u << bits) / 1e6);
+    double period = (double)(1u << bits);
+    if (count >= 3 * period)
+    {
+      // Long idle stretch: nothing is pending after the first overflow, so
+      // every period up to the last one outputs the same
+      uint8_t before = bits;
+      overflow();
+      if (bits != before)
+        count = 0;
+      else
+      {
+        uint64_t idle = (uint64_t)(count / period) - 2;
+        periods.back().repeats += idle;
+        count -= (double)(idle + 1) * period;
+      }
+    }
+    while (count >= (double)(1u << bits))
+    {
+      count -= (double)(1u << bits);
+      uint8_t before = bits;
+      overflow();
+      if (bits != before)
+        count = 0;
+    }
+  }
+
+  void write()
+  {
+    if (!stubClock.real)
+      stubAdvanceUs(writeUs);
+    sync();
+  }
+};
+static LedcStub ledcStub;
+
+inline esp_err_t ledc_timer_config(const ledc_timer_config_t *config)
+{
+  ledcStub.sync();
+  ledcStub.freq = config->freq_hz;
+  ledcStub.bits = config->duty_resolution;
+  ledcStub.count = 0;
+  return ESP_OK;
+}
+inline esp_err_t ledc_channel_config(const ledc_channel_config_t *config)
+{
+  LedcStubChannel &c = ledcStub.channel[config->channel];
+  c.duty = c.outDuty = config->duty;
+  c.hpoint = c.outHpoint = config->hpoint;
+  c.pending = false;
+  return ESP_OK;
+}
+// clock_divider is 10.8 fixed point of the 80 MHz APB clock
+inline esp_err_t ledc_timer_set(ledc_mode_t, ledc_timer_t, uint32_t clockDivider, uint32_t bits, ledc_clk_src_t)
+{
+  ledcStub.write();
+  ledcStub.nextFreq = (uint32_t)((80000000ULL << 8) / clockDivider >> bits);
+  ledcStub.nextBits = bits;
+  ledcStub.timerPending = true;
+  return ESP_OK;
+}
+inline esp_err_t ledc_set_duty_with_hpoint(ledc_mode_t, ledc_channel_t channel, uint32_t duty, uint32_t hpoint)
+{
+  ledcStub.write();
+  ledcStub.channel[channel].duty = duty;
+  ledcStub.channel[channel].hpoint = hpoint;
+  return ESP_OK;
+}
+inline esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty)
+{
+  return ledc_set_duty_with_hpoint(mode, channel, duty, ledcStub.channel[channel].hpoint);
+}
+inline esp_err_t ledc_update_duty(ledc_mode_t, ledc_channel_t channel)
+{
+  ledcStub.write();
+  ledcStub.channel[channel].pending = true;
+  return ESP_OK;
+}
+inline uint32_t ledc_get_duty(ledc_mode_t, ledc_channel_t channel)
+{
+  return ledcStub.channel[channel].outDuty;
+}
@@ -0,0 +1,20 @@
+// Native test stub: no core dump present
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_partition.h>
+typedef struct
+{
+  uint32_t bt[16];
+  uint32_t depth;
+  bool corrupted;
+} esp_core_dump_bt_info_t;
+typedef struct
+{
+  uint32_t exc_tcb;
+  char exc_task[16];
+  uint32_t exc_pc;
+  esp_core_dump_bt_info_t exc_bt_info;
+} esp_core_dump_summary_t;
+inline esp_err_t esp_core_dump_image_get(size_t *, size_t *) { return -1; }
+inline esp_err_t esp_core_dump_get_summary(esp_core_dump_summary_t *) { return -1; }
@@ -0,0 +1,8 @@
+// Native test stub
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#define MALLOC_CAP_8BIT (1 << 2)
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return 100000; }
+inline size_t heap_caps_get_free_size(uint32_t) { return 150000; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return 120000; }
@@ -0,0 +1,5 @@
+// Native test stub
+#pragma once
+#include <esp_partition.h>
+inline const esp_partition_t *esp_ota_get_running_partition() { return nullptr; }
+inline const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *) { return nullptr; }
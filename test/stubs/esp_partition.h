@@ -0,0 +1,59 @@
+// Native test stub: partitions are RAM buffers; the event log partition is
+// present, the core dump partition is not
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+typedef struct
+{
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+typedef enum
+{
+  ESP_PARTITION_TYPE_APP = 0,
+  ESP_PARTITION_TYPE_DATA = 1
+} esp_partition_type_t;
+typedef enum
+{
+  ESP_PARTITION_SUBTYPE_ANY = 0xff,
+  ESP_PARTITION_SUBTYPE_DATA_COREDUMP = 3
+} esp_partition_subtype_t;
+
+static const esp_partition_t stubEventLogPartition = {0x3f0000, 0x10000, "eventlog"};
+static uint8_t stubEventLogFlash[0x10000];
+
+inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t, int subtype, const char *label)
+{
+  if (subtype == ESP_PARTITION_SUBTYPE_DATA_COREDUMP)
+    return nullptr;
+  (void)label;
+  return &stubEventLogPartition;
+}
+inline esp_err_t esp_partition_read(const esp_partition_t *, size_t offset, void *dst, size_t size)
+{
+  if (offset + size > sizeof(stubEventLogFlash))
+    return -1;
+  memcpy(dst, stubEventLogFlash + offset, size);
+  return ESP_OK;
+}
+inline esp_err_t esp_partition_write(const esp_partition_t *, size_t offset, const void *src, size_t size)
+{
+  if (offset + size > sizeof(stubEventLogFlash))
+    return -1;
+  for (size_t i = 0; i < size; i++)
+    stubEventLogFlash[offset + i] &= ((const uint8_t *)src)[i];
+  return ESP_OK;
+}
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *, size_t offset, size_t size)
+{
+  if (offset + size > sizeof(stubEventLogFlash))
+    return -1;
+  memset(stubEventLogFlash + offset, 0xff, size);
+  return ESP_OK;
+}
@@ -0,0 +1,12 @@
+// Native test stub
+#pragma once
+#include <stdint.h>
+#include <sys/time.h>
+typedef enum
+{
+  SNTP_SYNC_STATUS_RESET,
+  SNTP_SYNC_STATUS_COMPLETED,
+  SNTP_SYNC_STATUS_IN_PROGRESS
+} sntp_sync_status_t;
+extern "C" inline void sntp_set_sync_status(sntp_sync_status_t) {}
+extern "C" inline void sntp_set_sync_interval(uint32_t) {}
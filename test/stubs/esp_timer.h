@@ -0,0 +1,52 @@
+// Native test stub: esp_timer on a simulated microsecond clock.
+// Tests move the clock with stubAdvanceUs(); every read also steps it by
+// stubClock.stepUs so firmware busy-waits end. stubClock.real switches to
+// the host's monotonic clock (for tests that run firmware tasks on threads).
+#pragma once
+#include <stdint.h>
+#include <chrono>
+
+struct StubClock
+{
+  int64_t us = 1000000;
+  int64_t stepUs = 1;
+  bool real = false;
+};
+static StubClock stubClock;
+
+inline int64_t esp_timer_get_time()
+{
+  if (stubClock.real)
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  int64_t now = stubClock.us;
+  stubClock.us += stubClock.stepUs;
+  return now;
+}
+
+inline void stubAdvanceUs(int64_t us)
+{
+  stubClock.us += us;
+}
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *);
+typedef enum
+{
+  ESP_TIMER_TASK
+} esp_timer_dispatch_t;
+typedef struct
+{
+  esp_timer_cb_t callback;
+  void *arg;
+  esp_timer_dispatch_t dispatch_method;
+  const char *name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+// Timers are never started; tests call the callbacks directly
+inline int esp_timer_create(const esp_timer_create_args_t *, esp_timer_handle_t *handle)
+{
+  *handle = nullptr;
+  return 0;
+}
+inline int esp_timer_start_periodic(esp_timer_handle_t, uint64_t) { return 0; }
@@ -0,0 +1,88 @@
+// Native test stub: FreeRTOS tasks as detached host threads, mutexes as
+// std::mutex. Critical sections are no-ops: the firmware state they guard is
+// only touched from the test thread.
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <esp_timer.h>
+
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef std::mutex *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t StackType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffff
+#define pdMS_TO_TICKS(x) (x)
+#define portTICK_PERIOD_MS 1
+
+// Set on task threads: their delays sleep for real, so a background task
+// spinning on vTaskDelay() never moves the test's simulated clock
+static thread_local bool stubInTask = false;
+
+inline BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *, uint32_t, void *arg, UBaseType_t, TaskHandle_t *handle, BaseType_t)
+{
+  std::thread([task, arg]()
+              { stubInTask = true; task(arg); })
+      .detach();
+  if (handle)
+    *handle = nullptr;
+  return pdPASS;
+}
+inline void vTaskDelay(TickType_t ms)
+{
+  if (stubClock.real || stubInTask)
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  else
+    stubAdvanceUs(ms * 1000LL);
+}
+inline void vTaskDelete(TaskHandle_t) {}
+inline TickType_t xTaskGetTickCount() { return (TickType_t)(esp_timer_get_time() / 1000); }
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 4096; }
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
+inline TaskHandle_t xTaskGetCurrentTaskHandleForCPU(BaseType_t) { return nullptr; }
+inline TaskHandle_t xTaskGetHandle(const char *) { return nullptr; }
+inline char *pcTaskGetName(TaskHandle_t)
+{
+  static char name[] = "test";
+  return name;
+}
+typedef enum
+{
+  eRunning,
+  eReady,
+  eBlocked,
+  eSuspended,
+  eDeleted,
+  eInvalid
+} eTaskState;
+inline eTaskState eTaskGetState(TaskHandle_t) { return eRunning; }
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::mutex; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t)
+{
+  m->lock();
+  return pdTRUE;
+}
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+  m->unlock();
+  return pdTRUE;
+}
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(m) (void)(m)
+#define portEXIT_CRITICAL(m) (void)(m)
+#define portENTER_CRITICAL_ISR(m) (void)(m)
+#define portEXIT_CRITICAL_ISR(m) (void)(m)
+
+// esp_system_abort() is recorded rather than fatal
+static int stubAborts = 0;
+inline void esp_system_abort(const char *) { stubAborts++; }
+inline uint32_t esp_random() { return (uint32_t)rand(); }
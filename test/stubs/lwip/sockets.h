@@ -0,0 +1,7 @@
+// Native test stub: lwIP's BSD socket API is the host's
+#pragma once
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#define closesocket close
@@ -0,0 +1,15 @@
+// Native test stub: no public-key support, every signature fails to verify
+#pragma once
+#include <stddef.h>
+typedef struct
+{
+  int unused;
+} mbedtls_pk_context;
+typedef enum
+{
+  MBEDTLS_MD_SHA256 = 6
+} mbedtls_md_type_t;
+inline void mbedtls_pk_init(mbedtls_pk_context *) {}
+inline void mbedtls_pk_free(mbedtls_pk_context *) {}
+inline int mbedtls_pk_parse_public_key(mbedtls_pk_context *, const unsigned char *, size_t) { return -1; }
+inline int mbedtls_pk_verify(mbedtls_pk_context *, mbedtls_md_type_t, const unsigned char *, size_t, const unsigned char *, size_t) { return -1; }
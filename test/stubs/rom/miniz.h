@@ -0,0 +1,35 @@
+// Native test stub: no inflate, compressed uploads fail
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+typedef uint8_t mz_uint8;
+typedef uint32_t mz_uint32;
+#define TINFL_LZ_DICT_SIZE 32768
+enum
+{
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+  TINFL_FLAG_HAS_MORE_INPUT = 2,
+  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4
+};
+typedef enum
+{
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+typedef struct
+{
+  int m_state;
+} tinfl_decompressor;
+#define tinfl_init(r) \
+  do                  \
+  {                   \
+    (r)->m_state = 0; \
+  } while (0)
+inline tinfl_status tinfl_decompress(tinfl_decompressor *, const mz_uint8 *, size_t *, mz_uint8 *, mz_uint8 *, size_t *, const mz_uint32)
+{
+  return TINFL_STATUS_FAILED;
+}
@@ -0,0 +1,55 @@
+// Native test stub: the LEDC registers the firmware touches directly, backed
+// by the model in driver/ledc.h. Reading a register runs the model up to the
+// current simulated time; writing int_clr clears interrupt bits.
+#pragma once
+#include <stdint.h>
+#include <driver/ledc.h>
+
+struct LedcStubCounter
+{
+  operator uint32_t() const
+  {
+    ledcStub.sync();
+    return (uint32_t)ledcStub.count;
+  }
+};
+struct LedcStubIntRaw
+{
+  operator uint32_t() const
+  {
+    ledcStub.sync();
+    return ledcStub.intRaw;
+  }
+};
+struct LedcStubIntClear
+{
+  LedcStubIntClear &operator=(uint32_t bits)
+  {
+    ledcStub.sync();
+    ledcStub.intRaw &= ~bits;
+    return *this;
+  }
+};
+
+struct ledc_dev_t
+{
+  struct
+  {
+    struct
+    {
+      struct
+      {
+        LedcStubCounter timer_cnt;
+      } value;
+    } timer[4];
+  } timer_group[2];
+  struct
+  {
+    LedcStubIntRaw val;
+  } int_raw;
+  struct
+  {
+    LedcStubIntClear val;
+  } int_clr;
+};
+static ledc_dev_t LEDC;
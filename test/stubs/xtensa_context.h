@@ -0,0 +1,22 @@
+// Native test stub
+#pragma once
+typedef struct
+{
+  long exit;
+  long pc;
+  long ps;
+  long a0;
+  long a1;
+  long a2;
+} XtExcFrame;
+typedef struct
+{
+  long exit;
+  long pc;
+  long ps;
+  long next;
+  long a0;
+  long a1;
+  long a2;
+  long a3;
+} XtSolFrame;
@@ -0,0 +1,178 @@
+// Ambient light filter and sunrise controller on a synthetic sensor stream:
+// ADC samples are queued in stubI2sSamples as the DMA would deliver them
+// (8 kHz, 12-bit, channel number in the upper bits) and drained by
+// updateAmbient() once per 20 ms tick.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+static const int TICK_MS = 20;
+static const int SAMPLES_PER_TICK = AMBIENT_SAMPLE_RATE * TICK_MS / 1000;
+static uint32_t seed = 1;
+
+static int noise(int amplitude)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 8) % (2 * amplitude + 1)) - amplitude;
+}
+
+// One tick of samples around `level` (0-1 of full scale) and drain them
+static void tick(double level, int noiseAmplitude = 0)
+{
+  for (int i = 0; i < SAMPLES_PER_TICK; i++)
+  {
+    int adc = constrain((int)(level * AMBIENT_ADC_MAX + 0.5) + noise(noiseAmplitude), 0, AMBIENT_ADC_MAX);
+    stubI2sSamples.push_back((uint16_t)((AMBIENT_ADC_CHANNEL << 12) | adc));
+  }
+  updateAmbient();
+}
+
+static double sensed()
+{
+  return ambientLevelQ16() / 65536.0;
+}
+
+void setUp(void)
+{
+  stubI2sSamples.clear();
+  ambientState.running = true; // AMBIENT_ENABLED is off by default
+  ambientState.primed = false;
+  ambientState.levelQ16 = 0;
+}
+
+void tearDown(void) {}
+
+// The first block primes the filter; the channel bits are masked off
+void test_first_block_primes(void)
+{
+  tick(0.5);
+  TEST_ASSERT_TRUE(ambientState.primed);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 0.5, sensed());
+}
+
+// A tick without samples leaves the level alone
+void test_no_samples(void)
+{
+  tick(0.25);
+  updateAmbient();
+  updateAmbient();
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 0.25, sensed());
+}
+
+// Step response of the 1/16 per tick moving average
+void test_step_response(void)
+{
+  tick(0.1);
+  for (int i = 0; i < 16; i++)
+    tick(0.9);
+  // 1 - (15/16)^16 = 64% of the step after 16 ticks
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 0.1 + 0.8 * (1 - pow(15.0 / 16, 16)), sensed());
+  for (int i = 0; i < 100; i++)
+    tick(0.9);
+  TEST_ASSERT_FLOAT_WITHIN(0.005, 0.9, sensed());
+}
+
+// Noisy samples average out; the output stays within the noise of the mean
+void test_noise_is_filtered(void)
+{
+  tick(0.4);
+  double low = 1, high = 0;
+  for (int i = 0; i < 500; i++)
+  {
+    tick(0.4, 600);
+    low = std::min(low, sensed());
+    high = std::max(high, sensed());
+  }
+  TEST_ASSERT_FLOAT_WITHIN(0.005, 0.4, low);
+  TEST_ASSERT_FLOAT_WITHIN(0.005, 0.4, high);
+}
+
+// Ticks that drain several DMA buffers at once average all of them
+void test_late_tick_drains_everything(void)
+{
+  tick(0.2);
+  for (int i = 0; i < 4 * AMBIENT_BLOCK_SAMPLES; i++)
+    stubI2sSamples.push_back((uint16_t)((AMBIENT_ADC_CHANNEL << 12) | AMBIENT_ADC_MAX));
+  updateAmbient();
+  TEST_ASSERT_EQUAL_INT(0, stubI2sSamples.size());
+  TEST_ASSERT_FLOAT_WITHIN(0.002, 0.2 + 0.8 / 16, sensed());
+}
+
+void test_sunrise_skip(void)
+{
+  tick(0.0);
+  TEST_ASSERT_EQUAL_INT(0, ambientBeginSunrise());
+  setUp();
+  tick(0.3);
+  TEST_ASSERT_INT_WITHIN(100, (int32_t)(0.3 / 0.6 * 65536), ambientBeginSunrise());
+  setUp();
+  tick(1.0);
+  TEST_ASSERT_EQUAL_INT(AMBIENT_MAX_SKIP_Q16, ambientBeginSunrise());
+}
+
+// Closed loop: the room's light is daylight plus the lamp's own share, and a
+// full-length sunrise is stepped through the controller tick by tick.
+// Returns the sunrise length in seconds.
+static double runSunrise(double daylight, double lampShare)
+{
+  tick(daylight);
+  double progress = ambientBeginSunrise() / 65536.0;
+  int ticks = 0;
+  while (progress < 1.0 && ticks < 1000000)
+  {
+    double output = progress * ambientState.outputScaleQ16 / 65536.0;
+    tick(std::min(1.0, daylight + lampShare * output));
+    ambientControlStep((int32_t)(progress * 65536), TICK_MS);
+    progress += (double)TICK_MS / SUNRISE_DURATION_MS * (ambientState.speedQ16 / 65536.0);
+    ticks++;
+  }
+  return ticks * TICK_MS / 1000.0;
+}
+
+// A dark room follows the curve: full length, full output
+void test_dark_room_sunrise(void)
+{
+  double seconds = runSunrise(0.0, 0.6);
+  TEST_ASSERT_FLOAT_WITHIN(2, SUNRISE_DURATION_MS / 1000.0, seconds);
+  TEST_ASSERT_EQUAL_INT(AMBIENT_FULL_SCALE, ambientState.outputScaleQ16);
+  TEST_ASSERT_EQUAL_INT(AMBIENT_FULL_SCALE, ambientState.speedQ16);
+}
+
+// A sunlit room skips ahead, runs faster and trims the output, never below
+// the floor
+void test_bright_room_sunrise(void)
+{
+  double seconds = runSunrise(0.45, 0.6);
+  TEST_ASSERT_LESS_THAN(SUNRISE_DURATION_MS / 1000 / 2, (int)seconds);
+  TEST_ASSERT_LESS_THAN(AMBIENT_FULL_SCALE, ambientState.outputScaleQ16);
+  TEST_ASSERT_GREATER_OR_EQUAL(AMBIENT_MIN_SCALE_Q16, ambientState.outputScaleQ16);
+
+  setUp();
+  runSunrise(1.0, 0.6);
+  TEST_ASSERT_EQUAL_INT(AMBIENT_MIN_SCALE_Q16, ambientState.outputScaleQ16);
+}
+
+// The level reported in /status is 0-1000
+void test_status_level(void)
+{
+  tick(0.75);
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_GET, "/status"));
+  int at = server.responseBody.indexOf("\"ambientLevel\":");
+  TEST_ASSERT_TRUE(at >= 0);
+  TEST_ASSERT_INT_WITHIN(1, 750, atoi(server.responseBody.c_str() + at + 15));
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_first_block_primes);
+  RUN_TEST(test_no_samples);
+  RUN_TEST(test_step_response);
+  RUN_TEST(test_noise_is_filtered);
+  RUN_TEST(test_late_tick_drains_everything);
+  RUN_TEST(test_sunrise_skip);
+  RUN_TEST(test_dark_room_sunrise);
+  RUN_TEST(test_bright_room_sunrise);
+  RUN_TEST(test_status_level);
+  return UNITY_END();
+}
@@ -0,0 +1,182 @@
+// Circadian mode hand-over: whatever takes the output hands it back to the
+// curve after the override timeout, except switching the light off, which
+// keeps it off until something turns it on again.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+// Run the output engines for `minutes`, a second per tick
+static void runMinutes(int minutes)
+{
+  for (int i = 0; i < minutes * 60; i++)
+  {
+    stubAdvanceUs(1000000);
+    updateManualFade();
+    updateSunset();
+    updateCircadian();
+  }
+}
+
+static bool lightIsOff()
+{
+  return alarmState.currentWarmBrightness == 0 && alarmState.currentCoolBrightness == 0;
+}
+
+// On the curve: the output is what the curve asks for right now
+static bool onCurve()
+{
+  struct tm local;
+  tzLocalTime(time(nullptr), &local);
+  int warm, cool;
+  circadianChannelsAt(local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec, warm, cool);
+  return !circadianState.overridden && !circadianState.suspended && !alarmState.isManualFadeActive &&
+         alarmState.currentWarmBrightness == levelFromBrightness(warm) &&
+         alarmState.currentCoolBrightness == levelFromBrightness(cool);
+}
+
+// A short press, acted on once the double click window has passed
+static void buttonPress()
+{
+  controlQueuePush(CONTROL_PRESS, 0);
+  updateControls();
+  stubAdvanceUs(BUTTON_DOUBLE_CLICK_MS * 1000);
+  updateControls();
+}
+
+static int post(const char *path, const char *body = nullptr)
+{
+  return stubRequest(server, HTTP_POST, path, body);
+}
+
+void setUp(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/set-circadian", "{\"enabled\": true, \"level\": 800, \"overrideMinutes\": 60}"));
+  runMinutes(1);
+  TEST_ASSERT_TRUE(onCurve());
+}
+
+void tearDown(void) {}
+
+// Manual off stays off, well past the override timeout
+void test_manual_off_stays_off(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/manual-off"));
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+  TEST_ASSERT_TRUE(circadianState.suspended);
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_GET, "/get-circadian"));
+  TEST_ASSERT_TRUE(server.responseBody.indexOf("\"isSuspended\":true") >= 0);
+
+  // Manual on ends the suspension; the curve takes over after the timeout
+  TEST_ASSERT_EQUAL_INT(200, post("/manual-on"));
+  runMinutes(30);
+  TEST_ASSERT_FALSE(circadianState.suspended);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.currentWarmBrightness);
+  runMinutes(32);
+  TEST_ASSERT_TRUE(onCurve());
+}
+
+// A non-zero setting is an override: the curve comes back
+void test_override_returns_to_curve(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/set-brightness", "{\"warm\": 300, \"cool\": 100}"));
+  runMinutes(30);
+  TEST_ASSERT_EQUAL_INT(levelFromBrightness(300), alarmState.currentWarmBrightness);
+  runMinutes(32);
+  TEST_ASSERT_TRUE(onCurve());
+}
+
+// Setting 0/0 is an off as well
+void test_set_brightness_zero_stays_off(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/set-brightness", "{\"warm\": 0, \"cool\": 0}"));
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+
+  // So is a scene recall an on
+  TEST_ASSERT_EQUAL_INT(200, post("/save-scene", "{\"id\": 3, \"name\": \"Dim\", \"warm\": 200, \"cool\": 50}"));
+  TEST_ASSERT_EQUAL_INT(200, post("/recall-scene", "{\"id\": 3}"));
+  runMinutes(62);
+  TEST_ASSERT_TRUE(onCurve());
+}
+
+// Button off, then on again
+void test_button_off_stays_off(void)
+{
+  buttonPress();
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+
+  buttonPress();
+  runMinutes(62);
+  TEST_ASSERT_TRUE(onCurve());
+}
+
+// Turning the knob down to nothing is an off
+void test_encoder_to_zero_stays_off(void)
+{
+  controlQueuePush(CONTROL_ROTATE, -(LEVEL_MAX / ENCODER_STEP + 1));
+  updateControls();
+  TEST_ASSERT_TRUE(lightIsOff());
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+}
+
+// A wind-down that ends in the dark stays dark, even when it outlasts the
+// override timeout
+void test_sunset_end_stays_off(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/start-sunset", "{\"minutes\": 90}"));
+  runMinutes(91);
+  TEST_ASSERT_FALSE(sunsetState.active);
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+}
+
+// Auto-off after a sunrise or scene is an off
+void test_auto_off_stays_off(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/save-scene", "{\"id\": 4, \"name\": \"Brief\", \"warm\": 500, \"cool\": 500, \"autoOffMinutes\": 5}"));
+  TEST_ASSERT_EQUAL_INT(200, post("/recall-scene", "{\"id\": 4}"));
+  for (int i = 0; i < 6 * 60; i++)
+  {
+    stubAdvanceUs(1000000);
+    updateAutoOff();
+    updateManualFade();
+    updateCircadian();
+  }
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+}
+
+// The suspension survives a reboot
+void test_suspension_is_saved(void)
+{
+  TEST_ASSERT_EQUAL_INT(200, post("/manual-off"));
+  runMinutes(1);
+  circadianState.suspended = false;
+  loadAlarmFromStorage();
+  TEST_ASSERT_TRUE(circadianState.suspended);
+  runMinutes(3 * 60);
+  TEST_ASSERT_TRUE(lightIsOff());
+
+  // Enabling the mode again is an explicit on
+  TEST_ASSERT_EQUAL_INT(200, post("/set-circadian", "{\"enabled\": true}"));
+  circadianState.suspended = true;
+  loadAlarmFromStorage();
+  TEST_ASSERT_FALSE(circadianState.suspended);
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_manual_off_stays_off);
+  RUN_TEST(test_override_returns_to_curve);
+  RUN_TEST(test_set_brightness_zero_stays_off);
+  RUN_TEST(test_button_off_stays_off);
+  RUN_TEST(test_encoder_to_zero_stays_off);
+  RUN_TEST(test_sunset_end_stays_off);
+  RUN_TEST(test_auto_off_stays_off);
+  RUN_TEST(test_suspension_is_saved);
+  return UNITY_END();
+}
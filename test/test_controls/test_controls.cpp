@@ -0,0 +1,341 @@
+// Button and encoder decoding from synthetic edge streams: clean and bouncy
+// contacts are driven into the GPIO handlers with stubPinEdge() and the
+// events that reach the control queue are checked.
+#include <unity.h>
+#include <vector>
+#include "../../src/main.cpp"
+
+static std::vector<ControlEvent> drain()
+{
+  std::vector<ControlEvent> events;
+  ControlEvent event;
+  while (controlQueuePop(event))
+    events.push_back(event);
+  return events;
+}
+
+static void waitMs(unsigned long ms)
+{
+  stubAdvanceUs((int64_t)ms * 1000);
+}
+
+// Contact bounce: a few fast toggles before the level settles
+static void bouncyEdge(int pin, int level)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    stubPinEdge(pin, level);
+    waitMs(1);
+    stubPinEdge(pin, !level);
+    waitMs(1);
+  }
+  stubPinEdge(pin, level);
+}
+
+static void press(unsigned long holdMs, bool bouncy)
+{
+  if (bouncy)
+    bouncyEdge(BUTTON_PIN, LOW);
+  else
+    stubPinEdge(BUTTON_PIN, LOW);
+  waitMs(holdMs);
+  if (bouncy)
+    bouncyEdge(BUTTON_PIN, HIGH);
+  else
+    stubPinEdge(BUTTON_PIN, HIGH);
+  waitMs(200);
+}
+
+// One detent is four quadrature transitions from rest (both high): A leads
+// B clockwise, B leads A counter-clockwise
+static void detent(int direction, unsigned long gapMs, bool bouncy)
+{
+  static const int cw[4][2] = {{LOW, HIGH}, {LOW, LOW}, {HIGH, LOW}, {HIGH, HIGH}};
+  static const int ccw[4][2] = {{HIGH, LOW}, {LOW, LOW}, {LOW, HIGH}, {HIGH, HIGH}};
+  for (int i = 0; i < 4; i++)
+  {
+    const int *ab = direction > 0 ? cw[i] : ccw[i];
+    bool aChanges = digitalRead(ENCODER_A_PIN) != ab[0];
+    int pin = aChanges ? ENCODER_A_PIN : ENCODER_B_PIN;
+    int level = aChanges ? ab[0] : ab[1];
+    if (bouncy)
+    {
+      stubPinEdge(pin, level);
+      stubPinEdge(pin, !level);
+    }
+    stubPinEdge(pin, level);
+  }
+  waitMs(gapMs);
+}
+
+void setUp(void)
+{
+  waitMs(1000);
+  drain();
+  controlQueue.dropped = 0;
+}
+
+void tearDown(void) {}
+
+void test_clean_press(void)
+{
+  press(100, false);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(1, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+}
+
+void test_bouncy_press_is_one_event(void)
+{
+  for (int i = 0; i < 10; i++)
+    press(120, true);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(10, events.size());
+  for (size_t i = 0; i < events.size(); i++)
+    TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[i].type);
+}
+
+void test_long_press(void)
+{
+  press(BUTTON_LONG_PRESS_MS - 50, true);
+  press(BUTTON_LONG_PRESS_MS + 50, true);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(2, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+  TEST_ASSERT_EQUAL_INT(CONTROL_LONG_PRESS, events[1].type);
+}
+
+// A tap shorter than the debounce window is read once the contacts are quiet
+void test_tap_shorter_than_debounce(void)
+{
+  stubPinEdge(BUTTON_PIN, LOW);
+  waitMs(BUTTON_DEBOUNCE_MS / 2);
+  stubPinEdge(BUTTON_PIN, HIGH);
+  waitMs(BUTTON_DEBOUNCE_MS);
+  buttonSettle();
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(1, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+
+  // and the button is not left held
+  press(100, false);
+  events = drain();
+  TEST_ASSERT_EQUAL_INT(1, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+}
+
+// Release bounce that outlasts the window, starting with a closed read
+void test_long_release_bounce(void)
+{
+  stubPinEdge(BUTTON_PIN, LOW);
+  waitMs(100);
+  for (unsigned long t = 0; t < 2 * BUTTON_DEBOUNCE_MS; t += 5)
+  {
+    stubPinEdge(BUTTON_PIN, (t / 5) % 2 ? HIGH : LOW);
+    waitMs(5);
+  }
+  stubPinEdge(BUTTON_PIN, HIGH);
+  waitMs(BUTTON_DEBOUNCE_MS);
+  buttonSettle();
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(1, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+
+  // The next press is a short press, not a long one
+  press(100, true);
+  buttonSettle();
+  events = drain();
+  TEST_ASSERT_EQUAL_INT(1, events.size());
+  TEST_ASSERT_EQUAL_INT(CONTROL_PRESS, events[0].type);
+}
+
+void test_slow_detents(void)
+{
+  for (int i = 0; i < 5; i++)
+    detent(1, 200, false);
+  for (int i = 0; i < 3; i++)
+    detent(-1, 200, false);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(8, events.size());
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    TEST_ASSERT_EQUAL_INT(CONTROL_ROTATE, events[i].type);
+    TEST_ASSERT_EQUAL_INT(i < 5 ? 1 : -1, events[i].delta);
+  }
+}
+
+// Bouncing contacts make transitions that cancel out
+void test_bouncy_detents(void)
+{
+  for (int i = 0; i < 6; i++)
+    detent(1, 200, true);
+  for (int i = 0; i < 6; i++)
+    detent(-1, 200, true);
+  std::vector<ControlEvent> events = drain();
+  int sum = 0;
+  for (size_t i = 0; i < events.size(); i++)
+    sum += events[i].delta;
+  TEST_ASSERT_EQUAL_INT(12, events.size());
+  TEST_ASSERT_EQUAL_INT(0, sum);
+  TEST_ASSERT_EQUAL_INT(1, events[0].delta);
+  TEST_ASSERT_EQUAL_INT(-1, events[11].delta);
+}
+
+// Turning partway and back is no detent; a detent with a missed edge still is
+void test_wiggle_and_missed_edge(void)
+{
+  stubPinEdge(ENCODER_A_PIN, LOW);
+  stubPinEdge(ENCODER_B_PIN, LOW);
+  stubPinEdge(ENCODER_B_PIN, HIGH);
+  stubPinEdge(ENCODER_A_PIN, HIGH);
+  TEST_ASSERT_EQUAL_INT(0, drain().size());
+
+  stubPinEdge(ENCODER_A_PIN, LOW); // 01
+  stubPinLevel[ENCODER_B_PIN] = LOW;
+  stubPinEdge(ENCODER_A_PIN, HIGH); // 10: the B edge was missed
+  stubPinEdge(ENCODER_B_PIN, HIGH); // 11
+  waitMs(200);
+  detent(1, 200, false);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(2, events.size());
+  TEST_ASSERT_EQUAL_INT(1, events[0].delta);
+  TEST_ASSERT_EQUAL_INT(1, events[1].delta);
+}
+
+void test_fast_turns_accelerate(void)
+{
+  detent(1, ENCODER_MEDIUM_MS + 20, false);
+  detent(1, (ENCODER_MEDIUM_MS + ENCODER_FAST_MS) / 2, false);
+  detent(1, ENCODER_FAST_MS / 2, false);
+  detent(1, 200, false);
+  std::vector<ControlEvent> events = drain();
+  TEST_ASSERT_EQUAL_INT(4, events.size());
+  TEST_ASSERT_EQUAL_INT(1, events[0].delta);
+  TEST_ASSERT_EQUAL_INT(1, events[1].delta); // the gap before a detent sets its speed
+  TEST_ASSERT_EQUAL_INT(ENCODER_MEDIUM_MULTIPLIER, events[2].delta);
+  TEST_ASSERT_EQUAL_INT(ENCODER_FAST_MULTIPLIER, events[3].delta);
+}
+
+// A full ring drops new events and counts them
+void test_queue_overflow(void)
+{
+  for (int i = 0; i < CONTROL_QUEUE_SIZE + 5; i++)
+    detent(1, 200, false);
+  TEST_ASSERT_EQUAL_INT(CONTROL_QUEUE_SIZE - 1, drain().size());
+  TEST_ASSERT_EQUAL_UINT32(6, controlQueue.dropped);
+}
+
+// loop() side: detents scale the output, a burst is applied as one update
+void test_detents_adjust_brightness(void)
+{
+  setBrightness(LEVEL_MAX / 2, LEVEL_MAX / 4);
+  uint32_t frames = pwmState.framesCommitted;
+  for (int i = 0; i < 3; i++)
+    detent(1, 200, false);
+  updateControls();
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX / 2 + 3 * ENCODER_STEP, alarmState.currentWarmBrightness);
+  TEST_ASSERT_INT_WITHIN(1, (LEVEL_MAX / 2 + 3 * ENCODER_STEP) / 2, alarmState.currentCoolBrightness);
+  TEST_ASSERT_EQUAL_UINT32(frames + 1, pwmState.framesCommitted);
+}
+
+static void saveButtonScene()
+{
+  char body[128];
+  snprintf(body, sizeof(body), "{\"id\": %d, \"name\": \"Reading\", \"warm\": 800, \"cool\": 300}", BUTTON_SCENE_ID);
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_POST, "/save-scene", body));
+}
+
+// Without a button scene there is no double click to wait for: every press
+// toggles at once, a quick second one too
+void test_press_toggles_at_once_without_scene(void)
+{
+  setBrightness(0, 0);
+  alarmState.isManualFadeActive = false;
+  press(80, true);
+  updateControls();
+  TEST_ASSERT_TRUE(alarmState.isManualFadeActive);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.manualTargetWarm);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.manualTargetCool);
+
+  setBrightness(LEVEL_MAX, LEVEL_MAX); // as if the fade had run
+  press(80, true);
+  updateControls();
+  TEST_ASSERT_EQUAL_INT(0, alarmState.manualTargetWarm);
+  TEST_ASSERT_EQUAL_INT(0, alarmState.manualTargetCool);
+}
+
+// With one, a single press toggles once the double click window has passed
+void test_press_toggles_after_window(void)
+{
+  saveButtonScene();
+  setBrightness(0, 0);
+  alarmState.isManualFadeActive = false;
+  press(80, true);
+  updateControls();
+  TEST_ASSERT_FALSE(alarmState.isManualFadeActive);
+  waitMs(BUTTON_DOUBLE_CLICK_MS);
+  updateControls();
+  TEST_ASSERT_TRUE(alarmState.isManualFadeActive);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.manualTargetWarm);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.manualTargetCool);
+}
+
+// Two presses in the window recall the button's scene instead
+void test_double_click_recalls_scene(void)
+{
+  saveButtonScene();
+  setBrightness(0, 0);
+  alarmState.isManualFadeActive = false;
+
+  stubPinEdge(BUTTON_PIN, LOW);
+  waitMs(80);
+  stubPinEdge(BUTTON_PIN, HIGH);
+  waitMs(20);
+  updateControls(); // the first press arrives on its own tick
+  waitMs(100);
+  stubPinEdge(BUTTON_PIN, LOW);
+  waitMs(80);
+  stubPinEdge(BUTTON_PIN, HIGH);
+  updateControls();
+  TEST_ASSERT_TRUE(alarmState.isManualFadeActive);
+  TEST_ASSERT_EQUAL_INT(levelFromBrightness(800), alarmState.manualTargetWarm);
+  TEST_ASSERT_EQUAL_INT(levelFromBrightness(300), alarmState.manualTargetCool);
+  // and no toggle follows
+  waitMs(BUTTON_DOUBLE_CLICK_MS);
+  updateControls();
+  TEST_ASSERT_EQUAL_INT(levelFromBrightness(800), alarmState.manualTargetWarm);
+
+  // A scene deleted after the first press: the held press still toggles
+  press(80, false);
+  updateControls();
+  char body[32];
+  snprintf(body, sizeof(body), "{\"id\": %d}", BUTTON_SCENE_ID);
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_POST, "/delete-scene", body));
+  setBrightness(0, 0);
+  alarmState.isManualFadeActive = false;
+  press(80, false);
+  updateControls();
+  TEST_ASSERT_TRUE(alarmState.isManualFadeActive);
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, alarmState.manualTargetWarm);
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_clean_press);
+  RUN_TEST(test_bouncy_press_is_one_event);
+  RUN_TEST(test_long_press);
+  RUN_TEST(test_tap_shorter_than_debounce);
+  RUN_TEST(test_long_release_bounce);
+  RUN_TEST(test_slow_detents);
+  RUN_TEST(test_bouncy_detents);
+  RUN_TEST(test_wiggle_and_missed_edge);
+  RUN_TEST(test_fast_turns_accelerate);
+  RUN_TEST(test_queue_overflow);
+  RUN_TEST(test_detents_adjust_brightness);
+  RUN_TEST(test_press_toggles_at_once_without_scene);
+  RUN_TEST(test_press_toggles_after_window);
+  RUN_TEST(test_double_click_recalls_scene);
+  return UNITY_END();
+}
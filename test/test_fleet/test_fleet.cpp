@@ -0,0 +1,360 @@
+// tools/fleet.cpp against a pool of mock lights: each one is a loopback HTTP
+// server on its own thread that speaks just enough of the light's API
+// (/status, /set-alarm, /toggle-alarm) and can be slow, flaky, strict or
+// gone. Built in env:native-tools (no firmware, no stubs).
+#include <unity.h>
+#define main fleetMain
+#include "../../tools/fleet.cpp"
+#undef main
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+enum MockMode
+{
+  MOCK_OK,
+  MOCK_SLOW,   // answers after MOCK_SLOW_MS
+  MOCK_FLAKY,  // 500 for the first `failures` requests
+  MOCK_REJECT, // 400 for every change
+  MOCK_DEAD,   // nothing listening
+};
+
+static const int MOCK_SLOW_MS = 1500;
+static std::atomic<int> generation(0); // current test; only its lights count as in flight
+static std::atomic<int> inFlight(0);
+static std::atomic<int> maxInFlight(0);
+
+struct MockLight
+{
+  MockMode mode = MOCK_OK;
+  int generation = 0;
+  int port = 0;
+  int listenFd = -1;
+  int delayMs = 5;  // per request
+  int failures = 2; // MOCK_FLAKY
+  std::string token;
+  // Guarded by lock
+  std::mutex lock;
+  int hour = 7;
+  int minute = 0;
+  bool set = false;
+  int requests = 0;
+  int posts = 0;
+  int dated = 0; // requests with a Date header
+};
+
+static std::vector<MockLight *> pool; // never freed: server threads outlive their test
+
+static std::string httpResponse(int code, const std::string &body)
+{
+  return "HTTP/1.1 " + std::to_string(code) + " X\r\nContent-Length: " + std::to_string(body.size()) +
+         "\r\nConnection: close\r\n\r\n" + body;
+}
+
+static std::string mockHandle(MockLight &m, const std::string &request, const std::string &body)
+{
+  std::lock_guard<std::mutex> guard(m.lock);
+  m.requests++;
+  if (request.find("\r\nDate: ") != std::string::npos)
+    m.dated++;
+  if (!m.token.empty() && request.find("\r\nAuthorization: Bearer " + m.token + "\r\n") == std::string::npos)
+    return httpResponse(401, "Unauthorized");
+  if (m.mode == MOCK_FLAKY && m.failures > 0)
+  {
+    m.failures--;
+    return httpResponse(500, "busy");
+  }
+
+  if (request.compare(0, 12, "GET /status ") == 0)
+  {
+    char status[160];
+    snprintf(status, sizeof(status), "{\"currentTime\":\"12:00:00\",\"alarmTime\":\"%d:%02d\",\"isAlarmSet\":%s,\"isSunriseActive\":false}",
+             m.hour, m.minute, m.set ? "true" : "false");
+    return httpResponse(200, status);
+  }
+  m.posts++;
+  if (m.mode == MOCK_REJECT)
+    return httpResponse(400, "Invalid time");
+  if (request.compare(0, 15, "POST /set-alarm") == 0 &&
+      sscanf(body.c_str(), "{\"hour\":%d,\"minute\":%d}", &m.hour, &m.minute) == 2)
+  {
+    m.set = true;
+    return httpResponse(200, "Alarm set");
+  }
+  if (request.compare(0, 18, "POST /toggle-alarm") == 0)
+  {
+    m.set = body.find("true") != std::string::npos;
+    return httpResponse(200, m.set ? "{\"enabled\":true}" : "{\"enabled\":false}");
+  }
+  return httpResponse(404, "Not found");
+}
+
+static void mockServe(MockLight *m, int fd)
+{
+  bool counted = m->generation == generation;
+  if (counted)
+  {
+    int now = ++inFlight;
+    int seen = maxInFlight.load();
+    while (now > seen && !maxInFlight.compare_exchange_weak(seen, now))
+      ;
+  }
+
+  std::string request;
+  char buf[1024];
+  size_t headerEnd;
+  while ((headerEnd = request.find("\r\n\r\n")) == std::string::npos)
+  {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    request.append(buf, n);
+  }
+  if (headerEnd != std::string::npos)
+  {
+    size_t lengthAt = request.find("Content-Length: ");
+    size_t length = lengthAt == std::string::npos ? 0 : atoi(request.c_str() + lengthAt + 16);
+    while (request.size() < headerEnd + 4 + length)
+    {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0)
+        break;
+      request.append(buf, n);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(m->mode == MOCK_SLOW ? MOCK_SLOW_MS : m->delayMs));
+    std::string response = mockHandle(*m, request, request.substr(headerEnd + 4));
+    send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+  }
+  if (counted && m->generation == generation)
+    --inFlight;
+  close(fd);
+}
+
+static void mockAccept(MockLight *m)
+{
+  for (;;)
+  {
+    int fd = accept(m->listenFd, nullptr, nullptr);
+    if (fd < 0)
+      return;
+    std::thread(mockServe, m, fd).detach();
+  }
+}
+
+static MockLight &addLight(MockMode mode)
+{
+  pool.push_back(new MockLight);
+  MockLight &m = *pool.back();
+  m.mode = mode;
+  m.generation = generation;
+  m.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(m.listenFd, (sockaddr *)&addr, sizeof(addr));
+  getsockname(m.listenFd, (sockaddr *)&addr, &len);
+  m.port = ntohs(addr.sin_port);
+  if (mode == MOCK_DEAD)
+  {
+    close(m.listenFd); // the port is refused from now on
+    return m;
+  }
+  listen(m.listenFd, 64);
+  std::thread(mockAccept, &m).detach();
+  return m;
+}
+
+// Run the fleet over every light in the pool
+static std::vector<Device> runFleet(const Options &opt)
+{
+  std::vector<Device> devices;
+  for (MockLight *m : pool)
+    addDevice(devices, "127.0.0.1:" + std::to_string(m->port));
+  for (Device &d : devices)
+    resolve(d);
+  run(devices, opt);
+  return devices;
+}
+
+static Options target()
+{
+  Options opt;
+  opt.hour = 6;
+  opt.minute = 45;
+  opt.enabled = 1;
+  opt.timeoutMs = 1000;
+  opt.backoffMs = 20;
+  return opt;
+}
+
+void setUp(void)
+{
+  pool.clear(); // the lights of earlier tests keep serving, unused
+  generation++;
+  inFlight = 0;
+  maxInFlight = 0;
+}
+
+void tearDown(void) {}
+
+// A mixed pool ends up at the target; lights that were right only get read
+void test_pool_reaches_target(void)
+{
+  for (int i = 0; i < 24; i++)
+  {
+    MockLight &m = addLight(MOCK_OK);
+    m.hour = i % 3 == 0 ? 6 : 5;
+    m.minute = 45;
+    m.set = i % 2 == 0;
+  }
+  std::vector<Device> devices = runFleet(target());
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    MockLight &m = *pool[i];
+    TEST_ASSERT_FALSE_MESSAGE(devices[i].failed, devices[i].detail.c_str());
+    TEST_ASSERT_EQUAL_INT(6, m.hour);
+    TEST_ASSERT_EQUAL_INT(45, m.minute);
+    TEST_ASSERT_TRUE(m.set);
+    TEST_ASSERT_EQUAL_INT(m.requests, m.dated);
+    if (i % 6 == 0) // 6:45 and on already
+    {
+      TEST_ASSERT_EQUAL_STRING("unchanged", devices[i].detail.c_str());
+      TEST_ASSERT_EQUAL_INT(1, m.requests);
+    }
+    else
+    {
+      TEST_ASSERT_EQUAL_STRING("changed", devices[i].detail.c_str());
+      TEST_ASSERT_EQUAL_INT(1, m.posts);
+    }
+  }
+
+  // A second run finds nothing to do
+  devices = runFleet(target());
+  for (size_t i = 0; i < devices.size(); i++)
+    TEST_ASSERT_EQUAL_STRING("unchanged", devices[i].detail.c_str());
+}
+
+// Switching alarms off leaves the times alone; set-alarm would enable them
+void test_disable_only_toggles(void)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    MockLight &m = addLight(MOCK_OK);
+    m.hour = 5 + i;
+    m.set = true;
+  }
+  Options opt = target();
+  opt.hour = -1;
+  opt.enabled = 0;
+  std::vector<Device> devices = runFleet(opt);
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    TEST_ASSERT_FALSE(devices[i].failed);
+    TEST_ASSERT_FALSE(pool[i]->set);
+    TEST_ASSERT_EQUAL_INT(5 + (int)i, pool[i]->hour);
+    TEST_ASSERT_EQUAL_INT(1, pool[i]->posts);
+  }
+}
+
+void test_dry_run_changes_nothing(void)
+{
+  addLight(MOCK_OK);
+  Options opt = target();
+  opt.dryRun = true;
+  std::vector<Device> devices = runFleet(opt);
+  TEST_ASSERT_FALSE(devices[0].failed);
+  TEST_ASSERT_EQUAL_STRING("would change, is 7:00 off", devices[0].detail.c_str());
+  TEST_ASSERT_EQUAL_INT(0, pool[0]->posts);
+}
+
+// 5xx is retried with backoff, up to --retries
+void test_flaky_light_is_retried(void)
+{
+  addLight(MOCK_FLAKY).failures = 2;
+  addLight(MOCK_FLAKY).failures = 3;
+  std::vector<Device> devices = runFleet(target());
+  TEST_ASSERT_FALSE(devices[0].failed);
+  TEST_ASSERT_TRUE(pool[0]->set);
+  TEST_ASSERT_TRUE(devices[1].failed);
+  TEST_ASSERT_EQUAL_STRING("HTTP 500 after 3 attempts", devices[1].detail.c_str());
+  TEST_ASSERT_EQUAL_INT(3, devices[1].attempts);
+}
+
+// 4xx fails at once
+void test_rejected_change_is_not_retried(void)
+{
+  addLight(MOCK_REJECT);
+  std::vector<Device> devices = runFleet(target());
+  TEST_ASSERT_TRUE(devices[0].failed);
+  TEST_ASSERT_EQUAL_STRING("HTTP 400: Invalid time", devices[0].detail.c_str());
+  TEST_ASSERT_EQUAL_INT(1, pool[0]->posts);
+}
+
+// A slow or missing light fails on its own without holding up the others
+void test_slow_and_dead_lights_fail_alone(void)
+{
+  addLight(MOCK_SLOW);
+  addLight(MOCK_DEAD);
+  for (int i = 0; i < 8; i++)
+    addLight(MOCK_OK);
+  Options opt = target();
+  opt.timeoutMs = 300;
+  opt.retries = 1;
+  int64_t start = nowUs();
+  std::vector<Device> devices = runFleet(opt);
+  TEST_ASSERT_TRUE(devices[0].failed);
+  TEST_ASSERT_EQUAL_STRING("timeout after 2 attempts", devices[0].detail.c_str());
+  TEST_ASSERT_TRUE(devices[1].failed);
+  TEST_ASSERT_TRUE(devices[1].detail.find("Connection refused") != std::string::npos);
+  for (size_t i = 2; i < devices.size(); i++)
+  {
+    TEST_ASSERT_FALSE(devices[i].failed);
+    TEST_ASSERT_LESS_THAN(200000, (int)(devices[i].finished - devices[i].started));
+  }
+  TEST_ASSERT_LESS_THAN(MOCK_SLOW_MS * 1000, (int)(nowUs() - start));
+}
+
+// No more than --jobs lights are talked to at once
+void test_jobs_limit_concurrency(void)
+{
+  for (int i = 0; i < 24; i++)
+    addLight(MOCK_OK).delayMs = 30;
+  Options opt = target();
+  opt.jobs = 4;
+  std::vector<Device> devices = runFleet(opt);
+  for (size_t i = 0; i < devices.size(); i++)
+    TEST_ASSERT_FALSE(devices[i].failed);
+  TEST_ASSERT_LESS_OR_EQUAL(4, maxInFlight.load());
+  TEST_ASSERT_GREATER_OR_EQUAL(2, maxInFlight.load());
+}
+
+// --token is sent with every request
+void test_token_is_sent(void)
+{
+  addLight(MOCK_OK).token = "secret";
+  addLight(MOCK_OK).token = "secret";
+  Options opt = target();
+  std::vector<Device> devices = runFleet(opt);
+  TEST_ASSERT_TRUE(devices[0].failed);
+  TEST_ASSERT_EQUAL_STRING("HTTP 401: Unauthorized", devices[0].detail.c_str());
+  opt.token = "secret";
+  devices = runFleet(opt);
+  TEST_ASSERT_FALSE(devices[1].failed);
+  TEST_ASSERT_TRUE(pool[1]->set);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_pool_reaches_target);
+  RUN_TEST(test_disable_only_toggles);
+  RUN_TEST(test_dry_run_changes_nothing);
+  RUN_TEST(test_flaky_light_is_retried);
+  RUN_TEST(test_rejected_change_is_not_retried);
+  RUN_TEST(test_slow_and_dead_lights_fail_alone);
+  RUN_TEST(test_jobs_limit_concurrency);
+  RUN_TEST(test_token_is_sent);
+  return UNITY_END();
+}
@@ -0,0 +1,318 @@
+// Group sync over real sockets: the firmware's group task runs on a host
+// thread with a loopback UDP socket (unicast to the test instead of the
+// multicast group), and the test plays the other lights on a second socket:
+// node 2, which leads, and later node 1, a newcomer. Both sides use the
+// host's monotonic clock.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+static const uint32_t NEWCOMER_ID = 1;
+static const uint32_t PEER_ID = 2;
+static const uint32_t LIGHT_ID = 3;
+static const int64_t PEER_OFFSET_US = 5000000; // the leader's clock runs 5 s ahead
+enum
+{
+  NEWCOMER_ABSENT,
+  NEWCOMER_BOOTING, // no timebase yet: answers with its own clock
+  NEWCOMER_SYNCED   // has the leader's offset
+};
+static int newcomer = NEWCOMER_ABSENT;
+static int peerSock = -1;
+static struct sockaddr_in lightAddr;
+static const char *peerKey = nullptr; // signs the peer's packets (nullptr = unsigned)
+static GroupPacket lastHeard;         // last packet the light sent
+
+static int openSocket(struct sockaddr_in &addr, long timeoutUs)
+{
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  TEST_ASSERT_TRUE(sock >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  TEST_ASSERT_EQUAL_INT(0, bind(sock, (struct sockaddr *)&addr, sizeof(addr)));
+  TEST_ASSERT_EQUAL_INT(0, getsockname(sock, (struct sockaddr *)&addr, &len));
+  struct timeval timeout = {0, (suseconds_t)timeoutUs};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+static void signPacket(GroupPacket &packet, const char *key)
+{
+  memset(packet.tag, 0, sizeof(packet.tag));
+  if (!key)
+    return;
+  uint8_t mac[32];
+  groupHmac((const uint8_t *)key, strlen(key), (const uint8_t *)&packet, offsetof(GroupPacket, tag), mac);
+  memcpy(packet.tag, mac, GROUP_TAG_BYTES);
+}
+
+static void peerSend(GroupPacket packet, uint32_t id = PEER_ID)
+{
+  static uint16_t seq = 0;
+  packet.magic = GROUP_MAGIC;
+  packet.flags = id == PEER_ID || newcomer == NEWCOMER_SYNCED ? GROUP_FLAG_TIMEBASE : 0;
+  packet.nodeId = id;
+  packet.seq = seq++;
+  signPacket(packet, peerKey);
+  sendto(peerSock, &packet, sizeof(packet), 0, (struct sockaddr *)&lightAddr, sizeof(lightAddr));
+}
+
+static void peerReply(const GroupPacket &request, int64_t rxUs, uint32_t id, int64_t offsetUs)
+{
+  GroupPacket reply = {};
+  reply.type = GROUP_SYNC_RESPONSE;
+  reply.target = request.nodeId;
+  reply.t1 = request.t1;
+  reply.t2 = rxUs + offsetUs;
+  reply.t3 = esp_timer_get_time() + offsetUs;
+  peerSend(reply, id);
+}
+
+// Lead the group for `ms`: beacon once a second and answer sync requests.
+// A newcomer that is around beacons and answers as well; the light only
+// takes the answers of the one it follows.
+static void peerRun(int ms)
+{
+  int64_t until = esp_timer_get_time() + ms * 1000LL;
+  static int64_t nextBeacon = 0;
+  while (esp_timer_get_time() < until)
+  {
+    if (esp_timer_get_time() >= nextBeacon)
+    {
+      GroupPacket beacon = {};
+      beacon.type = GROUP_BEACON;
+      peerSend(beacon);
+      if (newcomer != NEWCOMER_ABSENT)
+        peerSend(beacon, NEWCOMER_ID);
+      nextBeacon = esp_timer_get_time() + GROUP_BEACON_MS * 1000;
+    }
+    GroupPacket packet;
+    int received = recv(peerSock, &packet, sizeof(packet), 0);
+    int64_t rxUs = esp_timer_get_time();
+    if (received != (int)sizeof(packet))
+      continue;
+    lastHeard = packet;
+    if (packet.type == GROUP_SYNC_REQUEST)
+    {
+      peerReply(packet, rxUs, PEER_ID, PEER_OFFSET_US);
+      if (newcomer != NEWCOMER_ABSENT)
+        peerReply(packet, rxUs, NEWCOMER_ID, newcomer == NEWCOMER_SYNCED ? PEER_OFFSET_US : 0);
+    }
+  }
+}
+
+static uint32_t leaderId()
+{
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  uint32_t leader = groupState.leaderId;
+  xSemaphoreGive(groupLock);
+  return leader;
+}
+
+static int64_t offsetUs()
+{
+  xSemaphoreTake(groupLock, portMAX_DELAY);
+  int64_t offset = groupState.offsetUs;
+  xSemaphoreGive(groupLock);
+  return offset;
+}
+
+// Announce a sunrise that started `agoSeconds` ago on group time, then run
+// the light's loop side
+static void peerStartSunrise(int agoSeconds)
+{
+  GroupPacket start = {};
+  start.type = GROUP_START_SUNRISE;
+  start.startUs = groupNowUs() - agoSeconds * 1000000LL;
+  peerSend(start);
+  peerRun(200);
+  updateGroup();
+}
+
+static void setAlarmIn(int minutes)
+{
+  struct tm local;
+  tzLocalTime(time(nullptr) + minutes * 60, &local);
+  alarmState.hour = local.tm_hour;
+  alarmState.minute = local.tm_min;
+  alarmState.isAlarmSet = true;
+}
+
+void setUp(void)
+{
+  alarmState.isAlarmSet = false;
+  alarmState.isSunriseActive = false;
+  alarmState.isManualFadeActive = false;
+  snoozeState.active = false;
+  setBrightness(0, 0);
+  groupState.sunriseStartUs = 0;
+}
+
+void tearDown(void)
+{
+  API_TOKEN = "";
+  peerKey = nullptr;
+  newcomer = NEWCOMER_ABSENT;
+}
+
+// RFC 4231 test cases 2 and 6 (a key longer than the block is hashed first)
+void test_hmac_known_answers(void)
+{
+  static const uint8_t expect2[32] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24,
+                                      0x26, 0x08, 0x95, 0x75, 0xc7, 0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27,
+                                      0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43};
+  static const uint8_t expect6[32] = {0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26,
+                                      0xaa, 0xcb, 0xf5, 0xb7, 0x7f, 0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28,
+                                      0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54};
+  uint8_t mac[32];
+  const char *data = "what do ya want for nothing?";
+  groupHmac((const uint8_t *)"Jefe", 4, (const uint8_t *)data, strlen(data), mac);
+  TEST_ASSERT_EQUAL_MEMORY(expect2, mac, 32);
+
+  uint8_t key[131];
+  memset(key, 0xaa, sizeof(key));
+  data = "Test Using Larger Than Block-Size Key - Hash Key First";
+  groupHmac(key, sizeof(key), (const uint8_t *)data, strlen(data), mac);
+  TEST_ASSERT_EQUAL_MEMORY(expect6, mac, 32);
+}
+
+// The light follows the lower node ID and measures its offset to it
+void test_follower_syncs_to_leader(void)
+{
+  TEST_ASSERT_FALSE(groupIsSynced()); // nothing heard yet
+  peerRun(4000);
+  TEST_ASSERT_EQUAL_UINT32(PEER_ID, leaderId());
+  TEST_ASSERT_TRUE(groupIsSynced());
+  TEST_ASSERT_INT_WITHIN(5000, PEER_OFFSET_US, (int32_t)offsetUs());
+}
+
+// Another light's sunrise does not wake a light whose alarm is off or far away
+void test_sunrise_needs_own_alarm(void)
+{
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+
+  setAlarmIn(3 * 60);
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+}
+
+// With its own alarm due within the window, the light joins on group time
+void test_sunrise_joined_when_due(void)
+{
+  setAlarmIn(GROUP_JOIN_WINDOW_MINUTES - 2);
+  peerStartSunrise(10);
+  TEST_ASSERT_TRUE(alarmState.isSunriseActive);
+  TEST_ASSERT_INT_WITHIN(1000000, 10000000, (int32_t)(groupNowUs() - groupState.sunriseStartUs));
+}
+
+// A snoozed light, or one somebody is using, stays as it is
+void test_snoozed_or_busy_light_stays(void)
+{
+  setAlarmIn(1);
+  snoozeState.active = true;
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+
+  snoozeState.active = false;
+  setBrightness(LEVEL_MAX / 2, 0);
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+}
+
+// A sunrise this light started moves to an earlier group start, never a later one
+void test_own_sunrise_aligns(void)
+{
+  startSunrise();
+  int64_t own = groupNowUs();
+  groupState.sunriseStartUs = own;
+  peerStartSunrise(0); // later than ours
+  TEST_ASSERT_TRUE(groupState.sunriseStartUs == own);
+  peerStartSunrise(30);
+  TEST_ASSERT_INT_WITHIN(1000000, 30000000, (int32_t)(own - groupState.sunriseStartUs));
+}
+
+// Starts in the future are not believed
+void test_future_start_is_ignored(void)
+{
+  setAlarmIn(1);
+  peerStartSunrise(-60);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+}
+
+// With an API token, only packets signed with the group key count, and the
+// light signs its own
+void test_signed_packets(void)
+{
+  API_TOKEN = "secret";
+  setAlarmIn(1);
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+  peerKey = "guess";
+  peerStartSunrise(10);
+  TEST_ASSERT_FALSE(alarmState.isSunriseActive);
+  peerKey = "secret";
+  peerStartSunrise(10);
+  TEST_ASSERT_TRUE(alarmState.isSunriseActive);
+
+  peerRun(1500);
+  GroupPacket heard = lastHeard;
+  TEST_ASSERT_EQUAL_UINT32(LIGHT_ID, heard.nodeId);
+  signPacket(heard, "secret");
+  TEST_ASSERT_EQUAL_MEMORY(heard.tag, lastHeard.tag, GROUP_TAG_BYTES);
+}
+
+// A light with a lower ID that boots during a grouped sunrise only leads once
+// it has synced, so the group clock, and the sunrise on it, do not move
+void test_lower_id_newcomer_keeps_timebase(void)
+{
+  setAlarmIn(1);
+  int64_t announcedUs = esp_timer_get_time();
+  peerStartSunrise(10);
+  TEST_ASSERT_TRUE(alarmState.isSunriseActive);
+
+  newcomer = NEWCOMER_BOOTING;
+  peerRun(GROUP_PEER_TIMEOUT_MS + 1000);
+  TEST_ASSERT_EQUAL_UINT32(PEER_ID, leaderId());
+  TEST_ASSERT_INT_WITHIN(5000, PEER_OFFSET_US, (int32_t)offsetUs());
+
+  newcomer = NEWCOMER_SYNCED;
+  peerRun(3000);
+  TEST_ASSERT_EQUAL_UINT32(NEWCOMER_ID, leaderId());
+  TEST_ASSERT_TRUE(groupIsSynced());
+  TEST_ASSERT_INT_WITHIN(5000, PEER_OFFSET_US, (int32_t)offsetUs());
+
+  updateSunrise();
+  TEST_ASSERT_TRUE(alarmState.isSunriseActive);
+  int64_t elapsedUs = 10000000 + (esp_timer_get_time() - announcedUs);
+  TEST_ASSERT_INT_WITHIN(50000, elapsedUs, (int32_t)(groupNowUs() - groupState.sunriseStartUs));
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  stubClock.real = true; // the group task runs on its own thread
+  struct timeval wall = {1750000000, 0};
+  settimeofday(&wall, nullptr);
+
+  struct sockaddr_in peerAddr;
+  peerSock = openSocket(peerAddr, 20000);
+  groupState.nodeId = LIGHT_ID;
+  groupState.startedMillis = millis();
+  groupState.groupAddr = peerAddr;
+  groupState.sock = openSocket(lightAddr, GROUP_RECV_TIMEOUT_MS * 1000);
+  xTaskCreatePinnedToCore(groupTask, "group", GROUP_TASK_STACK, nullptr, 2, &groupTaskHandle, GROUP_TASK_CORE);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_hmac_known_answers);
+  RUN_TEST(test_follower_syncs_to_leader);
+  RUN_TEST(test_sunrise_needs_own_alarm);
+  RUN_TEST(test_sunrise_joined_when_due);
+  RUN_TEST(test_snoozed_or_busy_light_stays);
+  RUN_TEST(test_own_sunrise_aligns);
+  RUN_TEST(test_future_start_is_ignored);
+  RUN_TEST(test_signed_packets);
+  RUN_TEST(test_lower_id_newcomer_keeps_timebase);
+  return UNITY_END();
+}
@@ -0,0 +1,180 @@
+// PWM output stage on the host: band selection, duty scaling and the gamma
+// curve, swept through every band boundary of the selected board profile.
+// Build with -DWAKELIGHT_BOARD=n to check another profile.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+// Fraction of a period a duty keeps the output on
+static double dutyFraction(uint32_t duty, int bits)
+{
+  return duty / (double)(1u << bits);
+}
+
+// Largest output change one level step may cause: the gamma curve's own
+// step plus one count of the coarser resolution for the rounding on each side
+static double stepLimit(int level, int bitsA, int bitsB)
+{
+  double gammaStep = (applyGamma(std::min(level + 1, LEVEL_MAX), false) - applyGamma(level, false)) / 65535.0;
+  return gammaStep + 1.0 / (1u << std::min(bitsA, bitsB));
+}
+
+void setUp(void)
+{
+  setupPwm();
+  ledcStub.periods.clear();
+}
+
+void tearDown(void) {}
+
+void test_band_boundaries(void)
+{
+  for (int i = 1; i < PWM_BAND_COUNT; i++)
+  {
+    int from = Board::pwmBand(i).fromLevel;
+    pwmState.band = i - 1;
+    TEST_ASSERT_EQUAL_INT(i - 1, pwmBandFor(from - 1));
+    TEST_ASSERT_EQUAL_INT(i, pwmBandFor(from));
+    // Falling back needs the full hysteresis
+    pwmState.band = i;
+    TEST_ASSERT_EQUAL_INT(i, pwmBandFor(from - 1));
+    TEST_ASSERT_EQUAL_INT(i, pwmBandFor(from - PWM_BAND_HYSTERESIS));
+    TEST_ASSERT_EQUAL_INT(i - 1, pwmBandFor(from - PWM_BAND_HYSTERESIS - 1));
+  }
+  // Jumps skip bands in either direction
+  pwmState.band = 0;
+  TEST_ASSERT_EQUAL_INT(PWM_BAND_COUNT - 1, pwmBandFor(LEVEL_MAX));
+  pwmState.band = PWM_BAND_COUNT - 1;
+  TEST_ASSERT_EQUAL_INT(0, pwmBandFor(0));
+}
+
+void test_bands_are_ordered(void)
+{
+  TEST_ASSERT_EQUAL_INT(0, Board::pwmBand(0).fromLevel);
+  for (int i = 1; i < PWM_BAND_COUNT; i++)
+  {
+    TEST_ASSERT_GREATER_THAN(Board::pwmBand(i - 1).fromLevel + PWM_BAND_HYSTERESIS, Board::pwmBand(i).fromLevel);
+    TEST_ASSERT_GREATER_THAN(Board::pwmBand(i - 1).freq, Board::pwmBand(i).freq);
+    TEST_ASSERT_LESS_OR_EQUAL(Board::pwmBand(i - 1).bits, Board::pwmBand(i).bits);
+  }
+}
+
+void test_pwm_scale(void)
+{
+  for (int bits = 8; bits <= 16; bits++)
+  {
+    uint32_t top = (1u << bits) - 1;
+    TEST_ASSERT_EQUAL_UINT32(0, pwmScale(0, bits));
+    TEST_ASSERT_EQUAL_UINT32(top, pwmScale(65535, bits));
+    uint32_t last = 0;
+    for (uint32_t d = 0; d <= 65535; d++)
+    {
+      uint32_t scaled = pwmScale(d, bits);
+      TEST_ASSERT_LESS_OR_EQUAL(last + 1, scaled);
+      TEST_ASSERT_GREATER_OR_EQUAL(last, scaled);
+      // Rounded, not truncated
+      TEST_ASSERT_FLOAT_WITHIN(0.5001, d * (double)top / 65535, scaled);
+      last = scaled;
+    }
+  }
+}
+
+void test_gamma_curve(void)
+{
+  TEST_ASSERT_EQUAL_INT(0, applyGamma(0, false));
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, applyGamma(LEVEL_MAX, false));
+  TEST_ASSERT_EQUAL_INT(0, applyGamma(-5, false));
+  TEST_ASSERT_EQUAL_INT(LEVEL_MAX, applyGamma(LEVEL_MAX + 5, false));
+  int last = 0;
+  for (int level = 0; level <= LEVEL_MAX; level++)
+  {
+    int duty = applyGamma(level, false);
+    TEST_ASSERT_GREATER_OR_EQUAL(last, duty);
+    // Interpolation stays within a fraction of a percent of the curve
+    double exact = pow(level / (double)LEVEL_MAX, DEFAULT_GAMMA) * LEVEL_MAX;
+    TEST_ASSERT_FLOAT_WITHIN(LEVEL_MAX * 0.0005, exact, duty);
+    TEST_ASSERT_EQUAL_INT(level, applyGamma(level, true));
+    last = duty;
+  }
+}
+
+// At each boundary the level is output by two bands: the one below (while
+// the hysteresis holds it) and the one above. Both must give the same light.
+void test_band_switch_keeps_level(void)
+{
+  for (int i = 1; i < PWM_BAND_COUNT; i++)
+  {
+    int bitsLow = Board::pwmBand(i - 1).bits;
+    int bitsHigh = Board::pwmBand(i).bits;
+    int from = Board::pwmBand(i).fromLevel;
+    for (int level = from - PWM_BAND_HYSTERESIS - 1; level <= from; level++)
+    {
+      uint32_t duty16 = applyGamma(level, false);
+      double low = dutyFraction(pwmScale(duty16, bitsLow), bitsLow);
+      double high = dutyFraction(pwmScale(duty16, bitsHigh), bitsHigh);
+      TEST_ASSERT_FLOAT_WITHIN(1.0 / (1u << std::min(bitsLow, bitsHigh)), low, high);
+    }
+  }
+}
+
+// Fade the whole range up and back down through the output stage and check
+// each committed step against the gamma curve
+void test_fade_sweep_output_step(void)
+{
+  for (int dir = 0; dir < 2; dir++)
+  {
+    double lastFraction = -1;
+    int lastBits = pwmState.bits;
+    int switches = pwmState.bandSwitches;
+    for (int i = 0; i <= LEVEL_MAX; i += 7)
+    {
+      int level = dir == 0 ? i : LEVEL_MAX - i;
+      pwmStage(PWM_OUT_WARM, applyGamma(level, false));
+      pwmStage(PWM_OUT_COOL, 0);
+      pwmCommit(level);
+      double fraction = dutyFraction(pwmState.warmDuty, pwmState.bits);
+      if (lastFraction >= 0)
+      {
+        int from = dir == 0 ? level - 7 : level;
+        double limit = 0;
+        for (int l = from; l < from + 7; l++)
+          limit += stepLimit(l, lastBits, pwmState.bits);
+        TEST_ASSERT_FLOAT_WITHIN(limit, lastFraction, fraction);
+      }
+      lastFraction = fraction;
+      lastBits = pwmState.bits;
+    }
+    TEST_ASSERT_EQUAL_INT(switches + PWM_BAND_COUNT - 1, pwmState.bandSwitches);
+  }
+  TEST_ASSERT_EQUAL_INT(0, pwmState.band);
+}
+
+// The trace reports the fraction of the period actually output
+void test_trace_reports_duty_fraction(void)
+{
+  pwmStage(PWM_OUT_WARM, 65535);
+  pwmStage(PWM_OUT_COOL, 32768);
+  pwmCommit(LEVEL_MAX);
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_GET, "/debug/pwm-trace"));
+  String body = server.responseBody;
+  int at = body.lastIndexOf("\"warm\":");
+  TEST_ASSERT_TRUE(at >= 0);
+  double warm = atof(body.c_str() + at + 7);
+  double cool = atof(body.c_str() + body.lastIndexOf("\"cool\":") + 7);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, dutyFraction(pwmState.warmDuty, pwmState.bits), warm);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, dutyFraction(pwmState.coolDuty, pwmState.bits), cool);
+  TEST_ASSERT_TRUE(warm < 1.0);
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_band_boundaries);
+  RUN_TEST(test_bands_are_ordered);
+  RUN_TEST(test_pwm_scale);
+  RUN_TEST(test_gamma_curve);
+  RUN_TEST(test_band_switch_keeps_level);
+  RUN_TEST(test_fade_sweep_output_step);
+  RUN_TEST(test_trace_reports_duty_fraction);
+  return UNITY_END();
+}
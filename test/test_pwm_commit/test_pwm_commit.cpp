@@ -0,0 +1,158 @@
+// Output frames on the LEDC model in test/stubs/driver/ledc.h: every PWM
+// period must output one committed frame - never a new warm duty with an
+// old cool one, or a new timer with an old duty.
+#include <unity.h>
+#include <set>
+#include <tuple>
+#include "../../src/main.cpp"
+
+// The timer frequency is left out: the LEDC runs at what the clock divider
+// gives, not exactly the band's frequency (checked on its own below)
+typedef std::tuple<uint8_t, uint32_t, uint32_t, uint32_t> Frame; // bits, warm, cool, cool hpoint
+
+static std::set<Frame> committed;
+static uint32_t seed = 12345;
+
+static uint32_t nextRandom(uint32_t range)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % range;
+}
+
+static void recordFrame()
+{
+  committed.insert(Frame(pwmState.bits, pwmState.warmDuty, pwmState.coolDuty, pwmState.coolHpoint));
+}
+
+// Periods whose output is not one of the committed frames
+static int mixedPeriods()
+{
+  stubAdvanceUs(10000);
+  ledcStub.sync();
+  int mixed = 0;
+  for (size_t i = 0; i < ledcStub.periods.size(); i++)
+  {
+    const LedcStubPeriod &p = ledcStub.periods[i];
+    if (!committed.count(Frame(p.bits, p.duty[PWM_LEDC_WARM], p.duty[PWM_LEDC_COOL], p.hpoint[PWM_LEDC_COOL])))
+      mixed++;
+  }
+  return mixed;
+}
+
+// Commit one cross-fade step at a random point of the running period
+static void crossFadeStep(int warm, int cool)
+{
+  stubAdvanceUs(nextRandom(3000));
+  pwmStage(PWM_OUT_WARM, applyGamma(warm, false));
+  pwmStage(PWM_OUT_COOL, applyGamma(cool, false));
+  pwmCommit(std::max(warm, cool));
+  recordFrame();
+}
+
+void setUp(void)
+{
+  ledcStub.writeUs = 2;
+  setupPwm();
+  ledcStub.sync();
+  ledcStub.periods.clear();
+  committed.clear();
+  recordFrame();
+}
+
+void tearDown(void) {}
+
+// Warm to cool and back, through the band switches on the way
+void test_cross_fade_never_mixes_frames(void)
+{
+  uint32_t frames = pwmState.framesCommitted;
+  uint32_t torn = pwmState.framesTorn;
+  for (int pass = 0; pass < 4; pass++)
+  {
+    for (int i = 0; i <= LEVEL_MAX; i += 97)
+    {
+      int level = pass % 2 ? LEVEL_MAX - i : i;
+      crossFadeStep(level, LEVEL_MAX - level);
+    }
+  }
+  TEST_ASSERT_GREATER_THAN(1000, pwmState.framesCommitted - frames);
+  TEST_ASSERT_GREATER_THAN(0, pwmState.bandSwitches);
+  TEST_ASSERT_EQUAL_UINT32(torn, pwmState.framesTorn);
+  TEST_ASSERT_EQUAL_INT(0, mixedPeriods());
+}
+
+// Fading up from off retimes the timer several times in one fade
+void test_band_switch_latches_with_duties(void)
+{
+  uint32_t switches = pwmState.bandSwitches;
+  for (int level = 0; level <= LEVEL_MAX; level += 331)
+    crossFadeStep(level, level / 2);
+  for (int level = LEVEL_MAX; level >= 0; level -= 331)
+    crossFadeStep(level, level / 2);
+  TEST_ASSERT_EQUAL_UINT32(switches + 2 * (PWM_BAND_COUNT - 1), pwmState.bandSwitches);
+  TEST_ASSERT_EQUAL_UINT32(0, pwmState.lateSwitches);
+  TEST_ASSERT_EQUAL_INT(0, mixedPeriods());
+  // Each period ran at its band's frequency, to the divider's precision
+  for (size_t i = 0; i < ledcStub.periods.size(); i++)
+  {
+    const LedcStubPeriod &p = ledcStub.periods[i];
+    int band = 0;
+    while (Board::pwmBand(band).bits != p.bits)
+      band++;
+    TEST_ASSERT_FLOAT_WITHIN(Board::pwmBand(band).freq * 0.01, Board::pwmBand(band).freq, p.freq);
+  }
+}
+
+// The cool output's phase offset ends its on-time with the period
+void test_cool_hpoint_follows_duty(void)
+{
+  crossFadeStep(LEVEL_MAX / 3, LEVEL_MAX / 3);
+  uint32_t period = 1u << pwmState.bits;
+  TEST_ASSERT_EQUAL_UINT32(period - pwmState.coolDuty, pwmState.coolHpoint);
+  TEST_ASSERT_EQUAL_UINT32(0, pwmState.overlap);
+  crossFadeStep(LEVEL_MAX, LEVEL_MAX);
+  period = 1u << pwmState.bits;
+  TEST_ASSERT_EQUAL_UINT32(pwmState.warmDuty + pwmState.coolDuty - period, pwmState.overlap);
+  TEST_ASSERT_EQUAL_INT(0, mixedPeriods());
+}
+
+// Writes that take longer than the guard straddle period ends; the commit
+// must notice and count the frame as torn
+void test_slow_writes_are_counted_torn(void)
+{
+  ledcStub.writeUs = 400;
+  uint32_t torn = pwmState.framesTorn;
+  for (int i = 0; i < 50; i++)
+    crossFadeStep(i * 1000, LEVEL_MAX - i * 1000);
+  TEST_ASSERT_GREATER_THAN(torn, pwmState.framesTorn);
+  TEST_ASSERT_GREATER_THAN(0, mixedPeriods());
+}
+
+// Check on the check: channel by channel updates, as ledcWrite() would do
+// them, do show up as mixed periods
+void test_unframed_writes_are_detected(void)
+{
+  for (int i = 0; i <= LEVEL_MAX; i += 97)
+  {
+    stubAdvanceUs(nextRandom(3000));
+    uint32_t warm = pwmScale(applyGamma(i, false), pwmState.bits);
+    uint32_t cool = pwmScale(applyGamma(LEVEL_MAX - i, false), pwmState.bits);
+    ledc_set_duty_with_hpoint(PWM_MODE, PWM_LEDC_WARM, warm, 0);
+    ledc_update_duty(PWM_MODE, PWM_LEDC_WARM);
+    ledc_set_duty_with_hpoint(PWM_MODE, PWM_LEDC_COOL, cool, 0);
+    ledc_update_duty(PWM_MODE, PWM_LEDC_COOL);
+    committed.insert(Frame(pwmState.bits, warm, cool, 0));
+  }
+  TEST_ASSERT_GREATER_THAN(0, mixedPeriods());
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_cross_fade_never_mixes_frames);
+  RUN_TEST(test_band_switch_latches_with_duties);
+  RUN_TEST(test_cool_hpoint_follows_duty);
+  RUN_TEST(test_slow_writes_are_counted_torn);
+  RUN_TEST(test_unframed_writes_are_detected);
+  return UNITY_END();
+}
@@ -0,0 +1,92 @@
+// Loop stall detector on the simulated clock: the esp_timer callback is run
+// by hand every STALL_CHECK_MS, and a slow HTTP client is played through the
+// web server stub's onSendContent hook. esp_system_abort() only counts.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+// Let `ms` pass with the detector looking, as its timer would
+static void waitMs(unsigned long ms)
+{
+  for (unsigned long t = 0; t < ms; t += STALL_CHECK_MS)
+  {
+    stubAdvanceUs(STALL_CHECK_MS * 1000);
+    stallCheck(nullptr);
+  }
+}
+
+static uint32_t stallsBefore;
+
+void setUp(void)
+{
+  server.onSendContent = nullptr;
+  stallHeartbeat(); // a fresh tick, in the HTTP stage
+  stubAborts = 0;
+  stallsBefore = stallState.stalls;
+}
+
+void tearDown(void)
+{
+  server.onSendContent = nullptr;
+  stallHeartbeat();
+}
+
+// A stuck update function is captured after a second and panics at the limit
+void test_lighting_stall_aborts(void)
+{
+  stallState.stage = STAGE_LIGHTING;
+  waitMs(STALL_DETECT_MS + STALL_CHECK_MS);
+  TEST_ASSERT_EQUAL_UINT32(stallsBefore + 1, stallState.stalls);
+  TEST_ASSERT_EQUAL_INT(STAGE_LIGHTING, stallRtc.stage);
+  TEST_ASSERT_EQUAL_INT(0, stubAborts);
+  waitMs(STALL_ABORT_MS);
+  TEST_ASSERT_TRUE(stubAborts > 0);
+  TEST_ASSERT_TRUE(stallRtc.aborted);
+}
+
+// A handler blocked on its client is recorded, however long, but not aborted
+void test_blocked_handler_is_recorded(void)
+{
+  strlcpy(stallState.handler, "/debug/coredump", sizeof(stallState.handler));
+  waitMs(STALL_ABORT_MS * 2);
+  stallState.handler[0] = '\0';
+  TEST_ASSERT_EQUAL_UINT32(stallsBefore + 1, stallState.stalls);
+  TEST_ASSERT_EQUAL_INT(STAGE_HTTP, stallRtc.stage);
+  TEST_ASSERT_EQUAL_STRING("/debug/coredump", stallRtc.handler);
+  TEST_ASSERT_GREATER_OR_EQUAL(STALL_ABORT_MS * 2 - STALL_CHECK_MS, stallRtc.stalledMs);
+  TEST_ASSERT_FALSE(stallRtc.aborted);
+  TEST_ASSERT_EQUAL_INT(0, stubAborts);
+}
+
+// A long /events listing to a slow client marks progress per chunk: far
+// longer than the abort limit in total, and no stall at all
+void test_slow_event_listing_is_no_stall(void)
+{
+  for (int i = 0; i < EVENT_QUERY_MAX; i++)
+  {
+    logEvent(EVENT_ALARM_FIRED, i);
+    if (i % EVENT_PAGE_RECORDS == EVENT_PAGE_RECORDS - 1)
+      flushEventLog(); // fewer than EVENT_PENDING_MAX staged at once
+  }
+  flushEventLog();
+  int chunks = 0;
+  server.onSendContent = [&chunks]()
+  {
+    chunks++;
+    waitMs(STALL_DETECT_MS - 2 * STALL_CHECK_MS);
+  };
+  TEST_ASSERT_EQUAL_INT(200, stubRequest(server, HTTP_GET, "/events?limit=1000"));
+  TEST_ASSERT_GREATER_THAN((int)(STALL_ABORT_MS / (STALL_DETECT_MS - 2 * STALL_CHECK_MS)), chunks);
+  TEST_ASSERT_TRUE(server.responseBody.indexOf("\"more\":") > 0);
+  TEST_ASSERT_EQUAL_UINT32(stallsBefore, stallState.stalls);
+  TEST_ASSERT_EQUAL_INT(0, stubAborts);
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_lighting_stall_aborts);
+  RUN_TEST(test_blocked_handler_is_recorded);
+  RUN_TEST(test_slow_event_listing_is_no_stall);
+  return UNITY_END();
+}
@@ -0,0 +1,119 @@
+// Time discipline on the simulated wall clock in test/stubs/Arduino.h, which
+// slews adjtime() corrections at 500 ppm like newlib on the ESP32.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+static int64_t trueOffsetUs; // reference clock minus the stub's monotonic clock
+
+static int64_t wallUs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int64_t errorUs()
+{
+  return wallUs() - (esp_timer_get_time() + trueOffsetUs);
+}
+
+static int64_t pendingSlewUs()
+{
+  struct timeval outstanding;
+  adjtime(nullptr, &outstanding);
+  return (int64_t)outstanding.tv_sec * 1000000 + outstanding.tv_usec;
+}
+
+// An NTP sample of the reference clock
+static void ntpSample()
+{
+  int64_t us = esp_timer_get_time() + trueOffsetUs;
+  struct timeval tv = {(time_t)(us / 1000000), (suseconds_t)(us % 1000000)};
+  sntp_sync_time(&tv);
+}
+
+// Let the slew run out
+static void runFor(int64_t seconds)
+{
+  for (int64_t i = 0; i < seconds; i++)
+  {
+    stubAdvanceUs(1000000);
+    wallUs();
+  }
+}
+
+void setUp(void)
+{
+  timeDiscipline.synced = false;
+  timeDiscipline.driftPpm = 0;
+  timeDiscipline.lastSyncUs = 0;
+  struct timeval zero = {0, 0};
+  adjtime(&zero, nullptr);
+  trueOffsetUs = wallUs() - esp_timer_get_time();
+}
+
+void tearDown(void) {}
+
+void test_offset_is_slewed_out(void)
+{
+  trueOffsetUs += 600000;
+  ntpSample();
+  TEST_ASSERT_INT_WITHIN(100, 600000, pendingSlewUs());
+  runFor(1300);
+  TEST_ASSERT_INT_WITHIN(1000, 0, errorUs());
+}
+
+// A second sample while the first slew is still running measures what is
+// left of it; it must replace the running slew, not add to it
+void test_sample_during_slew_does_not_overshoot(void)
+{
+  trueOffsetUs += 800000;
+  ntpSample();
+  runFor(20); // 10 ms of the 800 ms applied
+  ntpSample();
+  TEST_ASSERT_INT_WITHIN(1000, 790000, pendingSlewUs());
+  runFor(1700);
+  TEST_ASSERT_INT_WITHIN(1000, 0, errorUs());
+  // Samples every 10 s of a clock that is already right leave it right
+  for (int i = 0; i < 20; i++)
+  {
+    ntpSample();
+    runFor(10);
+  }
+  TEST_ASSERT_INT_WITHIN(1000, 0, errorUs());
+}
+
+// Drift correction adds to the slew still in progress
+void test_drift_correction_adds_to_slew(void)
+{
+  trueOffsetUs += 400000;
+  ntpSample();
+  timeDiscipline.driftPpm = 50;
+  timeDiscipline.lastHoldoverTime = millis() - TIME_HOLDOVER_INTERVAL_MS;
+  int64_t before = pendingSlewUs();
+  updateTimeDiscipline();
+  TEST_ASSERT_INT_WITHIN(100, before - 50 * (int64_t)TIME_HOLDOVER_INTERVAL_MS / 1000, pendingSlewUs());
+}
+
+// Large offsets step the clock
+void test_large_offset_steps(void)
+{
+  ntpSample();
+  uint32_t steps = timeDiscipline.stepCount;
+  trueOffsetUs -= 5000000;
+  ntpSample();
+  TEST_ASSERT_EQUAL_UINT32(steps + 1, timeDiscipline.stepCount);
+  TEST_ASSERT_INT_WITHIN(1000, 0, errorUs());
+  TEST_ASSERT_EQUAL_INT(0, pendingSlewUs());
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+  UNITY_BEGIN();
+  RUN_TEST(test_offset_is_slewed_out);
+  RUN_TEST(test_sample_during_slew_does_not_overshoot);
+  RUN_TEST(test_drift_correction_adds_to_slew);
+  RUN_TEST(test_large_offset_steps);
+  return UNITY_END();
+}
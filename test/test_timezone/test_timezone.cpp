@@ -0,0 +1,153 @@
+// Time zone table against the host C library: tzLocalTime() must agree with
+// glibc's localtime_r() for the same POSIX TZ rule, to the second, across
+// 2000-2033 and on both sides of every transition.
+#include <unity.h>
+#include "../../src/main.cpp"
+
+static const time_t FROM = 946684800; // 2000-01-01
+static const time_t TO = 2000000000;  // 2033-05-18
+
+static const char *ZONES[] = {
+    "GMT0BST,M3.5.0/1,M10.5.0",
+    "EST5EDT,M3.2.0,M11.1.0",
+    "CET-1CEST,M3.5.0,M10.5.0/3",
+    "AEST-10AEDT,M10.1.0,M4.1.0/3",       // southern hemisphere: DST spans the new year
+    "NZST-12NZDT,M9.5.0,M4.1.0/3",
+    "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0", // half-hour offsets and a half-hour shift
+    "IST-5:30",
+    "<-03>3",
+    "JST-9",
+};
+
+static void useZone(const char *zone)
+{
+  TEST_ASSERT_TRUE_MESSAGE(tzSetZone(zone), zone);
+  setenv("TZ", zone, 1);
+  tzset();
+}
+
+static void checkInstant(const char *zone, time_t t)
+{
+  struct tm ours, libc;
+  tzLocalTime(t, &ours);
+  localtime_r(&t, &libc);
+  char message[160];
+  snprintf(message, sizeof(message), "%s at %lld: %04d-%02d-%02d %02d:%02d:%02d dst %d", zone, (long long)t,
+           libc.tm_year + 1900, libc.tm_mon + 1, libc.tm_mday, libc.tm_hour, libc.tm_min, libc.tm_sec, libc.tm_isdst);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_year, ours.tm_year, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_mon, ours.tm_mon, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_mday, ours.tm_mday, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_hour, ours.tm_hour, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_min, ours.tm_min, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_sec, ours.tm_sec, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_wday, ours.tm_wday, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_yday, ours.tm_yday, message);
+  TEST_ASSERT_EQUAL_INT_MESSAGE(libc.tm_isdst, ours.tm_isdst, message);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// Every half hour (less a second, so the samples drift through the clock)
+void test_matches_libc_across_years(void)
+{
+  for (size_t z = 0; z < sizeof(ZONES) / sizeof(ZONES[0]); z++)
+  {
+    useZone(ZONES[z]);
+    for (time_t t = FROM; t < TO; t += 1799)
+      checkInstant(ZONES[z], t);
+  }
+}
+
+// The second before and the second of each transition, found from libc
+void test_matches_libc_at_transitions(void)
+{
+  for (size_t z = 0; z < sizeof(ZONES) / sizeof(ZONES[0]); z++)
+  {
+    useZone(ZONES[z]);
+    int transitions = 0;
+    struct tm libc;
+    localtime_r(&FROM, &libc);
+    long offset = libc.tm_gmtoff;
+    for (time_t t = FROM + 3600; t < TO; t += 3600)
+    {
+      localtime_r(&t, &libc);
+      if (libc.tm_gmtoff == offset)
+        continue;
+      time_t lo = t - 3600, hi = t; // offset changes in (lo, hi]
+      while (hi - lo > 1)
+      {
+        time_t mid = lo + (hi - lo) / 2;
+        localtime_r(&mid, &libc);
+        if (libc.tm_gmtoff == offset)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      checkInstant(ZONES[z], hi - 1);
+      checkInstant(ZONES[z], hi);
+      localtime_r(&t, &libc);
+      offset = libc.tm_gmtoff;
+      transitions++;
+    }
+    if (strchr(ZONES[z], ','))
+      TEST_ASSERT_GREATER_THAN(60, transitions);
+    else
+      TEST_ASSERT_EQUAL_INT(0, transitions);
+  }
+}
+
+// The table is rebuilt when a conversion leaves it; jumping around in time
+// must give the same answers as walking forward
+void test_random_order(void)
+{
+  uint32_t seed = 1;
+  for (size_t z = 0; z < sizeof(ZONES) / sizeof(ZONES[0]); z++)
+  {
+    useZone(ZONES[z]);
+    for (int i = 0; i < 20000; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      checkInstant(ZONES[z], FROM + (time_t)(((uint64_t)seed << 16 | (seed >> 16)) % (uint64_t)(TO - FROM)));
+    }
+  }
+}
+
+// DST without rules takes the US ones. glibc fills these in from its
+// posixrules file (pre-2007 dates), so compare with the explicit rule instead.
+void test_default_dst_rules(void)
+{
+  for (time_t t = FROM; t < TO; t += 1799)
+  {
+    struct tm implicit, explicitRule;
+    TEST_ASSERT_TRUE(tzSetZone("EST5EDT"));
+    tzLocalTime(t, &implicit);
+    TEST_ASSERT_TRUE(tzSetZone("EST5EDT,M3.2.0,M11.1.0"));
+    tzLocalTime(t, &explicitRule);
+    TEST_ASSERT_EQUAL_INT(explicitRule.tm_hour, implicit.tm_hour);
+    TEST_ASSERT_EQUAL_INT(explicitRule.tm_isdst, implicit.tm_isdst);
+  }
+}
+
+void test_rejects_bad_rules(void)
+{
+  useZone("CET-1CEST,M3.5.0,M10.5.0/3");
+  const char *bad[] = {"", "CET", "CET-1CEST,M3.5.0", "CET-1CEST,M13.5.0,M10.5.0", "CET-1CEST,M3.6.0,M10.5.0",
+                       "CET-1CEST,M3.5.7,M10.5.0", "CET-1CEST,M3.5.0,M10.5.0,", "<+1030"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    TEST_ASSERT_FALSE_MESSAGE(tzSetZone(bad[i]), bad[i]);
+  // A rejected rule leaves the zone in use alone
+  checkInstant("CET-1CEST,M3.5.0,M10.5.0/3", 1750000000);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_matches_libc_across_years);
+  RUN_TEST(test_matches_libc_at_transitions);
+  RUN_TEST(test_random_order);
+  RUN_TEST(test_default_dst_rules);
+  RUN_TEST(test_rejects_bad_rules);
+  return UNITY_END();
+}
@@ -0,0 +1,551 @@
+// Fleet controller - brings many lights to one alarm setting in parallel.
+//
+// Build (Linux/macOS, no dependencies):
+//   c++ -std=c++17 -O2 -o fleet tools/fleet.cpp
+//
+// Usage:
+//   fleet [options] <host[:port]>... | -f devices.txt
+//     --alarm HH:MM       desired alarm time
+//     --enabled on|off    desired alarm state
+//     --jobs N            devices in flight at once (default 16)
+//     --timeout MS        per request, connect to last byte (default 3000)
+//     --retries N         extra attempts per request on network errors/5xx (default 2)
+//     --token TOKEN       sent as "Authorization: Bearer TOKEN" (see API_TOKEN)
+//     --dry-run           only report the diff
+//
+// Each device is read with GET /status, compared with the desired state,
+// changed only where it differs (POST /set-alarm, POST /toggle-alarm) and read
+// back to verify. Every request carries a Date header, so the lights also get
+// a time sample. Runs are idempotent: re-running after a partial failure only
+// touches the devices that are still wrong. Exit status is 1 if any device
+// failed.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// ============ CONFIGURATION ============
+struct Options
+{
+  int hour = -1; // -1 = leave alone
+  int minute = -1;
+  int enabled = -1; // -1 = leave alone, 0/1
+  int jobs = 16;
+  int timeoutMs = 3000;
+  int retries = 2;
+  int backoffMs = 200; // doubled per retry
+  std::string token;
+  bool dryRun = false;
+};
+
+// ============ DEVICE STATE ============
+enum Step
+{
+  STEP_READ,    // GET /status
+  STEP_SET,     // POST /set-alarm
+  STEP_TOGGLE,  // POST /toggle-alarm
+  STEP_VERIFY,  // GET /status again
+  STEP_DONE,
+};
+
+enum ConnPhase
+{
+  CONN_IDLE,
+  CONN_WAIT,       // retry backoff
+  CONN_CONNECTING,
+  CONN_SENDING,
+  CONN_RECEIVING,
+};
+
+struct Device
+{
+  std::string name;
+  std::string host;
+  int port = 80;
+  sockaddr_storage addr = {};
+  socklen_t addrLen = 0;
+  bool resolved = false;
+
+  Step step = STEP_READ;
+  ConnPhase phase = CONN_IDLE;
+  int fd = -1;
+  std::string request;
+  size_t sent = 0;
+  std::string response;
+  int attempt = 0;
+  int64_t requestStart = 0;
+  int64_t deadline = 0; // request timeout, or end of the backoff in CONN_WAIT
+
+  // Actual state from /status
+  int hour = -1;
+  int minute = -1;
+  int enabled = -1;
+
+  // Report
+  bool changed = false;
+  bool failed = false;
+  std::string detail;
+  int requests = 0;
+  int attempts = 0;
+  std::vector<int64_t> latencies; // successful requests, microseconds
+  int64_t started = 0;
+  int64_t finished = 0;
+};
+
+static int64_t nowUs()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ============ HTTP ============
+static std::string httpDate()
+{
+  char buf[64];
+  time_t t = time(nullptr);
+  struct tm gmt;
+  gmtime_r(&t, &gmt);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+  return buf;
+}
+
+static std::string buildRequest(const Device &d, const Options &opt, const char *method, const char *path, const std::string &body)
+{
+  std::string r = std::string(method) + " " + path + " HTTP/1.1\r\nHost: " + d.host + "\r\nConnection: close\r\nDate: " + httpDate() + "\r\n";
+  if (!opt.token.empty())
+    r += "Authorization: Bearer " + opt.token + "\r\n";
+  if (!body.empty() || strcmp(method, "POST") == 0)
+    r += "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+  return r + "\r\n" + body;
+}
+
+// Status code of a complete response, or 0 if it is malformed
+static int responseStatus(const std::string &response, std::string &body)
+{
+  int status = 0;
+  if (sscanf(response.c_str(), "HTTP/1.%*d %d", &status) != 1)
+    return 0;
+  size_t split = response.find("\r\n\r\n");
+  body = split == std::string::npos ? "" : response.substr(split + 4);
+  return status;
+}
+
+// Same hand-rolled parsing as the firmware: find the key, read what follows
+static bool parseStatus(const std::string &body, Device &d)
+{
+  size_t timePos = body.find("\"alarmTime\":\"");
+  size_t setPos = body.find("\"isAlarmSet\":");
+  if (timePos == std::string::npos || setPos == std::string::npos)
+    return false;
+  if (sscanf(body.c_str() + timePos + 13, "%d:%d", &d.hour, &d.minute) != 2)
+    return false;
+  d.enabled = body.compare(setPos + 13, 4, "true") == 0 ? 1 : 0;
+  return true;
+}
+
+// ============ STEPS ============
+static bool timeDiffers(const Device &d, const Options &opt)
+{
+  return opt.hour >= 0 && (d.hour != opt.hour || d.minute != opt.minute);
+}
+
+// /set-alarm also enables the alarm, so the toggle runs after it when needed
+static bool enabledDiffers(const Device &d, const Options &opt)
+{
+  int after = timeDiffers(d, opt) ? 1 : d.enabled;
+  return opt.enabled >= 0 && after != opt.enabled;
+}
+
+static void finish(Device &d, bool failed, const std::string &detail)
+{
+  d.step = STEP_DONE;
+  d.failed = failed;
+  d.detail = detail;
+  d.finished = nowUs();
+}
+
+// Prepare the request for the current step, or skip to the next one
+static void beginStep(Device &d, const Options &opt)
+{
+  for (;;)
+  {
+    switch (d.step)
+    {
+    case STEP_READ:
+    case STEP_VERIFY:
+      d.request = buildRequest(d, opt, "GET", "/status", "");
+      break;
+    case STEP_SET:
+      if (!timeDiffers(d, opt))
+      {
+        d.step = STEP_TOGGLE;
+        continue;
+      }
+      d.request = buildRequest(d, opt, "POST", "/set-alarm",
+                               "{\"hour\":" + std::to_string(opt.hour) + ",\"minute\":" + std::to_string(opt.minute) + "}");
+      break;
+    case STEP_TOGGLE:
+      if (!enabledDiffers(d, opt))
+      {
+        d.step = d.changed ? STEP_VERIFY : STEP_DONE;
+        if (d.step == STEP_DONE)
+          finish(d, false, "unchanged");
+        continue;
+      }
+      d.request = buildRequest(d, opt, "POST", "/toggle-alarm",
+                               std::string("{\"enabled\":") + (opt.enabled ? "true" : "false") + "}");
+      break;
+    case STEP_DONE:
+      return;
+    }
+    d.attempt = 0;
+    d.phase = CONN_IDLE;
+    return;
+  }
+}
+
+static void closeConn(Device &d)
+{
+  if (d.fd >= 0)
+    close(d.fd);
+  d.fd = -1;
+}
+
+static void startAttempt(Device &d, const Options &opt)
+{
+  d.attempt++;
+  d.attempts++;
+  d.sent = 0;
+  d.response.clear();
+  d.requestStart = nowUs();
+  d.deadline = d.requestStart + (int64_t)opt.timeoutMs * 1000;
+
+  d.fd = socket(d.addr.ss_family, SOCK_STREAM, 0);
+  if (d.fd < 0)
+  {
+    finish(d, true, std::string("socket: ") + strerror(errno));
+    return;
+  }
+  fcntl(d.fd, F_SETFL, fcntl(d.fd, F_GETFL) | O_NONBLOCK);
+  if (connect(d.fd, (sockaddr *)&d.addr, d.addrLen) == 0)
+    d.phase = CONN_SENDING;
+  else if (errno == EINPROGRESS)
+    d.phase = CONN_CONNECTING;
+  else
+    d.phase = CONN_SENDING; // let the send report the error
+}
+
+// Network error, timeout or 5xx: back off and retry, or give up
+static void attemptFailed(Device &d, const Options &opt, const std::string &why)
+{
+  closeConn(d);
+  if (d.attempt > opt.retries)
+  {
+    finish(d, true, why + " after " + std::to_string(d.attempt) + " attempts");
+    return;
+  }
+  d.phase = CONN_WAIT;
+  d.deadline = nowUs() + (int64_t)(opt.backoffMs << (d.attempt - 1)) * 1000;
+}
+
+// A full response arrived for the current step
+static void stepComplete(Device &d, const Options &opt)
+{
+  closeConn(d);
+  std::string body;
+  int status = responseStatus(d.response, body);
+  if (status == 0 || status >= 500)
+  {
+    attemptFailed(d, opt, status ? "HTTP " + std::to_string(status) : "bad response");
+    return;
+  }
+
+  d.requests++;
+  d.latencies.push_back(nowUs() - d.requestStart);
+  if (status != 200)
+  {
+    finish(d, true, "HTTP " + std::to_string(status) + ": " + body.substr(0, 60));
+    return;
+  }
+
+  switch (d.step)
+  {
+  case STEP_READ:
+    if (!parseStatus(body, d))
+    {
+      finish(d, true, "unexpected /status response");
+      return;
+    }
+    if (opt.dryRun)
+    {
+      bool differs = timeDiffers(d, opt) || enabledDiffers(d, opt);
+      char actual[48];
+      snprintf(actual, sizeof(actual), "is %d:%02d %s", d.hour, d.minute, d.enabled ? "on" : "off");
+      finish(d, false, std::string(differs ? "would change, " : "unchanged, ") + actual);
+      return;
+    }
+    d.step = STEP_SET;
+    break;
+  case STEP_SET:
+    d.changed = true;
+    d.enabled = 1;
+    d.step = STEP_TOGGLE;
+    break;
+  case STEP_TOGGLE:
+    d.changed = true;
+    d.step = STEP_VERIFY;
+    break;
+  case STEP_VERIFY:
+    if (!parseStatus(body, d) || timeDiffers(d, opt) || (opt.enabled >= 0 && d.enabled != opt.enabled))
+    {
+      finish(d, true, "verify mismatch");
+      return;
+    }
+    finish(d, false, "changed");
+    return;
+  case STEP_DONE:
+    return;
+  }
+  beginStep(d, opt);
+}
+
+// ============ EVENT LOOP ============
+static void run(std::vector<Device> &devices, const Options &opt)
+{
+  size_t next = 0;
+  std::vector<Device *> active;
+
+  while (next < devices.size() || !active.empty())
+  {
+    // Keep up to opt.jobs devices in flight
+    while (next < devices.size() && (int)active.size() < opt.jobs)
+    {
+      Device &d = devices[next++];
+      d.started = nowUs();
+      if (!d.resolved)
+      {
+        finish(d, true, "cannot resolve host");
+        continue;
+      }
+      beginStep(d, opt);
+      active.push_back(&d);
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<Device *> owners;
+    int64_t now = nowUs();
+    int64_t wake = now + 1000000;
+    for (Device *d : active)
+    {
+      if (d->phase == CONN_IDLE || (d->phase == CONN_WAIT && now >= d->deadline))
+      {
+        startAttempt(*d, opt);
+        if (d->step == STEP_DONE)
+          continue;
+      }
+      wake = std::min(wake, d->deadline);
+      if (d->phase == CONN_WAIT)
+        continue;
+      short events = d->phase == CONN_RECEIVING ? POLLIN : POLLOUT;
+      fds.push_back({d->fd, events, 0});
+      owners.push_back(d);
+    }
+
+    int timeoutMs = (int)std::max<int64_t>(0, (wake - now + 999) / 1000);
+    if (poll(fds.data(), fds.size(), timeoutMs) < 0 && errno != EINTR)
+    {
+      perror("poll");
+      exit(2);
+    }
+
+    now = nowUs();
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+      Device &d = *owners[i];
+      short revents = fds[i].revents;
+
+      if (revents == 0)
+      {
+        if (now >= d.deadline)
+          attemptFailed(d, opt, "timeout");
+        continue;
+      }
+
+      if (d.phase == CONN_CONNECTING)
+      {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(d.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+          attemptFailed(d, opt, std::string("connect: ") + strerror(err));
+          continue;
+        }
+        d.phase = CONN_SENDING;
+      }
+
+      if (d.phase == CONN_SENDING)
+      {
+        ssize_t n = send(d.fd, d.request.data() + d.sent, d.request.size() - d.sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN)
+        {
+          attemptFailed(d, opt, std::string("send: ") + strerror(errno));
+          continue;
+        }
+        if (n > 0)
+          d.sent += n;
+        if (d.sent == d.request.size())
+          d.phase = CONN_RECEIVING;
+        continue;
+      }
+
+      // Connection: close - the response ends when the device closes the socket
+      char buf[2048];
+      ssize_t n = recv(d.fd, buf, sizeof(buf), 0);
+      if (n > 0)
+        d.response.append(buf, n);
+      else if (n == 0)
+        stepComplete(d, opt);
+      else if (errno != EAGAIN)
+        attemptFailed(d, opt, std::string("recv: ") + strerror(errno));
+    }
+
+    active.erase(std::remove_if(active.begin(), active.end(), [](Device *d)
+                                { return d->step == STEP_DONE; }),
+                 active.end());
+  }
+}
+
+// ============ SETUP ============
+static void addDevice(std::vector<Device> &devices, const std::string &spec)
+{
+  devices.emplace_back();
+  devices.back().name = spec;
+}
+
+static void resolve(Device &d)
+{
+  std::string spec = d.name;
+  size_t colon = spec.rfind(':');
+  d.host = spec.substr(0, colon);
+  if (colon != std::string::npos)
+    d.port = atoi(spec.c_str() + colon + 1);
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result = nullptr;
+  if (getaddrinfo(d.host.c_str(), std::to_string(d.port).c_str(), &hints, &result) != 0 || result == nullptr)
+    return;
+  memcpy(&d.addr, result->ai_addr, result->ai_addrlen);
+  d.addrLen = result->ai_addrlen;
+  d.resolved = true;
+  freeaddrinfo(result);
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: fleet [--alarm HH:MM] [--enabled on|off] [--jobs N] [--timeout MS] [--retries N]\n"
+                  "             [--token TOKEN] [--dry-run] (<host[:port]>... | -f devices.txt)\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  std::vector<Device> devices;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--alarm" && hasValue)
+    {
+      if (sscanf(argv[++i], "%d:%d", &opt.hour, &opt.minute) != 2 || opt.hour < 0 || opt.hour > 23 || opt.minute < 0 ||
+          opt.minute > 59)
+        usage();
+    }
+    else if (arg == "--enabled" && hasValue)
+    {
+      std::string v = argv[++i];
+      if (v != "on" && v != "off")
+        usage();
+      opt.enabled = v == "on";
+    }
+    else if (arg == "--jobs" && hasValue)
+      opt.jobs = std::max(1, atoi(argv[++i]));
+    else if (arg == "--timeout" && hasValue)
+      opt.timeoutMs = std::max(1, atoi(argv[++i]));
+    else if (arg == "--retries" && hasValue)
+      opt.retries = std::max(0, atoi(argv[++i]));
+    else if (arg == "--token" && hasValue)
+      opt.token = argv[++i];
+    else if (arg == "--dry-run")
+      opt.dryRun = true;
+    else if (arg == "-f" && hasValue)
+    {
+      std::ifstream file(argv[++i]);
+      if (!file)
+        usage();
+      std::string line;
+      while (std::getline(file, line))
+      {
+        line = line.substr(0, line.find('#'));
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty())
+          addDevice(devices, line);
+      }
+    }
+    else if (arg[0] != '-')
+      addDevice(devices, arg);
+    else
+      usage();
+  }
+  if (devices.empty() || (opt.hour < 0 && opt.enabled < 0))
+    usage();
+
+  for (Device &d : devices)
+    resolve(d);
+
+  int64_t start = nowUs();
+  run(devices, opt);
+  int64_t elapsed = nowUs() - start;
+
+  // Report - one line per device, then a summary
+  int failed = 0, changed = 0;
+  int64_t worst = 0;
+  printf("%-24s %-8s %4s %5s %8s %8s %8s  %s\n", "device", "result", "reqs", "tries", "min ms", "avg ms", "max ms", "detail");
+  for (const Device &d : devices)
+  {
+    int64_t lo = 0, hi = 0, sum = 0;
+    for (int64_t l : d.latencies)
+    {
+      lo = lo == 0 ? l : std::min(lo, l);
+      hi = std::max(hi, l);
+      sum += l;
+    }
+    double avg = d.latencies.empty() ? 0.0 : sum / 1000.0 / d.latencies.size();
+    worst = std::max(worst, d.finished - d.started);
+    failed += d.failed;
+    changed += !d.failed && d.changed;
+    printf("%-24s %-8s %4d %5d %8.1f %8.1f %8.1f  %s\n", d.name.c_str(), d.failed ? "FAILED" : "ok", d.requests, d.attempts,
+           lo / 1000.0, avg, hi / 1000.0, d.detail.c_str());
+  }
+  printf("\n%zu devices: %d changed, %d unchanged, %d failed in %.2f s (slowest device %.2f s)\n", devices.size(), changed,
+         (int)devices.size() - changed - failed, failed, elapsed / 1e6, worst / 1e6);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Group sync peer: speaks the lights' UDP multicast sync protocol.
+
+Run several instances on one machine to exercise leader election and offset
+measurement over loopback, or one next to real lights to watch the group:
+
+    python tools/groupsync.py --id 1 --interface 127.0.0.1
+    python tools/groupsync.py --id 2 --interface 127.0.0.1 --offset-ms 5000 --skew-ppm 40
+    python tools/groupsync.py --id 3 --interface 127.0.0.1 --start-sunrise 5
+
+Lights with an API_TOKEN only accept packets signed with the group key
+(GROUP_KEY, or API_TOKEN when that is empty): pass it with --key.
+
+Each instance simulates its own clock (offset and rate error on top of the
+host clock) and prints once a second. On loopback all instances share the host
+clock, so the 'group-host' column should agree across instances to within the
+sync error once they have converged.
+
+The wire format must match GroupPacket in src/main.cpp.
+"""
+
+import argparse
+import hashlib
+import hmac
+import select
+import socket
+import struct
+import time
+
+MAGIC = 0x53475557  # "WUGS"
+BODY = struct.Struct("<IBBHIIqqqqI")
+TAG_BYTES = 16
+PACKET_SIZE = BODY.size + TAG_BYTES
+NONE, BEACON, SYNC_REQUEST, SYNC_RESPONSE, START_SUNRISE, START_SUNSET = range(6)
+FLAG_TIMEBASE = 0x01  # sender leads, or has synced to a leader
+BEACON_S = 1.0
+PEER_TIMEOUT_S = 3.5
+SYNC_SAMPLES = 8
+
+
+def host_us():
+    return time.monotonic_ns() // 1000
+
+
+class Peer:
+    def __init__(self, args):
+        self.id = args.id
+        self.key = args.key.encode() if args.key else None
+        self.offset_us = int(args.offset_ms * 1000)  # simulated local clock error
+        self.skew = args.skew_ppm / 1e6
+        self.start = host_us()
+        self.started = time.monotonic()
+        self.leader = 0  # none until a light holding the timebase is heard
+        self.has_timebase = False
+        self.peers = {}  # id -> (last seen, holds the timebase)
+        self.group_offset = 0  # group time = local time + group_offset
+        self.delay = 0
+        self.samples = []
+        self.last_sync = None
+        self.seq = 0
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        if hasattr(socket, "SO_REUSEPORT"):
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        self.sock.bind(("", args.port))
+        membership = socket.inet_aton(args.group) + socket.inet_aton(args.interface)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        self.dest = (args.group, args.port)
+
+    def local_us(self):
+        elapsed = host_us() - self.start
+        return self.start + int(elapsed * (1 + self.skew)) + self.offset_us
+
+    def group_us(self):
+        return self.local_us() + self.group_offset
+
+    def tag(self, body):
+        if not self.key:
+            return bytes(TAG_BYTES)
+        return hmac.new(self.key, body, hashlib.sha256).digest()[:TAG_BYTES]
+
+    def send(self, kind, target=0, t1=0, t2=0, t3=0, start_us=0, minutes=0):
+        self.seq = (self.seq + 1) & 0xFFFF
+        flags = FLAG_TIMEBASE if self.has_timebase else 0
+        body = BODY.pack(MAGIC, kind, flags, self.seq, self.id, target, t1, t2, t3, start_us, minutes)
+        self.sock.sendto(body + self.tag(body), self.dest)
+
+    def elect(self):
+        # Same rule as groupElectLeader(): the lowest ID among the lights that
+        # hold the timebase leads, and the lowest ID founds it when none is heard
+        now = time.monotonic()
+        self.peers = {pid: p for pid, p in self.peers.items() if now - p[0] <= PEER_TIMEOUT_S}
+        holders = [pid for pid, p in self.peers.items() if p[1]] + ([self.id] if self.has_timebase else [])
+        leader = min(holders) if holders else 0
+        if not leader and all(pid > self.id for pid in self.peers) and now - self.started >= PEER_TIMEOUT_S:
+            self.has_timebase = True
+            leader = self.id
+        if leader != self.leader:
+            self.leader = leader
+            self.samples = []
+            print("leader is %08x%s" % (leader, " (us)" if leader == self.id else ""))
+
+    def handle(self, data, rx_local):
+        if len(data) != PACKET_SIZE:
+            return
+        body = data[:BODY.size]
+        magic, kind, flags, _, node, target, t1, t2, t3, start_us, minutes = BODY.unpack(body)
+        if magic != MAGIC or node == self.id or not hmac.compare_digest(self.tag(body), data[BODY.size:]):
+            return
+        self.peers[node] = (time.monotonic(), bool(flags & FLAG_TIMEBASE))
+
+        if kind == SYNC_REQUEST and self.leader == self.id:
+            self.send(SYNC_RESPONSE, target=node, t1=t1, t2=rx_local + self.group_offset,
+                      t3=self.local_us() + self.group_offset)
+        elif kind == SYNC_RESPONSE and target == self.id and node == self.leader:
+            delay = ((rx_local - t1) - (t3 - t2)) // 2
+            offset = ((t2 - t1) + (t3 - rx_local)) // 2
+            if delay >= 0:
+                self.samples = (self.samples + [(delay, offset)])[-SYNC_SAMPLES:]
+                self.delay, self.group_offset = min(self.samples)
+                self.last_sync = time.monotonic()
+                self.has_timebase = True
+        elif kind in (START_SUNRISE, START_SUNSET):
+            name = "sunrise" if kind == START_SUNRISE else "sunset (%d min)" % minutes
+            print("%08x started %s, %.3f s ago on group time" % (node, name, (self.group_us() - start_us) / 1e6))
+
+    def status(self):
+        role = "leader" if self.leader == self.id else "follower" if self.leader else "waiting"
+        synced = self.has_timebase and (role == "leader" or (self.last_sync and time.monotonic() - self.last_sync < PEER_TIMEOUT_S))
+        print("%-8s leader=%08x peers=%d synced=%-5s offset=%+12d us delay=%6d us group-host=%+12d us" % (
+            role, self.leader, len(self.peers), bool(synced), self.group_offset, self.delay,
+            self.group_us() - host_us()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--id", type=lambda v: int(v, 0), required=True, help="node ID (lowest leads)")
+    parser.add_argument("--group", default="239.255.77.77")
+    parser.add_argument("--port", type=int, default=4777)
+    parser.add_argument("--key", help="group key of lights with an API_TOKEN")
+    parser.add_argument("--interface", default="0.0.0.0", help="interface address (127.0.0.1 for loopback)")
+    parser.add_argument("--offset-ms", type=float, default=0.0, help="simulated local clock offset")
+    parser.add_argument("--skew-ppm", type=float, default=0.0, help="simulated local clock rate error")
+    parser.add_argument("--start-sunrise", type=float, metavar="SECONDS", help="announce a sunrise after this long")
+    parser.add_argument("--start-sunset", type=int, metavar="MINUTES", help="announce a sunset of this length after 5 s")
+    args = parser.parse_args()
+
+    peer = Peer(args)
+    started = time.monotonic()
+    next_beacon = started
+    announced = False
+    while True:
+        ready, _, _ = select.select([peer.sock], [], [], max(0.0, next_beacon - time.monotonic()))
+        if ready:
+            data = peer.sock.recv(256)
+            peer.handle(data, peer.local_us())
+            continue
+
+        next_beacon += BEACON_S
+        peer.elect()
+        peer.send(BEACON)
+        if peer.leader and peer.leader != peer.id:
+            peer.send(SYNC_REQUEST, t1=peer.local_us())
+        peer.status()
+
+        if not announced and args.start_sunrise is not None and time.monotonic() - started >= args.start_sunrise:
+            peer.send(START_SUNRISE, start_us=peer.group_us())
+            announced = True
+        if not announced and args.start_sunset and time.monotonic() - started >= 5:
+            peer.send(START_SUNSET, start_us=peer.group_us(), minutes=args.start_sunset)
+            announced = True
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Compile a light effect to bytecode for the effect VM (POST /load-effect).
+
+Usage:
+    python tools/lightc.py effect.lvm           # prints the hex bytecode
+    python tools/lightc.py --json effect.lvm    # prints a /load-effect request body
+
+Source is one instruction per line, '#' starts a comment, 'name:' defines a
+label. Values are registers r0-r7 or integers 0-65535. Mnemonics, registers
+and labels are not case sensitive.
+
+    mov  r, v          r = v
+    add  r, v          r += v
+    sub  r, v          r -= v
+    rnd  r, lo, hi     r = random integer in [lo, hi]
+    sense r            r = ambient light level 0-1023
+    set  warm, cool    set both channels immediately
+    fade warm, cool, ms   fade to the target and wait for it
+    wait ms
+    loop count         repeat up to the matching 'end' (0 = forever)
+    end
+    jmp  label
+    jlt  a, b, label   jump if a < b
+    halt
+
+Keep the opcodes in sync with VmOp in src/main.cpp.
+"""
+
+import argparse
+import json
+import sys
+
+MAX_CODE = 256
+REGISTERS = 8
+IMM16 = 0x80
+
+# name: (opcode, operand kinds) - r = register, v = value, a = label address
+OPCODES = {
+    "halt": (0x00, ""),
+    "mov": (0x01, "rv"),
+    "rnd": (0x02, "rvv"),
+    "sense": (0x03, "r"),
+    "add": (0x04, "rv"),
+    "sub": (0x05, "rv"),
+    "set": (0x06, "vv"),
+    "fade": (0x07, "vvv"),
+    "wait": (0x08, "v"),
+    "loop": (0x09, "v"),
+    "end": (0x0A, ""),
+    "jmp": (0x0B, "a"),
+    "jlt": (0x0C, "vva"),
+}
+
+
+class CompileError(Exception):
+    pass
+
+
+def parse_register(token):
+    if len(token) >= 2 and token[0] == "r" and token[1:].isdigit() and int(token[1:]) < REGISTERS:
+        return int(token[1:])
+    raise CompileError("expected register r0-r%d, got '%s'" % (REGISTERS - 1, token))
+
+
+def encode_value(token):
+    if token.startswith("r"):
+        return [parse_register(token)]
+    try:
+        value = int(token, 0)
+    except ValueError:
+        raise CompileError("expected register or integer, got '%s'" % token)
+    if not 0 <= value <= 0xFFFF:
+        raise CompileError("immediate out of range 0-65535: %d" % value)
+    return [IMM16, value & 0xFF, value >> 8]
+
+
+def tokenize(source):
+    """Yield (line number, label or None, mnemonic or None, operands)."""
+    for number, line in enumerate(source.splitlines(), 1):
+        line = line.split("#", 1)[0].replace(",", " ").strip()
+        if not line:
+            continue
+        label = None
+        if ":" in line:
+            label, line = line.split(":", 1)
+            label, line = label.strip().lower(), line.strip()
+        tokens = line.lower().split()
+        yield number, label, (tokens[0] if tokens else None), tokens[1:]
+
+
+def compile_source(source):
+    lines = list(tokenize(source))
+
+    # Pass 1: instruction sizes and label addresses
+    labels = {}
+    address = 0
+    for number, label, mnemonic, operands in lines:
+        if label:
+            if label in labels:
+                raise CompileError("line %d: duplicate label '%s'" % (number, label))
+            labels[label] = address
+        if mnemonic is None:
+            continue
+        if mnemonic not in OPCODES:
+            raise CompileError("line %d: unknown instruction '%s'" % (number, mnemonic))
+        kinds = OPCODES[mnemonic][1]
+        if len(operands) != len(kinds):
+            raise CompileError("line %d: '%s' takes %d operands" % (number, mnemonic, len(kinds)))
+        address += 1
+        for kind, token in zip(kinds, operands):
+            address += {"r": 1, "a": 2}.get(kind, 1 if token.startswith("r") else 3)
+
+    # Pass 2: emit
+    code = []
+    depth = 0
+    for number, label, mnemonic, operands in lines:
+        if mnemonic is None:
+            continue
+        opcode, kinds = OPCODES[mnemonic]
+        depth += {"loop": 1, "end": -1}.get(mnemonic, 0)
+        if depth < 0:
+            raise CompileError("line %d: 'end' without 'loop'" % number)
+        try:
+            code.append(opcode)
+            for kind, token in zip(kinds, operands):
+                if kind == "r":
+                    code.append(parse_register(token))
+                elif kind == "v":
+                    code.extend(encode_value(token))
+                else:
+                    if token not in labels:
+                        raise CompileError("unknown label '%s'" % token)
+                    code.extend([labels[token] & 0xFF, labels[token] >> 8])
+        except CompileError as e:
+            raise CompileError("line %d: %s" % (number, e))
+
+    if depth != 0:
+        raise CompileError("%d unclosed 'loop'" % depth)
+    if not code:
+        raise CompileError("empty program")
+    if len(code) > MAX_CODE:
+        raise CompileError("program is %d bytes, the limit is %d" % (len(code), MAX_CODE))
+    return bytes(code)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="effect source file, or - for stdin")
+    parser.add_argument("--json", action="store_true", help="print a /load-effect request body")
+    parser.add_argument("--start", action="store_true", help="with --json, start the effect after loading")
+    args = parser.parse_args()
+
+    source = sys.stdin.read() if args.source == "-" else open(args.source).read()
+    try:
+        code = compile_source(source)
+    except CompileError as e:
+        sys.exit("%s: %s" % (args.source, e))
+
+    if args.json:
+        body = {"code": code.hex()}
+        if args.start:
+            body["start"] = True
+        print(json.dumps(body))
+    else:
+        print(code.hex())
+    print("%d bytes" % len(code), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()